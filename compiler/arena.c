@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* This file describes the arena allocator. Everything the parser builds
+ * (expressions, statements, blocks, types and the arrays they point to)
+ * lives exactly as long as the translation unit, so instead of being
+ * allocated one by one with calloc and freed by walking the trees, it is
+ * carved out of large chunks of memory and released all at once.
+ *
+ * Allocation just bumps a pointer. There is one bump region per size
+ * class, so small nodes are packed densely next to each other instead of
+ * being interleaved with larger arrays, and a walk over the tree touches
+ * as few cache lines as possible. Allocations too big for any class get a
+ * chunk of their own.
+ *
+ * Chunks are mapped straight from the kernel, optionally backed by huge
+ * pages to save TLB misses on large inputs. Resetting the arena doesn't
+ * look at what was allocated at all: the chunks are kept to be used again,
+ * and are cleared when they are taken, so memory from the arena always
+ * starts out zeroed, like memory from calloc.
+ */
+
+/* Size of the chunks that bump regions are carved from, normally and with huge pages */
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_HUGE_CHUNK (2 << 20)
+
+/* Number of size classes, and the largest allocation in each one. Anything
+ * larger than the last class gets a chunk of its own. */
+#define ARENA_CLASSES 3
+int arena_class_limit[ARENA_CLASSES] = {64, 512, 16384};
+
+/* Alignment of every allocation */
+#define ARENA_ALIGN 16
+
+/* A chunk of memory mapped for an arena. The header sits at the start of
+ * the mapping, and the rest is handed out. */
+typedef struct _arena_chunk {
+    struct _arena_chunk* next;
+    size_t size;
+} arena_chunk;
+
+/* An arena, with a bump region for each size class */
+typedef struct _arena {
+    char* next[ARENA_CLASSES];
+    char* end[ARENA_CLASSES];
+
+    /* Chunks in use, and chunks kept from before the last reset */
+    arena_chunk* chunks;
+    arena_chunk* spare;
+
+    size_t chunk_size;
+    int huge_pages;
+
+    /* Bytes handed out and bytes mapped, for statistics */
+    size_t used;
+    size_t mapped;
+} arena;
+
+/* Create an empty arena. If huge_pages is set, chunks are backed by huge
+ * pages where the system has them. */
+arena* make_arena(int huge_pages){
+    arena* a = calloc(1, sizeof(arena));
+    a->huge_pages = huge_pages;
+    a->chunk_size = huge_pages ? ARENA_HUGE_CHUNK : ARENA_CHUNK;
+    return a;
+}
+
+/* Map a new chunk of at least size bytes, header included */
+arena_chunk* map_arena_chunk(arena* a, size_t size){
+    void* memory = MAP_FAILED;
+
+    /* Reserved huge pages first, then transparent huge pages, then plain pages */
+#ifdef MAP_HUGETLB
+    if(a->huge_pages && size % ARENA_HUGE_CHUNK == 0)
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if(memory == MAP_FAILED){
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED)
+            error("Could not map arena chunk");
+#ifdef MADV_HUGEPAGE
+        if(a->huge_pages)
+            madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    arena_chunk* chunk = memory;
+    chunk->size = size;
+    a->mapped += size;
+    return chunk;
+}
+
+/* Get a chunk for a bump region, reusing a spare one if there is one */
+arena_chunk* take_arena_chunk(arena* a){
+    arena_chunk* chunk = a->spare;
+    if(chunk != NULL){
+        /* Fresh mappings are zero already, but spare chunks have old data */
+        a->spare = chunk->next;
+        memset(chunk + 1, 0, chunk->size - sizeof(arena_chunk));
+    }
+    else
+        chunk = map_arena_chunk(a, a->chunk_size);
+
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    return chunk;
+}
+
+/* Allocate size bytes of zeroed memory from an arena. The memory is valid
+ * until the arena is reset. */
+void* arena_alloc(arena* a, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    a->used += size;
+
+    int c = 0;
+    while(c < ARENA_CLASSES && size > arena_class_limit[c])
+        c++;
+
+    /* Big allocations get a chunk of their own, which isn't kept after a reset */
+    if(c == ARENA_CLASSES){
+        size_t page = a->chunk_size;
+        arena_chunk* chunk = map_arena_chunk(a, (size + ARENA_ALIGN + page - 1) / page * page);
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        return (char*) chunk + ARENA_ALIGN;
+    }
+
+    if(size > (size_t) (a->end[c] - a->next[c])){
+        arena_chunk* chunk = take_arena_chunk(a);
+        a->next[c] = (char*) chunk + ARENA_ALIGN;
+        a->end[c] = (char*) chunk + chunk->size;
+    }
+
+    void* memory = a->next[c];
+    a->next[c] += size;
+    return memory;
+}
+
+/* Grow an array allocated from an arena from old_size to new_size bytes.
+ * The old array is left behind in the arena. */
+void* arena_grow(arena* a, void* memory, size_t old_size, size_t new_size){
+    void* grown = arena_alloc(a, new_size);
+    if(old_size > 0)
+        memcpy(grown, memory, old_size);
+    return grown;
+}
+
+/* Release everything allocated from an arena at once. Chunks of the normal
+ * size are kept to be used again, and big ones are unmapped. */
+void reset_arena(arena* a){
+    arena_chunk* chunk = a->chunks;
+    while(chunk != NULL){
+        arena_chunk* next = chunk->next;
+        if(chunk->size == a->chunk_size){
+            chunk->next = a->spare;
+            a->spare = chunk;
+        }
+        else {
+            a->mapped -= chunk->size;
+            munmap(chunk, chunk->size);
+        }
+        chunk = next;
+    }
+
+    a->chunks = NULL;
+    for(int c = 0; c < ARENA_CLASSES; c++){
+        a->next[c] = NULL;
+        a->end[c] = NULL;
+    }
+    a->used = 0;
+}
+
+/* Delete an arena and unmap all its memory */
+void free_arena(arena* a){
+    reset_arena(a);
+    arena_chunk* chunk = a->spare;
+    while(chunk != NULL){
+        arena_chunk* next = chunk->next;
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+    free(a);
+}
+
+/* The arena that the parser allocates everything it builds from, from
+ * init_parser() until del_parser(). Each thread of a parallel parse
+ * allocates from an arena of its own. */
+__thread arena* ast_arena = NULL;
@@ -0,0 +1,479 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * This is the benchmark driver for the tokenizer and parser. It is built
+ * by make bench, in place of compiler.c. It generates synthetic
+ * source corpora in memory, each one stressing a different hot path, and
+ * times the tokenizer, the preprocessor and the parse functions on them
+ * separately. Corpora made of statements are also parsed whole with
+ * parse_program(), on as many threads as --threads says.
+ *
+ * For corpora made of statements without directives, single-character edits are also timed
+ * through the incremental re-lexer and re-parser.
+ *
+ * --scalar-scan times the tokenizer with the scalar scanning kernels instead
+ * of the vector ones. --check-scan times nothing, but tokenizes every corpus
+ * with both and checks that they give the same tokens, exiting with 1 if
+ * they don't for any.
+ *
+ * Results are printed to stdout as JSON, one record per corpus and phase,
+ * with the best time over all iterations, the time per byte and per token,
+ * the number of heap allocations per token, and the peak resident set size
+ * of the process so far.
+ */
+
+/* Count heap allocations by wrapping the C library allocator */
+long bench_allocations = 0;
+
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t num, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size){
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size){
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size){
+    __atomic_add_fetch(&bench_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+/* Benchmark settings, set from the command line */
+struct {
+    int size;
+    int iterations;
+    int depth;
+    int width;
+    char* corpus;
+    int scalar_scan;
+    int check_scan;
+    int scan_mismatches;
+    int first_record;
+} bench;
+
+/* Growable text buffer used to generate corpora */
+typedef struct _text_buffer {
+    char* text;
+    int length;
+    int allocated;
+} text_buffer;
+
+/* Append formatted text to a text buffer */
+void append(text_buffer* buf, char* format, ...){
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if(buf->length + needed + 1 > buf->allocated){
+        buf->allocated = (buf->length + needed + 1) * 2;
+        buf->text = realloc(buf->text, buf->allocated);
+    }
+
+    va_start(args, format);
+    vsnprintf(buf->text + buf->length, needed + 1, format, args);
+    va_end(args);
+    buf->length += needed;
+}
+
+/*** Corpus generators. Each one appends items until the buffer reaches the target size. ***/
+
+/* Deeply nested parenthesized expressions: ((((x + 1) * 2) - y) ...); */
+void gen_expr_nest(text_buffer* buf){
+    char* ops[4] = {"+", "*", "-", "/"};
+    for(int item = 0; buf->length < bench.size; item++){
+        for(int i = 0; i < bench.depth; i++)
+            append(buf, "(");
+        append(buf, "x%d", item);
+        for(int i = 0; i < bench.depth; i++)
+            append(buf, " %s %s)", ops[i % 4], i % 3 == 0 ? "y" : "2");
+        append(buf, ";\n");
+    }
+}
+
+/* Long chains of binary operators: a + b * 3 - c / 4 && ...; */
+void gen_op_chain(text_buffer* buf){
+    char* ops[6] = {"+", "*", "-", "/", "&&", "||"};
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "v%d", item);
+        for(int i = 0; i < bench.width; i++){
+            if(i % 2 == 0)
+                append(buf, " %s value_%d", ops[i % 6], i);
+            else
+                append(buf, " %s %d", ops[i % 6], i * 7);
+        }
+        append(buf, ";\n");
+    }
+}
+
+/* Wide struct declarations: struct wN { int f0; char* f1; ... }; */
+void gen_wide_struct(text_buffer* buf){
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "struct w%d {\n", item);
+        for(int i = 0; i < bench.width; i++)
+            append(buf, "    %s field_%d;\n", i % 3 == 0 ? "int" : i % 3 == 1 ? "char*" : "int**", i);
+        append(buf, "};\n");
+    }
+}
+
+/* Many typedefs, each followed by a declaration using it */
+void gen_typedefs(text_buffer* buf){
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "typedef %s type_%d;\n", item % 2 == 0 ? "int" : "char*", item);
+        append(buf, "type_%d var_%d = %d;\n", item, item, item);
+    }
+}
+
+/* Calls with long string literals containing escapes */
+void gen_strings(text_buffer* buf){
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "puts(\"");
+        for(int i = 0; i < bench.width; i++)
+            append(buf, "string %d with \\\"escapes\\\"\\t ", i);
+        append(buf, "\\n\");\n");
+    }
+}
+
+/* Long block comments between short statements */
+void gen_comments(text_buffer* buf){
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "/* Comment %d:", item);
+        for(int i = 0; i < bench.width; i++)
+            append(buf, " lorem ipsum * dolor / sit");
+        append(buf, " */\nx%d;\n", item);
+    }
+}
+
+/* Macros used over and over: object-like ones, which expand from the
+ * expansion cache, and function-like ones with pasting and stringizing */
+void gen_macros(text_buffer* buf){
+    append(buf, "#define LIMIT 100\n#define OFFSET (LIMIT / 4)\n#define SCALE (LIMIT * 2 + OFFSET)\n");
+    append(buf, "#define SQUARE(x) ((x) * (x))\n#define NAME(a, b) a ## _ ## b\n#define STR(x) #x\n");
+    for(int item = 0; buf->length < bench.size; item++){
+        append(buf, "SCALE + SQUARE(v%d) - LIMIT;\n", item);
+        append(buf, "NAME(var, %d) * OFFSET;\n", item);
+        append(buf, "puts(STR(item %d));\n", item);
+    }
+}
+
+/* Parse phases: the parse function each corpus is timed with */
+int PHASE_EXPRESSION = 0;
+int PHASE_TYPE = 1;
+int PHASE_STATEMENT = 2;
+char* phase_names[3] = {"parse_expression", "parse_type", "parse_statement"};
+
+/*** Timing ***/
+
+/* Get the peak resident set size of the process, in kilobytes */
+long peak_rss_kb(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Print one JSON result record */
+void report(char* corpus, char* phase, int bytes, int num_tokens, int iterations, long long best_ns, long allocations){
+    printf("%s\n    {\"corpus\": \"%s\", \"phase\": \"%s\", \"bytes\": %d, \"tokens\": %d, \"iterations\": %d, "
+            "\"ns\": %lld, \"ns_per_byte\": %.3f, \"ns_per_token\": %.3f, \"allocs_per_token\": %.3f, \"peak_rss_kb\": %ld}",
+            bench.first_record ? "" : ",", corpus, phase, bytes, num_tokens, iterations, best_ns,
+            (double) best_ns / bytes, (double) best_ns / num_tokens, (double) allocations / num_tokens, peak_rss_kb());
+    bench.first_record = 0;
+}
+
+/* Check that the scalar scanning kernels and the vector kernels this CPU
+ * supports give the same tokens for a corpus, printing a record of whether
+ * they did */
+void check_scan(char* corpus, unsigned int start, int bytes){
+    token_stream* streams[2];
+    for(int i = 0; i < 2; i++){
+        init_scanner(i);
+        streams[i] = make_token_stream(source_table.base);
+        tokenize(streams[i], start, bytes);
+    }
+    init_scanner(!bench.scalar_scan);
+
+    token_stream* scalar = streams[0];
+    token_stream* vector = streams[1];
+    int num = scalar->num;
+    int same = num == vector->num && scalar->num_literals == vector->num_literals
+        && memcmp(scalar->types, vector->types, num) == 0
+        && memcmp(scalar->offsets, vector->offsets, num * sizeof(unsigned int)) == 0
+        && memcmp(scalar->lengths, vector->lengths, num * sizeof(unsigned int)) == 0
+        && memcmp(scalar->data, vector->data, num * sizeof(unsigned int)) == 0
+        && memcmp(scalar->literals, vector->literals, scalar->num_literals * sizeof(unsigned long long)) == 0;
+    if(!same)
+        bench.scan_mismatches++;
+
+    printf("%s\n    {\"corpus\": \"%s\", \"phase\": \"check-scan\", \"bytes\": %d, \"tokens\": %d, \"same\": %s}",
+            bench.first_record ? "" : ",", corpus, bytes, num, same ? "true" : "false");
+    bench.first_record = 0;
+    free_token_stream(scalar);
+    free_token_stream(vector);
+}
+
+/* Time single-character edits in the middle of a corpus, which is re-lexed and
+ * re-parsed incrementally. The edit changes a digit that starts a number (or
+ * sits in a comment or string) back and forth. */
+void run_edits(char* name, int file){
+    int length;
+    char* text = source_view(file, &length);
+    int pos = length / 2;
+    while(pos < length && !(text[pos] >= '1' && text[pos] <= '9' && lex_tables.lex_class[(unsigned char) text[pos - 1]] != LEX_IDENT
+                && lex_tables.lex_class[(unsigned char) text[pos - 1]] != LEX_NUMBER))
+        pos++;
+    if(pos == length)
+        return;
+
+    token_stream* tokens = make_token_stream(source_table.base);
+    tokenize(tokens, source_table.files[file].offset, length);
+
+    /* The incremental parser works on tokens which haven't been preprocessed */
+    for(int i = 0; i < tokens->num; i++){
+        if(tokens->types[i] == TOKEN_DIRECTIVE){
+            free_token_stream(tokens);
+            return;
+        }
+    }
+    init_parser();
+    program* prog = parse_program(tokens);
+
+    long long best_ns = -1;
+    long allocations = 0;
+    int edits = bench.iterations * 100;
+    for(int i = 0; i < edits; i++){
+        char digit = source_view(file, &length)[pos] == '3' ? '7' : '3';
+
+        long allocs_before = bench_allocations;
+        long long before = now_ns();
+        file = apply_edit(tokens, prog, file, pos, 1, &digit, 1);
+        long long elapsed = now_ns() - before;
+        allocations = bench_allocations - allocs_before;
+
+        if(best_ns < 0 || elapsed < best_ns)
+            best_ns = elapsed;
+    }
+    report(name, "edit", length, tokens->num, edits, best_ns, allocations);
+
+    free_program(prog);
+    del_parser();
+    free_token_stream(tokens);
+}
+
+/* Tokenize and preprocess a corpus into a new token stream */
+token_stream* preprocess_corpus(unsigned int start, int bytes){
+    token_stream* tokens = make_token_stream(source_table.base);
+    tokenize(tokens, start, bytes);
+    token_stream* out = make_token_stream(source_table.base);
+    preprocess_tokens(out, tokens, ".", intern_string("."), 0);
+    free_token_stream(tokens);
+    return out;
+}
+
+/* Time parsing a corpus of statements as a whole program, which may be
+ * parallel, with tokens that have been preprocessed from start */
+void run_parse_program(char* name, unsigned int start, int bytes){
+    long long best_ns = -1;
+    long allocations = 0;
+    int num_tokens = 0;
+    for(int i = 0; i < bench.iterations; i++){
+        token_stream* tokens = preprocess_corpus(start, bytes);
+        init_parser();
+
+        long allocs_before = bench_allocations;
+        long long before = now_ns();
+        program* prog = parse_program(tokens);
+        long long elapsed = now_ns() - before;
+        allocations = bench_allocations - allocs_before;
+
+        if(best_ns < 0 || elapsed < best_ns)
+            best_ns = elapsed;
+        num_tokens = tokens->num;
+
+        free_program(prog);
+        del_parser();
+        free_token_stream(tokens);
+    }
+    report(name, "parse_program", bytes, num_tokens, bench.iterations, best_ns, allocations);
+}
+
+/* Generate a corpus, then time the tokenizer, the preprocessor and a parse function on it */
+void run_corpus(char* name, void (*generate)(text_buffer*), int phase){
+    if(bench.corpus != NULL && strcmp(bench.corpus, name) != 0)
+        return;
+
+    /* Generate the corpus into the source buffer */
+    text_buffer buf = {NULL, 0, 0};
+    generate(&buf);
+    int file = add_source_buffer(name, buf.text, buf.length);
+    free(buf.text);
+    unsigned int start = source_table.files[file].offset;
+    int bytes = source_table.files[file].length;
+    if(bench.check_scan){
+        check_scan(name, start, bytes);
+        return;
+    }
+
+    /* Tokenizer */
+    long long best_ns = -1;
+    long allocations = 0;
+    int num_tokens = 0;
+    for(int i = 0; i < bench.iterations; i++){
+        token_stream* tokens = make_token_stream(source_table.base);
+
+        long allocs_before = bench_allocations;
+        long long before = now_ns();
+        tokenize(tokens, start, bytes);
+        long long elapsed = now_ns() - before;
+        allocations = bench_allocations - allocs_before;
+
+        if(best_ns < 0 || elapsed < best_ns)
+            best_ns = elapsed;
+        num_tokens = tokens->num;
+        free_token_stream(tokens);
+    }
+    report(name, "tokenize", bytes, num_tokens, bench.iterations, best_ns, allocations);
+
+    /* Preprocessor. Defining the corpus's macros again each time throws away
+     * their cached expansions, so every iteration starts cold. */
+    best_ns = -1;
+    for(int i = 0; i < bench.iterations; i++){
+        token_stream* tokens = make_token_stream(source_table.base);
+        tokenize(tokens, start, bytes);
+        token_stream* out = make_token_stream(source_table.base);
+
+        long allocs_before = bench_allocations;
+        long long before = now_ns();
+        preprocess_tokens(out, tokens, ".", intern_string("."), 0);
+        long long elapsed = now_ns() - before;
+        allocations = bench_allocations - allocs_before;
+
+        if(best_ns < 0 || elapsed < best_ns)
+            best_ns = elapsed;
+        num_tokens = out->num;
+        free_token_stream(out);
+        free_token_stream(tokens);
+    }
+    report(name, "preprocess", bytes, num_tokens, bench.iterations, best_ns, allocations);
+
+    /* Parser */
+    best_ns = -1;
+    for(int i = 0; i < bench.iterations; i++){
+        /* Parsing changes token types in place, so every iteration gets fresh tokens and types */
+        token_stream* tokens = preprocess_corpus(start, bytes);
+        init_parser();
+
+        long allocs_before = bench_allocations;
+        long long before = now_ns();
+        int index = 0;
+        while(index < tokens->num){
+            if(phase == PHASE_EXPRESSION){
+                parse_expression(tokens, &index, tokens->num, TOKEN_SEMICOLON);
+                index++;
+            }
+            else if(phase == PHASE_TYPE){
+                parse_type(tokens, &index, tokens->num);
+                index++;
+            }
+            else
+                parse_statement(tokens, &index, tokens->num);
+        }
+        long long elapsed = now_ns() - before;
+        allocations = bench_allocations - allocs_before;
+
+        if(best_ns < 0 || elapsed < best_ns)
+            best_ns = elapsed;
+
+        /* Release everything the parser made */
+        del_parser();
+        free_token_stream(tokens);
+    }
+    report(name, phase_names[phase], bytes, num_tokens, bench.iterations, best_ns, allocations);
+
+    if(phase != PHASE_TYPE){
+        run_parse_program(name, start, bytes);
+        run_edits(name, file);
+    }
+}
+
+/* Print help to the standard error */
+void print_help(char** args){
+    fprintf(stderr, "Usage: %s [--size bytes] [--iterations n] [--depth n] [--width n] [--corpus name] [--share-expressions] [--huge-pages] [--threads n] [--scalar-scan] [--check-scan]\n", args[0]);
+    fprintf(stderr, "Corpora: expr-nest op-chain wide-struct typedefs strings comments macros\n");
+}
+
+/* Main entry point for the benchmarks */
+int main(int argc, char** argv){
+    /* Default settings */
+    bench.size = 1 << 20;
+    bench.iterations = 5;
+    bench.depth = 64;
+    bench.width = 64;
+    bench.corpus = NULL;
+    bench.first_record = 1;
+
+    /* Read settings from the command line */
+    for(int i = 1; i < argc; i++){
+        if(i + 1 < argc && strcmp(argv[i], "--size") == 0)
+            bench.size = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "--iterations") == 0)
+            bench.iterations = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "--depth") == 0)
+            bench.depth = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "--width") == 0)
+            bench.width = atoi(argv[++i]);
+        else if(i + 1 < argc && strcmp(argv[i], "--corpus") == 0)
+            bench.corpus = argv[++i];
+        else if(strcmp(argv[i], "--huge-pages") == 0)
+            parser_huge_pages = 1;
+        else if(strcmp(argv[i], "--share-expressions") == 0)
+            share_expressions = 1;
+        else if(i + 1 < argc && strcmp(argv[i], "--threads") == 0)
+            parser_threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--scalar-scan") == 0)
+            bench.scalar_scan = 1;
+        else if(strcmp(argv[i], "--check-scan") == 0)
+            bench.check_scan = 1;
+        else {
+            print_help(argv);
+            exit(1);
+        }
+    }
+    if(bench.iterations < 1)
+        bench.iterations = 1;
+
+    init_source_manager();
+    init_symbol_table();
+    init_tokenizer();
+    init_preprocessor();
+    if(bench.scalar_scan)
+        init_scanner(0);
+
+    printf("{\"benchmarks\": [");
+    run_corpus("expr-nest", gen_expr_nest, PHASE_EXPRESSION);
+    run_corpus("op-chain", gen_op_chain, PHASE_EXPRESSION);
+    run_corpus("wide-struct", gen_wide_struct, PHASE_TYPE);
+    run_corpus("typedefs", gen_typedefs, PHASE_STATEMENT);
+    run_corpus("strings", gen_strings, PHASE_EXPRESSION);
+    run_corpus("comments", gen_comments, PHASE_STATEMENT);
+    run_corpus("macros", gen_macros, PHASE_STATEMENT);
+    printf("\n]}\n");
+
+    del_preprocessor();
+    del_source_manager();
+    del_symbol_table();
+    return bench.scan_mismatches > 0;
+}
@@ -11,51 +11,103 @@
 
 /* Print help to the standard error */
 void print_help(char** args){
-    fprintf(stderr, "Usage: %s file1.c file2.c ...\n", args[0]); 
+    fprintf(stderr, "Usage: %s [-I dir] [-O0] [--opt-report] [--share-expressions] [--huge-pages] [-j threads] [--layout-report[=json]] [--emit-ir] [--run] [--scalar-scan] file1.c file2.c ...\n", args[0]); 
 }
 
 /* Main entry point: this is where the program starts */
 int main(int argc, char** argv){
+    init_source_manager();
+    init_symbol_table();
+    init_tokenizer();
+    init_preprocessor();
+
+    /* Read include paths, and map every file into the source buffer */
+    int num_files = 0;
+    int optimize = 1;
+    int opt_report = 0;
+    int layout_report = 0;
+    int emit_ir = 0;
+    int run = 0;
+    int* files = calloc(argc, sizeof(int));
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+            add_include_path(argv[++i]);
+        else if(strncmp(argv[i], "-I", 2) == 0 && argv[i][2] != '\0')
+            add_include_path(argv[i] + 2);
+        else if(strcmp(argv[i], "--huge-pages") == 0)
+            parser_huge_pages = 1;
+        else if(strcmp(argv[i], "--share-expressions") == 0)
+            share_expressions = 1;
+        else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            parser_threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-O0") == 0)
+            optimize = 0;
+        else if(strcmp(argv[i], "--opt-report") == 0)
+            opt_report = 1;
+        else if(strcmp(argv[i], "--layout-report") == 0)
+            layout_report = 1;
+        else if(strcmp(argv[i], "--layout-report=json") == 0)
+            layout_report = 2;
+        else if(strcmp(argv[i], "--emit-ir") == 0)
+            emit_ir = 1;
+        else if(strcmp(argv[i], "--run") == 0)
+            run = 1;
+        else if(strcmp(argv[i], "--scalar-scan") == 0)
+            init_scanner(0);
+        else
+            files[num_files++] = add_source_file(argv[i]);
+    }
+
     /* Require at least one filename. If the user doesn't pass a filename,
      * print help and exit, because we have nothing to compile. */
-    if(argc < 2){
+    if(num_files == 0){
         print_help(argv);
         exit(1);
     }
 
-    /* Find total length of all the files */
-    int total_length = 0;
-    for(int i = 1; i < argc; i++)
-        total_length += file_get_length(argv[i]);
-
-    /* Allocate space for the text, initialize text to "" */
-    char* text = calloc(1, total_length+1);
-    text[0] = '\0';
-
-    /* Read all files into our string */
-    for(int i = 1; i < argc; i++){
-        /* Get file contents, copy them over to our main text, and free them */
-        char* file_contents = read_file(argv[i]);
-        strcat(text, file_contents);
-        free(file_contents);
-    }
-
-    /* Tokenize, and free source text memory */
-    int num_tokens = 0;
-    token** tokens = tokenize(text, &num_tokens);
-    free(text);
+    /* Tokenize and preprocess each file straight out of its mapping, collecting all the tokens into one stream */
+    token_stream* tokens = make_token_stream(source_table.base);
+    for(int i = 0; i < num_files; i++)
+        preprocess_file(tokens, files[i]);
+    free(files);
 
     /* Parse tokens */
     init_parser();
-    int index = 0;
-    statement* statement = parse_statement(tokens, &index, num_tokens);
-    print_statement(statement);
-    free_statement(statement);
+    program* prog = parse_program(tokens);
+
+    /* The layout report only needs the types the parser found */
+    if(layout_report)
+        print_layout_report(layout_report == 2);
+    else {
+        if(optimize)
+            optimize_program(prog, opt_report);
+        resolve_program(prog);
+        typecheck_program(prog, tokens);
+
+        /* Lower to the IR to print or run it, optimizing it as well unless -O0 is given */
+        if(emit_ir || run){
+            lower_program(prog, tokens);
+            if(optimize)
+                optimize_ir(opt_report);
+            if(emit_ir)
+                print_ir();
+            if(run)
+                printf("return %lld\n", run_ir());
+            del_ir();
+        }
+        else
+            print_program(prog);
+    }
+    free_program(prog);
+    del_type_checker();
+    del_resolver();
+    del_parser();
 
     /* Free all tokens */
-    for(int i = 0; i < num_tokens; i++)
-        free_token(tokens[i]);
-    free(tokens);
+    free_token_stream(tokens);
+    del_preprocessor();
+    del_source_manager();
+    del_symbol_table();
 
     /* Return success */
     return 0;
@@ -0,0 +1,379 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file describes incremental re-lexing and re-parsing, for tools such
+ * as editors which run the front end again after every small change. An
+ * edit replaces a range of bytes in one file with new text. Instead of
+ * tokenizing and parsing everything again, apply_edit() does the least work
+ * that gives the same tokens and statements as starting from scratch.
+ *
+ * Re-lexing starts at the end of the last token before the edit, since the
+ * tokenizer only ever looks back past spaces (to see whether a # starts a
+ * line), and stops as soon as it produces a token that starts (after the
+ * edit) exactly where an old token of the same type started. From there on
+ * the text is the same, so the rest of the old tokens are the same too, and
+ * only their offsets need moving. The new tokens are spliced into the
+ * stream in place of the damaged ones.
+ *
+ * Re-parsing starts at the statement containing the token just before the
+ * damage, since that statement may have looked one token ahead, and stops
+ * as soon as it reaches the start of an old statement which lies entirely
+ * after the damage. Every other statement is kept as it was.
+ *
+ * Statements that declare types change the type table, which later
+ * statements depend on. If a typedef or struct is re-parsed, or removed by
+ * the edit, the whole program is parsed again with a fresh type table.
+ * Otherwise the type table is what it was, but it also holds the types
+ * declared after the statements being re-parsed, so they are parsed with
+ * the table limited to the types there were before them, as a parallel
+ * parse does.
+ *
+ * Statements live in the statement pool, so the ones an edit replaces can't
+ * be freed one at a time. Once more statements have been thrown away than
+ * the program has, the whole program is parsed again from a reset pool,
+ * which keeps memory in proportion to the program at an amortized cost of
+ * one statement parsed per statement replaced.
+ *
+ * All of this relies on the tokens of a file being the tokens of its text.
+ * That stops being true once the preprocessor has carried out a directive,
+ * which can define macros, include headers or drop groups of tokens, so an
+ * edit to a stream which preprocess_file() made with any directive in it,
+ * or which adds one, preprocesses all of the stream's files again from the
+ * start, and parses the whole program again.
+ *
+ * Parse errors are still fatal, so the edited program must be valid.
+ */
+
+/* An edit to one file, which may also have moved the file in the source buffer */
+typedef struct _source_edit {
+    /* Offset of the file before and after the edit, and its new length */
+    unsigned int old_base;
+    unsigned int old_end;
+    unsigned int new_base;
+    unsigned int new_file_length;
+
+    /* Offset of the edit within the file, and the lengths of the old and new text */
+    unsigned int start;
+    unsigned int old_length;
+    unsigned int new_length;
+} source_edit;
+
+/* Check whether any of the tokens in [first, last) declare types */
+int declares_types(token_stream* tokens, int first, int last){
+    for(int i = first; i < last; i++)
+        if(tokens->types[i] == TOKEN_TYPEDEF || tokens->types[i] == TOKEN_STRUCT)
+            return 1;
+    return 0;
+}
+
+/* Check whether token index came from the text between the offsets base and end */
+int token_in_range(token_stream* tokens, int index, unsigned int base, unsigned int end){
+    return index >= 0 && index < tokens->num && tokens->offsets[index] >= base && tokens->offsets[index] <= end;
+}
+
+/* Find the tokens [first, last) which came from the text of a file between the
+ * offsets base and end. They are contiguous in the stream. */
+void find_file_tokens(token_stream* tokens, unsigned int base, unsigned int end, int* first, int* last){
+    /* Files are tokenized in order, so usually the offsets are sorted and
+     * binary searches find both ends */
+    int low = 0;
+    int high = tokens->num;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(tokens->offsets[mid] < base)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *first = low;
+
+    high = tokens->num;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(tokens->offsets[mid] <= end)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    *last = low;
+
+    /* Once a file has been moved to the end of the source buffer, they are not
+     * sorted any more, so if the ends don't check out fall back to a scan */
+    if(*first < *last && token_in_range(tokens, *first, base, end) && !token_in_range(tokens, *first - 1, base, end)
+            && token_in_range(tokens, *last - 1, base, end) && !token_in_range(tokens, *last, base, end))
+        return;
+
+    int index = 0;
+    while(index < tokens->num && !token_in_range(tokens, index, base, end))
+        index++;
+
+    /* A file with no tokens keeps the place the binary search found */
+    if(index == tokens->num)
+        return;
+
+    *first = index;
+    while(index < tokens->num && token_in_range(tokens, index, base, end))
+        index++;
+    *last = index;
+}
+
+/* Find the first token at or after index which ends at or after the global offset */
+int first_token_ending_at(token_stream* tokens, int index, int last, unsigned int offset){
+    /* Tokens within a file are in order, so binary search */
+    while(index < last){
+        int mid = (index + last) / 2;
+        if(token_end(tokens, mid) < offset)
+            index = mid + 1;
+        else
+            last = mid;
+    }
+    return index;
+}
+
+/*
+ * Re-lex the part of the edited file which the edit damaged, and splice the
+ * new tokens into the stream. Afterwards, the old tokens [first, old_last)
+ * have been replaced by the new tokens [first, new_last). Returns 1 if any
+ * of the removed tokens declared types.
+ */
+int relex_edit(token_stream* tokens, source_edit* edit, int* first, int* old_last, int* new_last){
+    /* Find the tokens of the edited file */
+    int file_first, file_last;
+    find_file_tokens(tokens, edit->old_base, edit->old_end, &file_first, &file_last);
+
+    /* A token that ends right where the edit starts may run into the new text, so it is damaged too */
+    int i = first_token_ending_at(tokens, file_first, file_last, edit->old_base + edit->start);
+    unsigned int restart = i > file_first ? token_end(tokens, i - 1) - edit->old_base : 0;
+
+    /* Lex the new text until a new token lines up with an old one after the edit */
+    int delta = (int) edit->new_length - (int) edit->old_length;
+    unsigned int edit_end = edit->start + edit->new_length;
+    token_stream* fresh = make_token_stream(tokens->text);
+    int j = i;
+    int synced = 0;
+    int index = restart;
+    while(!synced && index < edit->new_file_length){
+        int before = fresh->num;
+        index = lex_step(fresh, edit->new_base, index, edit->new_file_length);
+        if(fresh->num == before)
+            continue;
+
+        unsigned int local = token_start(fresh, fresh->num - 1) - edit->new_base;
+        if(local < edit_end)
+            continue;
+
+        /* Old tokens after the edit have moved by delta */
+        while(j < file_last && (long long) token_start(tokens, j) - edit->old_base + delta < local)
+            j++;
+        if(j < file_last && (long long) token_start(tokens, j) - edit->old_base + delta == local
+                && base_token_type(tokens->types[j]) == fresh->types[fresh->num - 1]){
+            fresh->num--;
+            synced = 1;
+        }
+    }
+    if(!synced)
+        j = file_last;
+    int removed_types = declares_types(tokens, i, j);
+
+    /* Move the offsets of the tokens which are kept */
+    unsigned int moved = edit->new_base - edit->old_base;
+    if(moved != 0)
+        for(int k = file_first; k < i; k++)
+            tokens->offsets[k] += moved;
+    if(moved + delta != 0)
+        for(int k = j; k < file_last; k++)
+            tokens->offsets[k] += moved + delta;
+
+    /* Splice the new tokens in. The literals of the removed tokens stay in the
+     * literals array until the stream is rebuilt. */
+    int added = fresh->num - (j - i);
+    reserve_tokens(tokens, tokens->num + added);
+    int tail = added != 0 ? tokens->num - j : 0;
+    memmove(tokens->types + i + fresh->num, tokens->types + j, tail * sizeof(unsigned char));
+    memmove(tokens->offsets + i + fresh->num, tokens->offsets + j, tail * sizeof(unsigned int));
+    memmove(tokens->lengths + i + fresh->num, tokens->lengths + j, tail * sizeof(unsigned int));
+    memmove(tokens->data + i + fresh->num, tokens->data + j, tail * sizeof(unsigned int));
+    for(int k = 0; k < fresh->num; k++){
+        int type = fresh->types[k];
+        unsigned int data = fresh->data[k];
+        if(type == TOKEN_NUMBER || type == TOKEN_CHARACTER)
+            data = add_literal(tokens, token_value(fresh, k));
+
+        tokens->types[i + k] = type;
+        tokens->offsets[i + k] = fresh->offsets[k];
+        tokens->lengths[i + k] = fresh->lengths[k];
+        tokens->data[i + k] = data;
+    }
+    tokens->num += added;
+
+    *first = i;
+    *old_last = j;
+    *new_last = i + fresh->num;
+    free_token_stream(fresh);
+    return removed_types;
+}
+
+/* Throw away every statement and the type table, and parse the whole program again */
+void reparse_program(token_stream* tokens, program* prog){
+    prog->num = 0;
+    prog->discarded = 0;
+    reset_parser();
+
+    int index = 0;
+    while(index < tokens->num){
+        int first_token = index;
+        int types_before = type_table.num;
+        add_to_program(prog, parse_statement(tokens, &index, tokens->num), first_token, types_before);
+    }
+}
+
+/*
+ * Re-parse the statements of a program which were damaged when the tokens
+ * [first, old_last) were replaced by [first, new_last). If removed_types is
+ * set, or any of the statements to re-parse declare types, the whole program
+ * is parsed again instead.
+ */
+void reparse_edit(token_stream* tokens, program* prog, int first, int old_last, int new_last, int removed_types){
+    if(removed_types){
+        reparse_program(tokens, prog);
+        return;
+    }
+
+    /* Find the statement containing the token before the damage */
+    int a = 0;
+    int high = prog->num - 1;
+    while(a < high){
+        int mid = (a + high + 1) / 2;
+        if(prog->first_tokens[mid] <= first - 1)
+            a = mid;
+        else
+            high = mid - 1;
+    }
+
+    /* Parse statements until one starts where an old statement after the damage
+     * started. Those are the only ones which can be kept; their first tokens
+     * have moved by shift. */
+    int shift = new_last - old_last;
+    program* fresh = make_program();
+    int index = prog->num > 0 ? prog->first_tokens[a] : 0;
+
+    /* The statements re-parsed don't declare types, so they can only see
+     * the types declared before them, not the ones later statements added */
+    int types_before = prog->num > 0 ? prog->types_before[a] : type_table.num;
+    type_table_limit = types_before;
+    int checked = index;
+    int b = a;
+    while(b < prog->num && prog->first_tokens[b] < old_last)
+        b++;
+    while(index < tokens->num){
+        while(b < prog->num && prog->first_tokens[b] + shift < index)
+            b++;
+        if(b < prog->num && prog->first_tokens[b] + shift == index)
+            break;
+
+        /* Before parsing, check that the tokens up to the next place we could stop
+         * don't declare types, which would change the type table */
+        int limit = b < prog->num ? prog->first_tokens[b] + shift : tokens->num;
+        if(declares_types(tokens, checked > index ? checked : index, limit)){
+            type_table_limit = -1;
+            free_program(fresh);
+            reparse_program(tokens, prog);
+            return;
+        }
+        checked = limit;
+
+        int first_token = index;
+        add_to_program(fresh, parse_statement(tokens, &index, tokens->num), first_token, types_before);
+    }
+    type_table_limit = -1;
+    while(b < prog->num && prog->first_tokens[b] + shift < index)
+        b++;
+
+    /* Replace the old statements [a, b) with the new ones */
+    int kept = prog->num - b;
+    int num = a + fresh->num + kept;
+    reserve_program(prog, num);
+    memmove(prog->statements + a + fresh->num, prog->statements + b, kept * sizeof(unsigned int));
+    memmove(prog->first_tokens + a + fresh->num, prog->first_tokens + b, kept * sizeof(int));
+    memmove(prog->types_before + a + fresh->num, prog->types_before + b, kept * sizeof(int));
+    memcpy(prog->statements + a, fresh->statements, fresh->num * sizeof(unsigned int));
+    memcpy(prog->first_tokens + a, fresh->first_tokens, fresh->num * sizeof(int));
+    memcpy(prog->types_before + a, fresh->types_before, fresh->num * sizeof(int));
+    for(int i = a + fresh->num; i < num; i++)
+        prog->first_tokens[i] += shift;
+    prog->num = num;
+
+    free_program(fresh);
+
+    /* Reclaim the memory of replaced statements once there are too many */
+    prog->discarded += b - a;
+    if(prog->discarded > prog->num)
+        reparse_program(tokens, prog);
+}
+
+/* Check whether any of the tokens in [first, last) start a directive */
+int has_directives(token_stream* tokens, int first, int last){
+    for(int i = first; i < last; i++)
+        if(base_token_type(tokens->types[i]) == TOKEN_DIRECTIVE)
+            return 1;
+    return 0;
+}
+
+/* Preprocess every file of a stream again from the start, after old_file
+ * was edited and became new_file, and parse the whole program again */
+void repreprocess_edit(token_stream* tokens, program* prog, int old_file, int new_file){
+    int num_files = tokens->num_files;
+    int* files = tokens->files;
+    tokens->num_files = 0;
+    tokens->files = NULL;
+    tokens->directives = 0;
+    tokens->num = 0;
+    tokens->num_literals = 0;
+
+    restart_preprocessor();
+    reload_header(old_file, new_file);
+    for(int i = 0; i < num_files; i++)
+        preprocess_file(tokens, files[i] == old_file ? new_file : files[i]);
+    free(files);
+
+    if(prog != NULL)
+        reparse_program(tokens, prog);
+}
+
+/*
+ * Replace old_length bytes at local offset start in a file with new_length
+ * bytes of text, then update the token stream and the program parsed from
+ * it to match. The program may be NULL to only update the tokens. Returns
+ * the index of the file in the source table, which changes if the file had
+ * to be moved to make room for the edit.
+ */
+int apply_edit(token_stream* tokens, program* prog, int file, unsigned int start, unsigned int old_length, char* text, unsigned int new_length){
+    int old_file = file;
+    source_edit edit;
+    edit.old_base = source_table.files[file].offset;
+    edit.old_end = edit.old_base + source_table.files[file].length;
+    edit.start = start;
+    edit.old_length = old_length;
+    edit.new_length = new_length;
+
+    file = edit_source_file(file, start, old_length, text, new_length);
+    edit.new_base = source_table.files[file].offset;
+    edit.new_file_length = source_table.files[file].length;
+
+    if(tokens->directives > 0){
+        repreprocess_edit(tokens, prog, old_file, file);
+        return file;
+    }
+
+    int first, old_last, new_last;
+    int removed_types = relex_edit(tokens, &edit, &first, &old_last, &new_last);
+    if(tokens->num_files > 0 && has_directives(tokens, first, new_last)){
+        repreprocess_edit(tokens, prog, old_file, file);
+        return file;
+    }
+    if(prog != NULL)
+        reparse_edit(tokens, prog, first, old_last, new_last, removed_types);
+    return file;
+}
@@ -1,19 +1,92 @@
 /* An expression type, which defines an expression that returns a value. The
  * type of the expression is stored in expression_type, while the rest of the
- * fields describe possible data needed for expression evaluation. Many 
- * expressions utilize sub-expressions, stored in the children array, while
- * constant expressions will utilize the num_value and char_value fields to
- * store the actual values of the constants. chars are just single-character
- * strings in this implementation.
+ * fields describe possible data needed for expression evaluation. Only one
+ * of the fields in the union is used, depending on the type. Unary and
+ * binary operators and array accesses store their sub-expressions in the
+ * children array, while function calls store theirs in the argument pool.
+ * Constant expressions will utilize the num_value and str_value fields to
+ * store the actual values of the constants. Numbers and chars are both
+ * stored in num_value, as decoded by the tokenizer. Expressions that refer
+ * to something by name store the interned symbol of the name in the name
+ * field. pure is set if evaluating the expression has no side effects:
+ * it doesn't call a function, assign or increment anything.
+ *
+ * Expressions refer to each other by their index in the expression pool,
+ * so every expression is 16 bytes.
  */
 typedef struct _expression {
-    int expression_type;
-    int num_children;
-    struct _expression** children;
-    int num_value;
-    char* str_value;
+    unsigned char expression_type;
+    unsigned char num_children;
+    unsigned char pure;
+    unsigned int name;
+    union {
+        long long num_value;
+        char* str_value;
+        unsigned int children[2];
+
+        /* Function call arguments: the run [first, first + num) of the argument pool */
+        struct {
+            unsigned int first;
+            unsigned int num;
+        } args;
+    };
 } expression;
 
+/* A slot of the table of shared expressions */
+typedef struct _shared_slot {
+    unsigned int expr;
+    unsigned int hash;
+} shared_slot;
+
+/*
+ * Global expression pool. Every expression lives in one array, in the order
+ * they were built, which puts children before their parents (a depth-first
+ * post-order for each tree). Expression 0 is never used, so 0 can mean no
+ * expression. Pointers into the pool are only valid until the next
+ * expression is created, since the array can move as it grows.
+ *
+ * Every expression has a structural hash, kept alongside the nodes, which
+ * depends only on what the expression says and not on where its children
+ * are, so equal expressions have equal hashes wherever they are.
+ *
+ * If share_expressions is set, pure expressions are hash-consed as they are
+ * built: building one that is equal to one already built gives back the
+ * existing expression, so a pure subexpression repeated across the program
+ * is one node, and analyses can keep one result per distinct expression.
+ * Since its children were shared before it, two pure expressions are equal
+ * when they have the same type, name and children indices, so checking is
+ * a comparison of two nodes and not of trees. A shared node stands for the
+ * same text wherever it is used; anything that depends on where it is used,
+ * such as which variable a name refers to, has to be kept per use.
+ *
+ * Each thread has its own expression pool, so the threads of a parallel
+ * parse can build expressions without locking; their pools are merged into
+ * the main thread's afterwards.
+ */
+__thread struct {
+    expression* nodes;
+    unsigned int* hashes;
+    unsigned int num;
+    unsigned int allocated;
+
+    /* Open addressing hash table of shared expressions, with their hashes
+     * so that most probes don't have to look at the expression, 0 for empty slots */
+    shared_slot* shared;
+    unsigned int shared_capacity;
+    unsigned int num_shared;
+
+    /* The argument pool: each function call's arguments are a run of it */
+    index_vector args;
+
+    /* Arguments of the function calls still being parsed, as a stack */
+    index_vector pending;
+} expression_pool;
+
+/* Whether pure expressions are hash-consed as they are built. This is per
+ * thread too: the threads of a parallel parse build unshared expressions,
+ * and they are shared as they are merged. */
+__thread int share_expressions = 0;
+
 /*** Expression types ***/
 
 /* Constants (numeric, string, character literals) */
@@ -27,7 +100,7 @@ int EXPRESSION_ARITH_SUB = 5;
 int EXPRESSION_ARITH_MUL = 6;
 int EXPRESSION_ARITH_DIV = 7;
 
-/* Identifier to be evaluated. Name stored in str_value. */
+/* Identifier to be evaluated. Name stored in name. */
 int EXPRESSION_IDENT = 8;
 
 /* Function call (variable number of children) */
@@ -69,15 +142,294 @@ int EXPRESSION_LESSEQ = 22;
 /* Unary negation operator */
 int EXPRESSION_NOT = 23;
 
-/* Create a blank expression of a given type */
-expression* create_expression(int t){
-    expression* expr = calloc(1, sizeof(expression));
+/* Left shift with two children, which the optimizer turns some multiplications into */
+int EXPRESSION_SHIFT_LEFT = 24;
+
+/* Struct member access, s.name and p->name, with the struct or the pointer
+ * to it as the child and the field's name in name */
+int EXPRESSION_MEMBER = 25;
+int EXPRESSION_MEMBER_REF = 26;
+
+/* 
+ * The expression parser is driven by tables indexed by token type, which
+ * are filled in once by init_expression_tables(). Binary operators have a
+ * binding power, which is higher for operators that bind tighter, and the
+ * expression type they build. Tokens which can be prefix or postfix
+ * operators have the token type they are changed to when they are used
+ * that way, and the expression type they build.
+ */
+struct {
+    /* Binary operators: binding power (0 if the token isn't one), whether
+     * they group right to left, and the expression they build */
+    unsigned char binary_power[256];
+    unsigned char right_associative[256];
+    int binary_type[256];
+
+    /* Type the tokenizer gave each token type, undoing what the parser changed it to */
+    unsigned char base_type[256];
+
+    /* Prefix and postfix operators: what the token becomes (0 if it can't be one) */
+    unsigned char prefix_token[256];
+    unsigned char postfix_token[256];
+
+    /* Expression built by each unary operator, indexed by its changed token type */
+    int unary_type[256];
+} expression_tables;
+
+/* Binding power of prefix operators, which bind tighter than any binary operator */
+#define PREFIX_POWER 100
+
+/* Add a binary operator to the expression tables */
+void add_binary_operator(int tok_type, int power, int right_associative, int expr_type){
+    expression_tables.binary_power[tok_type] = power;
+    expression_tables.right_associative[tok_type] = right_associative;
+    expression_tables.binary_type[tok_type] = expr_type;
+}
+
+/* Fill in the expression parser tables */
+void init_expression_tables(){
+    memset(&expression_tables, 0, sizeof(expression_tables));
+    for(int i = 0; i < 256; i++)
+        expression_tables.base_type[i] = base_token_type(i);
+
+    /* Binary operators, loosest first, with C's precedence */
+    add_binary_operator(TOKEN_ASSIGN, 10, 1, EXPRESSION_ASSIGN);
+    add_binary_operator(TOKEN_OR, 20, 0, EXPRESSION_OR);
+    add_binary_operator(TOKEN_AND, 30, 0, EXPRESSION_AND);
+    add_binary_operator(TOKEN_EQUALS, 40, 0, EXPRESSION_EQUALS);
+    add_binary_operator(TOKEN_GREATER, 50, 0, EXPRESSION_GREATER);
+    add_binary_operator(TOKEN_LESS, 50, 0, EXPRESSION_LESS);
+    add_binary_operator(TOKEN_GREATEREQ, 50, 0, EXPRESSION_GREATEREQ);
+    add_binary_operator(TOKEN_LESSEQ, 50, 0, EXPRESSION_LESSEQ);
+    add_binary_operator(TOKEN_PLUS, 60, 0, EXPRESSION_ARITH_ADD);
+    add_binary_operator(TOKEN_MINUS, 60, 0, EXPRESSION_ARITH_SUB);
+    add_binary_operator(TOKEN_TIMES, 70, 0, EXPRESSION_ARITH_MUL);
+    add_binary_operator(TOKEN_DIV, 70, 0, EXPRESSION_ARITH_DIV);
+
+    /* Prefix operators. Unary minus is built as 0 - value. */
+    expression_tables.prefix_token[TOKEN_TIMES] = TOKEN_UNARY_DEREF;
+    expression_tables.prefix_token[TOKEN_MINUS] = TOKEN_UNARY_MINUS;
+    expression_tables.prefix_token[TOKEN_INCR] = TOKEN_PREINCR;
+    expression_tables.prefix_token[TOKEN_DECR] = TOKEN_PREDECR;
+    expression_tables.prefix_token[TOKEN_ADDR] = TOKEN_ADDR;
+    expression_tables.prefix_token[TOKEN_NOT] = TOKEN_NOT;
+
+    /* Postfix operators */
+    expression_tables.postfix_token[TOKEN_INCR] = TOKEN_POSTINCR;
+    expression_tables.postfix_token[TOKEN_DECR] = TOKEN_POSTDECR;
+
+    expression_tables.unary_type[TOKEN_UNARY_DEREF] = EXPRESSION_DEREF;
+    expression_tables.unary_type[TOKEN_ADDR] = EXPRESSION_ADDR;
+    expression_tables.unary_type[TOKEN_NOT] = EXPRESSION_NOT;
+    expression_tables.unary_type[TOKEN_POSTINCR] = EXPRESSION_POSTINCR;
+    expression_tables.unary_type[TOKEN_POSTDECR] = EXPRESSION_POSTDECR;
+    expression_tables.unary_type[TOKEN_PREINCR] = EXPRESSION_PREINCR;
+    expression_tables.unary_type[TOKEN_PREDECR] = EXPRESSION_PREDECR;
+}
+
+/* Throw away every expression in the pool, keeping its memory. Index 0
+ * stands for no expression, and is kept zeroed so that reading it gives
+ * nothing which could be taken for a real node. */
+void reset_expression_pool(){
+    memset(&expression_pool.nodes[0], 0, sizeof(expression));
+    expression_pool.hashes[0] = 0;
+    expression_pool.num = 1;
+    expression_pool.args.num = 0;
+    expression_pool.pending.num = 0;
+    expression_pool.num_shared = 0;
+    memset(expression_pool.shared, 0, expression_pool.shared_capacity * sizeof(shared_slot));
+}
+
+/* Set up an empty expression pool */
+void init_expression_pool(){
+    expression_pool.allocated = 1024;
+    expression_pool.nodes = malloc(expression_pool.allocated * sizeof(expression));
+    expression_pool.hashes = malloc(expression_pool.allocated * sizeof(unsigned int));
+    expression_pool.shared_capacity = 1024;
+    expression_pool.shared = calloc(expression_pool.shared_capacity, sizeof(shared_slot));
+    init_index_vector(&expression_pool.args, 256);
+    init_index_vector(&expression_pool.pending, 64);
+    reset_expression_pool();
+}
+
+/* Release the expression pool */
+void del_expression_pool(){
+    free(expression_pool.nodes);
+    free(expression_pool.hashes);
+    free(expression_pool.shared);
+    free_index_vector(&expression_pool.args);
+    free_index_vector(&expression_pool.pending);
+}
+
+/* Make room for num expressions and num_args function call arguments in the pool in all */
+void reserve_expression_pool(unsigned int num, unsigned int num_args){
+    if(num > expression_pool.allocated){
+        expression_pool.allocated = grow_capacity(expression_pool.allocated, num);
+        expression_pool.nodes = realloc(expression_pool.nodes, expression_pool.allocated * sizeof(expression));
+        expression_pool.hashes = realloc(expression_pool.hashes, expression_pool.allocated * sizeof(unsigned int));
+    }
+    reserve_index_vector(&expression_pool.args, num_args);
+}
+
+/* Get an expression from its index. The pointer is valid until the next expression is created. */
+expression* expression_at(unsigned int index){
+    return &expression_pool.nodes[index];
+}
+
+/* Get the number of sub-expressions of an expression */
+int expression_num_children(unsigned int index){
+    expression* expr = &expression_pool.nodes[index];
+    if(expr->expression_type == EXPRESSION_FUNCALL)
+        return expr->args.num;
+    return expr->num_children;
+}
+
+/* Get sub-expression i of an expression */
+unsigned int expression_child(unsigned int index, int i){
+    expression* expr = &expression_pool.nodes[index];
+    if(expr->expression_type == EXPRESSION_FUNCALL)
+        return expression_pool.args.vals[expr->args.first + i];
+    return expr->children[i];
+}
+
+/* Create a blank expression of a given type with num_children children,
+ * returning its index in the expression pool */
+unsigned int create_expression(int t, int num_children){
+    if(expression_pool.num == expression_pool.allocated)
+        reserve_expression_pool(expression_pool.num + 1, 0);
+
+    unsigned int index = expression_pool.num++;
+    expression* expr = &expression_pool.nodes[index];
+    memset(expr, 0, sizeof(expression));
     expr->expression_type = t;
-    expr->num_children = 0;
-    return expr;
+    expr->num_children = num_children;
+    return index;
+}
+
+/* Get the structural hash of an expression */
+unsigned int expression_hash(unsigned int index){
+    return expression_pool.hashes[index];
 }
 
-void print_expression(expression* expr);
+/* Mix a value into a hash */
+unsigned int mix_hash(unsigned int hash, unsigned int value){
+    hash ^= value + 0x9e3779b9u + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+/* Work out the structural hash and purity of an expression from its own
+ * fields and its children's hashes and purity */
+void hash_expression(unsigned int index){
+    expression* expr = &expression_pool.nodes[index];
+    int t = expr->expression_type;
+    unsigned int hash = mix_hash(t, expr->name);
+
+    if(t == EXPRESSION_STR_CONST)
+        hash = mix_hash(hash, hash_string(expr->str_value, strlen(expr->str_value)));
+    else if(t == EXPRESSION_NUM_CONST || t == EXPRESSION_CHR_CONST){
+        hash = mix_hash(hash, (unsigned int) expr->num_value);
+        hash = mix_hash(hash, (unsigned int) (expr->num_value >> 32));
+    }
+
+    int pure = t != EXPRESSION_FUNCALL && t != EXPRESSION_ASSIGN && t != EXPRESSION_PREINCR
+        && t != EXPRESSION_PREDECR && t != EXPRESSION_POSTINCR && t != EXPRESSION_POSTDECR;
+    int num_children = expression_num_children(index);
+    for(int i = 0; i < num_children; i++){
+        unsigned int child = expression_child(index, i);
+        hash = mix_hash(hash, expression_pool.hashes[child]);
+        pure = pure && expression_pool.nodes[child].pure;
+    }
+
+    /* Spread the bits out, since the low bits pick the slot in the shared table */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    expression_pool.hashes[index] = hash;
+    expr->pure = pure;
+}
+
+/* Check whether two pure expressions are equal, given that their children are shared */
+int same_expression(unsigned int a, unsigned int b){
+    expression* x = &expression_pool.nodes[a];
+    expression* y = &expression_pool.nodes[b];
+    if(x->expression_type != y->expression_type || x->name != y->name || x->num_children != y->num_children)
+        return 0;
+    if(x->expression_type == EXPRESSION_STR_CONST)
+        return strcmp(x->str_value, y->str_value) == 0;
+    return x->num_value == y->num_value;
+}
+
+/* Add an expression to the table of shared expressions */
+void insert_shared_expression(unsigned int index){
+    unsigned int hash = expression_pool.hashes[index];
+    unsigned int mask = expression_pool.shared_capacity - 1;
+    unsigned int slot = hash & mask;
+    while(expression_pool.shared[slot].expr != 0)
+        slot = (slot + 1) & mask;
+    expression_pool.shared[slot].expr = index;
+    expression_pool.shared[slot].hash = hash;
+    expression_pool.num_shared++;
+
+    /* Keep the table at most half full */
+    if(expression_pool.num_shared * 2 > expression_pool.shared_capacity){
+        unsigned int capacity = expression_pool.shared_capacity * 2;
+        shared_slot* shared = calloc(capacity, sizeof(shared_slot));
+        for(unsigned int i = 0; i < expression_pool.shared_capacity; i++){
+            if(expression_pool.shared[i].expr == 0)
+                continue;
+            slot = expression_pool.shared[i].hash & (capacity - 1);
+            while(shared[slot].expr != 0)
+                slot = (slot + 1) & (capacity - 1);
+            shared[slot] = expression_pool.shared[i];
+        }
+
+        free(expression_pool.shared);
+        expression_pool.shared = shared;
+        expression_pool.shared_capacity = capacity;
+    }
+}
+
+/* Finish building the last expression created, once all its fields are
+ * set. Returns the expression, or if expressions are shared and an equal
+ * one already exists, throws the new one away and returns that instead. */
+unsigned int finish_expression(unsigned int index){
+    hash_expression(index);
+    if(!share_expressions || !expression_pool.nodes[index].pure)
+        return index;
+
+    unsigned int hash = expression_pool.hashes[index];
+    unsigned int mask = expression_pool.shared_capacity - 1;
+    unsigned int slot = hash & mask;
+    unsigned int existing;
+    while((existing = expression_pool.shared[slot].expr) != 0){
+        if(expression_pool.shared[slot].hash == hash && same_expression(existing, index)){
+            expression_pool.num--;
+            return existing;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    insert_shared_expression(index);
+    return index;
+}
+
+/* Work out every expression's hash and purity again, after expressions have
+ * been rewritten in place, and rebuild the table of shared expressions from
+ * the expressions as they are now */
+void rehash_expressions(){
+    expression_pool.num_shared = 0;
+    memset(expression_pool.shared, 0, expression_pool.shared_capacity * sizeof(shared_slot));
+    for(unsigned int i = 1; i < expression_pool.num; i++){
+        hash_expression(i);
+        if(share_expressions && expression_pool.nodes[i].pure)
+            insert_shared_expression(i);
+    }
+}
+
+void print_expression(unsigned int index);
 
 /* Print a binary operator expression */
 void print_binary_expression(char* operator, expression* expr){
@@ -98,25 +450,28 @@ void print_unary_expression(char* operator, expression* expr){
 /* Print an expression in some useful debugging form to stdout.
  * The print output will attempt to mirror the original source.
  */
-void print_expression(expression* expr){
+void print_expression(unsigned int index){
+    if(index == 0)
+        return;
+    expression* expr = expression_at(index);
     /* Constants printed in literal form */
     if(expr->expression_type == EXPRESSION_NUM_CONST)
-        printf("%d", expr->num_value);
+        printf("%lld", expr->num_value);
     else if(expr->expression_type == EXPRESSION_STR_CONST)
         printf("\"%s\"", expr->str_value);
     else if(expr->expression_type == EXPRESSION_CHR_CONST)
-        printf("'%s'", expr->str_value);
+        printf("'%c'", (char) expr->num_value);
 
     /* Identifier */
     else if(expr->expression_type == EXPRESSION_IDENT)
-        printf("%s", expr->str_value);
+        printf("%s", symbol_name(expr->name));
 
     /* Function call */
     else if(expr->expression_type == EXPRESSION_FUNCALL){
-        printf("%s(", expr->str_value);
-        for(int i = 0; i < expr->num_children; i++){
-            print_expression(expr->children[i]);
-            if(i != expr->num_children - 1)
+        printf("%s(", symbol_name(expr->name));
+        for(int i = 0; i < expr->args.num; i++){
+            print_expression(expression_pool.args.vals[expr->args.first + i]);
+            if(i != expr->args.num - 1)
                 printf(", ");
         }
         printf(")");
@@ -124,7 +479,7 @@ void print_expression(expression* expr){
 
     /* Array access */
     else if(expr->expression_type == EXPRESSION_ARRAY_ACCESS){
-        printf("%s[", expr->str_value);
+        printf("%s[", symbol_name(expr->name));
         print_expression(expr->children[0]);
         printf("]");
     }
@@ -154,6 +509,8 @@ void print_expression(expression* expr){
         print_binary_expression("||", expr);
     else if(expr->expression_type == EXPRESSION_AND)
         print_binary_expression("&&", expr);
+    else if(expr->expression_type == EXPRESSION_SHIFT_LEFT)
+        print_binary_expression("<<", expr);
 
     /* Unary operators */
     else if(expr->expression_type == EXPRESSION_NOT)
@@ -167,6 +524,12 @@ void print_expression(expression* expr){
     else if(expr->expression_type == EXPRESSION_PREDECR)
         print_unary_expression("--", expr);
 
+    /* Member access */
+    else if(expr->expression_type == EXPRESSION_MEMBER || expr->expression_type == EXPRESSION_MEMBER_REF){
+        print_expression(expr->children[0]);
+        printf("%s%s", expr->expression_type == EXPRESSION_MEMBER ? "." : "->", symbol_name(expr->name));
+    }
+
     /* Post increment and decrement */
     else if(expr->expression_type == EXPRESSION_POSTINCR){
         print_expression(expr->children[0]);
@@ -183,536 +546,270 @@ void print_expression(expression* expr){
     }
 }
 
-/* Release memory used by an expression */
-void free_expression(expression* expr){
-    /* Free string value */
-    if(expr->str_value != NULL)
-        free(expr->str_value);
-
-    /* Free child expressions */
-    for(int i = 0; i < expr->num_children; i++)
-        free_expression(expr->children[i]);
-
-    /* Free children array */
-    if(expr->children != NULL)
-        free(expr->children);
-
-    /* Free memory itself */
-    free(expr);
-} 
-
 /*** Expression constructors ***/
 
 /* Create a numeric literal expression */
-expression* numeric_constant_expression(int num){
-    expression* expr = create_expression(EXPRESSION_NUM_CONST);
-    expr->num_value = num;
-    return expr;
+unsigned int numeric_constant_expression(long long num){
+    unsigned int expr = create_expression(EXPRESSION_NUM_CONST, 0);
+    expression_pool.nodes[expr].num_value = num;
+    return finish_expression(expr);
 }
 
 /* Create a string literal expression */
-expression* string_constant_expression(char* str){
-    expression* expr = create_expression(EXPRESSION_STR_CONST);
-    expr->str_value = str;
-    return expr;
+unsigned int string_constant_expression(char* str){
+    unsigned int expr = create_expression(EXPRESSION_STR_CONST, 0);
+    expression_pool.nodes[expr].str_value = str;
+    return finish_expression(expr);
 }
 
 /* Create a character literal expression */
-expression* char_constant_expression(char* c){
-    expression* expr = create_expression(EXPRESSION_CHR_CONST);
-    expr->str_value = c;
-    return expr;
+unsigned int char_constant_expression(long long c){
+    unsigned int expr = create_expression(EXPRESSION_CHR_CONST, 0);
+    expression_pool.nodes[expr].num_value = c;
+    return finish_expression(expr);
 }
 
 /* Create a numeric literal expression with the value 0 */
-expression* zero_expression(){
+unsigned int zero_expression(){
     return numeric_constant_expression(0);
 }
 
-/* Create a unary operator expression */
-expression* create_unary_expr(expression* ptr_expr, int tok_type){
-    int expr_type = 0;
-    if(tok_type == TOKEN_UNARY_DEREF)
-        expr_type = EXPRESSION_DEREF;
-    if(tok_type == TOKEN_ADDR)
-        expr_type = EXPRESSION_ADDR;
-    if(tok_type == TOKEN_NOT)
-        expr_type = EXPRESSION_NOT;
-    if(tok_type == TOKEN_POSTINCR)
-        expr_type = EXPRESSION_POSTINCR;
-    if(tok_type == TOKEN_POSTDECR)
-        expr_type = EXPRESSION_POSTDECR;
-    if(tok_type == TOKEN_PREINCR)
-        expr_type = EXPRESSION_PREINCR;
-    if(tok_type == TOKEN_PREDECR)
-        expr_type = EXPRESSION_PREDECR;
-
-    expression* expr = create_expression(expr_type);
-    expr->num_children = 1;
-    expr->children = calloc(1, sizeof(expression*));
-    expr->children[0] = ptr_expr;
-    return expr;
+/* Create a unary operator expression, from the token type the operator was changed to */
+unsigned int create_unary_expr(unsigned int operand, int tok_type){
+    unsigned int expr = create_expression(expression_tables.unary_type[tok_type], 1);
+    expression_pool.nodes[expr].children[0] = operand;
+    return finish_expression(expr);
 }
 
 /* Create a binary operator expression */
-expression* create_arithmetic_expr(expression* first, expression* second, int tok_type){
-    int expr_type = 0;
-    if(tok_type == TOKEN_PLUS)
-        expr_type = EXPRESSION_ARITH_ADD;
-    if(tok_type == TOKEN_MINUS)
-        expr_type = EXPRESSION_ARITH_SUB;
-    if(tok_type == TOKEN_TIMES)
-        expr_type = EXPRESSION_ARITH_MUL;
-    if(tok_type == TOKEN_DIV)
-        expr_type = EXPRESSION_ARITH_DIV;
-    if(tok_type == TOKEN_AND)
-        expr_type = EXPRESSION_AND;
-    if(tok_type == TOKEN_OR)
-        expr_type = EXPRESSION_OR;
-    if(tok_type == TOKEN_EQUALS)
-        expr_type = EXPRESSION_EQUALS;
-    if(tok_type == TOKEN_GREATER)
-        expr_type = EXPRESSION_GREATER;
-    if(tok_type == TOKEN_GREATEREQ)
-        expr_type = EXPRESSION_GREATEREQ;
-    if(tok_type == TOKEN_LESS)
-        expr_type = EXPRESSION_LESS;
-    if(tok_type == TOKEN_LESSEQ)
-        expr_type = EXPRESSION_LESSEQ;
-
-    expression* expr = create_expression(expr_type);
-    expr->num_children = 2;
-    expr->children = calloc(expr->num_children, sizeof(expression*));
-    expr->children[0] = first;
-    expr->children[1] = second;
-    return expr;
+unsigned int create_arithmetic_expr(unsigned int first, unsigned int second, int tok_type){
+    unsigned int expr = create_expression(expression_tables.binary_type[tok_type], 2);
+    expression_pool.nodes[expr].children[0] = first;
+    expression_pool.nodes[expr].children[1] = second;
+    return finish_expression(expr);
 }
 
-/* Create a function call expression */
-expression* create_funcall_expr(char* name, int args, expression** arg_exprs){
-    expression* expr = create_expression(EXPRESSION_FUNCALL);
-    expr->str_value = strdup(name);
-    expr->num_children = args;
-    expr->children = arg_exprs;
-    return expr;
+/* Push the argument of a function call being parsed */
+void push_pending_arg(unsigned int arg){
+    index_vector_push(&expression_pool.pending, arg);
 }
 
-/* Create an array access expression */
-expression* create_array_access_expr(char* name, expression* index_expr){
-    expression* expr = create_expression(EXPRESSION_ARRAY_ACCESS);
-    expr->str_value = strdup(name);
-    expr->num_children = 1;
-    expr->children = calloc(1, sizeof(expression*));
-    expr->children[0] = index_expr;
-    return expr;
-}
+/* Create a function call expression, whose arguments are the last num_args
+ * pending arguments. They are moved into the argument pool. */
+unsigned int create_funcall_expr(unsigned int name, int num_args){
+    unsigned int first = index_vector_move_top(&expression_pool.args, &expression_pool.pending, num_args);
 
-/* Create a variable evaluation expression */
-expression* create_var_expression(char* ident){
-    expression* expr = create_expression(EXPRESSION_IDENT);
-    expr->str_value = strdup(ident);
-    return expr;
+    unsigned int expr = create_expression(EXPRESSION_FUNCALL, 0);
+    expression_pool.nodes[expr].name = name;
+    expression_pool.nodes[expr].args.first = first;
+    expression_pool.nodes[expr].args.num = num_args;
+    return finish_expression(expr);
 }
 
-/*** Parsing functions ***/
-
-/* Return 1 if the token represents a prefix or infix operator, 0 otherwise */
-int is_operator_token(int tok_type){
-    int operators[13] = {
-        TOKEN_PLUS, TOKEN_MINUS, TOKEN_TIMES, TOKEN_DIV, 
-        TOKEN_OR, TOKEN_AND, TOKEN_ASSIGN, TOKEN_NOT, 
-        TOKEN_ADDR, TOKEN_UNARY_DEREF, TOKEN_UNARY_MINUS, TOKEN_PREINCR,
-        TOKEN_PREDECR
-    };
-    for(int i = 0; i < 13; i++)
-        if(tok_type == operators[i])
-            return 1;
-
-    return 0;
+/* Create an array access expression */
+unsigned int create_array_access_expr(unsigned int name, unsigned int index_expr){
+    unsigned int expr = create_expression(EXPRESSION_ARRAY_ACCESS, 1);
+    expression_pool.nodes[expr].name = name;
+    expression_pool.nodes[expr].children[0] = index_expr;
+    return finish_expression(expr);
 }
 
-/* Check if an operator is left-associative */
-int is_left_associative(int tok_type){
-    /* Only a few operators are right associative - assignment, unary minus, dereferencing, and addressing */
-    if(tok_type == TOKEN_ASSIGN || tok_type == TOKEN_UNARY_MINUS ||
-            tok_type == TOKEN_UNARY_DEREF || tok_type == TOKEN_ADDR)
-        return 0;
-    else
-        return 1;
+/* Create a member access expression, for the token . or -> */
+unsigned int create_member_expr(unsigned int object, unsigned int field, int tok_type){
+    unsigned int expr = create_expression(tok_type == TOKEN_REF ? EXPRESSION_MEMBER_REF : EXPRESSION_MEMBER, 1);
+    expression_pool.nodes[expr].name = field;
+    expression_pool.nodes[expr].children[0] = object;
+    return finish_expression(expr);
 }
 
-/* 
- * Return a value representing operator precedence. Higher values correspond
- * to higher precedence. Thus, * will return a higher value than +.
- */
-int op_precedence(int tok_type){
-    if(tok_type == TOKEN_ASSIGN)
-        return 1;
-    if(tok_type == TOKEN_AND || tok_type == TOKEN_OR)
-        return 5;
-    if(tok_type == TOKEN_NOT)
-        return 9;
-    if(tok_type == TOKEN_PLUS || tok_type == TOKEN_MINUS)
-        return 10;
-    if(tok_type == TOKEN_TIMES || tok_type == TOKEN_DIV)
-        return 20;
-    if(tok_type == TOKEN_UNARY_DEREF || tok_type == TOKEN_UNARY_MINUS || tok_type == TOKEN_ADDR)
-        return 100;
-
-    error("Unknown operator precedence");
-    return 0;
+/* Create a variable evaluation expression */
+unsigned int create_var_expression(unsigned int ident){
+    unsigned int expr = create_expression(EXPRESSION_IDENT, 0);
+    expression_pool.nodes[expr].name = ident;
+    return finish_expression(expr);
 }
 
+/*** Parsing functions ***/
+
 /* Parse a value literal */
-expression* parse_const_expr(token** tokens, int* index, int len){
-    expression* expr = NULL;
+unsigned int parse_const_expr(token_stream* tokens, int* index, int len){
+    unsigned int expr = 0;
 
     /* Parse numbers, strings, and characters */
-    int token_type = tokens[*index]->type;
+    int token_type = tokens->types[*index];
     if(token_type == TOKEN_NUMBER)
-        expr = numeric_constant_expression(atoi(tokens[*index]->data));
+        expr = numeric_constant_expression(token_value(tokens, *index));
     if(token_type == TOKEN_STRING)
-        expr = string_constant_expression(strdup(tokens[*index]->data));
-    if(token_type == TOKEN_CHAR)
-        expr = char_constant_expression(strdup(tokens[*index]->data));
+        expr = string_constant_expression(decode_token_string(tokens, *index, arena_alloc(ast_arena, tokens->lengths[*index] + 1)));
+    if(token_type == TOKEN_CHARACTER)
+        expr = char_constant_expression(token_value(tokens, *index));
     
-    if(expr == NULL)
-        error("Expected constant");
+    if(expr == 0)
+        error_at(tokens->offsets[*index], "Expected constant");
 
     return expr;
 }
 
-/* Dummy token meaning: return self */
-const int TOKEN_RET_SELF = 999;
-token dummy = {type: 999, data: NULL};
-token* self_token = &dummy;
-
-/* 
- * Collapse an operator on the operator stack by applying it to the arguments on the 
- * output stack, and then pushing the resulting expression back on the output stack
- *
- * Returns: resulting expression (same expression that is now on top of the output stack)
- */
-expression* collapse_operator(stack* output_stack, stack* op_stack, int tok_type){
-    expression* expr = NULL;
-
-    /* Do nothing */
-    if(tok_type == TOKEN_RET_SELF){
-        expr = stack_pop(output_stack);
-    }
-
-    /* Replace a unary minus with 0 - value */
-    else if(tok_type == TOKEN_UNARY_MINUS){
-        expression* first = stack_pop(output_stack);
-        expr = create_arithmetic_expr(zero_expression(), first, TOKEN_MINUS);
-    }
+unsigned int parse_binary(token_stream* tokens, int* index, int len, int min_power);
 
-    /* Apply unary operators to the value on top of the output stack */
-    else if(tok_type == TOKEN_UNARY_DEREF || tok_type == TOKEN_NOT || 
-            tok_type == TOKEN_ADDR || tok_type == TOKEN_PREDECR || tok_type == TOKEN_PREINCR){
-        expression* first = stack_pop(output_stack);
-        expr = create_unary_expr(first, tok_type);
+/* Parse the arguments of a function call, starting after the opening parenthesis */
+unsigned int parse_funcall(token_stream* tokens, int* index, int len, unsigned int name){
+    int num_args = 0;
+    if(tokens->types[*index] == TOKEN_CPAREN){
+        inc_ptr(tokens, index, len);
+        return create_funcall_expr(name, 0);
     }
 
-    /* Apply binary operators to the top two values on the output stack */
-    else if(is_operator_token(tok_type)){
-        expression* second = stack_pop(output_stack);
-        expression* first = stack_pop(output_stack);
-        expr = create_arithmetic_expr(first, second, tok_type);
+    /* Arguments wait on the pending stack until the call is built, since
+     * calls in the arguments push their own above them */
+    while(1){
+        push_pending_arg(parse_binary(tokens, index, len, 0));
+        num_args++;
+
+        int token_type = tokens->types[*index];
+        inc_ptr(tokens, index, len);
+        if(token_type == TOKEN_CPAREN)
+            break;
+        if(token_type != TOKEN_COMMA)
+            error_at(tokens->offsets[*index - 1], "Expected comma or closing parenthesis in function call");
     }
-
-    /* Take used operator off the stack */
-    stack_pop(op_stack);
-
-    /* 
-     * If we've generated an expression, put it on the output stack
-     * to replace whatever expressions the operator used up
-     */
-    if(expr != NULL)
-        stack_push(output_stack, expr);
-
-    return expr;
+    return create_funcall_expr(name, num_args);
 }
 
-/* 
- * Collapse all operators and values on the output stack and operator stack into one value, until
- * we reach one of the two provided operators on the operator stack. This function is used
- * when we encounter a closing bracket or parenthesis, or a comma delimiting function arguments.
- *
- * Returns: 1 if an expression was collapsed, 0 if nothing was done.
- */
-int collapse_expression_stack_until(stack* output_stack, stack* op_stack, int first_end_token, int second_end_token){
-    int collapsed = 0;
-
-    /* Until we reach either of the desired tokens */
-    token* peek = stack_peek(op_stack);
-    while(peek != NULL && peek->type != first_end_token && peek->type != second_end_token){
-        /* Collapse the operator on top */
-        collapse_operator(output_stack, op_stack, peek->type);
-
-        /* We've collapsed something */
-        collapsed = 1;
+/* Parse a primary expression: a literal, a variable, a function call, or an array access */
+unsigned int parse_primary(token_stream* tokens, int* index, int len){
+    int token_type = tokens->types[*index];
+    if(token_type == TOKEN_NUMBER || token_type == TOKEN_STRING || token_type == TOKEN_CHARACTER){
+        unsigned int expr = parse_const_expr(tokens, index, len);
+        inc_ptr(tokens, index, len);
+        return expr;
+    }
 
-        peek = stack_peek(op_stack);
+    /* A variable, or the function being called or array being accessed */
+    if(token_type == TOKEN_IDENT){
+        unsigned int name = token_symbol(tokens, *index);
+        inc_ptr(tokens, index, len);
+        token_type = tokens->types[*index];
+        if(token_type == TOKEN_OPAREN){
+            inc_ptr(tokens, index, len);
+            return parse_funcall(tokens, index, len, name);
+        }
+        if(token_type == TOKEN_OBRACKET){
+            inc_ptr(tokens, index, len);
+            unsigned int index_expr = parse_binary(tokens, index, len, 0);
+            if(tokens->types[*index] != TOKEN_CBRACKET)
+                error_at(tokens->offsets[*index], "Expected closing bracket after array index");
+            inc_ptr(tokens, index, len);
+            return create_array_access_expr(name, index_expr);
+        }
+        return create_var_expression(name);
     }
 
-    return collapsed;
+    error_at(tokens->offsets[*index], "Expected expression");
+    return 0;
 }
 
 /*
- * Parse expressions using a modified Shunting-Yard algorithm.
- *
- * The Shunting-Yard algorithm uses two stacks for parsing, an output
- * stack (of expressions) and an operator stack (of tokens). The output
- * stack contains already-processed expressions, while the operator stack
- * contains operators which haven't been used yet. It loops
- * over the tokens until it reaches the end (semicolon), and processes
- * them one by one:
- *  - Literals: pushed directly onto the output stack
- *
- *  - Unary postfix operators: they are applied to the top expresssion 
- *      on the output stack, and the resulting expression is put on the
- *      top of the output stack.
- *
- *  - Identifiers:
- *      - Normal identifiers: pushed onto the output stack as a variable
- *      - Followed by a [ or (: pushed onto the operator stack, because
- *          the identifier actually represents an array or function being
- *          called or accessed
- *
- *  - Infix operators: Infix operators are collapsed as they can be,
- *      with certain rules being followed to preserve order of operations.
- *
- *  - Closing ] and ): Treated as the end of an expression, and the
- *      previous expression is collapsed and put on the output stack.
+ * Parse an expression by precedence climbing. First comes an operand: a
+ * primary expression with any prefix operators before it and postfix
+ * operators after it. Postfix operators bind tighter than prefix ones, so
+ * *p++ is *(p++).
  *
- *  - Commas: Since these indicate the end of an argument, operators
- *      are collapsed until we reach the previous comma or opening (.
+ * Then each binary operator whose binding power is at least min_power
+ * takes the expression so far as its left side, and everything after it
+ * that binds tighter as its right side. Left associative operators only
+ * let tighter operators into their right side, so a - b - c is (a - b) - c,
+ * while right associative ones also let in the same operator, so a = b = c
+ * is a = (b = c).
  *
- * See actual code below for details on each of the above.
- *
- * In the final stage, the algorithm reduces all the operators and
- * expressions into one by taking the top operator on the stack, applying
- * it to the expressions on the output stack, and putting the result back
- * on the output stack. After no operators are left, there should only
- * be one expression on the output stack, and that is the result of parsing.
- *
- * Main Source: http://en.wikipedia.org/wiki/Shunting-yard_algorithm
+ * Tokens which are ambiguous (* can be multiplication or dereferencing, -
+ * subtraction or negation, ++ and -- pre or post increment) are prefix
+ * operators exactly when they come where an operand is expected. The
+ * token's type is changed in place to say which one it turned out to be,
+ * and is looked up by the type the tokenizer gave, in case this token was
+ * parsed before.
  */
-expression* parse_expression(token** tokens, int* index, int len, int end_token){
-    /* Create the operator and output stack */
-    stack* output_stack = make_stack();
-    stack* op_stack = make_stack();
-    
-    /* 
-     * Use a look-behind token to resolve some ambiguities with unary
-     * dereferencing, minus, pre-incrementing, and post-incrementing.
-     * Negative number indicates beginning of expression.
-     */
-    int previous_token_type = -1;
-    
-    /* Loop until end of input or a semicolon */
-    while(*index < len && tokens[*index]->type != end_token){
-        int token_type = tokens[*index]->type;
-
-        /* 
-         * Fix unary prefix operators. Unary operators can occur at
-         * the beginning of an expression, after an operator, or
-         * after an opening parenthesis or bracket.
-         *
-         * Unary operators which need to be corrected include: 
-         *  - dereference (ambiguous with multiplication)
-         *  - unary minus (ambiguous with subtraction)
-         *  - increment (ambiguous with post-increment)
-         *  - decrement (ambiguous with post-decrement)
-         */
-        int can_be_prefix_operator = (previous_token_type < 0 || 
-                       is_operator_token(previous_token_type) || 
-                       previous_token_type == TOKEN_OPAREN || 
-                       previous_token_type == TOKEN_OBRACKET);
-        if(token_type == TOKEN_TIMES && can_be_prefix_operator)
-            tokens[*index]->type = TOKEN_UNARY_DEREF;
-        else if(token_type == TOKEN_MINUS && can_be_prefix_operator)
-            tokens[*index]->type = TOKEN_UNARY_MINUS;
-        else if(token_type == TOKEN_INCR && can_be_prefix_operator)
-            tokens[*index]->type = TOKEN_PREINCR;
-        else if(token_type == TOKEN_DECR && can_be_prefix_operator)
-            tokens[*index]->type = TOKEN_PREDECR;
-
-        /* 
-         * Any increments and decrements which are not pre-increments
-         * or pre-decrements are classified as post-increments/decrements.
-         */
-        else if(token_type == TOKEN_INCR)
-            tokens[*index]->type = TOKEN_POSTINCR;
-        else if(token_type == TOKEN_DECR)
-            tokens[*index]->type = TOKEN_POSTDECR;
-
-        /* Propogate the fix to the token type variable */
-        token_type = tokens[*index]->type;
-
-        /* Literal values: push them to the output stack */
-        if(token_type == TOKEN_NUMBER || token_type == TOKEN_STRING || token_type == TOKEN_CHAR){
-            expression* const_expr = parse_const_expr(tokens, index, len);
-            stack_push(output_stack, const_expr);
-            stack_push(op_stack, self_token);
-        }
-
-        /* 
-         * Postfix arithmetic: apply the postfix operator directly to the
-         * expression on top of the output stack, and keep the expression there
-         */
-        else if(token_type == TOKEN_POSTINCR || token_type == TOKEN_POSTDECR)
-            stack_push(output_stack, create_unary_expr(stack_pop(output_stack), token_type));
-
-        /* Infix arithmetic */
-        else if(is_operator_token(token_type)){
-            /* Collapse all operators that can be collapsed. Operators that can't be collapsed
-             * are ones with a lower precedence than the current operator. For instance,
-             * in the expression 1 + 2 * 3, when we reach the multiplication operator, we can't
-             * collapse the addition operator, because that would consume the 1 and 2.
-             * If we collapsed it, the result would be (1 + 2) * 3, but if we only collapse 
-             * operators with higher or equal precedence, we get 1 + (2*3). 
-             *
-             * Instead of explaining this badly, I'll just refer you to the Wikipedia page:
-             *      http://en.wikipedia.org/wiki/Shunting-yard_algorithm
-             * It has a wonderful diagram.
-             */
-            token* peek = stack_peek(op_stack);
-            while(peek != NULL && is_operator_token(peek->type) &&
-                    ((is_left_associative(token_type) && op_precedence(token_type) <= op_precedence(peek->type)) || 
-                     (!is_left_associative(token_type) && op_precedence(token_type) < op_precedence(peek->type)))){
-
-                collapse_operator(output_stack, op_stack, peek->type);
-                peek = stack_peek(op_stack);
-            }
-
-            /* Push the new operator onto the operator stack */
-            stack_push(op_stack, tokens[*index]);
-        }
-
-        /* 
-         * Process an identifier as a variable, or as the
-         * begining of a function call or array access.
-         */
-        else if(token_type == TOKEN_IDENT){
-            token* ident_token = tokens[*index];
-            int next_type = tokens[*index + 1]->type;
-
-            /* Function call or array access */
-            if(next_type == TOKEN_OPAREN || next_type == TOKEN_OBRACKET)
-                stack_push(op_stack, ident_token);
-
-            /* Normal identifier */
-            else 
-                stack_push(output_stack, create_var_expression(ident_token->data));
+unsigned int parse_binary(token_stream* tokens, int* index, int len, int min_power){
+    unsigned int left;
+    int token_type = expression_tables.base_type[tokens->types[*index]];
+    int prefix = expression_tables.prefix_token[token_type];
+    if(prefix != 0){
+        tokens->types[*index] = prefix;
+        inc_ptr(tokens, index, len);
+
+        /* No binary operator binds as tightly, so this stops after one operand */
+        unsigned int operand = parse_binary(tokens, index, len, PREFIX_POWER);
+
+        /* Replace a unary minus with 0 - value */
+        if(prefix == TOKEN_UNARY_MINUS)
+            left = create_arithmetic_expr(zero_expression(), operand, TOKEN_MINUS);
+        else
+            left = create_unary_expr(operand, prefix);
+    }
+    else{
+        /* Parentheses are handled here rather than in parse_primary, so deep
+         * nesting costs one call per level */
+        if(token_type == TOKEN_OPAREN){
+            inc_ptr(tokens, index, len);
+            left = parse_binary(tokens, index, len, 0);
+            if(tokens->types[*index] != TOKEN_CPAREN)
+                error_at(tokens->offsets[*index], "Expected closing parenthesis");
+            inc_ptr(tokens, index, len);
         }
-
-        /* Push opening parentheses and brackets onto the operator stack */
-        else if(token_type == TOKEN_OPAREN || token_type == TOKEN_OBRACKET)
-            stack_push(op_stack, tokens[*index]);
-
-        else if(token_type == TOKEN_CPAREN){
-            /* Collapse the previous argument (see the TOKEN_COMMA case) */
-            int has_arg = collapse_expression_stack_until(output_stack, op_stack, TOKEN_OPAREN, TOKEN_COMMA);
-
-            /* 
-             * The following argument calculation is done in case this turns
-             * out to be the closing parenthesis of a function call.
-             *
-             * If nothing was collapsed, we have 0 arguments.
-             * If something was collapsed, we have 1 + # of commas arguments.
-             */
-            int args = 1;
-            if(!has_arg)
-                args = 0;
-
-            /* Pop all commas and the left parenthesis off the operator stack,
-             * while counting the number of arguments to this function */
-            token* peek;
-            while((peek = stack_pop(op_stack))->type == TOKEN_COMMA)
-                args++;
-
-            /* 
-             * If the previous token on the operator stack is an identifier,
-             * then this is the closing parenthesis to a function call.
-             */
-            peek = stack_peek(op_stack);
-            if(peek != NULL && peek->type == TOKEN_IDENT){
-                /* Pop arguments off the output stack, store them in an array */
-                expression** arg_exprs = calloc(args, sizeof(expression*));
-                for(int i = args - 1; i >= 0; i--)
-                    arg_exprs[i] = stack_pop(output_stack);
-                
-                /* Create the function call and put it on the output stack */
-                token* func_name = stack_pop(op_stack);
-                stack_push(output_stack, create_funcall_expr(func_name->data, args, arg_exprs));
+        else
+            left = parse_primary(tokens, index, len);
+
+        /* Postfix operators, and member accesses, which bind as tightly */
+        while(1){
+            token_type = expression_tables.base_type[tokens->types[*index]];
+            if(token_type == TOKEN_DOT || token_type == TOKEN_REF){
+                inc_ptr(tokens, index, len);
+                if(tokens->types[*index] != TOKEN_IDENT)
+                    error_at(tokens->offsets[*index], "Expected field name");
+                left = create_member_expr(left, token_symbol(tokens, *index), token_type);
+                inc_ptr(tokens, index, len);
+                continue;
             }
-        }
-
-        /* Array closing bracket */
-        else if(token_type == TOKEN_CBRACKET){
-            /* 
-             * Collapse all the operators and expressions until we reach
-             * the opening bracket. Now, the top expression will be the
-             * index which we want to access.
-             */
-            collapse_expression_stack_until(output_stack, op_stack, TOKEN_OBRACKET, -1);
-
-            /* Remove the opening bracket from the op stack */
-            stack_pop(op_stack);
-
-            /* Get the array name, and push the array access onto the output stack */
-            token* array_name = stack_pop(op_stack);
-            stack_push(output_stack, create_array_access_expr(array_name->data, stack_pop(output_stack)));
-        }
 
-        /* Function argument separator */
-        else if(token_type == TOKEN_COMMA){
-            /* 
-             * Collapse all expressions until either the previous comma or the
-             * opening parenthesis. This leaves the top expression on the 
-             * output stack as the expression representing this current 
-             * argument, and nothing more.
-             */
-            collapse_expression_stack_until(output_stack, op_stack, TOKEN_OPAREN, TOKEN_COMMA);
-
-            /* 
-             * Push the comma onto the stack - this is used to count
-             * arguments when we process the closing parenthesis 
-             */
-            stack_push(op_stack, tokens[*index]);
+            int postfix = expression_tables.postfix_token[token_type];
+            if(postfix == 0)
+                break;
+            tokens->types[*index] = postfix;
+            left = create_unary_expr(left, postfix);
+            inc_ptr(tokens, index, len);
         }
-
-        /* Error: we don't know what to do! */
-        else
-            error("Unexpected token type");
-
-        /* Advance to the next token */
-        previous_token_type = token_type;
-        inc_ptr(index, len);
     }
 
-    /* While there are ore operators on the stack */
-    while(stack_peek(op_stack) != NULL){
-        /* Collapse the operator and use as many expressions as we need to */
-        token* op = stack_peek(op_stack);
-        collapse_operator(output_stack, op_stack, op->type);
-    }
+    while(1){
+        token_type = expression_tables.base_type[tokens->types[*index]];
+        int power = expression_tables.binary_power[token_type];
+        if(power == 0 || power < min_power)
+            return left;
 
-    /* Get the top expression on the stack as our output */
-    expression* expr = stack_pop(output_stack);
-
-    /* Nothing else should be on the output stack */
-    expression* top;
-    if((top = stack_pop(output_stack)) != NULL){
-        print_expression(top);
-        error("Expression remaining on stack");
+        tokens->types[*index] = token_type;
+        inc_ptr(tokens, index, len);
+        unsigned int right = parse_binary(tokens, index, len, expression_tables.right_associative[token_type] ? power : power + 1);
+        left = create_arithmetic_expr(left, right, token_type);
     }
+}
 
-    /* Free the stacks used */
-    free_stack(output_stack);
-    free_stack(op_stack);
+/*
+ * Parse an expression, which must be followed by end_token. The index is
+ * left at the end token. Returns the index of the expression in the
+ * expression pool, or 0 for an empty expression, which the caller has to
+ * reject where one isn't allowed.
+ *
+ * Expressions are parsed by precedence climbing (a Pratt parser): every
+ * decision is a lookup in the expression tables by token type, and nodes
+ * are built as soon as both sides of an operator are known, so there are
+ * no operator or output stacks. Nesting is limited only by the C stack.
+ */
+unsigned int parse_expression(token_stream* tokens, int* index, int len, int end_token){
+    if(*index < len && tokens->types[*index] == end_token)
+        return 0;
 
+    unsigned int expr = parse_binary(tokens, index, len, 0);
+    if(tokens->types[*index] != end_token)
+        error_at(tokens->offsets[*index], "Unexpected token in expression");
     return expr;
 }
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* This file describes the symbol table, which interns strings. Interning a
+ * string gives back a 32-bit symbol ID, and interning the same string again
+ * always gives back the same ID, so names can be stored and compared as
+ * integers instead of strings. Every distinct name is stored exactly once.
+ *
+ * Symbol 0 is never handed out, so it can be used to mean "no name".
+ *
+ * Interning is safe to call from several threads at once; inserts and
+ * lookups in the hash index take a lock. Looking up a symbol's name does not
+ * take the lock: symbols are stored in chunks which are never moved, and
+ * chunk k holds twice as many symbols as chunk k-1, so the chunk directory
+ * never has to grow either.
+ */
+
+/* Symbols in the first chunk, and number of chunks (enough for 2^32 symbols) */
+#define SYMBOL_CHUNK_BITS 8
+#define SYMBOL_CHUNKS 24
+
+/* Size of the blocks that symbol names are copied into */
+#define SYMBOL_TEXT_BLOCK 65536
+
+/* A single interned string */
+typedef struct _symbol {
+    char* name;
+    unsigned int length;
+    unsigned int hash;
+} symbol;
+
+/* Global symbol table */
+struct {
+    pthread_mutex_t lock;
+
+    /* Symbols by ID, in chunks of doubling size */
+    unsigned int num;
+    symbol* chunks[SYMBOL_CHUNKS];
+
+    /* Open addressing hash index from string to symbol ID, 0 for empty slots */
+    unsigned int capacity;
+    unsigned int* slots;
+
+    /* Block that the next name is copied into, and the list of all blocks */
+    char* text;
+    int text_left;
+    int num_blocks;
+    char** blocks;
+} symbol_table;
+
+/* Hash a string (32-bit FNV-1a) */
+unsigned int hash_string(char* str, int len){
+    unsigned int hash = 2166136261u;
+    for(int i = 0; i < len; i++){
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Find the symbol struct for a symbol ID */
+symbol* get_symbol(unsigned int sym){
+    /* Chunk k starts at ID (2^k - 1) << SYMBOL_CHUNK_BITS */
+    unsigned int scaled = (sym >> SYMBOL_CHUNK_BITS) + 1;
+    int chunk = 31 - __builtin_clz(scaled);
+    unsigned int first = ((1u << chunk) - 1) << SYMBOL_CHUNK_BITS;
+    return &symbol_table.chunks[chunk][sym - first];
+}
+
+/* Get the null-terminated name of a symbol */
+char* symbol_name(unsigned int sym){
+    return get_symbol(sym)->name;
+}
+
+/* Get the length of a symbol's name */
+int symbol_length(unsigned int sym){
+    return get_symbol(sym)->length;
+}
+
+/* Copy a name into the current text block, starting a new block if it doesn't fit */
+char* copy_symbol_text(char* str, int len){
+    if(len + 1 > symbol_table.text_left){
+        int size = len + 1 > SYMBOL_TEXT_BLOCK ? len + 1 : SYMBOL_TEXT_BLOCK;
+        symbol_table.text = malloc(size);
+        symbol_table.text_left = size;
+        symbol_table.blocks = realloc(symbol_table.blocks, (symbol_table.num_blocks + 1) * sizeof(char*));
+        symbol_table.blocks[symbol_table.num_blocks++] = symbol_table.text;
+    }
+
+    char* copy = symbol_table.text;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    symbol_table.text += len + 1;
+    symbol_table.text_left -= len + 1;
+    return copy;
+}
+
+/* Double the size of the hash index, reinserting every symbol */
+void grow_symbol_index(){
+    unsigned int capacity = symbol_table.capacity * 2;
+    unsigned int* slots = calloc(capacity, sizeof(unsigned int));
+    for(unsigned int sym = 1; sym < symbol_table.num; sym++){
+        unsigned int slot = get_symbol(sym)->hash & (capacity - 1);
+        while(slots[slot] != 0)
+            slot = (slot + 1) & (capacity - 1);
+        slots[slot] = sym;
+    }
+
+    free(symbol_table.slots);
+    symbol_table.slots = slots;
+    symbol_table.capacity = capacity;
+}
+
+/* Intern len characters of str, returning its symbol ID */
+unsigned int intern(char* str, int len){
+    unsigned int hash = hash_string(str, len);
+
+    pthread_mutex_lock(&symbol_table.lock);
+
+    /* Look for the string in the hash index */
+    unsigned int mask = symbol_table.capacity - 1;
+    unsigned int slot = hash & mask;
+    unsigned int sym;
+    while((sym = symbol_table.slots[slot]) != 0){
+        symbol* s = get_symbol(sym);
+        if(s->hash == hash && s->length == len && memcmp(s->name, str, len) == 0){
+            pthread_mutex_unlock(&symbol_table.lock);
+            return sym;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    /* Not found: create a new symbol, allocating its chunk if this is the first symbol in it */
+    sym = symbol_table.num;
+    int chunk = 31 - __builtin_clz((sym >> SYMBOL_CHUNK_BITS) + 1);
+    if(symbol_table.chunks[chunk] == NULL)
+        symbol_table.chunks[chunk] = malloc(((size_t) 1 << (chunk + SYMBOL_CHUNK_BITS)) * sizeof(symbol));
+
+    symbol* s = get_symbol(sym);
+    s->name = copy_symbol_text(str, len);
+    s->length = len;
+    s->hash = hash;
+
+    symbol_table.slots[slot] = sym;
+    symbol_table.num++;
+
+    /* Keep the index at most half full */
+    if(symbol_table.num * 2 > symbol_table.capacity)
+        grow_symbol_index();
+
+    pthread_mutex_unlock(&symbol_table.lock);
+    return sym;
+}
+
+/* Intern a null-terminated string */
+unsigned int intern_string(char* str){
+    return intern(str, strlen(str));
+}
+
+/* Initialize the symbol table, reserving symbol 0 */
+void init_symbol_table(){
+    memset(&symbol_table, 0, sizeof(symbol_table));
+    pthread_mutex_init(&symbol_table.lock, NULL);
+    symbol_table.capacity = 1024;
+    symbol_table.slots = calloc(symbol_table.capacity, sizeof(unsigned int));
+
+    symbol_table.chunks[0] = malloc((1 << SYMBOL_CHUNK_BITS) * sizeof(symbol));
+    symbol* none = get_symbol(0);
+    none->name = copy_symbol_text("", 0);
+    none->length = 0;
+    none->hash = 0;
+    symbol_table.num = 1;
+}
+
+/* Delete the symbol table and every interned name */
+void del_symbol_table(){
+    for(int i = 0; i < SYMBOL_CHUNKS; i++)
+        free(symbol_table.chunks[i]);
+    for(int i = 0; i < symbol_table.num_blocks; i++)
+        free(symbol_table.blocks[i]);
+    free(symbol_table.blocks);
+    free(symbol_table.slots);
+    pthread_mutex_destroy(&symbol_table.lock);
+}
@@ -0,0 +1,1715 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file describes the intermediate representation (IR) which a parsed,
+ * resolved and type checked program is lowered to, the optimization passes
+ * which run on it, and an interpreter for it.
+ *
+ * The IR is in SSA form: every instruction which produces a value is the
+ * only definition of that value, and it is named by its index in the
+ * instruction array, which every instruction lives in, in the order they
+ * were built. Instruction 0 is never used, so 0 can mean no instruction.
+ * A basic block is a list of phi instructions followed by a list of other
+ * instructions, the last of which is a jump, a branch or a return. A phi
+ * has one operand for each predecessor of its block, in the order of the
+ * block's predecessors, and its value is the operand for the predecessor
+ * control came from. The operands of phis and of calls are runs of a shared
+ * operand pool, like the arguments of function calls in the expression pool.
+ *
+ * The whole program is one function, since the language has no functions
+ * yet, and globals are variables of it like the rest. Variables become SSA
+ * values, using the algorithm of Braun et al.: a variable read in a block
+ * which doesn't assign it is looked up in the block's predecessors, with a
+ * phi where they differ. The language has no loops, so every block's
+ * predecessors are known by the time anything reads a variable in it.
+ * Variables whose address is taken, structs, and names which aren't
+ * declared live in memory instead, in a data area which also holds the
+ * string constants, and are loaded and stored. Values are 32-bit ints and
+ * addresses are offsets into the data area, as on the target. Arithmetic
+ * and comparison instructions are the expression types of the operators
+ * they come from, so they are folded by the same code as the tree
+ * optimizer's.
+ *
+ * The passes are run in order by a pass manager, which can report the time
+ * each one took and how many instructions it left:
+ *
+ *  - simplify-cfg: folds branches on constants, removes unreachable blocks
+ *                  and phis with one value, merges a block into its only
+ *                  predecessor, and skips blocks which only jump
+ *  - sccp:         sparse conditional constant propagation, which finds
+ *                  the values that are constant over the branches that can
+ *                  be taken, and turns branches it decides into jumps
+ *  - gvn:          global value numbering: an instruction computing what
+ *                  an instruction in a dominating block already computed
+ *                  is replaced by it
+ *  - dce:          removes instructions whose values are never used and
+ *                  which have no side effects
+ *
+ * Passes replace an instruction by recording what replaces it, and the
+ * operands which use it are rewritten once, at the end of the pass.
+ *
+ * The interpreter runs the IR from the entry block, printing every call it
+ * makes, since functions aren't defined yet, and gives back the value the
+ * program returns.
+ */
+
+/*** IR operations ***/
+
+/* Binary operators are the EXPRESSION_ types of the operators they come
+ * from. The other operations are numbered after all of those. */
+
+/* Constant value, and the address in the data area value */
+int IR_CONST = 64;
+int IR_ADDRESS = 65;
+
+/* Load size bytes from the address args[0], and store args[1] as size
+ * bytes to the address args[0]. Bytes are signed, as chars are. */
+int IR_LOAD = 66;
+int IR_STORE = 67;
+
+/* Sign extension of the low size bytes of args[0] */
+int IR_EXTEND = 68;
+
+/* Call of the function named value, and phi. Both have the operands
+ * [args[0], args[0] + args[1]) of the operand pool. */
+int IR_CALL = 69;
+int IR_PHI = 70;
+
+/* Terminators: jump to the block's successor, branch to its first
+ * successor if args[0] isn't 0 and its second if it is, and return args[0] */
+int IR_JUMP = 71;
+int IR_BRANCH = 72;
+int IR_RETURN = 73;
+
+/* Addresses below this aren't in the data area, so that 0 is never one */
+int IR_DATA_START = 4;
+
+/* The block the program starts in */
+int IR_ENTRY = 1;
+
+/* An IR instruction */
+typedef struct _instruction {
+    unsigned char op;
+    unsigned char size;
+    unsigned char removed;
+    unsigned int block;
+    unsigned int args[2];
+    long long value;
+} instruction;
+
+/* A basic block */
+typedef struct _ir_block {
+    index_vector phis;
+    index_vector code;
+    index_vector preds;
+    unsigned int succs[2];
+    int num_succs;
+    int removed;
+} ir_block;
+
+/* The value of a variable at the end of a block, while the IR is built */
+typedef struct _ir_definition {
+    unsigned int block;
+    unsigned int variable;
+    unsigned int value;
+} ir_definition;
+
+/* Global IR. Block 0 is never used either. */
+struct {
+    instruction* instructions;
+    unsigned int num;
+    unsigned int allocated;
+
+    /* The instruction that replaces each instruction, 0 if none does */
+    unsigned int* replaced;
+
+    ir_block* blocks;
+    unsigned int num_blocks;
+    unsigned int allocated_blocks;
+
+    /* The operand pool, and operands of phis and calls still being built, as a stack */
+    index_vector operands;
+    index_vector pending;
+
+    /* Initial contents of the data area */
+    unsigned char* data;
+    unsigned int data_size;
+    unsigned int allocated_data;
+
+    /* While lowering: the block being built, the constant 0 in the entry
+     * block, the tokens of the program, the first token of the top-level
+     * statement being lowered, and the offset of the statement inside it
+     * being lowered, where errors are reported */
+    unsigned int current;
+    unsigned int zero;
+    token_stream* tokens;
+    int first_token;
+    unsigned int offset;
+
+    /* While lowering: for each declaration statement, whether its
+     * variable's address is taken, and its address if it is in memory;
+     * and the address of each undeclared name, by symbol */
+    unsigned char* addressed;
+    unsigned int* memory;
+    unsigned int* externals;
+
+    /* While lowering: open addressing hash table of the value of each
+     * variable in each block, empty slots having value 0 */
+    ir_definition* definitions;
+    unsigned int definitions_capacity;
+    unsigned int num_definitions;
+} ir;
+
+/* Release the IR */
+void del_ir(){
+    for(unsigned int b = 0; b < ir.num_blocks; b++){
+        free_index_vector(&ir.blocks[b].phis);
+        free_index_vector(&ir.blocks[b].code);
+        free_index_vector(&ir.blocks[b].preds);
+    }
+    free(ir.instructions);
+    free(ir.replaced);
+    free(ir.blocks);
+    free_index_vector(&ir.operands);
+    free_index_vector(&ir.pending);
+    free(ir.data);
+    free(ir.addressed);
+    free(ir.memory);
+    free(ir.externals);
+    free(ir.definitions);
+    memset(&ir, 0, sizeof(ir));
+}
+
+/*** Building ***/
+
+/* Check whether an operation produces a value */
+int ir_has_value(int op){
+    return op != IR_STORE && op != IR_JUMP && op != IR_BRANCH && op != IR_RETURN;
+}
+
+/* Check whether an operation must be kept even if its value isn't used */
+int ir_has_side_effects(int op){
+    return op == IR_STORE || op == IR_CALL || op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
+
+/* Get the number of operands of an instruction */
+int ir_num_operands(unsigned int i){
+    instruction* in = &ir.instructions[i];
+    if(in->op == IR_CALL || in->op == IR_PHI)
+        return in->args[1];
+    if(in->op == IR_CONST || in->op == IR_ADDRESS || in->op == IR_JUMP)
+        return 0;
+    if(in->op == IR_LOAD || in->op == IR_EXTEND || in->op == IR_BRANCH || in->op == IR_RETURN)
+        return 1;
+    return 2;
+}
+
+/* Get operand k of an instruction. The pointer is valid until the next operand is added. */
+unsigned int* ir_operand(unsigned int i, int k){
+    instruction* in = &ir.instructions[i];
+    if(in->op == IR_CALL || in->op == IR_PHI)
+        return &ir.operands.vals[in->args[0] + k];
+    return &in->args[k];
+}
+
+/* Create an instruction which isn't in any block yet, returning its index */
+unsigned int create_instruction(int op){
+    if(ir.num == ir.allocated){
+        ir.allocated = grow_capacity(ir.allocated, ir.num + 1);
+        ir.instructions = realloc(ir.instructions, ir.allocated * sizeof(instruction));
+        ir.replaced = realloc(ir.replaced, ir.allocated * sizeof(unsigned int));
+    }
+    unsigned int index = ir.num++;
+    memset(&ir.instructions[index], 0, sizeof(instruction));
+    ir.instructions[index].op = op;
+    ir.replaced[index] = 0;
+    return index;
+}
+
+/* Create an empty block, returning its index */
+unsigned int create_block(){
+    if(ir.num_blocks == ir.allocated_blocks){
+        ir.allocated_blocks = grow_capacity(ir.allocated_blocks, ir.num_blocks + 1);
+        ir.blocks = realloc(ir.blocks, ir.allocated_blocks * sizeof(ir_block));
+    }
+    unsigned int index = ir.num_blocks++;
+    memset(&ir.blocks[index], 0, sizeof(ir_block));
+    return index;
+}
+
+/* Add an edge from a block to a successor */
+void add_edge(unsigned int from, unsigned int to){
+    ir.blocks[from].succs[ir.blocks[from].num_succs++] = to;
+    index_vector_push(&ir.blocks[to].preds, from);
+}
+
+/* Add an instruction with up to two operands to the end of the block being built */
+unsigned int emit(int op, unsigned int a, unsigned int b){
+    unsigned int i = create_instruction(op);
+    ir.instructions[i].args[0] = a;
+    ir.instructions[i].args[1] = b;
+    ir.instructions[i].block = ir.current;
+    index_vector_push(&ir.blocks[ir.current].code, i);
+    return i;
+}
+
+/* Add an instruction whose value is given to the end of the block being built */
+unsigned int emit_value(int op, long long value){
+    unsigned int i = emit(op, 0, 0);
+    ir.instructions[i].value = value;
+    return i;
+}
+
+/* Add a load or store of size bytes to the end of the block being built */
+unsigned int emit_sized(int op, int size, unsigned int a, unsigned int b){
+    unsigned int i = emit(op, a, b);
+    ir.instructions[i].size = size;
+    return i;
+}
+
+/* End a block with a jump to another */
+void emit_jump(unsigned int from, unsigned int to){
+    unsigned int current = ir.current;
+    ir.current = from;
+    emit(IR_JUMP, 0, 0);
+    ir.current = current;
+    add_edge(from, to);
+}
+
+/* Create a phi at the start of a block, whose operands are the last count pending operands */
+unsigned int create_phi(unsigned int block, int count){
+    unsigned int i = create_instruction(IR_PHI);
+    ir.instructions[i].args[0] = index_vector_move_top(&ir.operands, &ir.pending, count);
+    ir.instructions[i].args[1] = count;
+    ir.instructions[i].block = block;
+    index_vector_push(&ir.blocks[block].phis, i);
+    return i;
+}
+
+/* Make room in the data area for size bytes aligned to align, which start
+ * as zeros, returning their address */
+unsigned int allocate_data(unsigned int size, int align){
+    unsigned int address = (ir.data_size + align - 1) & ~(unsigned int) (align - 1);
+    unsigned int end = address + (size > 0 ? size : 1);
+    if(end > ir.allocated_data){
+        unsigned int old = ir.allocated_data;
+        ir.allocated_data = grow_capacity(old, end);
+        ir.data = realloc(ir.data, ir.allocated_data);
+        memset(ir.data + old, 0, ir.allocated_data - old);
+    }
+    ir.data_size = end;
+    return address;
+}
+
+/*** Variables ***/
+
+/* Find the slot of the definitions table for a variable in a block */
+ir_definition* find_definition(unsigned int block, unsigned int variable){
+    unsigned int mask = ir.definitions_capacity - 1;
+    unsigned int slot = (block * 2654435761u ^ variable * 0x85ebca6bu) & mask;
+    while(ir.definitions[slot].value != 0 && (ir.definitions[slot].block != block || ir.definitions[slot].variable != variable))
+        slot = (slot + 1) & mask;
+    return &ir.definitions[slot];
+}
+
+/* Record the value of a variable at the end of a block, so far */
+void define_variable(unsigned int block, unsigned int variable, unsigned int value){
+    /* Keep the table at most half full */
+    if(2 * (ir.num_definitions + 1) > ir.definitions_capacity){
+        ir_definition* old = ir.definitions;
+        unsigned int old_capacity = ir.definitions_capacity;
+        ir.definitions_capacity = grow_capacity(old_capacity, 2 * (ir.num_definitions + 1));
+        ir.definitions = calloc(ir.definitions_capacity, sizeof(ir_definition));
+        for(unsigned int i = 0; i < old_capacity; i++)
+            if(old[i].value != 0)
+                *find_definition(old[i].block, old[i].variable) = old[i];
+        free(old);
+    }
+
+    ir_definition* d = find_definition(block, variable);
+    if(d->value == 0)
+        ir.num_definitions++;
+    d->block = block;
+    d->variable = variable;
+    d->value = value;
+}
+
+/* Get the value of a variable at the end of a block, looking it up in the
+ * block's predecessors if the block doesn't assign it. A variable which
+ * nothing has assigned yet is 0. */
+unsigned int read_variable(unsigned int variable, unsigned int block){
+    if(ir.definitions_capacity > 0){
+        ir_definition* d = find_definition(block, variable);
+        if(d->value != 0)
+            return d->value;
+    }
+
+    unsigned int value;
+    unsigned int num_preds = ir.blocks[block].preds.num;
+    if(num_preds == 0)
+        value = ir.zero;
+    else if(num_preds == 1)
+        value = read_variable(variable, ir.blocks[block].preds.vals[0]);
+    else {
+        /* The values from the predecessors wait on the pending stack, and
+         * only need a phi if they differ */
+        int differ = 0;
+        for(unsigned int j = 0; j < num_preds; j++){
+            unsigned int v = read_variable(variable, ir.blocks[block].preds.vals[j]);
+            index_vector_push(&ir.pending, v);
+            differ = differ || v != ir.pending.vals[ir.pending.num - 1 - j];
+        }
+        if(differ)
+            value = create_phi(block, num_preds);
+        else {
+            value = ir.pending.vals[ir.pending.num - 1];
+            ir.pending.num -= num_preds;
+        }
+    }
+
+    define_variable(block, variable, value);
+    return value;
+}
+
+/* Check whether the variable a name in an expression refers to is in memory */
+int in_memory(unsigned int expr){
+    binding b = binding_of(expr);
+    return b.declaration == 0 || ir.memory[b.declaration] != 0;
+}
+
+/* Get the address of the variable in memory that a name in an expression refers to */
+unsigned int variable_address(unsigned int expr){
+    binding b = binding_of(expr);
+    if(b.declaration != 0)
+        return emit_value(IR_ADDRESS, ir.memory[b.declaration]);
+
+    /* Undeclared names are ints which start as 0 */
+    unsigned int name = expression_at(expr)->name;
+    if(ir.externals[name] == 0)
+        ir.externals[name] = allocate_data(4, 4);
+    return emit_value(IR_ADDRESS, ir.externals[name]);
+}
+
+/* Get the size of the values of a type which loads and stores move, 0 for
+ * structs, which aren't values, and 4 if the type isn't known */
+int value_size(type* t){
+    if(t == NULL)
+        return 4;
+    if(t->canonical->struct_type)
+        return 0;
+    return t->size == 1 ? 1 : 4;
+}
+
+/* Load a value of a type from an address. A struct stands for its address,
+ * since nothing copies structs yet. */
+unsigned int load_value(unsigned int address, type* t){
+    int size = value_size(t);
+    if(size == 0)
+        return address;
+    return emit_sized(IR_LOAD, size, address, 0);
+}
+
+/* Store a value of a type to an address */
+void store_value(unsigned int address, unsigned int value, type* t){
+    int size = value_size(t);
+    if(size == 0)
+        error_at(ir.offset, "Structs can't be assigned yet");
+    emit_sized(IR_STORE, size, address, value);
+}
+
+/* Cut a value down to a char, unless it already is one */
+unsigned int extend_char(unsigned int value){
+    instruction* in = &ir.instructions[value];
+    if(in->op == IR_EXTEND && in->size == 1)
+        return value;
+    return emit_sized(IR_EXTEND, 1, value, 0);
+}
+
+/* Get the value the variable a name in an expression refers to has */
+unsigned int load_variable(unsigned int expr){
+    if(in_memory(expr))
+        return load_value(variable_address(expr), declared_type(expr));
+    return read_variable(binding_of(expr).declaration, ir.current);
+}
+
+/* Give the variable a name in an expression refers to a value, returning
+ * the value it has, which is cut down to a char for chars */
+unsigned int store_variable(unsigned int expr, unsigned int value){
+    type* t = declared_type(expr);
+    if(in_memory(expr)){
+        store_value(variable_address(expr), value, t);
+        return value;
+    }
+    if(value_size(t) == 1)
+        value = extend_char(value);
+    define_variable(ir.current, binding_of(expr).declaration, value);
+    return value;
+}
+
+/*** Lowering ***/
+
+unsigned int lower_expression(unsigned int index);
+
+/* Mark the declarations whose variables have their address taken in an expression */
+void find_addressed_expressions(unsigned int index){
+    if(index == 0)
+        return;
+    expression* expr = expression_at(index);
+    if(expr->expression_type == EXPRESSION_ADDR && expression_at(expr->children[0])->expression_type == EXPRESSION_IDENT)
+        ir.addressed[binding_of(expr->children[0]).declaration] = 1;
+
+    int num_children = expression_num_children(index);
+    for(int i = 0; i < num_children; i++)
+        find_addressed_expressions(expression_child(index, i));
+}
+
+/* Mark the declarations whose variables have their address taken in a statement */
+void find_addressed_statements(unsigned int index){
+    if(index == 0)
+        return;
+    statement* st = statement_at(index);
+    if(st->statement_type == STATEMENT_ASSIGN || st->statement_type == STATEMENT_EXPRESSION
+        || st->statement_type == STATEMENT_RETURN || st->statement_type == STATEMENT_IF)
+        find_addressed_expressions(st->expr);
+    if(st->statement_type == STATEMENT_IF){
+        find_addressed_statements(st->children[0]);
+        find_addressed_statements(st->children[1]);
+    }
+    if(st->statement_type == STATEMENT_BLOCK)
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            find_addressed_statements(statement_pool.blocks.vals[st->code_block.first + i]);
+}
+
+/* Multiply a value by the scale of pointer arithmetic, if it isn't 1 */
+unsigned int scale_value(unsigned int value, int scale){
+    if(scale == 1)
+        return value;
+    return emit(EXPRESSION_ARITH_MUL, value, emit_value(IR_CONST, scale));
+}
+
+/* Get the address of a field of the struct at an address */
+unsigned int field_address(unsigned int address, type* object, unsigned int name){
+    if(object == NULL || !object->canonical->struct_type)
+        error_at(ir.offset, "Member access on something which isn't a struct");
+    int field = find_field(object, name);
+    if(field < 0)
+        error_at(ir.offset, "Member access to a field the struct doesn't have");
+
+    unsigned int offset = field_offset(object, field);
+    if(offset == 0)
+        return address;
+    return emit(EXPRESSION_ARITH_ADD, address, emit_value(IR_CONST, offset));
+}
+
+/* Lower an expression which stands for something in memory, returning its address */
+unsigned int lower_address(unsigned int index){
+    expression* expr = expression_at(index);
+    int t = expr->expression_type;
+    if(t == EXPRESSION_IDENT && in_memory(index))
+        return variable_address(index);
+    if(t == EXPRESSION_DEREF)
+        return lower_expression(expr->children[0]);
+    if(t == EXPRESSION_ARRAY_ACCESS){
+        unsigned int base = load_variable(index);
+        unsigned int offset = scale_value(lower_expression(expr->children[0]), pointer_scale(index));
+        return emit(EXPRESSION_ARITH_ADD, base, offset);
+    }
+    if(t == EXPRESSION_MEMBER)
+        return field_address(lower_address(expr->children[0]), type_of_expression(expr->children[0]), expr->name);
+    if(t == EXPRESSION_MEMBER_REF){
+        type* pointer = type_of_expression(expr->children[0]);
+        return field_address(lower_expression(expr->children[0]), is_pointer_type(pointer) ? pointer->canonical->ptr_to : NULL, expr->name);
+    }
+    error_at(ir.offset, "Expected something with an address");
+    return 0;
+}
+
+/* Lower && or ||, which only evaluate their second operand if the first
+ * doesn't decide them, to a branch and a phi */
+unsigned int lower_logical(unsigned int index, int is_and){
+    expression* expr = expression_at(index);
+    unsigned int first = lower_expression(expr->children[0]);
+    unsigned int decided = emit_value(IR_CONST, is_and ? 0 : 1);
+    unsigned int from = ir.current;
+    emit(IR_BRANCH, first, 0);
+
+    unsigned int second_block = create_block();
+    unsigned int join = create_block();
+    add_edge(from, is_and ? second_block : join);
+    add_edge(from, is_and ? join : second_block);
+
+    ir.current = second_block;
+    unsigned int second = lower_expression(expr->children[1]);
+    second = emit(EXPRESSION_EQUALS, emit(EXPRESSION_EQUALS, second, ir.zero), ir.zero);
+    emit_jump(ir.current, join);
+
+    ir.current = join;
+    index_vector_push(&ir.pending, decided);
+    index_vector_push(&ir.pending, second);
+    return create_phi(join, 2);
+}
+
+/* Lower an increment or decrement */
+unsigned int lower_increment(unsigned int index){
+    expression* expr = expression_at(index);
+    int t = expr->expression_type;
+    unsigned int target = expr->children[0];
+    unsigned int step = emit_value(IR_CONST, pointer_scale(index));
+    int op = t == EXPRESSION_PREINCR || t == EXPRESSION_POSTINCR ? EXPRESSION_ARITH_ADD : EXPRESSION_ARITH_SUB;
+    int pre = t == EXPRESSION_PREINCR || t == EXPRESSION_PREDECR;
+
+    if(expression_at(target)->expression_type == EXPRESSION_IDENT && !in_memory(target)){
+        unsigned int old = load_variable(target);
+        unsigned int new = store_variable(target, emit(op, old, step));
+        return pre ? new : old;
+    }
+
+    type* target_type = type_of_expression(target);
+    unsigned int address = lower_address(target);
+    unsigned int old = load_value(address, target_type);
+    unsigned int new = emit(op, old, step);
+    store_value(address, new, target_type);
+    return pre ? new : old;
+}
+
+/* Lower an expression into the block being built, returning the instruction with its value */
+unsigned int lower_expression(unsigned int index){
+    expression* expr = expression_at(index);
+    int t = expr->expression_type;
+
+    if(t == EXPRESSION_NUM_CONST || t == EXPRESSION_CHR_CONST)
+        return emit_value(IR_CONST, truncate_int(expr->num_value));
+    if(t == EXPRESSION_STR_CONST){
+        unsigned int length = strlen(expr->str_value) + 1;
+        unsigned int address = allocate_data(length, 1);
+        memcpy(ir.data + address, expr->str_value, length);
+        return emit_value(IR_ADDRESS, address);
+    }
+    if(t == EXPRESSION_IDENT)
+        return load_variable(index);
+    if(t == EXPRESSION_FUNCALL){
+        int num_args = expr->args.num;
+        for(int i = 0; i < num_args; i++){
+            unsigned int arg = lower_expression(expression_child(index, i));
+            index_vector_push(&ir.pending, arg);
+        }
+        unsigned int call = emit_value(IR_CALL, expression_at(index)->name);
+        ir.instructions[call].args[0] = index_vector_move_top(&ir.operands, &ir.pending, num_args);
+        ir.instructions[call].args[1] = num_args;
+        return call;
+    }
+    if(t == EXPRESSION_ARRAY_ACCESS || t == EXPRESSION_DEREF || t == EXPRESSION_MEMBER || t == EXPRESSION_MEMBER_REF)
+        return load_value(lower_address(index), type_of_expression(index));
+    if(t == EXPRESSION_ADDR)
+        return lower_address(expr->children[0]);
+    if(t == EXPRESSION_AND || t == EXPRESSION_OR)
+        return lower_logical(index, t == EXPRESSION_AND);
+    if(t == EXPRESSION_PREINCR || t == EXPRESSION_PREDECR || t == EXPRESSION_POSTINCR || t == EXPRESSION_POSTDECR)
+        return lower_increment(index);
+    if(t == EXPRESSION_NOT)
+        return emit(EXPRESSION_EQUALS, lower_expression(expr->children[0]), ir.zero);
+
+    if(t == EXPRESSION_ASSIGN){
+        unsigned int target = expr->children[0];
+        unsigned int source = expr->children[1];
+        if(expression_at(target)->expression_type == EXPRESSION_IDENT && !in_memory(target))
+            return store_variable(target, lower_expression(source));
+
+        unsigned int address = lower_address(target);
+        unsigned int value = lower_expression(source);
+        store_value(address, value, type_of_expression(target));
+        return value;
+    }
+
+    if(is_binary_operator(t)){
+        unsigned int first = expr->children[0];
+        unsigned int second = expr->children[1];
+        unsigned int a = lower_expression(first);
+        unsigned int b = lower_expression(second);
+
+        /* Scale the int of pointer arithmetic, and the difference of two pointers */
+        int scale = pointer_scale(index);
+        int pa = is_pointer_type(type_of_expression(first));
+        int pb = is_pointer_type(type_of_expression(second));
+        if(t == EXPRESSION_ARITH_SUB && pa && pb)
+            return scale == 1 ? emit(t, a, b) : emit(EXPRESSION_ARITH_DIV, emit(t, a, b), emit_value(IR_CONST, scale));
+        if((t == EXPRESSION_ARITH_ADD || t == EXPRESSION_ARITH_SUB) && pa)
+            b = scale_value(b, scale);
+        else if(t == EXPRESSION_ARITH_ADD && pb)
+            a = scale_value(a, scale);
+        return emit(t, a, b);
+    }
+
+    error_at(ir.offset, "Expression can't be lowered to IR");
+    return 0;
+}
+
+/* Lower a statement into the block being built */
+void lower_statement(unsigned int index){
+    if(index == 0)
+        return;
+    statement* st = statement_at(index);
+    int t = st->statement_type;
+    ir.offset = statement_offset(ir.tokens, ir.first_token, index);
+
+    /* A declaration's variable is in memory from the start, since it is in scope in its own initializer */
+    if(t == STATEMENT_ASSIGN){
+        type* declared = declared_statement_type(index);
+        if(ir.addressed[index] || declared->canonical->struct_type)
+            ir.memory[index] = allocate_data(declared->size, type_align(declared));
+
+        /* Structs start as zeros, since each declaration runs once */
+        if(declared->canonical->struct_type){
+            expression* init = expression_at(st->expr);
+            if(init->expression_type != EXPRESSION_NUM_CONST || init->num_value != 0)
+                error_at(ir.offset, "Structs can't be initialized yet");
+            return;
+        }
+
+        unsigned int value = lower_expression(st->expr);
+        if(ir.memory[index] != 0)
+            store_value(emit_value(IR_ADDRESS, ir.memory[index]), value, declared);
+        else {
+            if(value_size(declared) == 1)
+                value = extend_char(value);
+            define_variable(ir.current, index, value);
+        }
+    }
+    else if(t == STATEMENT_EXPRESSION){
+        if(st->expr != 0)
+            lower_expression(st->expr);
+    }
+    else if(t == STATEMENT_RETURN){
+        unsigned int value = st->expr != 0 ? lower_expression(st->expr) : ir.zero;
+        emit(IR_RETURN, value, 0);
+
+        /* Anything after a return is unreachable, in a block of its own */
+        ir.current = create_block();
+    }
+    else if(t == STATEMENT_IF){
+        unsigned int then_st = st->children[0];
+        unsigned int else_st = st->children[1];
+        emit(IR_BRANCH, lower_expression(st->expr), 0);
+        unsigned int from = ir.current;
+
+        unsigned int then_block = create_block();
+        add_edge(from, then_block);
+        unsigned int else_block = 0;
+        if(else_st != 0){
+            else_block = create_block();
+            add_edge(from, else_block);
+        }
+
+        ir.current = then_block;
+        lower_statement(then_st);
+        unsigned int then_end = ir.current;
+
+        unsigned int else_end = 0;
+        if(else_st != 0){
+            ir.current = else_block;
+            lower_statement(else_st);
+            else_end = ir.current;
+        }
+
+        unsigned int join = create_block();
+        emit_jump(then_end, join);
+        if(else_st != 0)
+            emit_jump(else_end, join);
+        else
+            add_edge(from, join);
+        ir.current = join;
+    }
+    else if(t == STATEMENT_BLOCK){
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            lower_statement(statement_pool.blocks.vals[st->code_block.first + i]);
+    }
+}
+
+/* Lower a resolved and type checked program to the IR */
+void lower_program(program* prog, token_stream* tokens){
+    del_ir();
+    create_instruction(0);
+    create_block();
+    allocate_data(IR_DATA_START, 1);
+
+    ir.addressed = calloc(statement_pool.num, 1);
+    ir.memory = calloc(statement_pool.num, sizeof(unsigned int));
+    ir.externals = calloc(symbol_table.num + 1, sizeof(unsigned int));
+    for(int i = 0; i < prog->num; i++)
+        find_addressed_statements(prog->statements[i]);
+
+    ir.current = create_block();
+    ir.zero = emit_value(IR_CONST, 0);
+    ir.tokens = tokens;
+    for(int i = 0; i < prog->num; i++){
+        ir.first_token = prog->first_tokens[i];
+        lower_statement(prog->statements[i]);
+    }
+    emit(IR_RETURN, ir.zero, 0);
+
+    /* Only lowering needs these */
+    free(ir.definitions);
+    ir.definitions = NULL;
+    ir.definitions_capacity = ir.num_definitions = 0;
+}
+
+/*** Printing ***/
+
+/* Get the name of an IR operation */
+char* ir_op_name(int op){
+    if(op == EXPRESSION_ARITH_ADD) return "add";
+    if(op == EXPRESSION_ARITH_SUB) return "sub";
+    if(op == EXPRESSION_ARITH_MUL) return "mul";
+    if(op == EXPRESSION_ARITH_DIV) return "div";
+    if(op == EXPRESSION_SHIFT_LEFT) return "shl";
+    if(op == EXPRESSION_EQUALS) return "eq";
+    if(op == EXPRESSION_GREATER) return "gt";
+    if(op == EXPRESSION_LESS) return "lt";
+    if(op == EXPRESSION_GREATEREQ) return "ge";
+    if(op == EXPRESSION_LESSEQ) return "le";
+    if(op == EXPRESSION_AND) return "and";
+    if(op == EXPRESSION_OR) return "or";
+    if(op == IR_CONST) return "const";
+    if(op == IR_ADDRESS) return "address";
+    if(op == IR_LOAD) return "load";
+    if(op == IR_STORE) return "store";
+    if(op == IR_EXTEND) return "extend";
+    if(op == IR_CALL) return "call";
+    if(op == IR_PHI) return "phi";
+    if(op == IR_JUMP) return "jump";
+    if(op == IR_BRANCH) return "branch";
+    if(op == IR_RETURN) return "return";
+    return "unknown";
+}
+
+/* Print an instruction in some useful debugging form to stdout */
+void print_instruction(unsigned int i){
+    instruction* in = &ir.instructions[i];
+    int op = in->op;
+    printf("    ");
+    if(ir_has_value(op))
+        printf("%%%u = ", i);
+    printf("%s", ir_op_name(op));
+    if(op == IR_LOAD || op == IR_STORE || op == IR_EXTEND)
+        printf("%d", in->size);
+
+    if(op == IR_CONST || op == IR_ADDRESS)
+        printf(" %lld", in->value);
+    else if(op == IR_CALL){
+        printf(" %s(", symbol_name(in->value));
+        for(int k = 0; k < ir_num_operands(i); k++)
+            printf("%s%%%u", k > 0 ? ", " : "", *ir_operand(i, k));
+        printf(")");
+    }
+    else if(op == IR_PHI){
+        ir_block* b = &ir.blocks[in->block];
+        for(int k = 0; k < ir_num_operands(i); k++)
+            printf("%s [%%%u, block %u]", k > 0 ? "," : "", *ir_operand(i, k), b->preds.vals[k]);
+    }
+    else {
+        for(int k = 0; k < ir_num_operands(i); k++)
+            printf("%s %%%u", k > 0 ? "," : "", *ir_operand(i, k));
+    }
+
+    ir_block* b = &ir.blocks[in->block];
+    if(op == IR_JUMP)
+        printf(" block %u", b->succs[0]);
+    if(op == IR_BRANCH)
+        printf(", block %u, block %u", b->succs[0], b->succs[1]);
+    printf("\n");
+}
+
+/* Print the IR in some useful debugging form to stdout */
+void print_ir(){
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+        ir_block* block = &ir.blocks[b];
+        if(block->removed)
+            continue;
+        printf("block %u:", b);
+        if(block->preds.num > 0){
+            printf(" preds");
+            for(unsigned int j = 0; j < block->preds.num; j++)
+                printf(" %u", block->preds.vals[j]);
+        }
+        printf("\n");
+        for(unsigned int k = 0; k < block->phis.num; k++)
+            print_instruction(block->phis.vals[k]);
+        for(unsigned int k = 0; k < block->code.num; k++)
+            print_instruction(block->code.vals[k]);
+    }
+}
+
+/*** Editing ***/
+
+/* Get the instruction which replaces an instruction, following replacements of replacements */
+unsigned int resolve_value(unsigned int i){
+    while(ir.replaced[i] != 0)
+        i = ir.replaced[i];
+    return i;
+}
+
+/* Replace an instruction by another, removing it */
+void replace_instruction(unsigned int old, unsigned int new){
+    ir.replaced[old] = new;
+    ir.instructions[old].removed = 1;
+}
+
+/* Get the last instruction of a block, which is its terminator once it is built */
+unsigned int block_terminator(unsigned int b){
+    ir_block* block = &ir.blocks[b];
+    return block->code.vals[block->code.num - 1];
+}
+
+/* Rewrite the operands of every instruction which use a replaced
+ * instruction, and drop removed instructions from their blocks */
+void apply_replacements(){
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+        ir_block* block = &ir.blocks[b];
+        if(block->removed)
+            continue;
+        for(int list = 0; list < 2; list++){
+            index_vector* vec = list == 0 ? &block->phis : &block->code;
+            unsigned int kept = 0;
+            for(unsigned int k = 0; k < vec->num; k++){
+                unsigned int i = vec->vals[k];
+                if(ir.instructions[i].removed)
+                    continue;
+                int num_operands = ir_num_operands(i);
+                for(int j = 0; j < num_operands; j++){
+                    unsigned int* operand = ir_operand(i, j);
+                    *operand = resolve_value(*operand);
+                }
+                vec->vals[kept++] = i;
+            }
+            vec->num = kept;
+        }
+    }
+}
+
+/* Find which predecessor of a block another block is, or -1 if it isn't one */
+int find_pred(unsigned int b, unsigned int pred){
+    ir_block* block = &ir.blocks[b];
+    for(unsigned int j = 0; j < block->preds.num; j++)
+        if(block->preds.vals[j] == pred)
+            return j;
+    return -1;
+}
+
+/* Remove a predecessor from a block, along with its operand of every phi */
+void remove_pred(unsigned int b, unsigned int pred){
+    ir_block* block = &ir.blocks[b];
+    int j = find_pred(b, pred);
+    if(block->removed || j < 0)
+        return;
+
+    memmove(block->preds.vals + j, block->preds.vals + j + 1, (block->preds.num - j - 1) * sizeof(unsigned int));
+    block->preds.num--;
+    for(unsigned int k = 0; k < block->phis.num; k++){
+        instruction* phi = &ir.instructions[block->phis.vals[k]];
+        unsigned int* run = ir.operands.vals + phi->args[0];
+        memmove(run + j, run + j + 1, (phi->args[1] - j - 1) * sizeof(unsigned int));
+        phi->args[1]--;
+    }
+}
+
+/* Remove a block and its instructions, and its edges to its successors */
+void remove_block(unsigned int b){
+    ir_block* block = &ir.blocks[b];
+    for(int list = 0; list < 2; list++){
+        index_vector* vec = list == 0 ? &block->phis : &block->code;
+        for(unsigned int k = 0; k < vec->num; k++)
+            ir.instructions[vec->vals[k]].removed = 1;
+        vec->num = 0;
+    }
+    for(int s = 0; s < block->num_succs; s++)
+        if(block->succs[s] != b)
+            remove_pred(block->succs[s], b);
+    block->num_succs = 0;
+    block->preds.num = 0;
+    block->removed = 1;
+}
+
+/* Turn a branch which ends a block into a jump to one of its successors */
+void branch_to(unsigned int b, int taken){
+    ir_block* block = &ir.blocks[b];
+    unsigned int kept = block->succs[taken];
+    unsigned int dropped = block->succs[1 - taken];
+    instruction* branch = &ir.instructions[block_terminator(b)];
+    branch->op = IR_JUMP;
+    branch->args[0] = 0;
+    block->succs[0] = kept;
+    block->num_succs = 1;
+    remove_pred(dropped, b);
+}
+
+/* Mark the blocks which can be reached from the entry block */
+unsigned char* find_reachable_blocks(){
+    unsigned char* reached = calloc(ir.num_blocks, 1);
+    index_vector work = {0};
+    reached[IR_ENTRY] = 1;
+    index_vector_push(&work, IR_ENTRY);
+    while(work.num > 0){
+        ir_block* block = &ir.blocks[index_vector_pop(&work)];
+        for(int s = 0; s < block->num_succs; s++){
+            if(!reached[block->succs[s]]){
+                reached[block->succs[s]] = 1;
+                index_vector_push(&work, block->succs[s]);
+            }
+        }
+    }
+    free_index_vector(&work);
+    return reached;
+}
+
+/* Count the instructions in the blocks of the IR */
+unsigned int count_instructions(){
+    unsigned int count = 0;
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++)
+        if(!ir.blocks[b].removed)
+            count += ir.blocks[b].phis.num + ir.blocks[b].code.num;
+    return count;
+}
+
+/* Count the blocks of the IR */
+unsigned int count_blocks(){
+    unsigned int count = 0;
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++)
+        count += !ir.blocks[b].removed;
+    return count;
+}
+
+/*** Passes ***/
+
+/* Merge a block into its only predecessor, which only jumps to it */
+void merge_blocks(unsigned int pred, unsigned int b){
+    ir_block* block = &ir.blocks[b];
+
+    /* Its phis have one operand each */
+    for(unsigned int k = 0; k < block->phis.num; k++)
+        replace_instruction(block->phis.vals[k], *ir_operand(block->phis.vals[k], 0));
+    block->phis.num = 0;
+
+    ir_block* into = &ir.blocks[pred];
+    ir.instructions[block_terminator(pred)].removed = 1;
+    into->code.num--;
+    for(unsigned int k = 0; k < block->code.num; k++){
+        ir.instructions[block->code.vals[k]].block = pred;
+        index_vector_push(&into->code, block->code.vals[k]);
+    }
+    block->code.num = 0;
+
+    into = &ir.blocks[pred];
+    into->num_succs = block->num_succs;
+    for(int s = 0; s < block->num_succs; s++){
+        into->succs[s] = block->succs[s];
+        ir_block* succ = &ir.blocks[block->succs[s]];
+        succ->preds.vals[find_pred(block->succs[s], b)] = pred;
+    }
+    block->num_succs = 0;
+    block->preds.num = 0;
+    block->removed = 1;
+}
+
+/* Check whether a block only jumps to its successor */
+int is_forwarding_block(unsigned int b){
+    ir_block* block = &ir.blocks[b];
+    return block->phis.num == 0 && block->code.num == 1 && ir.instructions[block->code.vals[0]].op == IR_JUMP;
+}
+
+/* Send the predecessors of a block which only jumps straight to its
+ * successor, if the successor has no phis that would need to tell them
+ * apart and none of them already goes there. Returns whether it did. */
+int skip_forwarding_block(unsigned int b){
+    ir_block* block = &ir.blocks[b];
+    unsigned int target = block->succs[0];
+    if(target == b || ir.blocks[target].phis.num > 0)
+        return 0;
+    for(unsigned int j = 0; j < block->preds.num; j++)
+        if(find_pred(target, block->preds.vals[j]) >= 0)
+            return 0;
+
+    for(unsigned int j = 0; j < block->preds.num; j++){
+        unsigned int pred = block->preds.vals[j];
+        ir_block* from = &ir.blocks[pred];
+        for(int s = 0; s < from->num_succs; s++)
+            if(from->succs[s] == b)
+                from->succs[s] = target;
+        index_vector_push(&ir.blocks[target].preds, pred);
+    }
+    block->preds.num = 0;
+    remove_block(b);
+    return 1;
+}
+
+/* Simplify the control flow graph until nothing changes */
+void simplify_cfg(){
+    int changed = 1;
+    while(changed){
+        changed = 0;
+
+        /* Branches on constants */
+        for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+            if(ir.blocks[b].removed)
+                continue;
+            instruction* term = &ir.instructions[block_terminator(b)];
+            if(term->op == IR_BRANCH && ir.instructions[term->args[0]].op == IR_CONST){
+                branch_to(b, ir.instructions[term->args[0]].value != 0 ? 0 : 1);
+                changed = 1;
+            }
+        }
+
+        /* Unreachable blocks */
+        unsigned char* reached = find_reachable_blocks();
+        for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+            if(!ir.blocks[b].removed && !reached[b]){
+                remove_block(b);
+                changed = 1;
+            }
+        }
+        free(reached);
+
+        /* Phis whose operands are all the same value */
+        for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+            ir_block* block = &ir.blocks[b];
+            if(block->removed)
+                continue;
+            for(unsigned int k = 0; k < block->phis.num; k++){
+                unsigned int phi = block->phis.vals[k];
+                unsigned int same = resolve_value(*ir_operand(phi, 0));
+                int num_operands = ir_num_operands(phi);
+                int j = 1;
+                while(j < num_operands && resolve_value(*ir_operand(phi, j)) == same)
+                    j++;
+                if(j == num_operands){
+                    replace_instruction(phi, same);
+                    changed = 1;
+                }
+            }
+        }
+        apply_replacements();
+
+        /* Blocks which only jump to a block with no other predecessor */
+        for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+            if(ir.blocks[b].removed)
+                continue;
+            while(ir.instructions[block_terminator(b)].op == IR_JUMP){
+                unsigned int succ = ir.blocks[b].succs[0];
+                if(succ == b || succ == IR_ENTRY || ir.blocks[succ].preds.num != 1)
+                    break;
+                merge_blocks(b, succ);
+                changed = 1;
+            }
+        }
+
+        /* Blocks which only jump */
+        for(unsigned int b = IR_ENTRY + 1; b < ir.num_blocks; b++)
+            if(!ir.blocks[b].removed && is_forwarding_block(b) && skip_forwarding_block(b))
+                changed = 1;
+        apply_replacements();
+    }
+}
+
+/* Lattice values of sparse conditional constant propagation: not known to
+ * be anything yet, a constant, or not a constant */
+int LATTICE_UNKNOWN = 0;
+int LATTICE_CONSTANT = 1;
+int LATTICE_VARYING = 2;
+
+/* Sparse conditional constant propagation state */
+struct {
+    unsigned char* lattice;
+    long long* values;
+
+    /* Users of each instruction: users[user_start[i] ... user_start[i + 1]) */
+    unsigned int* user_start;
+    unsigned int* users;
+
+    /* Whether each block, and each edge into it, numbered from
+     * edge_start[b] in the order of its predecessors, can be taken */
+    unsigned char* executable;
+    unsigned int* edge_start;
+    unsigned char* edge_executable;
+
+    /* Instructions whose operands changed, and edges newly found executable as from, to pairs */
+    index_vector ssa_work;
+    index_vector flow_work;
+} sccp;
+
+/* Find the users of every instruction of the IR */
+void find_users(){
+    sccp.user_start = calloc(ir.num + 1, sizeof(unsigned int));
+    for(int pass = 0; pass < 2; pass++){
+        for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+            ir_block* block = &ir.blocks[b];
+            if(block->removed)
+                continue;
+            for(int list = 0; list < 2; list++){
+                index_vector* vec = list == 0 ? &block->phis : &block->code;
+                for(unsigned int k = 0; k < vec->num; k++){
+                    unsigned int i = vec->vals[k];
+                    for(int j = 0; j < ir_num_operands(i); j++){
+                        unsigned int operand = *ir_operand(i, j);
+                        if(pass == 0)
+                            sccp.user_start[operand + 1]++;
+                        else
+                            sccp.users[sccp.user_start[operand]++] = i;
+                    }
+                }
+            }
+        }
+
+        /* Turn the counts into starts, and after the second pass, the
+         * starts moved on to the ends back into starts */
+        if(pass == 0){
+            for(unsigned int i = 1; i <= ir.num; i++)
+                sccp.user_start[i] += sccp.user_start[i - 1];
+            sccp.users = malloc((sccp.user_start[ir.num] + 1) * sizeof(unsigned int));
+        } else {
+            for(unsigned int i = ir.num; i > 0; i--)
+                sccp.user_start[i] = sccp.user_start[i - 1];
+            sccp.user_start[0] = 0;
+        }
+    }
+}
+
+/* Lower the lattice value of an instruction, queueing its users if it changed */
+void set_lattice(unsigned int i, int state, long long value){
+    if(sccp.lattice[i] == state && (state != LATTICE_CONSTANT || sccp.values[i] == value))
+        return;
+    sccp.lattice[i] = state;
+    sccp.values[i] = value;
+    for(unsigned int k = sccp.user_start[i]; k < sccp.user_start[i + 1]; k++)
+        index_vector_push(&sccp.ssa_work, sccp.users[k]);
+}
+
+/* Mark an edge as executable, queueing it if it is new */
+void mark_edge(unsigned int from, unsigned int to){
+    unsigned int edge = sccp.edge_start[to] + find_pred(to, from);
+    if(sccp.edge_executable[edge])
+        return;
+    sccp.edge_executable[edge] = 1;
+    index_vector_push(&sccp.flow_work, from);
+    index_vector_push(&sccp.flow_work, to);
+}
+
+/* Work out the lattice value of an instruction from its operands' */
+void evaluate_instruction(unsigned int i){
+    instruction* in = &ir.instructions[i];
+    int op = in->op;
+    ir_block* block = &ir.blocks[in->block];
+
+    if(op == IR_CONST)
+        set_lattice(i, LATTICE_CONSTANT, in->value);
+    else if(op == IR_PHI){
+        /* Meet of the operands coming over executable edges */
+        int state = LATTICE_UNKNOWN;
+        long long value = 0;
+        for(int j = 0; j < ir_num_operands(i) && state != LATTICE_VARYING; j++){
+            unsigned int operand = *ir_operand(i, j);
+            if(!sccp.edge_executable[sccp.edge_start[in->block] + j] || sccp.lattice[operand] == LATTICE_UNKNOWN)
+                continue;
+            if(sccp.lattice[operand] == LATTICE_VARYING || (state == LATTICE_CONSTANT && sccp.values[operand] != value))
+                state = LATTICE_VARYING;
+            else {
+                state = LATTICE_CONSTANT;
+                value = sccp.values[operand];
+            }
+        }
+        set_lattice(i, state, value);
+    }
+    else if(op == IR_EXTEND || is_binary_operator(op)){
+        /* Varying if any operand is, else unknown until they all are constants */
+        int num_operands = ir_num_operands(i);
+        int state = LATTICE_CONSTANT;
+        for(int j = 0; j < num_operands; j++){
+            int operand = sccp.lattice[in->args[j]];
+            if(operand == LATTICE_VARYING)
+                state = LATTICE_VARYING;
+            else if(operand == LATTICE_UNKNOWN && state == LATTICE_CONSTANT)
+                state = LATTICE_UNKNOWN;
+        }
+        if(state != LATTICE_CONSTANT){
+            set_lattice(i, state, 0);
+            return;
+        }
+
+        long long value;
+        if(op == IR_EXTEND)
+            set_lattice(i, LATTICE_CONSTANT, (signed char) sccp.values[in->args[0]]);
+        else if(fold_binary(op, sccp.values[in->args[0]], sccp.values[in->args[1]], &value))
+            set_lattice(i, LATTICE_CONSTANT, value);
+        else
+            set_lattice(i, LATTICE_VARYING, 0);
+    }
+    else if(op == IR_BRANCH){
+        int state = sccp.lattice[in->args[0]];
+        if(state == LATTICE_CONSTANT)
+            mark_edge(in->block, block->succs[sccp.values[in->args[0]] != 0 ? 0 : 1]);
+        else if(state == LATTICE_VARYING){
+            mark_edge(in->block, block->succs[0]);
+            mark_edge(in->block, block->succs[1]);
+        }
+    }
+    else if(op == IR_JUMP)
+        mark_edge(in->block, block->succs[0]);
+    else if(ir_has_value(op))
+        set_lattice(i, LATTICE_VARYING, 0);
+}
+
+/* Evaluate the instructions of a block, or only its phis */
+void evaluate_block(unsigned int b, int phis_only){
+    for(unsigned int k = 0; k < ir.blocks[b].phis.num; k++)
+        evaluate_instruction(ir.blocks[b].phis.vals[k]);
+    if(!phis_only)
+        for(unsigned int k = 0; k < ir.blocks[b].code.num; k++)
+            evaluate_instruction(ir.blocks[b].code.vals[k]);
+}
+
+/* Replace every instruction which is constant on every path that can be
+ * taken by that constant, decide branches, and remove blocks that can't be
+ * reached */
+void propagate_constants(){
+    sccp.lattice = calloc(ir.num, 1);
+    sccp.values = calloc(ir.num, sizeof(long long));
+    sccp.executable = calloc(ir.num_blocks, 1);
+    sccp.edge_start = calloc(ir.num_blocks + 1, sizeof(unsigned int));
+    for(unsigned int b = 0; b < ir.num_blocks; b++)
+        sccp.edge_start[b + 1] = sccp.edge_start[b] + (ir.blocks[b].removed ? 0 : ir.blocks[b].preds.num);
+    sccp.edge_executable = calloc(sccp.edge_start[ir.num_blocks] + 1, 1);
+    find_users();
+
+    sccp.executable[IR_ENTRY] = 1;
+    evaluate_block(IR_ENTRY, 0);
+    while(sccp.flow_work.num > 0 || sccp.ssa_work.num > 0){
+        if(sccp.flow_work.num > 0){
+            unsigned int to = index_vector_pop(&sccp.flow_work);
+            index_vector_pop(&sccp.flow_work);
+            int phis_only = sccp.executable[to];
+            sccp.executable[to] = 1;
+            evaluate_block(to, phis_only);
+        } else {
+            unsigned int i = index_vector_pop(&sccp.ssa_work);
+            if(sccp.executable[ir.instructions[i].block])
+                evaluate_instruction(i);
+        }
+    }
+
+    /* Blocks which are never reached go first, taking their phi operands with them */
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++)
+        if(!ir.blocks[b].removed && !sccp.executable[b])
+            remove_block(b);
+
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+        ir_block* block = &ir.blocks[b];
+        if(block->removed)
+            continue;
+
+        /* Constant phis become constants at the start of the block */
+        unsigned int constant_phis = 0;
+        for(unsigned int k = 0; k < block->phis.num; k++)
+            if(sccp.lattice[block->phis.vals[k]] == LATTICE_CONSTANT)
+                constant_phis++;
+        if(constant_phis > 0){
+            index_vector code = {0};
+            reserve_index_vector(&code, block->code.num + constant_phis);
+            unsigned int kept = 0;
+            for(unsigned int k = 0; k < block->phis.num; k++){
+                unsigned int phi = block->phis.vals[k];
+                if(sccp.lattice[phi] == LATTICE_CONSTANT)
+                    index_vector_push(&code, phi);
+                else
+                    block->phis.vals[kept++] = phi;
+            }
+            block->phis.num = kept;
+            for(unsigned int k = 0; k < block->code.num; k++)
+                index_vector_push(&code, block->code.vals[k]);
+            free_index_vector(&block->code);
+            block->code = code;
+        }
+
+        for(unsigned int k = 0; k < block->code.num; k++){
+            unsigned int i = block->code.vals[k];
+            instruction* in = &ir.instructions[i];
+            if(sccp.lattice[i] == LATTICE_CONSTANT && in->op != IR_CONST){
+                in->op = IR_CONST;
+                in->value = sccp.values[i];
+                in->args[0] = in->args[1] = 0;
+            }
+            if(in->op == IR_BRANCH && sccp.lattice[in->args[0]] == LATTICE_CONSTANT)
+                branch_to(b, sccp.values[in->args[0]] != 0 ? 0 : 1);
+        }
+    }
+
+    free(sccp.lattice);
+    free(sccp.values);
+    free(sccp.user_start);
+    free(sccp.users);
+    free(sccp.executable);
+    free(sccp.edge_start);
+    free(sccp.edge_executable);
+    free_index_vector(&sccp.ssa_work);
+    free_index_vector(&sccp.flow_work);
+}
+
+/* Remove every instruction without side effects whose value isn't used */
+void eliminate_dead_code(){
+    unsigned char* live = calloc(ir.num, 1);
+    index_vector work = {0};
+    for(unsigned int b = IR_ENTRY; b < ir.num_blocks; b++){
+        ir_block* block = &ir.blocks[b];
+        if(block->removed)
+            continue;
+        for(unsigned int k = 0; k < block->code.num; k++){
+            unsigned int i = block->code.vals[k];
+            if(ir_has_side_effects(ir.instructions[i].op)){
+                live[i] = 1;
+                index_vector_push(&work, i);
+            }
+        }
+    }
+
+    while(work.num > 0){
+        unsigned int i = index_vector_pop(&work);
+        for(int j = 0; j < ir_num_operands(i); j++){
+            unsigned int operand = *ir_operand(i, j);
+            if(!live[operand]){
+                live[operand] = 1;
+                index_vector_push(&work, operand);
+            }
+        }
+    }
+
+    for(unsigned int i = 1; i < ir.num; i++)
+        if(!live[i])
+            ir.instructions[i].removed = 1;
+    apply_replacements();
+
+    free(live);
+    free_index_vector(&work);
+}
+
+/* Check whether a binary operation gives the same value with its operands swapped */
+int is_commutative(int op){
+    return op == EXPRESSION_ARITH_ADD || op == EXPRESSION_ARITH_MUL || op == EXPRESSION_EQUALS;
+}
+
+/* Check whether an instruction's value depends only on its operation and operands */
+int is_numberable(int op){
+    return op == IR_CONST || op == IR_ADDRESS || op == IR_EXTEND || op == IR_PHI || is_binary_operator(op);
+}
+
+/* Hash an instruction by what it computes */
+unsigned int hash_instruction(unsigned int i){
+    instruction* in = &ir.instructions[i];
+    unsigned int hash = mix_hash(in->op, in->size);
+    hash = mix_hash(hash, (unsigned int) in->value);
+    hash = mix_hash(hash, (unsigned int) (in->value >> 32));
+    if(in->op == IR_PHI)
+        hash = mix_hash(hash, in->block);
+    for(int j = 0; j < ir_num_operands(i); j++)
+        hash = mix_hash(hash, *ir_operand(i, j));
+    return hash;
+}
+
+/* Check whether two instructions compute the same value */
+int same_instruction(unsigned int a, unsigned int b){
+    instruction* x = &ir.instructions[a];
+    instruction* y = &ir.instructions[b];
+    if(x->op != y->op || x->size != y->size || x->value != y->value)
+        return 0;
+    if(x->op == IR_PHI && (x->block != y->block || x->args[1] != y->args[1]))
+        return 0;
+    for(int j = 0; j < ir_num_operands(a); j++)
+        if(*ir_operand(a, j) != *ir_operand(b, j))
+            return 0;
+    return 1;
+}
+
+/* Find the immediate dominator of every reachable block, by the algorithm
+ * of Cooper, Harvey and Kennedy, storing the reachable blocks in reverse
+ * postorder in order. Unreachable blocks have no immediate dominator, 0. */
+unsigned int* find_dominators(index_vector* order){
+    unsigned int* rpo_number = calloc(ir.num_blocks, sizeof(unsigned int));
+    unsigned int* next_succ = calloc(ir.num_blocks, sizeof(unsigned int));
+    index_vector stack = {0};
+
+    /* Postorder by depth first search, then reversed */
+    order->num = 0;
+    rpo_number[IR_ENTRY] = 1;
+    index_vector_push(&stack, IR_ENTRY);
+    while(stack.num > 0){
+        unsigned int b = stack.vals[stack.num - 1];
+        if(next_succ[b] < ir.blocks[b].num_succs){
+            unsigned int succ = ir.blocks[b].succs[next_succ[b]++];
+            if(rpo_number[succ] == 0){
+                rpo_number[succ] = 1;
+                index_vector_push(&stack, succ);
+            }
+        } else {
+            index_vector_push(order, b);
+            stack.num--;
+        }
+    }
+    for(unsigned int k = 0; k < order->num / 2; k++){
+        unsigned int swap = order->vals[k];
+        order->vals[k] = order->vals[order->num - 1 - k];
+        order->vals[order->num - 1 - k] = swap;
+    }
+    for(unsigned int k = 0; k < order->num; k++)
+        rpo_number[order->vals[k]] = k + 1;
+
+    unsigned int* idom = calloc(ir.num_blocks, sizeof(unsigned int));
+    idom[IR_ENTRY] = IR_ENTRY;
+    int changed = 1;
+    while(changed){
+        changed = 0;
+        for(unsigned int k = 1; k < order->num; k++){
+            unsigned int b = order->vals[k];
+            unsigned int new_idom = 0;
+            for(unsigned int j = 0; j < ir.blocks[b].preds.num; j++){
+                unsigned int pred = ir.blocks[b].preds.vals[j];
+                if(idom[pred] == 0)
+                    continue;
+                if(new_idom == 0){
+                    new_idom = pred;
+                    continue;
+                }
+
+                /* Walk up from both to where they meet */
+                unsigned int x = pred;
+                unsigned int y = new_idom;
+                while(x != y){
+                    while(rpo_number[x] > rpo_number[y])
+                        x = idom[x];
+                    while(rpo_number[y] > rpo_number[x])
+                        y = idom[y];
+                }
+                new_idom = x;
+            }
+            if(idom[b] != new_idom){
+                idom[b] = new_idom;
+                changed = 1;
+            }
+        }
+    }
+
+    free(rpo_number);
+    free(next_succ);
+    free_index_vector(&stack);
+    return idom;
+}
+
+/* Replace every instruction which computes the same value as one in a
+ * block which dominates it, or earlier in its block, by that one. The
+ * dominator tree is walked depth first with a scoped hash table of the
+ * instructions in the blocks above, which forgets a block's instructions
+ * when the walk leaves it. */
+void number_values(){
+    index_vector order = {0};
+    unsigned int* idom = find_dominators(&order);
+
+    /* Children of each block in the dominator tree: children[child_start[b] ... child_start[b + 1]) */
+    unsigned int* child_start = calloc(ir.num_blocks + 1, sizeof(unsigned int));
+    unsigned int* children = malloc((order.num + 1) * sizeof(unsigned int));
+    for(unsigned int k = 1; k < order.num; k++)
+        child_start[idom[order.vals[k]] + 1]++;
+    for(unsigned int b = 1; b <= ir.num_blocks; b++)
+        child_start[b] += child_start[b - 1];
+    unsigned int* fill = malloc((ir.num_blocks + 1) * sizeof(unsigned int));
+    memcpy(fill, child_start, (ir.num_blocks + 1) * sizeof(unsigned int));
+    for(unsigned int k = 1; k < order.num; k++)
+        children[fill[idom[order.vals[k]]]++] = order.vals[k];
+    free(fill);
+
+    /* Chained hash table: the newest instruction in each bucket, and for
+     * each instruction the one it was put in front of. Undoing an insertion
+     * puts back the one in front of it. */
+    unsigned int capacity = grow_capacity(0, 2 * ir.num);
+    unsigned int* buckets = calloc(capacity, sizeof(unsigned int));
+    unsigned int* next = calloc(ir.num, sizeof(unsigned int));
+    index_vector inserted = {0};
+    unsigned int* scope_start = calloc(ir.num_blocks, sizeof(unsigned int));
+
+    /* Blocks are pushed as 2b to enter them and 2b + 1 to leave them */
+    index_vector stack = {0};
+    index_vector_push(&stack, 2 * IR_ENTRY);
+    while(stack.num > 0){
+        unsigned int item = index_vector_pop(&stack);
+        unsigned int b = item / 2;
+        if(item % 2 == 1){
+            while(inserted.num > scope_start[b]){
+                unsigned int i = index_vector_pop(&inserted);
+                buckets[hash_instruction(i) & (capacity - 1)] = next[i];
+            }
+            continue;
+        }
+
+        scope_start[b] = inserted.num;
+        index_vector_push(&stack, 2 * b + 1);
+        for(unsigned int k = child_start[b]; k < child_start[b + 1]; k++)
+            index_vector_push(&stack, 2 * children[k]);
+
+        ir_block* block = &ir.blocks[b];
+        for(int list = 0; list < 2; list++){
+            index_vector* vec = list == 0 ? &block->phis : &block->code;
+            for(unsigned int k = 0; k < vec->num; k++){
+                unsigned int i = vec->vals[k];
+                instruction* in = &ir.instructions[i];
+                for(int j = 0; j < ir_num_operands(i); j++){
+                    unsigned int* operand = ir_operand(i, j);
+                    *operand = resolve_value(*operand);
+                }
+                if(!is_numberable(in->op))
+                    continue;
+                if(is_commutative(in->op) && in->args[0] > in->args[1]){
+                    unsigned int swap = in->args[0];
+                    in->args[0] = in->args[1];
+                    in->args[1] = swap;
+                }
+
+                unsigned int bucket = hash_instruction(i) & (capacity - 1);
+                unsigned int found = buckets[bucket];
+                while(found != 0 && !same_instruction(found, i))
+                    found = next[found];
+                if(found != 0){
+                    replace_instruction(i, found);
+                    continue;
+                }
+                next[i] = buckets[bucket];
+                buckets[bucket] = i;
+                index_vector_push(&inserted, i);
+            }
+        }
+    }
+    apply_replacements();
+
+    free(idom);
+    free(child_start);
+    free(children);
+    free(buckets);
+    free(next);
+    free(scope_start);
+    free_index_vector(&order);
+    free_index_vector(&inserted);
+    free_index_vector(&stack);
+}
+
+/*** Pass manager ***/
+
+/* An IR pass */
+typedef struct _ir_pass {
+    char* name;
+    void (*run)();
+} ir_pass;
+
+/* The passes, in the order they run. The CFG is simplified first so the
+ * other passes see fewer blocks, and again after the passes that decide
+ * branches and empty blocks. */
+ir_pass ir_passes[] = {
+    {"simplify-cfg", simplify_cfg},
+    {"sccp", propagate_constants},
+    {"simplify-cfg", simplify_cfg},
+    {"gvn", number_values},
+    {"dce", eliminate_dead_code},
+    {"simplify-cfg", simplify_cfg},
+};
+int num_ir_passes = sizeof(ir_passes) / sizeof(ir_pass);
+
+/* Run every IR pass in order. If report is set, print how long each took
+ * and how many instructions and blocks it left to the standard error. */
+void optimize_ir(int report){
+    for(int i = 0; i < num_ir_passes; i++){
+        unsigned int before = count_instructions();
+        long long start = now_ns();
+        ir_passes[i].run();
+        long long time = now_ns() - start;
+        if(report)
+            fprintf(stderr, "%-12s %9.3f ms, %u -> %u instructions, %u blocks\n", ir_passes[i].name,
+                time / 1e6, before, count_instructions(), count_blocks());
+    }
+}
+
+/*** Interpreter ***/
+
+/* Check that size bytes at an address are in the data area */
+void check_address(long long address, int size, unsigned int data_size){
+    if(address < IR_DATA_START || address + size > data_size)
+        error("Interpreted program accessed memory outside its data");
+}
+
+/* Run the IR from the entry block, printing the calls it makes to stdout,
+ * and return the value it returns */
+long long run_ir(){
+    long long* values = calloc(ir.num, sizeof(long long));
+    unsigned char* memory = malloc(ir.data_size);
+    memcpy(memory, ir.data, ir.data_size);
+
+    /* Phis all take their values at once, so they are worked out here first */
+    long long* phi_values = NULL;
+    unsigned int allocated_phis = 0;
+
+    unsigned int b = IR_ENTRY;
+    unsigned int from = 0;
+    while(1){
+        ir_block* block = &ir.blocks[b];
+        if(block->phis.num > allocated_phis){
+            allocated_phis = grow_capacity(allocated_phis, block->phis.num);
+            phi_values = realloc(phi_values, allocated_phis * sizeof(long long));
+        }
+        int j = find_pred(b, from);
+        for(unsigned int k = 0; k < block->phis.num; k++)
+            phi_values[k] = values[*ir_operand(block->phis.vals[k], j)];
+        for(unsigned int k = 0; k < block->phis.num; k++)
+            values[block->phis.vals[k]] = phi_values[k];
+
+        for(unsigned int k = 0; k < block->code.num; k++){
+            unsigned int i = block->code.vals[k];
+            instruction* in = &ir.instructions[i];
+            int op = in->op;
+            long long a = values[in->args[0]];
+            long long result = 0;
+
+            if(op == IR_CONST || op == IR_ADDRESS)
+                result = in->value;
+            else if(op == IR_EXTEND)
+                result = (signed char) a;
+            else if(op == IR_LOAD){
+                check_address(a, in->size, ir.data_size);
+                int word = (signed char) memory[a];
+                if(in->size == 4)
+                    memcpy(&word, memory + a, 4);
+                result = word;
+            }
+            else if(op == IR_STORE){
+                check_address(a, in->size, ir.data_size);
+                int word = values[in->args[1]];
+                if(in->size == 1)
+                    memory[a] = word;
+                else
+                    memcpy(memory + a, &word, 4);
+            }
+            else if(op == IR_CALL){
+                printf("%s(", symbol_name(in->value));
+                for(int n = 0; n < ir_num_operands(i); n++)
+                    printf("%s%lld", n > 0 ? ", " : "", values[*ir_operand(i, n)]);
+                printf(")\n");
+            }
+            else if(op == IR_JUMP || op == IR_BRANCH){
+                from = b;
+                b = block->succs[op == IR_BRANCH && a == 0 ? 1 : 0];
+                break;
+            }
+            else if(op == IR_RETURN){
+                free(values);
+                free(memory);
+                free(phi_values);
+                return a;
+            }
+            else if(!fold_binary(op, a, values[in->args[1]], &result))
+                error("Interpreted program divided by zero or shifted too far");
+            values[i] = result;
+        }
+    }
+}
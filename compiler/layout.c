@@ -0,0 +1,326 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file describes the layout engine, which works out where the fields
+ * of each struct go in memory, and finds fields by name.
+ *
+ * Structs are laid out as the i386 System V ABI lays them out, since that
+ * is what this compiler targets: each field goes at the next offset which
+ * is a multiple of its alignment, a struct is aligned like its most aligned
+ * field, and its size is rounded up to a multiple of that, so that every
+ * element of an array of it is aligned too. Primitive types and pointers
+ * are aligned to their size.
+ *
+ * A struct is laid out once, as soon as the parser reaches the end of its
+ * definition, and the layout is kept on its type, which is canonical, so
+ * every use of the struct shares it.
+ *
+ * Fields are found by their interned names. A struct with up to
+ * FIELD_HASH_MAX_FIELDS fields gets a perfect hash: a multiplier is chosen
+ * which sends the name of every field to a slot of its own in a small
+ * table, so a lookup is one multiplication and one comparison. A bigger
+ * struct would need a table much bigger than itself for that, so its field
+ * names are kept sorted and binary searched instead.
+ *
+ * The layout report lists every named struct the parser saw with its size,
+ * alignment, padding holes and fields that straddle a cache line, and
+ * suggests a field order with less padding, as text or JSON.
+ */
+
+/* Structs with more fields than this are binary searched */
+int FIELD_HASH_MAX_FIELDS = 32;
+
+/* Number of multipliers tried at each table size before giving up on it */
+int FIELD_HASH_TRIES = 64;
+
+/* Cache line size the layout report checks fields against */
+int CACHE_LINE_SIZE = 64;
+
+/* A field name and its index, for the sorted field tables of big structs */
+typedef struct _field_entry {
+    unsigned int name;
+    unsigned int index;
+} field_entry;
+
+/* The layout of a struct */
+typedef struct _struct_layout {
+    int align;
+
+    /* Offset of each field from the start of the struct */
+    unsigned int* offsets;
+
+    /* Perfect hash table of the fields: the field named n is field
+     * slots[(n * multiplier) >> shift] - 1, and empty slots are 0 */
+    unsigned short* slots;
+    unsigned int multiplier;
+    int shift;
+
+    /* For structs without a perfect hash, the fields sorted by name */
+    field_entry* sorted;
+} struct_layout;
+
+/* Get the alignment of a type in bytes */
+int type_align(type* t){
+    t = t->canonical;
+    if(t->ptr_to != NULL)
+        return t->size;
+    if(t->struct_type)
+        return t->layout != NULL ? t->layout->align : 1;
+    return t->size > 0 ? t->size : 1;
+}
+
+/* Look for a multiplier which sends the names of all the fields of a struct
+ * to different slots of a table of 2^bits slots, filling in the table.
+ * Returns whether one was found. */
+int find_field_hash(type* t, unsigned short* slots, int bits, unsigned int* multiplier){
+    unsigned int capacity = 1u << bits;
+    for(int k = 0; k < FIELD_HASH_TRIES; k++){
+        *multiplier = (2654435761u + 2 * k * 0x9e3779b9u) | 1;
+        memset(slots, 0, capacity * sizeof(unsigned short));
+
+        int i = 0;
+        while(i < t->num_fields){
+            unsigned int slot = t->field_names[i] * *multiplier >> (32 - bits);
+            if(slots[slot] != 0)
+                break;
+            slots[slot] = i + 1;
+            i++;
+        }
+        if(i == t->num_fields)
+            return 1;
+    }
+    return 0;
+}
+
+/* Order field entries by name */
+int compare_field_entries(const void* a, const void* b){
+    unsigned int x = ((field_entry*) a)->name;
+    unsigned int y = ((field_entry*) b)->name;
+    return x < y ? -1 : x > y;
+}
+
+/* Build the table that fields of a struct are looked up in */
+void index_fields(type* t, struct_layout* layout){
+    if(t->num_fields == 0)
+        return;
+
+    /* Start with a table at least twice as big as the struct, and let it
+     * grow to four times that, which is at most 256 slots */
+    if(t->num_fields <= FIELD_HASH_MAX_FIELDS){
+        unsigned short slots[256];
+        int bits = 1;
+        while((1 << bits) < 2 * t->num_fields)
+            bits++;
+        for(int b = bits; b <= bits + 2; b++){
+            if(find_field_hash(t, slots, b, &layout->multiplier)){
+                layout->shift = 32 - b;
+                layout->slots = arena_alloc(ast_arena, (1 << b) * sizeof(unsigned short));
+                memcpy(layout->slots, slots, (1 << b) * sizeof(unsigned short));
+                return;
+            }
+        }
+    }
+
+    layout->sorted = arena_alloc(ast_arena, t->num_fields * sizeof(field_entry));
+    for(int i = 0; i < t->num_fields; i++){
+        layout->sorted[i].name = t->field_names[i];
+        layout->sorted[i].index = i;
+    }
+    qsort(layout->sorted, t->num_fields, sizeof(field_entry), compare_field_entries);
+}
+
+/* Place the fields of a struct one after another in an order, a list of
+ * field indices, or in the order they were declared if it is NULL. Stores
+ * each field's offset by its index and the struct's alignment, and
+ * returns the struct's size. */
+unsigned int place_fields(type* t, int* order, unsigned int* offsets, int* struct_align){
+    unsigned int offset = 0;
+    *struct_align = 1;
+    for(int k = 0; k < t->num_fields; k++){
+        int i = order != NULL ? order[k] : k;
+        type* field = t->field_types[i];
+        int align = type_align(field);
+        offset = (offset + align - 1) & ~(unsigned int) (align - 1);
+        offsets[i] = offset;
+        offset += field->size;
+        if(align > *struct_align)
+            *struct_align = align;
+    }
+    return (offset + *struct_align - 1) & ~(unsigned int) (*struct_align - 1);
+}
+
+/* Lay out a struct whose fields have all been parsed, setting its size */
+void lay_out_struct(type* t){
+    struct_layout* layout = arena_alloc(ast_arena, sizeof(struct_layout));
+    layout->offsets = arena_alloc(ast_arena, (t->num_fields + 1) * sizeof(unsigned int));
+    t->size = place_fields(t, NULL, layout->offsets, &layout->align);
+
+    index_fields(t, layout);
+    t->layout = layout;
+}
+
+/* Find the field of a struct with a name, returning its index, or -1 if
+ * the struct has no such field */
+int find_field(type* t, unsigned int name){
+    t = t->canonical;
+    struct_layout* layout = t->layout;
+    if(layout == NULL || t->num_fields == 0)
+        return -1;
+
+    if(layout->slots != NULL){
+        int field = layout->slots[name * layout->multiplier >> layout->shift] - 1;
+        return field >= 0 && t->field_names[field] == name ? field : -1;
+    }
+
+    int low = 0;
+    int high = t->num_fields;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(layout->sorted[mid].name < name)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if(low < t->num_fields && layout->sorted[low].name == name)
+        return layout->sorted[low].index;
+    return -1;
+}
+
+/* Get the offset of field i of a struct from its start */
+unsigned int field_offset(type* t, int i){
+    return t->canonical->layout->offsets[i];
+}
+
+/*** Layout report ***/
+
+/* Fill in a field order for a struct which needs as little padding as
+ * possible: the most aligned fields first, keeping the order of fields
+ * which are aligned alike. Alignments are powers of two. */
+void order_fields_by_align(type* t, int* order){
+    int max_align = 1;
+    for(int i = 0; i < t->num_fields; i++)
+        if(type_align(t->field_types[i]) > max_align)
+            max_align = type_align(t->field_types[i]);
+
+    int n = 0;
+    for(int align = max_align; align >= 1; align /= 2)
+        for(int i = 0; i < t->num_fields; i++)
+            if(type_align(t->field_types[i]) == align)
+                order[n++] = i;
+}
+
+/* Check whether a field at an offset runs from one cache line into the next */
+int straddles_cache_line(unsigned int offset, int size){
+    return size > 0 && offset / CACHE_LINE_SIZE != (offset + size - 1) / CACHE_LINE_SIZE;
+}
+
+/* Print the layout of a struct for the layout report under a name, as text
+ * or as a JSON object, listing a better field order if there is one */
+void print_struct_layout(type* t, char* name, int json){
+    unsigned int* offsets = t->layout->offsets;
+
+    /* Padding is whatever the fields don't cover */
+    int padding = t->size;
+    for(int i = 0; i < t->num_fields; i++)
+        padding -= t->field_types[i]->size;
+
+    int* order = malloc((t->num_fields + 1) * sizeof(int));
+    unsigned int* suggested_offsets = malloc((t->num_fields + 1) * sizeof(unsigned int));
+    int suggested_align;
+    order_fields_by_align(t, order);
+    unsigned int suggested_size = place_fields(t, order, suggested_offsets, &suggested_align);
+    int better = suggested_size < t->size;
+
+    if(json){
+        printf("{\"name\": \"%s\", \"size\": %d, \"align\": %d, \"padding\": %d, \"fields\": [",
+            name, t->size, t->layout->align, padding);
+        for(int i = 0; i < t->num_fields; i++){
+            type* field = t->field_types[i];
+            printf("%s{\"name\": \"%s\", \"offset\": %u, \"size\": %d, \"align\": %d, \"straddles_cache_line\": %s}",
+                i > 0 ? ", " : "", symbol_name(t->field_names[i]), offsets[i], field->size, type_align(field),
+                straddles_cache_line(offsets[i], field->size) ? "true" : "false");
+        }
+
+        printf("], \"holes\": [");
+        unsigned int end = 0;
+        int holes = 0;
+        for(int i = 0; i <= t->num_fields; i++){
+            unsigned int next = i < t->num_fields ? offsets[i] : t->size;
+            if(next > end)
+                printf("%s{\"offset\": %u, \"size\": %u}", holes++ > 0 ? ", " : "", end, next - end);
+            if(i < t->num_fields)
+                end = offsets[i] + t->field_types[i]->size;
+        }
+
+        printf("], \"suggested_order\": [");
+        for(int k = 0; better && k < t->num_fields; k++)
+            printf("%s\"%s\"", k > 0 ? ", " : "", symbol_name(t->field_names[order[k]]));
+        printf("], \"suggested_size\": %u}", better ? suggested_size : t->size);
+    } else {
+        printf("%s: size %d, align %d, padding %d\n", name, t->size, t->layout->align, padding);
+        unsigned int end = 0;
+        for(int i = 0; i <= t->num_fields; i++){
+            unsigned int next = i < t->num_fields ? offsets[i] : t->size;
+            if(next > end)
+                printf("    %5u  (padding, size %u)\n", end, next - end);
+            if(i == t->num_fields)
+                break;
+
+            /* Structs inside structs have their own entries, so just name them here */
+            type* field = t->field_types[i];
+            printf("    %5u  ", offsets[i]);
+            if(field->struct_type && field->name != 0)
+                printf("struct %s", symbol_name(field->name));
+            else if(field->struct_type)
+                printf("struct {...}");
+            else
+                print_type(field);
+            printf(" %s (size %d)%s\n", symbol_name(t->field_names[i]), field->size,
+                straddles_cache_line(offsets[i], field->size) ? ", straddles a cache line" : "");
+            end = offsets[i] + field->size;
+        }
+
+        if(better){
+            printf("    suggested order, size %u:", suggested_size);
+            for(int k = 0; k < t->num_fields; k++)
+                printf(" %s", symbol_name(t->field_names[order[k]]));
+            printf("\n");
+        }
+        printf("\n");
+    }
+
+    free(order);
+    free(suggested_offsets);
+}
+
+/* Print the layout of every struct in the type table, as text or JSON.
+ * Structs without a tag are only in the table through typedefs, and are
+ * listed once, under the name of the typedef which declared them: the only
+ * one naming the struct itself rather than another typedef. */
+void print_layout_report(int json){
+    int printed = 0;
+    char name[256];
+    if(json)
+        printf("{\"structs\": [");
+    for(int i = 0; i < type_table.num; i++){
+        type* t = type_table.types[i];
+        if(t->struct_type)
+            snprintf(name, sizeof(name), "struct %s", symbol_name(t->name));
+        else if(t->alias != NULL && t->alias == t->canonical && t->canonical->struct_type && t->canonical->name == 0){
+            snprintf(name, sizeof(name), "%s", symbol_name(t->name));
+            t = t->canonical;
+        } else
+            continue;
+        if(t->layout == NULL)
+            continue;
+
+        if(json)
+            printf("%s\n    ", printed > 0 ? "," : "");
+        print_struct_layout(t, name, json);
+        printed++;
+    }
+    if(json)
+        printf("\n]}\n");
+}
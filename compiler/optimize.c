@@ -0,0 +1,461 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* This file describes the optimizer, a pipeline of passes which rewrite the
+ * statement and expression trees of a program in place so that everything
+ * after it works on smaller trees:
+ *
+ *  - fold:      operators whose operands are constants become constants
+ *  - simplify:  algebraic identities such as x * 1, x + 0 and x * 0
+ *  - strength:  multiplication by a power of two becomes a left shift
+ *  - branches:  if statements whose condition is constant are replaced by
+ *               the branch that is always taken, in a block of its own
+ *
+ * Expressions are folded as C does for 32-bit ints, the size this compiler
+ * targets. Division by a power of two is not turned into a shift, since
+ * for negative numbers the two round differently, and nothing tells us yet
+ * whether a value can be negative.
+ *
+ * Passes don't walk the trees. Children are always created before their
+ * parents, so a pass just goes through the expression or statement pool in
+ * order, and by the time it reaches a node its children are already as
+ * simple as that pass can make them. Before each pass, the nodes the
+ * program can reach are marked, and the pass skips the rest, so that it
+ * neither rewrites nor counts nodes an earlier pass left behind. A node is
+ * rewritten by overwriting it, which keeps every reference to it valid;
+ * the nodes it no longer uses are left behind in the pool. Only the node
+ * being looked at is ever overwritten, never one of its children, since
+ * with shared expressions the children may belong to other parents too.
+ * Overwriting a shared node is fine: all its parents mean the same
+ * expression. Once the pipeline is done, the hashes of the expressions are
+ * worked out again.
+ *
+ * The pipeline runs until a round of all the passes changes nothing, and
+ * adds up how many nodes each pass removed from the trees.
+ */
+
+/* An optimization pass. It adds the number of nodes it removed from the
+ * trees to optimizer.removed, and the number it rewrote without removing
+ * any to optimizer.rewritten. */
+typedef struct _optimization_pass {
+    char* name;
+    void (*run)();
+} optimization_pass;
+
+/* Optimizer state */
+struct {
+    program* prog;
+
+    /* Whether each node of the expression and statement pools could be
+     * reached from the program when the pass being run started. Nodes
+     * created since then are past num_expressions or num_statements. */
+    unsigned char* live_expressions;
+    unsigned char* live_statements;
+    unsigned int num_expressions;
+    unsigned int num_statements;
+
+    int removed;
+    int rewritten;
+} optimizer;
+
+/*** Helpers ***/
+
+/* Check whether an expression is a number or character constant */
+int is_constant(unsigned int index){
+    int t = expression_at(index)->expression_type;
+    return t == EXPRESSION_NUM_CONST || t == EXPRESSION_CHR_CONST;
+}
+
+/* Check whether an expression is the constant value */
+int is_constant_value(unsigned int index, long long value){
+    return is_constant(index) && expression_at(index)->num_value == value;
+}
+
+/* Truncate a value to a 32-bit int, wrapping around like the target does */
+long long truncate_int(long long value){
+    return (int) (unsigned int) value;
+}
+
+/* Count the nodes of an expression tree. 0 is no expression, and has none. */
+int count_expression_nodes(unsigned int index){
+    if(index == 0)
+        return 0;
+
+    int count = 1;
+    int num_children = expression_num_children(index);
+    for(int i = 0; i < num_children; i++)
+        count += count_expression_nodes(expression_child(index, i));
+    return count;
+}
+
+/* Count the nodes of a statement tree, including its expressions */
+int count_statement_nodes(unsigned int index){
+    if(index == 0)
+        return 0;
+
+    statement* st = statement_at(index);
+    int count = 1 + count_expression_nodes(st->expr);
+    if(st->statement_type == STATEMENT_IF)
+        count += count_statement_nodes(st->children[0]) + count_statement_nodes(st->children[1]);
+    if(st->statement_type == STATEMENT_BLOCK)
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            count += count_statement_nodes(statement_pool.blocks.vals[st->code_block.first + i]);
+    return count;
+}
+
+/* Mark an expression and everything under it as reachable. A shared
+ * expression already marked has its children marked too. */
+void mark_live_expression(unsigned int index){
+    if(index == 0 || optimizer.live_expressions[index])
+        return;
+
+    optimizer.live_expressions[index] = 1;
+    int num_children = expression_num_children(index);
+    for(int i = 0; i < num_children; i++)
+        mark_live_expression(expression_child(index, i));
+}
+
+/* Mark a statement, its expression and the statements under it as reachable */
+void mark_live_statement(unsigned int index){
+    if(index == 0)
+        return;
+
+    statement* st = statement_at(index);
+    optimizer.live_statements[index] = 1;
+    mark_live_expression(st->expr);
+    if(st->statement_type == STATEMENT_IF){
+        mark_live_statement(st->children[0]);
+        mark_live_statement(st->children[1]);
+    }
+    if(st->statement_type == STATEMENT_BLOCK)
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            mark_live_statement(statement_pool.blocks.vals[st->code_block.first + i]);
+}
+
+/* Mark the nodes the program can reach, forgetting the marks of the last pass */
+void mark_live_nodes(){
+    optimizer.num_expressions = expression_pool.num;
+    optimizer.num_statements = statement_pool.num;
+    optimizer.live_expressions = realloc(optimizer.live_expressions, optimizer.num_expressions);
+    optimizer.live_statements = realloc(optimizer.live_statements, optimizer.num_statements);
+    memset(optimizer.live_expressions, 0, optimizer.num_expressions);
+    memset(optimizer.live_statements, 0, optimizer.num_statements);
+
+    program* prog = optimizer.prog;
+    for(int i = 0; i < prog->num; i++)
+        mark_live_statement(prog->statements[i]);
+}
+
+/* Check whether an expression could be reached when the pass started */
+int is_live_expression(unsigned int index){
+    return index < optimizer.num_expressions && optimizer.live_expressions[index];
+}
+
+/* Check whether a statement could be reached when the pass started */
+int is_live_statement(unsigned int index){
+    return index < optimizer.num_statements && optimizer.live_statements[index];
+}
+
+/* Overwrite an expression with a numeric constant */
+void make_constant(unsigned int index, long long value){
+    expression* expr = expression_at(index);
+    memset(expr, 0, sizeof(expression));
+    expr->expression_type = EXPRESSION_NUM_CONST;
+    expr->pure = 1;
+    expr->num_value = value;
+}
+
+/* Check whether an expression type is a binary operator whose children are its operands */
+int is_binary_operator(int t){
+    return t == EXPRESSION_ARITH_ADD || t == EXPRESSION_ARITH_SUB || t == EXPRESSION_ARITH_MUL || t == EXPRESSION_ARITH_DIV
+        || t == EXPRESSION_AND || t == EXPRESSION_OR || t == EXPRESSION_EQUALS || t == EXPRESSION_GREATER
+        || t == EXPRESSION_LESS || t == EXPRESSION_GREATEREQ || t == EXPRESSION_LESSEQ || t == EXPRESSION_SHIFT_LEFT;
+}
+
+/* Work out a binary operator on two constants, storing it in result. Returns
+ * 0 if it can't be worked out at compile time, such as division by zero. */
+int fold_binary(int t, long long a, long long b, long long* result){
+    a = truncate_int(a);
+    b = truncate_int(b);
+    unsigned int ua = (unsigned int) a;
+    unsigned int ub = (unsigned int) b;
+
+    if(t == EXPRESSION_ARITH_ADD)
+        *result = truncate_int(ua + ub);
+    else if(t == EXPRESSION_ARITH_SUB)
+        *result = truncate_int(ua - ub);
+    else if(t == EXPRESSION_ARITH_MUL)
+        *result = truncate_int(ua * ub);
+    else if(t == EXPRESSION_ARITH_DIV){
+        if(b == 0 || (a == INT_MIN && b == -1))
+            return 0;
+        *result = a / b;
+    }
+    else if(t == EXPRESSION_SHIFT_LEFT){
+        if(b < 0 || b >= 32)
+            return 0;
+        *result = truncate_int(ua << b);
+    }
+    else if(t == EXPRESSION_AND)
+        *result = a && b;
+    else if(t == EXPRESSION_OR)
+        *result = a || b;
+    else if(t == EXPRESSION_EQUALS)
+        *result = a == b;
+    else if(t == EXPRESSION_GREATER)
+        *result = a > b;
+    else if(t == EXPRESSION_LESS)
+        *result = a < b;
+    else if(t == EXPRESSION_GREATEREQ)
+        *result = a >= b;
+    else if(t == EXPRESSION_LESSEQ)
+        *result = a <= b;
+    else
+        return 0;
+    return 1;
+}
+
+/*** Passes ***/
+
+/* Fold operators whose operands are constants into constants */
+void fold_constants(){
+    for(unsigned int i = 1; i < expression_pool.num; i++){
+        if(!is_live_expression(i))
+            continue;
+        expression* expr = expression_at(i);
+        int t = expr->expression_type;
+
+        if(t == EXPRESSION_NOT && is_constant(expr->children[0])){
+            make_constant(i, !truncate_int(expression_at(expr->children[0])->num_value));
+            optimizer.removed++;
+            continue;
+        }
+        if(!is_binary_operator(t))
+            continue;
+
+        unsigned int first = expr->children[0];
+        unsigned int second = expr->children[1];
+        if(!is_constant(first))
+            continue;
+
+        /* && and || don't evaluate their right side if the left side decides the result */
+        long long a = truncate_int(expression_at(first)->num_value);
+        if((t == EXPRESSION_AND && a == 0) || (t == EXPRESSION_OR && a != 0)){
+            optimizer.removed += 1 + count_expression_nodes(second);
+            make_constant(i, t == EXPRESSION_OR);
+            continue;
+        }
+
+        long long result;
+        if(is_constant(second) && fold_binary(t, a, expression_at(second)->num_value, &result)){
+            make_constant(i, result);
+            optimizer.removed += 2;
+        }
+    }
+}
+
+/* Simplify algebraic identities: x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1
+ * and x << 0 become x, and x * 0 and 0 * x become 0 if x has no side effects */
+void simplify_identities(){
+    for(unsigned int i = 1; i < expression_pool.num; i++){
+        if(!is_live_expression(i))
+            continue;
+        expression* expr = expression_at(i);
+        int t = expr->expression_type;
+        if(t != EXPRESSION_ARITH_ADD && t != EXPRESSION_ARITH_SUB && t != EXPRESSION_ARITH_MUL
+                && t != EXPRESSION_ARITH_DIV && t != EXPRESSION_SHIFT_LEFT)
+            continue;
+
+        unsigned int first = expr->children[0];
+        unsigned int second = expr->children[1];
+        unsigned int keep = 0;
+        if(t == EXPRESSION_ARITH_ADD && is_constant_value(first, 0))
+            keep = second;
+        else if((t == EXPRESSION_ARITH_ADD || t == EXPRESSION_ARITH_SUB || t == EXPRESSION_SHIFT_LEFT) && is_constant_value(second, 0))
+            keep = first;
+        else if((t == EXPRESSION_ARITH_MUL || t == EXPRESSION_ARITH_DIV) && is_constant_value(second, 1))
+            keep = first;
+        else if(t == EXPRESSION_ARITH_MUL && is_constant_value(first, 1))
+            keep = second;
+
+        if(keep != 0){
+            *expr = *expression_at(keep);
+            optimizer.removed += 2;
+            continue;
+        }
+
+        /* Multiplying by zero */
+        if(t == EXPRESSION_ARITH_MUL && (is_constant_value(first, 0) || is_constant_value(second, 0))){
+            unsigned int other = is_constant_value(first, 0) ? second : first;
+            if(!expression_at(other)->pure)
+                continue;
+            optimizer.removed += 1 + count_expression_nodes(other);
+            make_constant(i, 0);
+        }
+    }
+}
+
+/* Get log2 of a constant expression if it is a power of two greater than 1, or 0 */
+int power_of_two(unsigned int index){
+    if(!is_constant(index))
+        return 0;
+
+    long long value = truncate_int(expression_at(index)->num_value);
+    if(value <= 1 || (value & (value - 1)) != 0)
+        return 0;
+
+    int shift = 0;
+    while(value > 1){
+        value >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+/* Turn multiplication by a power of two into a left shift */
+void reduce_strength(){
+    for(unsigned int i = 1; i < expression_pool.num; i++){
+        if(!is_live_expression(i))
+            continue;
+        expression* expr = expression_at(i);
+        if(expr->expression_type != EXPRESSION_ARITH_MUL)
+            continue;
+
+        unsigned int other = expr->children[0];
+        int shift = power_of_two(expr->children[1]);
+        if(shift == 0){
+            other = expr->children[1];
+            shift = power_of_two(expr->children[0]);
+        }
+        if(shift == 0)
+            continue;
+
+        /* The shift amount is a new constant, which may move the pool */
+        unsigned int amount = numeric_constant_expression(shift);
+        expr = expression_at(i);
+        expr->expression_type = EXPRESSION_SHIFT_LEFT;
+        expr->children[0] = other;
+        expr->children[1] = amount;
+        optimizer.rewritten++;
+    }
+}
+
+/* Check whether a statement is an empty block, which does nothing */
+int is_empty_block(unsigned int index){
+    statement* st = statement_at(index);
+    return st->statement_type == STATEMENT_BLOCK && st->code_block.num_statements == 0;
+}
+
+/* Replace if statements whose condition is constant with the branch that is
+ * taken, then drop the empty blocks that leaves from blocks and the program */
+void remove_dead_branches(){
+    for(unsigned int i = 1; i < statement_pool.num; i++){
+        statement* st = statement_at(i);
+        if(!is_live_statement(i) || st->statement_type != STATEMENT_IF || !is_constant(st->expr))
+            continue;
+
+        int taken = truncate_int(expression_at(st->expr)->num_value) != 0;
+        unsigned int branch = st->children[taken ? 0 : 1];
+        optimizer.removed += count_expression_nodes(st->expr) + count_statement_nodes(st->children[taken ? 1 : 0]);
+
+        /* An if whose branch isn't taken and has no else becomes an empty
+         * block. A block taken moves into the if's place, and where it was
+         * is left empty, so that its statements aren't shared by two
+         * blocks, which would each remove its empty blocks from them. Any
+         * other branch is a scope of its own, so it becomes the one
+         * statement of a block in the if's place, which keeps what it
+         * declares out of the scope around the if. */
+        if(branch != 0 && statement_at(branch)->statement_type == STATEMENT_BLOCK){
+            *st = *statement_at(branch);
+            memset(statement_at(branch), 0, sizeof(statement));
+            statement_at(branch)->statement_type = STATEMENT_BLOCK;
+            optimizer.removed++;
+        }
+        else {
+            memset(st, 0, sizeof(statement));
+            st->statement_type = STATEMENT_BLOCK;
+            if(branch != 0){
+                push_pending_statement(branch);
+                st->code_block.first = index_vector_move_top(&statement_pool.blocks, &statement_pool.pending, 1);
+                st->code_block.num_statements = 1;
+            }
+        }
+    }
+
+    /* Remove empty blocks from the blocks that contain them */
+    for(unsigned int i = 1; i < statement_pool.num; i++){
+        statement* st = statement_at(i);
+        if(!is_live_statement(i) || st->statement_type != STATEMENT_BLOCK)
+            continue;
+
+        unsigned int* run = statement_pool.blocks.vals + st->code_block.first;
+        int kept = 0;
+        for(int j = 0; j < st->code_block.num_statements; j++){
+            if(run[j] != 0 && is_empty_block(run[j]))
+                optimizer.removed++;
+            else
+                run[kept++] = run[j];
+        }
+        st->code_block.num_statements = kept;
+    }
+
+    /* Top-level statements are kept in place, as nothing, so the program
+     * still lines up with its tokens */
+    program* prog = optimizer.prog;
+    for(int i = 0; i < prog->num; i++){
+        if(prog->statements[i] != 0 && is_empty_block(prog->statements[i])){
+            prog->statements[i] = 0;
+            optimizer.removed++;
+        }
+    }
+}
+
+/* The passes, in the order they run */
+optimization_pass optimization_passes[] = {
+    {"fold", fold_constants},
+    {"simplify", simplify_identities},
+    {"strength", reduce_strength},
+    {"branches", remove_dead_branches},
+};
+#define NUM_OPTIMIZATION_PASSES (sizeof(optimization_passes) / sizeof(optimization_pass))
+
+/* Run every optimization pass over a program until nothing changes. If
+ * report is set, print how many nodes each pass removed and rewrote to the
+ * standard error. */
+void optimize_program(program* prog, int report){
+    int removed[NUM_OPTIMIZATION_PASSES] = {0};
+    int rewritten[NUM_OPTIMIZATION_PASSES] = {0};
+
+    optimizer.prog = prog;
+    int rounds = 0;
+    int changed = 1;
+    while(changed){
+        changed = 0;
+        rounds++;
+        for(int i = 0; i < NUM_OPTIMIZATION_PASSES; i++){
+            optimizer.removed = 0;
+            optimizer.rewritten = 0;
+            mark_live_nodes();
+            optimization_passes[i].run();
+            removed[i] += optimizer.removed;
+            rewritten[i] += optimizer.rewritten;
+            if(optimizer.removed != 0 || optimizer.rewritten != 0)
+                changed = 1;
+        }
+    }
+
+    if(report){
+        for(int i = 0; i < NUM_OPTIMIZATION_PASSES; i++)
+            fprintf(stderr, "%-10s removed %d nodes, rewrote %d\n", optimization_passes[i].name, removed[i], rewritten[i]);
+        fprintf(stderr, "%d rounds\n", rounds);
+    }
+    rehash_expressions();
+
+    free(optimizer.live_expressions);
+    free(optimizer.live_statements);
+    optimizer.live_expressions = NULL;
+    optimizer.live_statements = NULL;
+}
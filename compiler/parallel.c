@@ -0,0 +1,491 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* This file describes the parallel parser, which parses the top-level
+ * statements of a program on several threads at once and gives exactly the
+ * same result as parsing them one after another.
+ *
+ * First the token stream is split into units: runs of tokens ending in a
+ * semicolon which is outside any braces or parentheses and isn't followed
+ * by else. A unit is one or more whole top-level statements, so it can be
+ * parsed on its own. Units are handed out to the threads in contiguous
+ * runs, and each thread builds into its own expression and statement pools
+ * and its own arena.
+ *
+ * The only thing units share is the type table. Units with a typedef or a
+ * struct in them can add types, so they are all parsed in order by one
+ * thread, which publishes how big the type table is after each of them. Any
+ * other unit waits until the type-defining units before it are done, and
+ * then parses seeing only the types they defined, even if later ones have
+ * been added since, just as if everything were parsed in order.
+ *
+ * Once every unit is parsed, the pools are merged into the main thread's
+ * in the order of the units, which is the order a sequential parse builds
+ * the nodes in, so every node ends up with the same index it would have
+ * had. Each thread copies the nodes it built to their place, moving the
+ * indices in them along. If expressions are shared, they have to be shared
+ * in order across all the units, so the main thread merges them instead.
+ */
+
+/* Positions in a thread's pools: the expression, function call argument,
+ * statement and block pools, and the thread's list of top-level statements */
+typedef struct _pool_marks {
+    unsigned int exprs;
+    unsigned int args;
+    unsigned int statements;
+    unsigned int blocks;
+    unsigned int top;
+} pool_marks;
+
+/* A unit of a parallel parse. Once it is parsed, start and end say where
+ * the nodes it built are in the pools of the thread that parsed it, and
+ * base says where they go in the main thread's pools. */
+typedef struct _parse_unit {
+    int first_token;
+    int defines_types;
+
+    /* Number of type-defining units before this one */
+    int types_before;
+
+    int thread;
+    pool_marks start;
+    pool_marks end;
+    pool_marks base;
+} parse_unit;
+
+/* A thread of a parallel parse, and its pools once it is done parsing */
+typedef struct _parse_thread {
+    pthread_t handle;
+    int index;
+    arena* arena;
+
+    expression* exprs;
+    unsigned int* hashes;
+    unsigned int* args;
+    statement* statements;
+    type** types;
+    unsigned int* starts;
+    unsigned int* blocks;
+    program* top;
+} parse_thread;
+
+/* State of the parallel parse in progress */
+struct {
+    token_stream* tokens;
+    parse_unit* units;
+    int num_units;
+
+    /* Jobs that threads take in order. Job 0 is parsing the type-defining
+     * units; job j is parsing the other units from job_units[j - 1] up to
+     * job_units[j], where job_units[0] is 0. */
+    int num_jobs;
+    int* job_units;
+    int next_job;
+
+    /* Size of the type table after the first k type-defining units, and the
+     * number of them that are done, which threads wait on */
+    int* type_counts;
+    int types_done;
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+
+    /* The threads wait for each other once everything is parsed, and once
+     * the main thread has made room for the merged pools */
+    parse_thread* threads;
+    int num_threads;
+    int share;
+    pthread_barrier_t parsed;
+    pthread_barrier_t merged;
+
+    /* The main thread's pools, which the threads copy their nodes into */
+    expression* exprs;
+    unsigned int* hashes;
+    unsigned int* args;
+    statement* statements;
+    type** types;
+    unsigned int* starts;
+    unsigned int* blocks;
+} parallel;
+
+/* Get the current positions in this thread's pools */
+pool_marks current_pool_marks(program* top){
+    pool_marks marks;
+    marks.exprs = expression_pool.num;
+    marks.args = expression_pool.args.num;
+    marks.statements = statement_pool.num;
+    marks.blocks = statement_pool.blocks.num;
+    marks.top = top->num;
+    return marks;
+}
+
+/* Split a token stream into units, storing the number of them in
+ * num_units and the number of typedef and struct tokens in num_type_tokens */
+parse_unit* find_parse_units(token_stream* tokens, int* num_units, int* num_type_tokens){
+    int allocated = 256;
+    parse_unit* units = malloc(allocated * sizeof(parse_unit));
+    *num_units = 0;
+    *num_type_tokens = 0;
+
+    int depth = 0;
+    int first_token = 0;
+    int defines_types = 0;
+    int types_before = 0;
+    for(int i = 0; i < tokens->num; i++){
+        int t = tokens->types[i];
+        if(t == TOKEN_OBRACE || t == TOKEN_OPAREN)
+            depth++;
+        else if(t == TOKEN_CBRACE || t == TOKEN_CPAREN)
+            depth--;
+        else if(t == TOKEN_TYPEDEF || t == TOKEN_STRUCT){
+            defines_types = 1;
+            (*num_type_tokens)++;
+        }
+
+        /* A unit ends at a semicolon outside everything, unless it ends the then branch of an if */
+        int last = i == tokens->num - 1;
+        if(!last && (t != TOKEN_SEMICOLON || depth != 0 || tokens->types[i + 1] == TOKEN_ELSE))
+            continue;
+
+        if(*num_units == allocated){
+            allocated *= 2;
+            units = realloc(units, allocated * sizeof(parse_unit));
+        }
+        parse_unit* unit = &units[(*num_units)++];
+        memset(unit, 0, sizeof(parse_unit));
+        unit->first_token = first_token;
+        unit->defines_types = defines_types;
+        unit->types_before = types_before;
+
+        types_before += defines_types;
+        first_token = i + 1;
+        defines_types = 0;
+    }
+    return units;
+}
+
+/* Wait until the first count type-defining units have been parsed */
+void wait_for_types(int count){
+    if(__atomic_load_n(&parallel.types_done, __ATOMIC_ACQUIRE) >= count)
+        return;
+
+    pthread_mutex_lock(&parallel.lock);
+    while(__atomic_load_n(&parallel.types_done, __ATOMIC_ACQUIRE) < count)
+        pthread_cond_wait(&parallel.published, &parallel.lock);
+    pthread_mutex_unlock(&parallel.lock);
+}
+
+/* Parse unit u on the current thread, adding its top-level statements to top */
+void parse_unit_on_thread(int u, parse_thread* thread, program* top){
+    parse_unit* unit = &parallel.units[u];
+    token_stream* tokens = parallel.tokens;
+    int end = u + 1 < parallel.num_units ? parallel.units[u + 1].first_token : tokens->num;
+
+    /* Type-defining units come in order, so every type before them is there
+     * already, and no later ones are */
+    wait_for_types(unit->types_before);
+    type_table_limit = unit->defines_types ? -1 : parallel.type_counts[unit->types_before];
+
+    unit->thread = thread->index;
+    unit->start = current_pool_marks(top);
+
+    /* The unit is parsed as if the token stream ended with it, so that the
+     * parser doesn't look at the next unit's tokens while another thread may
+     * be changing them. A valid statement never needs to look past its end,
+     * so this only changes the error that some malformed input gets. */
+    int index = unit->first_token;
+    while(index < end){
+        int first_token = index;
+        int types_before = visible_type_count();
+        add_to_program(top, parse_statement(tokens, &index, end), first_token, types_before);
+    }
+
+    unit->end = current_pool_marks(top);
+
+    if(unit->defines_types){
+        pthread_mutex_lock(&parallel.lock);
+        parallel.type_counts[unit->types_before + 1] = type_table.num;
+        __atomic_store_n(&parallel.types_done, unit->types_before + 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&parallel.published);
+        pthread_mutex_unlock(&parallel.lock);
+    }
+}
+
+/* Move an expression index of a unit to where it is in the main pool. If
+ * expressions are shared, map says where each of the unit's expressions
+ * went. */
+unsigned int move_expression(unsigned int expr, parse_unit* unit, unsigned int* map){
+    if(expr == 0)
+        return 0;
+    if(map != NULL)
+        return map[expr - unit->start.exprs];
+    return expr - unit->start.exprs + unit->base.exprs;
+}
+
+/* Move a statement index of a unit to where it is in the main pool */
+unsigned int move_statement(unsigned int st, parse_unit* unit){
+    if(st == 0)
+        return 0;
+    return st - unit->start.statements + unit->base.statements;
+}
+
+/* Copy the expressions of a unit into the main pool, where room has been
+ * made for them, moving the indices in them along */
+void copy_unit_expressions(parse_thread* thread, parse_unit* unit){
+    unsigned int num = unit->end.exprs - unit->start.exprs;
+    for(unsigned int i = 0; i < num; i++){
+        expression expr = thread->exprs[unit->start.exprs + i];
+        if(expr.expression_type == EXPRESSION_FUNCALL)
+            expr.args.first = expr.args.first - unit->start.args + unit->base.args;
+        else
+            for(int c = 0; c < expr.num_children; c++)
+                expr.children[c] = move_expression(expr.children[c], unit, NULL);
+
+        parallel.exprs[unit->base.exprs + i] = expr;
+        parallel.hashes[unit->base.exprs + i] = thread->hashes[unit->start.exprs + i];
+    }
+
+    unsigned int num_args = unit->end.args - unit->start.args;
+    for(unsigned int i = 0; i < num_args; i++)
+        parallel.args[unit->base.args + i] = move_expression(thread->args[unit->start.args + i], unit, NULL);
+}
+
+/* Build the expressions of a unit again in the main pool on the main
+ * thread, so that they are shared with everything built before them.
+ * map is filled in with where each expression went. */
+void share_unit_expressions(parse_thread* thread, parse_unit* unit, unsigned int* map){
+    unit->base.exprs = expression_pool.num;
+    unit->base.args = expression_pool.args.num;
+
+    unsigned int num = unit->end.exprs - unit->start.exprs;
+    for(unsigned int i = 0; i < num; i++){
+        expression* src = &thread->exprs[unit->start.exprs + i];
+        if(src->expression_type == EXPRESSION_FUNCALL){
+            for(int a = 0; a < src->args.num; a++)
+                push_pending_arg(move_expression(thread->args[src->args.first + a], unit, map));
+            map[i] = create_funcall_expr(src->name, src->args.num);
+            continue;
+        }
+
+        unsigned int index = create_expression(src->expression_type, src->num_children);
+        expression* expr = expression_at(index);
+        expr->name = src->name;
+        expr->num_value = src->num_value;
+        for(int c = 0; c < src->num_children; c++)
+            expr->children[c] = move_expression(src->children[c], unit, map);
+        map[i] = finish_expression(index);
+    }
+}
+
+/* Copy the statements of a unit into the main pool, where room has been
+ * made for them, moving the indices in them along */
+void copy_unit_statements(parse_thread* thread, parse_unit* unit, unsigned int* map, statement* statements, type** types, unsigned int* starts, unsigned int* blocks){
+    unsigned int num = unit->end.statements - unit->start.statements;
+    for(unsigned int i = 0; i < num; i++){
+        statement st = thread->statements[unit->start.statements + i];
+        st.expr = move_expression(st.expr, unit, map);
+        if(st.statement_type == STATEMENT_IF){
+            st.children[0] = move_statement(st.children[0], unit);
+            st.children[1] = move_statement(st.children[1], unit);
+        }
+        else if(st.statement_type == STATEMENT_BLOCK)
+            st.code_block.first = st.code_block.first - unit->start.blocks + unit->base.blocks;
+        statements[unit->base.statements + i] = st;
+        types[unit->base.statements + i] = thread->types[unit->start.statements + i];
+        starts[unit->base.statements + i] = thread->starts[unit->start.statements + i];
+    }
+
+    unsigned int num_blocks = unit->end.blocks - unit->start.blocks;
+    for(unsigned int i = 0; i < num_blocks; i++)
+        blocks[unit->base.blocks + i] = move_statement(thread->blocks[unit->start.blocks + i], unit);
+}
+
+/* Entry point of a thread of a parallel parse */
+void* parse_thread_main(void* arg){
+    parse_thread* thread = arg;
+    ast_arena = thread->arena;
+    init_expression_pool();
+    init_statement_pool();
+    program* top = make_program();
+
+    int job;
+    while((job = __atomic_fetch_add(&parallel.next_job, 1, __ATOMIC_RELAXED)) < parallel.num_jobs){
+        if(job == 0){
+            for(int u = 0; u < parallel.num_units; u++)
+                if(parallel.units[u].defines_types)
+                    parse_unit_on_thread(u, thread, top);
+        }
+        else {
+            for(int u = parallel.job_units[job - 1]; u < parallel.job_units[job]; u++)
+                if(!parallel.units[u].defines_types)
+                    parse_unit_on_thread(u, thread, top);
+        }
+    }
+
+    /* Let the main thread see the pools, and wait while it makes room for them */
+    thread->exprs = expression_pool.nodes;
+    thread->hashes = expression_pool.hashes;
+    thread->args = expression_pool.args.vals;
+    thread->statements = statement_pool.nodes;
+    thread->types = statement_pool.types;
+    thread->starts = statement_pool.starts;
+    thread->blocks = statement_pool.blocks.vals;
+    thread->top = top;
+    pthread_barrier_wait(&parallel.parsed);
+    pthread_barrier_wait(&parallel.merged);
+
+    if(!parallel.share){
+        for(int u = 0; u < parallel.num_units; u++){
+            parse_unit* unit = &parallel.units[u];
+            if(unit->thread == thread->index){
+                copy_unit_expressions(thread, unit);
+                copy_unit_statements(thread, unit, NULL, parallel.statements, parallel.types, parallel.starts, parallel.blocks);
+            }
+        }
+    }
+
+    free_program(top);
+    del_expression_pool();
+    del_statement_pool();
+    return NULL;
+}
+
+/* Work out where every unit's nodes go in the main pools, make room for
+ * them, and let the threads copy them there */
+void lay_out_units(){
+    pool_marks base;
+    base.exprs = expression_pool.num;
+    base.args = expression_pool.args.num;
+    base.statements = statement_pool.num;
+    base.blocks = statement_pool.blocks.num;
+    for(int u = 0; u < parallel.num_units; u++){
+        parse_unit* unit = &parallel.units[u];
+        unit->base = base;
+        base.exprs += unit->end.exprs - unit->start.exprs;
+        base.args += unit->end.args - unit->start.args;
+        base.statements += unit->end.statements - unit->start.statements;
+        base.blocks += unit->end.blocks - unit->start.blocks;
+    }
+
+    reserve_expression_pool(base.exprs, base.args);
+    reserve_statement_pool(base.statements, base.blocks);
+    expression_pool.num = base.exprs;
+    expression_pool.args.num = base.args;
+    statement_pool.num = base.statements;
+    statement_pool.blocks.num = base.blocks;
+
+    parallel.exprs = expression_pool.nodes;
+    parallel.hashes = expression_pool.hashes;
+    parallel.args = expression_pool.args.vals;
+    parallel.statements = statement_pool.nodes;
+    parallel.types = statement_pool.types;
+    parallel.starts = statement_pool.starts;
+    parallel.blocks = statement_pool.blocks.vals;
+}
+
+/* Merge every unit's nodes into the main pools on the main thread, sharing
+ * expressions as they go */
+void merge_shared_units(){
+    unsigned int* map = NULL;
+    unsigned int allocated = 0;
+    for(int u = 0; u < parallel.num_units; u++){
+        parse_unit* unit = &parallel.units[u];
+        parse_thread* thread = &parallel.threads[unit->thread];
+
+        unsigned int num = unit->end.exprs - unit->start.exprs;
+        if(num > allocated){
+            allocated = num;
+            map = realloc(map, allocated * sizeof(unsigned int));
+        }
+        share_unit_expressions(thread, unit, map);
+
+        unit->base.statements = statement_pool.num;
+        unit->base.blocks = statement_pool.blocks.num;
+        statement_pool.num += unit->end.statements - unit->start.statements;
+        statement_pool.blocks.num += unit->end.blocks - unit->start.blocks;
+        reserve_statement_pool(statement_pool.num, statement_pool.blocks.num);
+        copy_unit_statements(thread, unit, map, statement_pool.nodes, statement_pool.types, statement_pool.starts, statement_pool.blocks.vals);
+    }
+    free(map);
+}
+
+/* Parse every statement in a token stream on up to parser_threads threads */
+program* parse_program_parallel(token_stream* tokens){
+    int num_type_tokens;
+    parallel.tokens = tokens;
+    parallel.units = find_parse_units(tokens, &parallel.num_units, &num_type_tokens);
+
+    /* Every typedef or struct adds at most one type, and the type table
+     * mustn't move while threads are reading it */
+    reserve_type_table(num_type_tokens);
+
+    int num_type_units = 0;
+    for(int u = 0; u < parallel.num_units; u++)
+        num_type_units += parallel.units[u].defines_types;
+    parallel.type_counts = malloc((num_type_units + 1) * sizeof(int));
+    parallel.type_counts[0] = type_table.num;
+    parallel.types_done = 0;
+
+    /* Hand out the other units in runs of about the same number of tokens,
+     * several per thread so that threads which finish early can take more */
+    int target = tokens->num / (parser_threads * 8) + 1;
+    parallel.job_units = malloc((parallel.num_units + 1) * sizeof(int));
+    parallel.job_units[0] = 0;
+    parallel.num_jobs = 1;
+    int job_start = 0;
+    for(int u = 0; u < parallel.num_units; u++){
+        int end = u + 1 < parallel.num_units ? parallel.units[u + 1].first_token : tokens->num;
+        if(end - job_start >= target || u == parallel.num_units - 1){
+            parallel.job_units[parallel.num_jobs++] = u + 1;
+            job_start = end;
+        }
+    }
+    parallel.next_job = 0;
+
+    parallel.share = share_expressions;
+    parallel.num_threads = parser_threads < parallel.num_jobs ? parser_threads : parallel.num_jobs;
+    parallel.threads = calloc(parallel.num_threads, sizeof(parse_thread));
+    pthread_mutex_init(&parallel.lock, NULL);
+    pthread_cond_init(&parallel.published, NULL);
+    pthread_barrier_init(&parallel.parsed, NULL, parallel.num_threads + 1);
+    pthread_barrier_init(&parallel.merged, NULL, parallel.num_threads + 1);
+
+    for(int i = 0; i < parallel.num_threads; i++){
+        parallel.threads[i].index = i;
+        parallel.threads[i].arena = thread_arena(i);
+        if(pthread_create(&parallel.threads[i].handle, NULL, parse_thread_main, &parallel.threads[i]) != 0)
+            error("Could not create parser thread");
+    }
+
+    /* Once everything is parsed, merge the pools and collect the top-level
+     * statements while the threads still have them */
+    pthread_barrier_wait(&parallel.parsed);
+    if(parallel.share)
+        merge_shared_units();
+    else
+        lay_out_units();
+
+    program* prog = make_program();
+    for(int u = 0; u < parallel.num_units; u++){
+        parse_unit* unit = &parallel.units[u];
+        program* top = parallel.threads[unit->thread].top;
+        for(unsigned int i = unit->start.top; i < unit->end.top; i++)
+            add_to_program(prog, move_statement(top->statements[i], unit), top->first_tokens[i], top->types_before[i]);
+    }
+
+    pthread_barrier_wait(&parallel.merged);
+    for(int i = 0; i < parallel.num_threads; i++)
+        pthread_join(parallel.threads[i].handle, NULL);
+
+    pthread_barrier_destroy(&parallel.parsed);
+    pthread_barrier_destroy(&parallel.merged);
+    pthread_cond_destroy(&parallel.published);
+    pthread_mutex_destroy(&parallel.lock);
+    free(parallel.threads);
+    free(parallel.job_units);
+    free(parallel.type_counts);
+    free(parallel.units);
+    return prog;
+}
@@ -13,23 +13,163 @@
  * double as full-fledged statements (such as var++ and x = 5), there is also
  * a generic statement which stores an inner expression.
  *
- * This parser uses a modified Shunning-Yard algorithm for parsing infix 
- * expressions. It uses a look-behind token to resolve some semantic
- * conflicts, such as whether the asterisk * means multiplication or
- * dereferencing. (x + *y has a different meaning completely from x * y.)
+ * This parser uses precedence climbing (a Pratt parser) for infix
+ * expressions, driven by tables of binding powers indexed by token type.
+ * Whether the asterisk * means multiplication or dereferencing depends on
+ * whether it comes where an operand is expected. (x + *y has a different
+ * meaning completely from x * y.)
  *
  * In addition to doing parsing, the parser creates and maintains a type table
  * which stores all the known primitive types and any user defined types. The
  * types stored in this type table can later be used for compiling to assembly.
+ *
+ * Expressions and statements live in the expression and statement pools,
+ * and everything else the parser builds is allocated from one arena. All of
+ * them live from init_parser() to del_parser(), so nothing the parser
+ * returns is freed on its own.
  */
 
+/* Whether the parser's arena should be backed by huge pages */
+int parser_huge_pages = 0;
+
+/* Number of threads parse_program() may parse with */
+int parser_threads = 1;
+
+/* Programs with fewer tokens than this are always parsed on one thread */
+#define PARALLEL_MIN_TOKENS 16384
+
+/* Arenas for the threads of a parallel parse, one per thread, which are
+ * kept as long as the main arena since what the threads built lives in them */
+struct {
+    arena** arenas;
+    int num;
+} thread_arenas;
+
+/* Get the arena for thread i of a parallel parse, making it if needed.
+ * Only the main thread may call this. */
+arena* thread_arena(int i){
+    if(i >= thread_arenas.num){
+        thread_arenas.arenas = realloc(thread_arenas.arenas, (i + 1) * sizeof(arena*));
+        while(thread_arenas.num <= i)
+            thread_arenas.arenas[thread_arenas.num++] = make_arena(parser_huge_pages);
+    }
+    return thread_arenas.arenas[i];
+}
+
 /* Initialize all aspects of the parser */
 void init_parser(){
+    init_expression_tables();
+    ast_arena = make_arena(parser_huge_pages);
+    init_expression_pool();
+    init_statement_pool();
     init_type_table();
 }
 
-/* Delete all parser resources */
+/* Delete all parser resources, and everything the parser has built */
 void del_parser(){
     del_type_table();
+    del_expression_pool();
+    del_statement_pool();
+    free_arena(ast_arena);
+    ast_arena = NULL;
+    for(int i = 0; i < thread_arenas.num; i++)
+        free_arena(thread_arenas.arenas[i]);
+    free(thread_arenas.arenas);
+    thread_arenas.arenas = NULL;
+    thread_arenas.num = 0;
+}
+
+/* Throw away everything the parser has built and start again with a fresh
+ * type table. The arenas' memory is kept to be used again. */
+void reset_parser(){
+    del_type_table();
+    reset_expression_pool();
+    reset_statement_pool();
+    reset_arena(ast_arena);
+    for(int i = 0; i < thread_arenas.num; i++)
+        reset_arena(thread_arenas.arenas[i]);
+    init_type_table();
+}
+
+
+/* A whole parsed program: the top-level statements in order, along with the
+ * index of the first token of each one. Statement i spans the tokens from
+ * first_tokens[i] up to the first token of the next statement. Statements
+ * are indices in the statement pool, 0 for a statement that parses to
+ * nothing. types_before[i] is the number of types in the type table when
+ * statement i was parsed, which are the ones it could see. */
+typedef struct _program {
+    int num;
+    int allocated;
+    unsigned int* statements;
+    int* first_tokens;
+    int* types_before;
+
+    /* Statements thrown away by edits since the program was last parsed from
+     * scratch, which are still in the statement pool */
+    int discarded;
+} program;
+
+/* Create an empty program */
+program* make_program(){
+    program* prog = calloc(1, sizeof(program));
+    prog->allocated = 16;
+    prog->statements = malloc(prog->allocated * sizeof(unsigned int));
+    prog->first_tokens = malloc(prog->allocated * sizeof(int));
+    prog->types_before = malloc(prog->allocated * sizeof(int));
+    return prog;
+}
+
+/* Make room for num statements in a program */
+void reserve_program(program* prog, int num){
+    if(num <= prog->allocated)
+        return;
+
+    prog->allocated = grow_capacity(prog->allocated, num);
+    prog->statements = realloc(prog->statements, prog->allocated * sizeof(unsigned int));
+    prog->first_tokens = realloc(prog->first_tokens, prog->allocated * sizeof(int));
+    prog->types_before = realloc(prog->types_before, prog->allocated * sizeof(int));
+}
+
+/* Add a statement which starts at token first_token, and was parsed with
+ * types_before types in the type table, to the end of a program */
+void add_to_program(program* prog, unsigned int st, int first_token, int types_before){
+    reserve_program(prog, prog->num + 1);
+    prog->statements[prog->num] = st;
+    prog->first_tokens[prog->num] = first_token;
+    prog->types_before[prog->num] = types_before;
+    prog->num++;
 }
 
+program* parse_program_parallel(token_stream* tokens);
+
+/* Parse every statement in a token stream, in parallel if the parser may
+ * use more than one thread and there is enough to parse */
+program* parse_program(token_stream* tokens){
+    if(parser_threads > 1 && tokens->num >= PARALLEL_MIN_TOKENS)
+        return parse_program_parallel(tokens);
+
+    program* prog = make_program();
+    int index = 0;
+    while(index < tokens->num){
+        int first_token = index;
+        int types_before = type_table.num;
+        add_to_program(prog, parse_statement(tokens, &index, tokens->num), first_token, types_before);
+    }
+    return prog;
+}
+
+/* Print every statement in a program */
+void print_program(program* prog){
+    for(int i = 0; i < prog->num; i++)
+        if(prog->statements[i] != 0)
+            print_statement(prog->statements[i]);
+}
+
+/* Release a program. Its statements are released with the statement pool. */
+void free_program(program* prog){
+    free(prog->statements);
+    free(prog->first_tokens);
+    free(prog->types_before);
+    free(prog);
+}
@@ -0,0 +1,1526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* This file describes the preprocessor. It works directly on the token
+ * stream: the tokenizer marks every # which starts a directive, and the
+ * preprocessor copies the tokens of a file into an output stream, carrying
+ * out the directives and expanding macros as it goes. Text is never lexed
+ * again, except for the new tokens that ## pastes together.
+ *
+ * #include "name" looks for the header next to the file that includes it,
+ * then in each include path (-I) in order. #include <name> only looks in
+ * the include paths.
+ *
+ * Every header is read and tokenized once per process, the first time it is
+ * included, and its tokens are kept in the header cache. Including it again
+ * just copies the cached tokens. Where a given #include line leads is also
+ * cached, so the file system is only searched once per distinct include.
+ *
+ * When a header is first tokenized, we check whether all of it is wrapped in
+ * an include guard (#ifndef NAME, #define NAME, ..., #endif), or whether it
+ * has #pragma once. Including it again after that costs nothing: if its
+ * guard is defined, or it has #pragma once, it is skipped without looking
+ * at its tokens at all.
+ *
+ * Macros are expanded with Prosser's algorithm. Every token being expanded
+ * carries a hide-set, the names of the macros it came out of, which must
+ * not be expanded again from it. Hide-sets are interned, so each is a
+ * single 32-bit ID. Tokens waiting to be scanned again after an expansion
+ * are kept on a stack, and tokens of the file which can't start a macro
+ * call are copied to the output in bulk without ever going on the stack.
+ *
+ * The expansion of an object-like macro depends only on the macros defined
+ * when it is used, so the first time one is used its full expansion is
+ * cached. Using it again just copies the cached tokens, until any macro is
+ * defined or undefined.
+ *
+ * #if, #ifdef, #ifndef, #elif, #else and #endif are evaluated. The tokens
+ * of groups which are skipped are dropped without being looked at, except
+ * for nested conditionals. #if expressions can use what the tokenizer
+ * knows about: numbers, characters, parentheses, unary - + !, the binary
+ * operators * / + - < > <= >= == != && ||, and defined. Every other
+ * directive is dropped.
+ */
+
+/* How deeply includes can be nested before we assume they are recursive */
+#define MAX_INCLUDE_DEPTH 200
+
+/* A header that has been read and tokenized */
+typedef struct _header {
+    char* path;
+    char* dir;
+    unsigned int dir_symbol;
+    int file;
+    token_stream* tokens;
+
+    /* Include guard macro, or 0, and whether the header has #pragma once */
+    unsigned int guard;
+    int once;
+    int times_included;
+} header;
+
+/* A cached #include lookup: the directory of the including file (0 for
+ * <name>) and the header name, and the header they lead to */
+typedef struct _include_lookup {
+    unsigned int dir;
+    unsigned int name;
+    int header;
+} include_lookup;
+
+/* A macro definition. Its body is the tokens [first, last) of the macro
+ * bodies list, with uses of parameters turned into TOKEN_MACRO_PARAM. For a
+ * variadic macro, the last parameter is __VA_ARGS__. */
+typedef struct _macro {
+    unsigned int name;
+    int function_like;
+    int num_params;
+    int variadic;
+    int first;
+    int last;
+
+    /* For object-like macros, the cached expansion is the tokens [cache_first,
+     * cache_last) of the expansion cache, if cache_generation is the current
+     * generation. cache_first is -1 if the expansion can't be cached. If
+     * rescan is set, the last token must be scanned again where it's used. */
+    unsigned int cache_generation;
+    int cache_first;
+    int cache_last;
+    int rescan;
+} macro;
+
+/* An interned hide-set: the largest name in the set, and the hide-set of the
+ * rest of the names. Hide-set 0 is the empty set. */
+typedef struct _hideset_node {
+    unsigned int name;
+    unsigned int rest;
+} hideset_node;
+
+/* A list of tokens being expanded, and the hide-set of each one. hidesets
+ * is NULL for lists whose hide-sets are all empty, or don't matter. */
+typedef struct _macro_tokens {
+    token_stream* tokens;
+    unsigned int* hidesets;
+    int allocated;
+} macro_tokens;
+
+/* Where expansion reads tokens from: first the pending tokens above bottom,
+ * then the tokens [index, last) of source */
+typedef struct _token_reader {
+    macro_tokens* source;
+    int index;
+    int last;
+    int bottom;
+
+    /* Whether the last token read was pending, so it can be put back */
+    int from_pending;
+
+    /* Set when expanding a macro body on its own to cache it. Running out of
+     * tokens in a macro call then isn't an error, and sets ran_out. */
+    int isolated;
+    int ran_out;
+} token_reader;
+
+/* An open conditional group */
+typedef struct _condition {
+    /* The # of the #if, for errors */
+    unsigned int offset;
+
+    /* Whether the tokens of the current branch are dropped, whether a branch
+     * was taken already (or the whole group is being skipped), and whether
+     * #else has been seen */
+    int skipping;
+    int taken;
+    int seen_else;
+} condition;
+
+/* Global preprocessor state */
+struct {
+    /* Include search paths, from -I */
+    int num_paths;
+    char** paths;
+
+    /* Header cache */
+    int num_headers;
+    int allocated_headers;
+    header* headers;
+
+    /* Open addressing hash table of include lookups, header -1 for empty slots */
+    int num_lookups;
+    int capacity;
+    include_lookup* lookups;
+
+    /* Macro definitions, and the definition of each symbol (plus one, 0 for
+     * none) indexed by symbol. The generation changes whenever any macro is
+     * defined or undefined. */
+    int num_macros;
+    int allocated_macros;
+    macro* macros;
+    unsigned int allocated_macro_of;
+    int* macro_of;
+    unsigned int generation;
+
+    /* Interned hide-sets, and an open addressing hash table of them, 0 for empty slots */
+    unsigned int num_hidesets;
+    unsigned int allocated_hidesets;
+    hideset_node* hidesets;
+    unsigned int hideset_capacity;
+    unsigned int* hideset_slots;
+
+    /* Macro bodies, and the cached expansions of object-like macros (from
+     * the generation cache_generation) */
+    macro_tokens bodies;
+    macro_tokens cache;
+    unsigned int cache_generation;
+
+    /* Tokens waiting to be scanned again, as a stack whose top is the next
+     * token, and the work list where macro arguments are collected and
+     * expanded. Both are used as stacks by nested expansions. */
+    macro_tokens pending;
+    macro_tokens work;
+
+    /* Bounds of macro arguments in the work list, four per argument: the
+     * raw tokens, and their expansion (-1 until it's needed) */
+    int num_bounds;
+    int allocated_bounds;
+    int* bounds;
+
+    /* Text of tokens being pasted or stringized, and the stream pasted tokens are lexed into */
+    char* spelling;
+    int spelling_length;
+    int allocated_spelling;
+    token_stream* pasted;
+
+    /* Open conditional groups; the ones at condition_base and above belong to the current file */
+    int num_conditions;
+    int allocated_conditions;
+    condition* conditions;
+    int condition_base;
+
+    /* Directive names */
+    unsigned int sym_include;
+    unsigned int sym_define;
+    unsigned int sym_undef;
+    unsigned int sym_ifdef;
+    unsigned int sym_ifndef;
+    unsigned int sym_elif;
+    unsigned int sym_endif;
+    unsigned int sym_pragma;
+    unsigned int sym_once;
+    unsigned int sym_defined;
+    unsigned int sym_va_args;
+} preprocessor;
+
+/* Set up an empty token list, with hide-sets if track_hidesets is set */
+void init_macro_tokens(macro_tokens* list, int track_hidesets){
+    list->tokens = make_token_stream(source_table.base);
+    list->allocated = list->tokens->allocated;
+    list->hidesets = track_hidesets ? malloc(list->allocated * sizeof(unsigned int)) : NULL;
+}
+
+/* Release a token list */
+void del_macro_tokens(macro_tokens* list){
+    free_token_stream(list->tokens);
+    free(list->hidesets);
+}
+
+/* Initialize the preprocessor, with no include paths */
+void init_preprocessor(){
+    memset(&preprocessor, 0, sizeof(preprocessor));
+    preprocessor.allocated_headers = 16;
+    preprocessor.headers = malloc(preprocessor.allocated_headers * sizeof(header));
+    preprocessor.capacity = 64;
+    preprocessor.lookups = malloc(preprocessor.capacity * sizeof(include_lookup));
+    for(int i = 0; i < preprocessor.capacity; i++)
+        preprocessor.lookups[i].header = -1;
+
+    preprocessor.allocated_macros = 64;
+    preprocessor.macros = malloc(preprocessor.allocated_macros * sizeof(macro));
+    preprocessor.generation = 1;
+
+    /* Hide-set 0 is the empty set, so the first node is never used */
+    preprocessor.num_hidesets = 1;
+    preprocessor.allocated_hidesets = 256;
+    preprocessor.hidesets = malloc(preprocessor.allocated_hidesets * sizeof(hideset_node));
+    preprocessor.hideset_capacity = 512;
+    preprocessor.hideset_slots = calloc(preprocessor.hideset_capacity, sizeof(unsigned int));
+
+    init_macro_tokens(&preprocessor.bodies, 0);
+    init_macro_tokens(&preprocessor.cache, 1);
+    init_macro_tokens(&preprocessor.pending, 1);
+    init_macro_tokens(&preprocessor.work, 1);
+    preprocessor.allocated_bounds = 64;
+    preprocessor.bounds = malloc(preprocessor.allocated_bounds * sizeof(int));
+    preprocessor.allocated_spelling = 256;
+    preprocessor.spelling = malloc(preprocessor.allocated_spelling);
+    preprocessor.pasted = make_token_stream(source_table.base);
+    preprocessor.allocated_conditions = 16;
+    preprocessor.conditions = malloc(preprocessor.allocated_conditions * sizeof(condition));
+
+    preprocessor.sym_include = intern_string("include");
+    preprocessor.sym_define = intern_string("define");
+    preprocessor.sym_undef = intern_string("undef");
+    preprocessor.sym_ifdef = intern_string("ifdef");
+    preprocessor.sym_ifndef = intern_string("ifndef");
+    preprocessor.sym_elif = intern_string("elif");
+    preprocessor.sym_endif = intern_string("endif");
+    preprocessor.sym_pragma = intern_string("pragma");
+    preprocessor.sym_once = intern_string("once");
+    preprocessor.sym_defined = intern_string("defined");
+    preprocessor.sym_va_args = intern_string("__VA_ARGS__");
+}
+
+/* Delete the preprocessor, the header cache and all macros */
+void del_preprocessor(){
+    for(int i = 0; i < preprocessor.num_headers; i++){
+        free(preprocessor.headers[i].path);
+        free(preprocessor.headers[i].dir);
+        free_token_stream(preprocessor.headers[i].tokens);
+    }
+    for(int i = 0; i < preprocessor.num_paths; i++)
+        free(preprocessor.paths[i]);
+    free(preprocessor.paths);
+    free(preprocessor.headers);
+    free(preprocessor.lookups);
+
+    free(preprocessor.macros);
+    free(preprocessor.macro_of);
+    free(preprocessor.hidesets);
+    free(preprocessor.hideset_slots);
+    del_macro_tokens(&preprocessor.bodies);
+    del_macro_tokens(&preprocessor.cache);
+    del_macro_tokens(&preprocessor.pending);
+    del_macro_tokens(&preprocessor.work);
+    free(preprocessor.bounds);
+    free(preprocessor.spelling);
+    free_token_stream(preprocessor.pasted);
+    free(preprocessor.conditions);
+}
+
+/* Forget every macro and conditional, and that any header was included, so
+ * that files can be preprocessed again from the start. Headers stay cached. */
+void restart_preprocessor(){
+    for(int i = 0; i < preprocessor.num_headers; i++)
+        preprocessor.headers[i].times_included = 0;
+    if(preprocessor.macro_of != NULL)
+        memset(preprocessor.macro_of, 0, preprocessor.allocated_macro_of * sizeof(int));
+    preprocessor.num_macros = 0;
+    preprocessor.bodies.tokens->num = 0;
+    preprocessor.bodies.tokens->num_literals = 0;
+    preprocessor.generation++;
+    preprocessor.num_conditions = 0;
+    preprocessor.condition_base = 0;
+}
+
+/* Add a directory to the end of the include search paths */
+void add_include_path(char* path){
+    preprocessor.paths = realloc(preprocessor.paths, (preprocessor.num_paths + 1) * sizeof(char*));
+    preprocessor.paths[preprocessor.num_paths++] = strdup(path);
+}
+
+/* Get the directory part of a path, as a new string */
+char* path_directory(char* path){
+    char* slash = strrchr(path, '/');
+    if(slash == NULL)
+        return strdup(".");
+
+    int len = slash == path ? 1 : slash - path;
+    char* dir = malloc(len + 1);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    return dir;
+}
+
+/*** Header cache ***/
+
+/* Check whether the directive at token index has the given name, and if so,
+ * whether its first argument is an identifier (stored in ident) */
+int is_directive(token_stream* tokens, int index, int last, unsigned int name, unsigned int* ident){
+    if(index + 1 >= last || tokens->types[index + 1] != TOKEN_IDENT || token_symbol(tokens, index + 1) != name)
+        return 0;
+    if(ident == NULL)
+        return 1;
+    if(index + 2 >= last || tokens->types[index + 2] != TOKEN_IDENT)
+        return 0;
+    *ident = token_symbol(tokens, index + 2);
+    return 1;
+}
+
+/* Find the index just past the tokens of the directive at token index */
+int directive_last(token_stream* tokens, int index){
+    unsigned int end = directive_end(tokens, index);
+    int last = index + 1;
+    while(last < tokens->num && tokens->offsets[last] < end)
+        last++;
+    return last;
+}
+
+/* Look for an include guard or #pragma once in a newly tokenized header */
+void find_include_guard(header* h){
+    token_stream* tokens = h->tokens;
+
+    /* #pragma once anywhere in the file */
+    for(int i = 0; i < tokens->num; i++)
+        if(tokens->types[i] == TOKEN_DIRECTIVE && i + 2 < tokens->num && tokens->types[i + 2] == TOKEN_IDENT
+                && is_directive(tokens, i, tokens->num, preprocessor.sym_pragma, NULL) && token_symbol(tokens, i + 2) == preprocessor.sym_once)
+            h->once = 1;
+
+    /* The guard: the file must start with #ifndef NAME and #define NAME */
+    unsigned int guard, defined;
+    if(tokens->num == 0 || tokens->types[0] != TOKEN_DIRECTIVE)
+        return;
+    int last = directive_last(tokens, 0);
+    if(!is_directive(tokens, 0, last, preprocessor.sym_ifndef, &guard))
+        return;
+    if(last >= tokens->num || tokens->types[last] != TOKEN_DIRECTIVE)
+        return;
+    int define_last = directive_last(tokens, last);
+    if(!is_directive(tokens, last, define_last, preprocessor.sym_define, &defined) || defined != guard)
+        return;
+
+    /* ... and the #endif which matches the #ifndef must be the last thing in it */
+    int depth = 0;
+    for(int i = 0; i < tokens->num; i = last){
+        last = i + 1;
+        if(tokens->types[i] != TOKEN_DIRECTIVE)
+            continue;
+        last = directive_last(tokens, i);
+        if(i + 1 >= last)
+            continue;
+
+        int kind = tokens->types[i + 1];
+        unsigned int name = kind == TOKEN_IDENT ? token_symbol(tokens, i + 1) : 0;
+        if(kind == TOKEN_IF || name == preprocessor.sym_ifdef || name == preprocessor.sym_ifndef)
+            depth++;
+        else if(name == preprocessor.sym_endif && --depth == 0)
+            break;
+    }
+    if(depth == 0 && last == tokens->num)
+        h->guard = guard;
+}
+
+/* Get the header cache entry for a path, reading and tokenizing the file if it isn't cached yet */
+int load_header(char* path){
+    for(int i = 0; i < preprocessor.num_headers; i++)
+        if(strcmp(preprocessor.headers[i].path, path) == 0)
+            return i;
+
+    if(preprocessor.num_headers == preprocessor.allocated_headers){
+        preprocessor.allocated_headers *= 2;
+        preprocessor.headers = realloc(preprocessor.headers, preprocessor.allocated_headers * sizeof(header));
+    }
+
+    header* h = &preprocessor.headers[preprocessor.num_headers];
+    memset(h, 0, sizeof(header));
+    h->path = strdup(path);
+    h->dir = path_directory(path);
+    h->dir_symbol = intern_string(h->dir);
+    h->file = add_source_file(path);
+    h->tokens = make_token_stream(source_table.base);
+    tokenize(h->tokens, source_table.files[h->file].offset, source_table.files[h->file].length);
+    find_include_guard(h);
+    return preprocessor.num_headers++;
+}
+
+/* Tokenize a cached header again after its file was edited, which may have
+ * moved the file from old_file to new_file in the source table */
+void reload_header(int old_file, int new_file){
+    for(int i = 0; i < preprocessor.num_headers; i++){
+        header* h = &preprocessor.headers[i];
+        if(h->file != old_file)
+            continue;
+
+        h->file = new_file;
+        h->tokens->num = 0;
+        h->tokens->num_literals = 0;
+        tokenize(h->tokens, source_table.files[new_file].offset, source_table.files[new_file].length);
+        h->guard = 0;
+        h->once = 0;
+        find_include_guard(h);
+    }
+}
+
+/* Search for a header. Returns the real path to it as a new string, or NULL if it can't be found. */
+char* search_header(char* name, char* dir){
+    char candidate[PATH_MAX];
+
+    /* Absolute paths are used as is */
+    if(name[0] == '/')
+        return realpath(name, NULL);
+
+    /* Quoted names are looked for next to the including file first */
+    if(dir != NULL){
+        snprintf(candidate, PATH_MAX, "%s/%s", dir, name);
+        char* path = realpath(candidate, NULL);
+        if(path != NULL)
+            return path;
+    }
+
+    for(int i = 0; i < preprocessor.num_paths; i++){
+        snprintf(candidate, PATH_MAX, "%s/%s", preprocessor.paths[i], name);
+        char* path = realpath(candidate, NULL);
+        if(path != NULL)
+            return path;
+    }
+    return NULL;
+}
+
+/* Double the size of the include lookup table, reinserting every lookup */
+void grow_include_lookups(){
+    include_lookup* old = preprocessor.lookups;
+    int old_capacity = preprocessor.capacity;
+
+    preprocessor.capacity *= 2;
+    preprocessor.lookups = malloc(preprocessor.capacity * sizeof(include_lookup));
+    for(int i = 0; i < preprocessor.capacity; i++)
+        preprocessor.lookups[i].header = -1;
+
+    for(int i = 0; i < old_capacity; i++){
+        if(old[i].header < 0)
+            continue;
+        int slot = (old[i].dir * 31 + old[i].name) & (preprocessor.capacity - 1);
+        while(preprocessor.lookups[slot].header >= 0)
+            slot = (slot + 1) & (preprocessor.capacity - 1);
+        preprocessor.lookups[slot] = old[i];
+    }
+    free(old);
+}
+
+/* Find the header that an include of name leads to. dir is the directory of
+ * the including file for "name", or NULL for <name>. Returns -1 if there is
+ * no such header. */
+int find_header(char* name, int name_length, char* dir, unsigned int dir_symbol){
+    unsigned int name_symbol = intern(name, name_length);
+    unsigned int key = dir == NULL ? 0 : dir_symbol;
+
+    /* Look for the same include from the same directory first */
+    int slot = (key * 31 + name_symbol) & (preprocessor.capacity - 1);
+    while(preprocessor.lookups[slot].header >= 0){
+        include_lookup* lookup = &preprocessor.lookups[slot];
+        if(lookup->dir == key && lookup->name == name_symbol)
+            return lookup->header;
+        slot = (slot + 1) & (preprocessor.capacity - 1);
+    }
+
+    char* path = search_header(symbol_name(name_symbol), dir);
+    if(path == NULL)
+        return -1;
+    int index = load_header(path);
+    free(path);
+
+    /* Nothing has been added to the lookup table since the search, so the slot is still free */
+    include_lookup* lookup = &preprocessor.lookups[slot];
+    lookup->dir = key;
+    lookup->name = name_symbol;
+    lookup->header = index;
+    if(++preprocessor.num_lookups * 2 > preprocessor.capacity)
+        grow_include_lookups();
+    return index;
+}
+
+/*** Macro table ***/
+
+/* Get the definition of a name, or NULL if it isn't a macro */
+macro* find_macro(unsigned int name){
+    if(name >= preprocessor.allocated_macro_of || preprocessor.macro_of[name] == 0)
+        return NULL;
+    return &preprocessor.macros[preprocessor.macro_of[name] - 1];
+}
+
+/* Check whether a name is defined */
+int is_defined(unsigned int name){
+    return find_macro(name) != NULL;
+}
+
+/* Get the macro that token index names, or NULL if it isn't the name of a macro */
+macro* token_macro(token_stream* tokens, int index){
+    if(tokens->types[index] != TOKEN_IDENT)
+        return NULL;
+    return find_macro(tokens->data[index]);
+}
+
+/* Make name refer to a definition (plus one, or 0 to undefine it) */
+void set_macro(unsigned int name, int definition){
+    if(name >= preprocessor.allocated_macro_of){
+        unsigned int allocated = preprocessor.allocated_macro_of == 0 ? 1024 : preprocessor.allocated_macro_of;
+        while(allocated <= name)
+            allocated *= 2;
+        preprocessor.macro_of = realloc(preprocessor.macro_of, allocated * sizeof(int));
+        memset(preprocessor.macro_of + preprocessor.allocated_macro_of, 0, (allocated - preprocessor.allocated_macro_of) * sizeof(int));
+        preprocessor.allocated_macro_of = allocated;
+    }
+    preprocessor.macro_of[name] = definition;
+
+    /* Any cached expansion may have changed */
+    preprocessor.generation++;
+}
+
+/*** Hide-sets ***/
+
+/* Get the hide-set made of name and the names in rest, which must all be smaller than name */
+unsigned int make_hideset(unsigned int name, unsigned int rest){
+    unsigned int mask = preprocessor.hideset_capacity - 1;
+    unsigned int slot = (name * 2654435761u ^ rest * 40503u) & mask;
+    while(preprocessor.hideset_slots[slot] != 0){
+        hideset_node* node = &preprocessor.hidesets[preprocessor.hideset_slots[slot]];
+        if(node->name == name && node->rest == rest)
+            return preprocessor.hideset_slots[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    if(preprocessor.num_hidesets == preprocessor.allocated_hidesets){
+        preprocessor.allocated_hidesets *= 2;
+        preprocessor.hidesets = realloc(preprocessor.hidesets, preprocessor.allocated_hidesets * sizeof(hideset_node));
+    }
+    unsigned int set = preprocessor.num_hidesets++;
+    preprocessor.hidesets[set].name = name;
+    preprocessor.hidesets[set].rest = rest;
+    preprocessor.hideset_slots[slot] = set;
+
+    /* Keep the table at most half full */
+    if(preprocessor.num_hidesets * 2 > preprocessor.hideset_capacity){
+        unsigned int capacity = preprocessor.hideset_capacity * 2;
+        unsigned int* slots = calloc(capacity, sizeof(unsigned int));
+        for(unsigned int i = 1; i < preprocessor.num_hidesets; i++){
+            hideset_node* node = &preprocessor.hidesets[i];
+            unsigned int s = (node->name * 2654435761u ^ node->rest * 40503u) & (capacity - 1);
+            while(slots[s] != 0)
+                s = (s + 1) & (capacity - 1);
+            slots[s] = i;
+        }
+        free(preprocessor.hideset_slots);
+        preprocessor.hideset_slots = slots;
+        preprocessor.hideset_capacity = capacity;
+    }
+    return set;
+}
+
+/* Check whether a hide-set contains a name */
+int hideset_contains(unsigned int set, unsigned int name){
+    /* Names are sorted largest first */
+    while(set != 0 && preprocessor.hidesets[set].name > name)
+        set = preprocessor.hidesets[set].rest;
+    return set != 0 && preprocessor.hidesets[set].name == name;
+}
+
+/* Add a name to a hide-set */
+unsigned int hideset_add(unsigned int set, unsigned int name){
+    if(set == 0 || name > preprocessor.hidesets[set].name)
+        return make_hideset(name, set);
+    if(name == preprocessor.hidesets[set].name)
+        return set;
+
+    unsigned int first = preprocessor.hidesets[set].name;
+    return make_hideset(first, hideset_add(preprocessor.hidesets[set].rest, name));
+}
+
+/* Get the union of two hide-sets */
+unsigned int hideset_union(unsigned int a, unsigned int b){
+    if(a == 0)
+        return b;
+    for(; b != 0 && b != a; b = preprocessor.hidesets[b].rest)
+        a = hideset_add(a, preprocessor.hidesets[b].name);
+    return a;
+}
+
+/* Get the intersection of two hide-sets */
+unsigned int hideset_intersect(unsigned int a, unsigned int b){
+    while(a != 0 && b != 0 && a != b){
+        unsigned int name_a = preprocessor.hidesets[a].name;
+        unsigned int name_b = preprocessor.hidesets[b].name;
+        if(name_a > name_b)
+            a = preprocessor.hidesets[a].rest;
+        else if(name_b > name_a)
+            b = preprocessor.hidesets[b].rest;
+        else
+            return make_hideset(name_a, hideset_intersect(preprocessor.hidesets[a].rest, preprocessor.hidesets[b].rest));
+    }
+    return a == b ? a : 0;
+}
+
+/*** Token lists ***/
+
+/* Get the hide-set of a token in a list */
+unsigned int token_hideset(macro_tokens* list, int index){
+    return list->hidesets != NULL ? list->hidesets[index] : 0;
+}
+
+/* Make the hide-sets of a list as big as its token stream, after tokens were added */
+void grow_hidesets(macro_tokens* list){
+    if(list->hidesets == NULL || list->allocated >= list->tokens->allocated)
+        return;
+    list->allocated = list->tokens->allocated;
+    list->hidesets = realloc(list->hidesets, list->allocated * sizeof(unsigned int));
+}
+
+/* Copy the tokens [first, last) of one list onto the end of another, adding
+ * the names in hideset to the hide-set of each one */
+void copy_macro_tokens(macro_tokens* to, macro_tokens* from, int first, int last, unsigned int hideset){
+    int num = to->tokens->num;
+    append_tokens(to->tokens, from->tokens, first, last);
+    grow_hidesets(to);
+    if(to->hidesets == NULL)
+        return;
+
+    if(hideset == 0 && from->hidesets != NULL)
+        memcpy(to->hidesets + num, from->hidesets + first, (last - first) * sizeof(unsigned int));
+    else
+        for(int i = first; i < last; i++)
+            to->hidesets[num + i - first] = hideset_union(token_hideset(from, i), hideset);
+}
+
+/* Add a new token to the end of a list */
+void add_macro_token(macro_tokens* to, int type, unsigned int offset, unsigned int length, unsigned int data, unsigned int hideset){
+    add_token(to->tokens, type, offset, length, data);
+    grow_hidesets(to);
+    if(to->hidesets != NULL)
+        to->hidesets[to->tokens->num - 1] = hideset;
+}
+
+/* Reverse the tokens [first, last) of a list in place */
+void reverse_macro_tokens(macro_tokens* list, int first, int last){
+    token_stream* tokens = list->tokens;
+    for(int i = first, j = last - 1; i < j; i++, j--){
+        unsigned char type = tokens->types[i];
+        tokens->types[i] = tokens->types[j];
+        tokens->types[j] = type;
+
+        unsigned int swap = tokens->offsets[i];
+        tokens->offsets[i] = tokens->offsets[j];
+        tokens->offsets[j] = swap;
+        swap = tokens->lengths[i];
+        tokens->lengths[i] = tokens->lengths[j];
+        tokens->lengths[j] = swap;
+        swap = tokens->data[i];
+        tokens->data[i] = tokens->data[j];
+        tokens->data[j] = swap;
+        swap = list->hidesets[i];
+        list->hidesets[i] = list->hidesets[j];
+        list->hidesets[j] = swap;
+    }
+}
+
+/* Push four argument bounds onto the bounds stack */
+void push_bounds(int raw_first, int raw_last, int expanded_first, int expanded_last){
+    if(preprocessor.num_bounds + 4 > preprocessor.allocated_bounds){
+        preprocessor.allocated_bounds *= 2;
+        preprocessor.bounds = realloc(preprocessor.bounds, preprocessor.allocated_bounds * sizeof(int));
+    }
+    int* bounds = preprocessor.bounds + preprocessor.num_bounds;
+    bounds[0] = raw_first;
+    bounds[1] = raw_last;
+    bounds[2] = expanded_first;
+    bounds[3] = expanded_last;
+    preprocessor.num_bounds += 4;
+}
+
+/*** Reading tokens ***/
+
+/* Read the next token, storing the list it's in and its index there. Returns
+ * 0 if there are no tokens left. A pending token is popped, but stays where
+ * it is until something else is pushed. */
+int next_token(token_reader* reader, macro_tokens** from, int* index){
+    macro_tokens* pending = &preprocessor.pending;
+    reader->from_pending = pending->tokens->num > reader->bottom;
+    if(reader->from_pending){
+        *from = pending;
+        *index = --pending->tokens->num;
+        return 1;
+    }
+
+    if(reader->index >= reader->last)
+        return 0;
+    *from = reader->source;
+    *index = reader->index++;
+    return 1;
+}
+
+/* Put back the token which was just read */
+void unread_token(token_reader* reader){
+    if(reader->from_pending)
+        preprocessor.pending.tokens->num++;
+    else
+        reader->index--;
+}
+
+/*** Pasting and stringizing ***/
+
+/* Add text to the spelling buffer */
+void add_spelling(char* text, int length){
+    if(preprocessor.spelling_length + length > preprocessor.allocated_spelling){
+        preprocessor.allocated_spelling = grow_capacity(preprocessor.allocated_spelling, preprocessor.spelling_length + length);
+        preprocessor.spelling = realloc(preprocessor.spelling, preprocessor.allocated_spelling);
+    }
+    memcpy(preprocessor.spelling + preprocessor.spelling_length, text, length);
+    preprocessor.spelling_length += length;
+}
+
+/* Add the source text of a token, including any quotes, to the spelling buffer */
+void add_token_spelling(token_stream* tokens, int index){
+    unsigned int start = token_start(tokens, index);
+    add_spelling(tokens->text + start, token_end(tokens, index) - start);
+}
+
+/* Paste a token onto the end of the last token in a list (the ## operator) */
+void paste_token(macro_tokens* to, macro_tokens* from, int index){
+    token_stream* tokens = to->tokens;
+    int lhs = tokens->num - 1;
+
+    /* Lex the text of the two tokens together into the generated text */
+    preprocessor.spelling_length = 0;
+    add_token_spelling(tokens, lhs);
+    add_token_spelling(from->tokens, index);
+    int length = preprocessor.spelling_length;
+    unsigned int offset = add_generated_text(preprocessor.spelling, length);
+
+    token_stream* pasted = preprocessor.pasted;
+    pasted->num = 0;
+    pasted->num_literals = 0;
+    int i = 0;
+    while(i < length)
+        i = lex_step(pasted, offset, i, length);
+    if(pasted->num != 1 || pasted->types[0] == TOKEN_DIRECTIVE)
+        error_at(tokens->offsets[lhs], "Pasting does not give a valid token");
+
+    /* The pasted token keeps the hide-set of the left one */
+    macro_tokens result = {pasted, NULL, 0};
+    unsigned int hideset = token_hideset(to, lhs);
+    tokens->num--;
+    copy_macro_tokens(to, &result, 0, 1, hideset);
+}
+
+/* Add a string token with the text of the tokens [first, last) of a list to
+ * another list (the # operator). offset is where the # is. */
+void stringize(macro_tokens* to, macro_tokens* from, int first, int last, unsigned int offset, unsigned int hideset){
+    token_stream* tokens = from->tokens;
+    preprocessor.spelling_length = 0;
+    add_spelling("\"", 1);
+    for(int i = first; i < last; i++){
+        /* Tokens which had space between them get one space */
+        if(i > first && token_start(tokens, i) > token_end(tokens, i - 1))
+            add_spelling(" ", 1);
+
+        if(tokens->types[i] != TOKEN_STRING && tokens->types[i] != TOKEN_CHARACTER){
+            add_token_spelling(tokens, i);
+            continue;
+        }
+
+        /* Quotes and backslashes in strings and characters are escaped */
+        char quote = tokens->types[i] == TOKEN_STRING ? '"' : '\'';
+        char* text = token_text(tokens, i);
+        add_spelling(quote == '"' ? "\\\"" : "'", quote == '"' ? 2 : 1);
+        for(int j = 0; j < tokens->lengths[i]; j++){
+            if(text[j] == '"' || text[j] == '\\')
+                add_spelling("\\", 1);
+            add_spelling(text + j, 1);
+        }
+        add_spelling(quote == '"' ? "\\\"" : "'", quote == '"' ? 2 : 1);
+    }
+    add_spelling("\"", 1);
+
+    unsigned int start = add_generated_text(preprocessor.spelling, preprocessor.spelling_length);
+    add_macro_token(to, TOKEN_STRING, start + 1, preprocessor.spelling_length - 2, 0, hideset);
+}
+
+/*** Macro expansion ***/
+
+void expand(token_reader* reader, macro_tokens* out);
+
+/* Get the bounds of the expansion of an argument, expanding it the first time
+ * it's needed. args is where the call's bounds start. */
+void expand_argument(int args, int param, int* first, int* last){
+    int bound = args + 4 * param;
+    if(preprocessor.bounds[bound + 2] < 0){
+        macro_tokens* work = &preprocessor.work;
+        token_reader reader;
+        memset(&reader, 0, sizeof(token_reader));
+        reader.source = work;
+        reader.index = preprocessor.bounds[bound];
+        reader.last = preprocessor.bounds[bound + 1];
+        reader.bottom = preprocessor.pending.tokens->num;
+
+        /* The bounds may move while the argument is expanded */
+        int expanded = work->tokens->num;
+        expand(&reader, work);
+        preprocessor.bounds[bound + 2] = expanded;
+        preprocessor.bounds[bound + 3] = work->tokens->num;
+    }
+    *first = preprocessor.bounds[bound + 2];
+    *last = preprocessor.bounds[bound + 3];
+}
+
+/* Push the body of a macro onto the pending tokens, with the arguments
+ * substituted for the parameters and hideset added to every token. args is
+ * where the call's bounds start, if it has any. */
+void substitute(macro* m, int args, unsigned int hideset){
+    macro_tokens* body = &preprocessor.bodies;
+    macro_tokens* pending = &preprocessor.pending;
+    macro_tokens* work = &preprocessor.work;
+    token_stream* tokens = body->tokens;
+
+    /* Whether the left side of a ## is an empty argument */
+    int placemarker = 0;
+    int start = pending->tokens->num;
+    for(int i = m->first; i < m->last; i++){
+        int type = tokens->types[i];
+        int next = i + 1 < m->last ? tokens->types[i + 1] : 0;
+
+        /* # param: the text of the argument, as a string */
+        if(type == TOKEN_HASH && m->function_like){
+            int bound = args + 4 * tokens->data[i + 1];
+            stringize(pending, work, preprocessor.bounds[bound], preprocessor.bounds[bound + 1], tokens->offsets[i], hideset);
+            placemarker = 0;
+            i++;
+            continue;
+        }
+
+        /* ## token: paste the token onto the last one. An argument is pasted by its
+         * first token, and if either side is an empty argument there's nothing to paste. */
+        if(type == TOKEN_HASHHASH){
+            i++;
+            macro_tokens* from = body;
+            int first = i;
+            int last = i + 1;
+            if(tokens->types[i] == TOKEN_MACRO_PARAM){
+                int bound = args + 4 * tokens->data[i];
+                from = work;
+                first = preprocessor.bounds[bound];
+                last = preprocessor.bounds[bound + 1];
+            }
+            if(first < last && !placemarker)
+                paste_token(pending, from, first++);
+            copy_macro_tokens(pending, from, first, last, hideset);
+            placemarker = placemarker && first == last;
+            continue;
+        }
+
+        /* An argument: as it is next to ##, otherwise fully expanded */
+        if(type == TOKEN_MACRO_PARAM){
+            int first, last;
+            if(next == TOKEN_HASHHASH){
+                int bound = args + 4 * tokens->data[i];
+                first = preprocessor.bounds[bound];
+                last = preprocessor.bounds[bound + 1];
+            }
+            else
+                expand_argument(args, tokens->data[i], &first, &last);
+            copy_macro_tokens(pending, work, first, last, hideset);
+            placemarker = first == last;
+            continue;
+        }
+
+        copy_macro_tokens(pending, body, i, i + 1, hideset);
+        placemarker = 0;
+    }
+
+    /* The stack is read from the top, so the first token goes last */
+    reverse_macro_tokens(pending, start, pending->tokens->num);
+}
+
+/* Read the arguments of a call to a function-like macro, after its (, into
+ * the work list, and push their bounds onto the bounds stack. Stores the
+ * hide-set of the ) in close. Returns where the bounds start, or -1 if the
+ * tokens ran out before the ). offset is where the macro's name is. */
+int collect_arguments(token_reader* reader, macro* m, unsigned int offset, unsigned int* close){
+    macro_tokens* work = &preprocessor.work;
+    int args = preprocessor.num_bounds;
+    int num_args = 0;
+    int depth = 0;
+    int first = work->tokens->num;
+
+    macro_tokens* from;
+    int index;
+    while(1){
+        if(!next_token(reader, &from, &index))
+            return -1;
+
+        /* Commas at the top level separate arguments, except in the variable arguments */
+        int type = from->tokens->types[index];
+        int variable = m->variadic && num_args == m->num_params - 1;
+        if(depth == 0 && (type == TOKEN_CPAREN || (type == TOKEN_COMMA && !variable))){
+            push_bounds(first, work->tokens->num, -1, -1);
+            num_args++;
+            first = work->tokens->num;
+            if(type == TOKEN_CPAREN){
+                *close = token_hideset(from, index);
+                break;
+            }
+            continue;
+        }
+
+        if(type == TOKEN_OPAREN)
+            depth++;
+        else if(type == TOKEN_CPAREN)
+            depth--;
+        copy_macro_tokens(work, from, index, index + 1, 0);
+    }
+
+    /* f() passes no arguments to a macro with no parameters, and the
+     * variable arguments can be left out entirely */
+    if(m->num_params == 0 && num_args == 1 && preprocessor.bounds[args] == preprocessor.bounds[args + 1])
+        num_args = 0;
+    if(m->variadic && num_args == m->num_params - 1){
+        push_bounds(first, first, -1, -1);
+        num_args++;
+    }
+    if(num_args != m->num_params)
+        error_at(offset, "Wrong number of arguments to macro");
+    return args;
+}
+
+/* Fully expand the body of an object-like macro on its own into the expansion cache */
+void cache_expansion(macro* m){
+    macro_tokens* cache = &preprocessor.cache;
+    macro_tokens* pending = &preprocessor.pending;
+
+    /* Expansions cached under older definitions are no use any more */
+    if(preprocessor.cache_generation != preprocessor.generation){
+        cache->tokens->num = 0;
+        cache->tokens->num_literals = 0;
+        preprocessor.cache_generation = preprocessor.generation;
+    }
+    m->cache_generation = preprocessor.generation;
+
+    token_reader reader;
+    memset(&reader, 0, sizeof(token_reader));
+    reader.source = cache;
+    reader.bottom = pending->tokens->num;
+    reader.isolated = 1;
+    int work_base = preprocessor.work.tokens->num;
+    int bounds_base = preprocessor.num_bounds;
+
+    int first = cache->tokens->num;
+    substitute(m, 0, make_hideset(m->name, 0));
+    expand(&reader, cache);
+
+    /* If it ends in a call whose arguments aren't all there, the expansion
+     * depends on what comes after the macro, so it can't be cached */
+    if(reader.ran_out){
+        pending->tokens->num = reader.bottom;
+        preprocessor.work.tokens->num = work_base;
+        preprocessor.num_bounds = bounds_base;
+        cache->tokens->num = first;
+        m->cache_first = -1;
+        return;
+    }
+    m->cache_first = first;
+    m->cache_last = cache->tokens->num;
+
+    /* If it ends in the name of a function-like macro, the tokens after the
+     * macro may be its arguments, so that name is scanned again where it's used */
+    macro* tail = m->cache_last > first ? token_macro(cache->tokens, m->cache_last - 1) : NULL;
+    m->rescan = tail != NULL && tail->function_like && !hideset_contains(cache->hidesets[m->cache_last - 1], tail->name);
+}
+
+/* Expand every token from a reader onto the end of a list */
+void expand(token_reader* reader, macro_tokens* out){
+    macro_tokens* pending = &preprocessor.pending;
+    macro_tokens* work = &preprocessor.work;
+    macro_tokens* from;
+    int index;
+    while(1){
+        /* Copy source tokens which can't be macro calls straight to the output */
+        if(pending->tokens->num == reader->bottom){
+            int run = reader->index;
+            while(run < reader->last && token_macro(reader->source->tokens, run) == NULL)
+                run++;
+            copy_macro_tokens(out, reader->source, reader->index, run, 0);
+            reader->index = run;
+        }
+        if(!next_token(reader, &from, &index))
+            return;
+
+        /* Names of macros which this token came out of aren't expanded */
+        macro* m = token_macro(from->tokens, index);
+        unsigned int hideset = token_hideset(from, index);
+        if(m == NULL || hideset_contains(hideset, m->name)){
+            copy_macro_tokens(out, from, index, index + 1, 0);
+            continue;
+        }
+        unsigned int offset = from->tokens->offsets[index];
+
+        /* Object-like macros straight from the source use their cached expansion */
+        if(!m->function_like){
+            if(hideset == 0){
+                if(m->cache_generation != preprocessor.generation)
+                    cache_expansion(m);
+                if(m->cache_first >= 0){
+                    int last = m->cache_last - m->rescan;
+                    copy_macro_tokens(out, &preprocessor.cache, m->cache_first, last, 0);
+                    if(m->rescan)
+                        copy_macro_tokens(pending, &preprocessor.cache, last, last + 1, 0);
+                    continue;
+                }
+            }
+            substitute(m, 0, hideset_add(hideset, m->name));
+            continue;
+        }
+
+        /* The name of a function-like macro is only a call if ( comes next */
+        macro_tokens* next;
+        int next_index;
+        if(!next_token(reader, &next, &next_index)){
+            copy_macro_tokens(out, from, index, index + 1, 0);
+            return;
+        }
+        if(next->tokens->types[next_index] != TOKEN_OPAREN){
+            unread_token(reader);
+            copy_macro_tokens(out, from, index, index + 1, 0);
+            continue;
+        }
+
+        unsigned int close;
+        int work_base = work->tokens->num;
+        int args = collect_arguments(reader, m, offset, &close);
+        if(args < 0){
+            if(reader->isolated){
+                reader->ran_out = 1;
+                return;
+            }
+            error_at(offset, "Unterminated call to macro");
+        }
+        substitute(m, args, hideset_add(hideset_intersect(hideset, close), m->name));
+        work->tokens->num = work_base;
+        preprocessor.num_bounds = args;
+    }
+}
+
+/* Expand macros in the tokens [first, last) of a stream, adding the result to the output stream */
+void expand_tokens(token_stream* out, token_stream* tokens, int first, int last){
+    macro_tokens source = {tokens, NULL, 0};
+    macro_tokens output = {out, NULL, 0};
+    token_reader reader;
+    memset(&reader, 0, sizeof(token_reader));
+    reader.source = &source;
+    reader.index = first;
+    reader.last = last;
+    expand(&reader, &output);
+
+    /* Nothing is pending any more, so the literals of the tokens that were can go */
+    preprocessor.pending.tokens->num_literals = 0;
+    if(preprocessor.work.tokens->num == 0)
+        preprocessor.work.tokens->num_literals = 0;
+}
+
+/* Find which parameter a name is in the parameter list tokens [first, last) of a #define, or -1 */
+int find_parameter(token_stream* tokens, int first, int last, unsigned int name){
+    int param = 0;
+    for(int i = first; i < last; i++){
+        if(tokens->types[i] == TOKEN_IDENT && token_symbol(tokens, i) == name)
+            return param;
+        if(tokens->types[i] == TOKEN_COMMA)
+            param++;
+    }
+    return -1;
+}
+
+/* Carry out a #define made of tokens [index, last) */
+void define_macro(token_stream* tokens, int index, int last){
+    unsigned int name;
+    if(!is_directive(tokens, index, last, preprocessor.sym_define, &name))
+        error_at(tokens->offsets[index], "Expected macro name after #define");
+
+    macro m;
+    memset(&m, 0, sizeof(macro));
+    m.name = name;
+
+    /* It's function-like if a ( comes right after the name, with no space */
+    int i = index + 3;
+    int params_first = i + 1;
+    if(i < last && tokens->types[i] == TOKEN_OPAREN && tokens->offsets[i] == tokens->offsets[i - 1] + tokens->lengths[i - 1]){
+        m.function_like = 1;
+        i++;
+        if(i < last && tokens->types[i] == TOKEN_CPAREN)
+            i++;
+        else while(1){
+            /* ... is three dots */
+            if(i + 2 < last && tokens->types[i] == TOKEN_DOT && tokens->types[i + 1] == TOKEN_DOT && tokens->types[i + 2] == TOKEN_DOT){
+                m.variadic = 1;
+                i += 3;
+            }
+            else if(i < last && tokens->types[i] == TOKEN_IDENT)
+                i++;
+            else
+                error_at(tokens->offsets[i < last ? i : index], "Expected parameter name");
+            m.num_params++;
+
+            if(i < last && tokens->types[i] == TOKEN_COMMA && !m.variadic){
+                i++;
+                continue;
+            }
+            if(i < last && tokens->types[i] == TOKEN_CPAREN){
+                i++;
+                break;
+            }
+            error_at(tokens->offsets[i < last ? i : index], "Expected , or ) after macro parameter");
+        }
+    }
+    int params_last = i - 1;
+
+    /* Copy the body, turning uses of parameters into parameter tokens */
+    macro_tokens* body = &preprocessor.bodies;
+    macro_tokens source = {tokens, NULL, 0};
+    m.first = body->tokens->num;
+    copy_macro_tokens(body, &source, i, last, 0);
+    m.last = body->tokens->num;
+    for(int j = m.first; j < m.last && m.function_like; j++){
+        if(body->tokens->types[j] != TOKEN_IDENT)
+            continue;
+
+        unsigned int ident = body->tokens->data[j];
+        int param = m.variadic && ident == preprocessor.sym_va_args ? m.num_params - 1 : find_parameter(tokens, params_first, params_last, ident);
+        if(param >= 0){
+            body->tokens->types[j] = TOKEN_MACRO_PARAM;
+            body->tokens->data[j] = param;
+        }
+    }
+
+    /* ## needs something on both sides, and # needs a parameter after it */
+    token_stream* bt = body->tokens;
+    if(m.first < m.last && (bt->types[m.first] == TOKEN_HASHHASH || bt->types[m.last - 1] == TOKEN_HASHHASH))
+        error_at(tokens->offsets[index], "## cannot be at either end of a macro");
+    for(int j = m.first; j < m.last && m.function_like; j++)
+        if(bt->types[j] == TOKEN_HASH && (j + 1 == m.last || bt->types[j + 1] != TOKEN_MACRO_PARAM))
+            error_at(bt->offsets[j], "# must be followed by a macro parameter");
+
+    if(preprocessor.num_macros == preprocessor.allocated_macros){
+        preprocessor.allocated_macros *= 2;
+        preprocessor.macros = realloc(preprocessor.macros, preprocessor.allocated_macros * sizeof(macro));
+    }
+    preprocessor.macros[preprocessor.num_macros++] = m;
+    set_macro(name, preprocessor.num_macros);
+}
+
+/*** Conditionals ***/
+
+long long eval_expression(token_stream* tokens, int* index, int last, int min_precedence, int live);
+
+/* Evaluate a value in an #if expression: a number, a unary operator and its
+ * operand, or an expression in parentheses. Division by zero is only an
+ * error if live is set. */
+long long eval_value(token_stream* tokens, int* index, int last, int live){
+    if(*index >= last)
+        error_at(tokens->offsets[*index - 1], "Expected value in #if");
+
+    int type = tokens->types[*index];
+    unsigned int offset = tokens->offsets[(*index)++];
+    if(type == TOKEN_NUMBER || type == TOKEN_CHARACTER)
+        return (long long) token_value(tokens, *index - 1);
+
+    /* Names which are left after expansion aren't macros */
+    if(type == TOKEN_IDENT)
+        return 0;
+    if(type == TOKEN_MINUS)
+        return -eval_value(tokens, index, last, live);
+    if(type == TOKEN_PLUS)
+        return eval_value(tokens, index, last, live);
+    if(type == TOKEN_NOT)
+        return !eval_value(tokens, index, last, live);
+    if(type == TOKEN_OPAREN){
+        long long value = eval_expression(tokens, index, last, 1, live);
+        if(*index >= last || tokens->types[*index] != TOKEN_CPAREN)
+            error_at(offset, "Expected ) in #if");
+        (*index)++;
+        return value;
+    }
+    error_at(offset, "Unexpected token in #if");
+    return 0;
+}
+
+/* Get the precedence of the binary operator at index in an #if expression,
+ * or 0 if it's not one, and store how many tokens it is (!= is two) in length */
+int condition_operator(token_stream* tokens, int index, int last, int* length){
+    int type = tokens->types[index];
+    *length = 1;
+    if(type == TOKEN_OR)
+        return 1;
+    if(type == TOKEN_AND)
+        return 2;
+    if(type == TOKEN_EQUALS)
+        return 3;
+    if(type == TOKEN_NOT && index + 1 < last && tokens->types[index + 1] == TOKEN_ASSIGN){
+        *length = 2;
+        return 3;
+    }
+    if(type == TOKEN_LESS || type == TOKEN_GREATER || type == TOKEN_LESSEQ || type == TOKEN_GREATEREQ)
+        return 4;
+    if(type == TOKEN_PLUS || type == TOKEN_MINUS)
+        return 5;
+    if(type == TOKEN_TIMES || type == TOKEN_DIV)
+        return 6;
+    return 0;
+}
+
+/* Evaluate an #if expression by precedence climbing, stopping at operators below min_precedence */
+long long eval_expression(token_stream* tokens, int* index, int last, int min_precedence, int live){
+    long long left = eval_value(tokens, index, last, live);
+    int length;
+    int precedence;
+    while(*index < last && (precedence = condition_operator(tokens, *index, last, &length)) >= min_precedence && precedence > 0){
+        int type = tokens->types[*index];
+        unsigned int offset = tokens->offsets[*index];
+        *index += length;
+
+        /* The right side of && and || isn't evaluated if it can't matter */
+        int right_live = live && !(type == TOKEN_AND && !left) && !(type == TOKEN_OR && left);
+        long long right = eval_expression(tokens, index, last, precedence + 1, right_live);
+        if(type == TOKEN_OR)
+            left = left || right;
+        else if(type == TOKEN_AND)
+            left = left && right;
+        else if(type == TOKEN_EQUALS)
+            left = left == right;
+        else if(type == TOKEN_NOT)
+            left = left != right;
+        else if(type == TOKEN_LESS)
+            left = left < right;
+        else if(type == TOKEN_GREATER)
+            left = left > right;
+        else if(type == TOKEN_LESSEQ)
+            left = left <= right;
+        else if(type == TOKEN_GREATEREQ)
+            left = left >= right;
+        else if(type == TOKEN_PLUS)
+            left = left + right;
+        else if(type == TOKEN_MINUS)
+            left = left - right;
+        else if(type == TOKEN_TIMES)
+            left = left * right;
+        else if(right != 0)
+            left = left / right;
+        else if(live)
+            error_at(offset, "Division by zero in #if");
+    }
+    return left;
+}
+
+/* Evaluate the condition of the #if or #elif made of tokens [index, last) */
+int eval_condition(token_stream* tokens, int index, int last){
+    macro_tokens* work = &preprocessor.work;
+    macro_tokens source = {tokens, NULL, 0};
+    int base = work->tokens->num;
+
+    /* defined NAME and defined(NAME) become 1 or 0 first, so the names aren't expanded */
+    for(int i = index + 2; i < last; i++){
+        if(tokens->types[i] != TOKEN_IDENT || token_symbol(tokens, i) != preprocessor.sym_defined){
+            copy_macro_tokens(work, &source, i, i + 1, 0);
+            continue;
+        }
+
+        int paren = i + 1 < last && tokens->types[i + 1] == TOKEN_OPAREN;
+        int name = i + 1 + paren;
+        if(name >= last || tokens->types[name] != TOKEN_IDENT)
+            error_at(tokens->offsets[i], "Expected macro name after defined");
+        if(paren && (name + 1 >= last || tokens->types[name + 1] != TOKEN_CPAREN))
+            error_at(tokens->offsets[i], "Expected ) after defined(name");
+
+        unsigned int value = add_literal(work->tokens, is_defined(token_symbol(tokens, name)));
+        add_macro_token(work, TOKEN_NUMBER, tokens->offsets[i], tokens->lengths[i], value, 0);
+        i = name + paren;
+    }
+
+    /* Then macros are expanded, and what's left is evaluated */
+    int expanded = work->tokens->num;
+    token_reader reader;
+    memset(&reader, 0, sizeof(token_reader));
+    reader.source = work;
+    reader.index = base;
+    reader.last = expanded;
+    reader.bottom = preprocessor.pending.tokens->num;
+    expand(&reader, work);
+    if(work->tokens->num == expanded)
+        error_at(tokens->offsets[index], "Expected expression after #if");
+
+    int i = expanded;
+    long long value = eval_expression(work->tokens, &i, work->tokens->num, 1, 1);
+    if(i != work->tokens->num)
+        error_at(work->tokens->offsets[i], "Unexpected token in #if");
+
+    work->tokens->num = base;
+    if(base == 0)
+        work->tokens->num_literals = 0;
+    return value != 0;
+}
+
+/* Check whether the tokens of the current conditional branch are being dropped */
+int skipping(){
+    return preprocessor.num_conditions > 0 && preprocessor.conditions[preprocessor.num_conditions - 1].skipping;
+}
+
+/* Carry out the directive made of tokens [index, last) if it's a conditional.
+ * Returns 0 if it's some other directive. */
+int do_conditional(token_stream* tokens, int index, int last){
+    if(index + 1 >= last)
+        return 0;
+
+    int type = tokens->types[index + 1];
+    unsigned int name = type == TOKEN_IDENT ? token_symbol(tokens, index + 1) : 0;
+    unsigned int offset = tokens->offsets[index];
+
+    /* #if, #ifdef and #ifndef open a group. Inside a skipped group, the
+     * condition isn't even evaluated. */
+    if(type == TOKEN_IF || name == preprocessor.sym_ifdef || name == preprocessor.sym_ifndef){
+        int outer = skipping();
+        int value = 0;
+        if(!outer && type == TOKEN_IF)
+            value = eval_condition(tokens, index, last);
+        else if(!outer){
+            unsigned int macro_name;
+            if(!is_directive(tokens, index, last, name, &macro_name))
+                error_at(offset, "Expected macro name after #ifdef or #ifndef");
+            value = is_defined(macro_name) == (name == preprocessor.sym_ifdef);
+        }
+
+        if(preprocessor.num_conditions == preprocessor.allocated_conditions){
+            preprocessor.allocated_conditions *= 2;
+            preprocessor.conditions = realloc(preprocessor.conditions, preprocessor.allocated_conditions * sizeof(condition));
+        }
+        condition* c = &preprocessor.conditions[preprocessor.num_conditions++];
+        c->offset = offset;
+        c->skipping = outer || !value;
+        c->taken = outer || value;
+        c->seen_else = 0;
+        return 1;
+    }
+
+    if(type != TOKEN_ELSE && name != preprocessor.sym_elif && name != preprocessor.sym_endif)
+        return 0;
+    if(preprocessor.num_conditions == preprocessor.condition_base)
+        error_at(offset, "#elif, #else or #endif without #if");
+
+    condition* c = &preprocessor.conditions[preprocessor.num_conditions - 1];
+    if(name == preprocessor.sym_endif){
+        preprocessor.num_conditions--;
+        return 1;
+    }
+    if(c->seen_else)
+        error_at(offset, "#elif or #else after #else");
+
+    /* #else is taken if nothing was, and #elif if nothing was and its condition holds */
+    if(type == TOKEN_ELSE){
+        c->seen_else = 1;
+        c->skipping = c->taken;
+        c->taken = 1;
+    }
+    else if(c->taken)
+        c->skipping = 1;
+    else {
+        c->taken = eval_condition(tokens, index, last);
+        c->skipping = !c->taken;
+    }
+    return 1;
+}
+
+/*** Directives ***/
+
+void preprocess_tokens(token_stream* out, token_stream* tokens, char* dir, unsigned int dir_symbol, int depth);
+
+/* Carry out an #include directive made of tokens [index, last) */
+void do_include(token_stream* out, token_stream* tokens, int index, int last, char* dir, unsigned int dir_symbol, int depth){
+    /* The name is either a string, or all the text between < and > */
+    int name_index = index + 2;
+    if(name_index >= last)
+        error_at(tokens->offsets[index], "Expected header name after #include");
+
+    char* name;
+    int name_length;
+    if(tokens->types[name_index] == TOKEN_STRING){
+        name = token_text(tokens, name_index);
+        name_length = tokens->lengths[name_index];
+    }
+    else if(tokens->types[name_index] == TOKEN_LESS){
+        int close = name_index + 1;
+        while(close < last && tokens->types[close] != TOKEN_GREATER)
+            close++;
+        if(close == last)
+            error_at(tokens->offsets[name_index], "Expected > after header name");
+
+        name = tokens->text + tokens->offsets[name_index] + 1;
+        name_length = tokens->offsets[close] - tokens->offsets[name_index] - 1;
+        dir = NULL;
+    }
+    else
+        error_at(tokens->offsets[name_index], "Expected \"name\" or <name> after #include");
+
+    if(depth >= MAX_INCLUDE_DEPTH)
+        error_at(tokens->offsets[index], "Includes nested too deeply");
+
+    int found = find_header(name, name_length, dir, dir_symbol);
+    if(found < 0){
+        char message[256];
+        snprintf(message, sizeof(message), "Could not find header %.*s", name_length, name);
+        error_at(tokens->offsets[name_index], message);
+    }
+
+    /* Headers which have been included before may not need to be looked at again */
+    header* h = &preprocessor.headers[found];
+    if(h->times_included > 0 && (h->once || (h->guard != 0 && is_defined(h->guard))))
+        return;
+    h->times_included++;
+
+    preprocess_tokens(out, h->tokens, h->dir, h->dir_symbol, depth + 1);
+}
+
+/* Carry out the directive made of tokens [index, last) */
+void do_directive(token_stream* out, token_stream* tokens, int index, int last, char* dir, unsigned int dir_symbol, int depth){
+    /* A # on its own does nothing */
+    if(index + 1 >= last || tokens->types[index + 1] != TOKEN_IDENT)
+        return;
+
+    unsigned int name = token_symbol(tokens, index + 1);
+    unsigned int macro_name;
+    if(name == preprocessor.sym_include)
+        do_include(out, tokens, index, last, dir, dir_symbol, depth);
+    else if(name == preprocessor.sym_define)
+        define_macro(tokens, index, last);
+    else if(name == preprocessor.sym_undef){
+        if(!is_directive(tokens, index, last, name, &macro_name))
+            error_at(tokens->offsets[index], "Expected macro name after #undef");
+        set_macro(macro_name, 0);
+    }
+}
+
+/* Preprocess a token stream, adding the result to the output stream. dir is the
+ * directory of the file the tokens came from. */
+void preprocess_tokens(token_stream* out, token_stream* tokens, char* dir, unsigned int dir_symbol, int depth){
+    /* Conditionals can't be closed in a different file */
+    int outer_base = preprocessor.condition_base;
+    preprocessor.condition_base = preprocessor.num_conditions;
+
+    int index = 0;
+    while(index < tokens->num){
+        /* Expand everything up to the next directive in one go */
+        int run = index;
+        while(run < tokens->num && tokens->types[run] != TOKEN_DIRECTIVE)
+            run++;
+        if(!skipping())
+            expand_tokens(out, tokens, index, run);
+        if(run == tokens->num)
+            break;
+
+        int last = directive_last(tokens, run);
+        out->directives++;
+        if(!do_conditional(tokens, run, last) && !skipping())
+            do_directive(out, tokens, run, last, dir, dir_symbol, depth);
+        index = last;
+    }
+
+    if(preprocessor.num_conditions != preprocessor.condition_base)
+        error_at(preprocessor.conditions[preprocessor.num_conditions - 1].offset, "Unterminated conditional");
+    preprocessor.condition_base = outer_base;
+}
+
+/* Tokenize and preprocess a file from the source table, adding the result to the output stream */
+void preprocess_file(token_stream* out, int file){
+    out->files = realloc(out->files, (out->num_files + 1) * sizeof(int));
+    out->files[out->num_files++] = file;
+
+    token_stream* tokens = make_token_stream(source_table.base);
+    tokenize(tokens, source_table.files[file].offset, source_table.files[file].length);
+
+    char* dir = path_directory(source_table.files[file].name);
+    preprocess_tokens(out, tokens, dir, intern_string(dir), 0);
+    free(dir);
+    free_token_stream(tokens);
+}
@@ -0,0 +1,266 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file describes name resolution, which binds every use of a name in
+ * an expression to the declaration it refers to, so that passes after it
+ * don't have to look names up and follow scopes again.
+ *
+ * A variable lives at a depth and a slot: globals are at depth 0, and each
+ * has a slot of its own, in the order they are declared; the variables of
+ * a block are at the depth of the block, which is one more than the depth
+ * of the block it is in, and in slots numbered from 0 in each block, in
+ * the order they are declared. A branch of an if statement which isn't a
+ * block is a scope of its own too, as if it were in one. The binding of a
+ * name is the statement which declares it along with that depth and slot,
+ * and bindings are kept in a table indexed by expression. Function names,
+ * and names no declaration is in scope for, are bound to no declaration.
+ *
+ * Statements are resolved in order. The innermost declaration of each name
+ * in scope is kept in a table indexed by its interned name, so a name is
+ * looked up in constant time however deep the scopes are, and a
+ * declaration which shadows another saves the one it hid, to be put back
+ * when its scope ends, as the type table does with types.
+ *
+ * A shared expression can be used under different declarations of its
+ * names, so its names have different bindings in each use. Each expression
+ * records the generation of declarations it was last resolved under, which
+ * changes whenever a declaration comes into or goes out of scope, so using
+ * it again under the same declarations costs nothing. Under different ones,
+ * it is resolved again, and if a binding in it comes out different, that
+ * use gets a copy of it, built after its children like every expression,
+ * which the statement or parent using it is pointed at. Copies aren't put
+ * in the table of shared expressions. Afterwards, every use of an
+ * expression means the same thing, so any pass after this one can keep one
+ * result per expression. Unshared expressions have one use, so they are
+ * never copied.
+ */
+
+/* What a name refers to: the statement that declares it, 0 if none, and where the variable lives */
+typedef struct _binding {
+    unsigned int declaration;
+    unsigned int depth;
+    unsigned int slot;
+} binding;
+
+/* A declaration hidden by a newer one with the same name, put back when the newer one goes out of scope */
+typedef struct _hidden_binding {
+    unsigned int name;
+    binding hidden;
+} hidden_binding;
+
+/* Global name resolution state */
+struct {
+    /* Binding of the name in each expression, and whether it has been worked out */
+    binding* bindings;
+    unsigned char* bound;
+
+    /* For each expression, the generation of declarations it was last
+     * resolved under, 0 if none, and the expression its uses under that
+     * generation are to use: itself, or a copy of it */
+    unsigned int* generations;
+    unsigned int* uses;
+    unsigned int allocated;
+
+    /* Where the variable of each declaration statement lives */
+    binding* declarations;
+    unsigned int num_globals;
+
+    /* Innermost declaration of each name in scope, indexed by name */
+    binding* visible;
+
+    /* Declarations hidden by the ones in scope, innermost last */
+    hidden_binding* hidden;
+    unsigned int num_hidden;
+    unsigned int allocated_hidden;
+
+    unsigned int generation;
+} resolver;
+
+/* Make room for the bindings of num expressions */
+void reserve_bindings(unsigned int num){
+    if(num <= resolver.allocated)
+        return;
+
+    unsigned int old = resolver.allocated;
+    resolver.allocated = grow_capacity(old, num);
+    resolver.bindings = realloc(resolver.bindings, resolver.allocated * sizeof(binding));
+    resolver.bound = realloc(resolver.bound, resolver.allocated);
+    resolver.generations = realloc(resolver.generations, resolver.allocated * sizeof(unsigned int));
+    resolver.uses = realloc(resolver.uses, resolver.allocated * sizeof(unsigned int));
+
+    unsigned int added = resolver.allocated - old;
+    memset(resolver.bound + old, 0, added);
+    memset(resolver.generations + old, 0, added * sizeof(unsigned int));
+}
+
+/* Release everything name resolution keeps, including the bindings */
+void del_resolver(){
+    free(resolver.bindings);
+    free(resolver.bound);
+    free(resolver.generations);
+    free(resolver.uses);
+    free(resolver.declarations);
+    free(resolver.visible);
+    free(resolver.hidden);
+    memset(&resolver, 0, sizeof(resolver));
+}
+
+/* Get what the name in an expression refers to, once the program has been resolved */
+binding binding_of(unsigned int index){
+    return resolver.bindings[index];
+}
+
+/* Get where the variable a declaration statement declares lives */
+binding declaration_binding(unsigned int st){
+    return resolver.declarations[st];
+}
+
+/* Check whether two bindings are of the same variable */
+int same_binding(binding a, binding b){
+    return a.declaration == b.declaration;
+}
+
+/* Declare the variable of a declaration statement in the innermost scope,
+ * at a depth, taking the next slot from a scope's count of slots */
+void bind_declaration(unsigned int st, unsigned int depth, unsigned int* slots){
+    binding b;
+    b.declaration = st;
+    b.depth = depth;
+    b.slot = (*slots)++;
+    resolver.declarations[st] = b;
+
+    unsigned int name = statement_at(st)->ident;
+    if(resolver.num_hidden == resolver.allocated_hidden){
+        resolver.allocated_hidden = grow_capacity(resolver.allocated_hidden, resolver.num_hidden + 1);
+        resolver.hidden = realloc(resolver.hidden, resolver.allocated_hidden * sizeof(hidden_binding));
+    }
+    resolver.hidden[resolver.num_hidden].name = name;
+    resolver.hidden[resolver.num_hidden].hidden = resolver.visible[name];
+    resolver.num_hidden++;
+
+    resolver.visible[name] = b;
+    resolver.generation++;
+}
+
+/* End a scope, putting back the declarations hidden since mark, the number hidden when it began */
+void close_binding_scope(unsigned int mark){
+    if(resolver.num_hidden == mark)
+        return;
+    while(resolver.num_hidden > mark){
+        resolver.num_hidden--;
+        hidden_binding* h = &resolver.hidden[resolver.num_hidden];
+        resolver.visible[h->name] = h->hidden;
+    }
+    resolver.generation++;
+}
+
+/* Copy an expression with other children, for a use whose bindings
+ * differ. The copy isn't shared, so its children are the ones given. */
+unsigned int copy_expression(unsigned int index, unsigned int* children){
+    unsigned int copy = create_expression(0, 0);
+    expression_pool.nodes[copy] = expression_pool.nodes[index];
+    for(int i = 0; i < expression_pool.nodes[copy].num_children; i++)
+        expression_pool.nodes[copy].children[i] = children[i];
+    hash_expression(copy);
+    reserve_bindings(expression_pool.num);
+    return copy;
+}
+
+/* Resolve the names in an expression under the declarations in scope,
+ * returning the expression this use of it is to use, which is itself
+ * unless it had to be copied */
+unsigned int resolve_expression(unsigned int index){
+    if(index == 0)
+        return 0;
+    if(resolver.generations[index] == resolver.generation)
+        return resolver.uses[index];
+
+    /* Resolve the children first. Function calls are never shared, so they
+     * only have to be rebuilt when an argument was copied. */
+    unsigned int children[2] = {0, 0};
+    int changed = 0;
+    int num_children = expression_num_children(index);
+    int t = expression_pool.nodes[index].expression_type;
+    for(int i = 0; i < num_children; i++){
+        unsigned int child = expression_child(index, i);
+        unsigned int use = resolve_expression(child);
+        changed = changed || use != child;
+        if(t == EXPRESSION_FUNCALL)
+            push_pending_arg(use);
+        else
+            children[i] = use;
+    }
+
+    binding b = {0, 0, 0};
+    if(t == EXPRESSION_IDENT || t == EXPRESSION_ARRAY_ACCESS || t == EXPRESSION_FUNCALL)
+        b = resolver.visible[expression_pool.nodes[index].name];
+
+    unsigned int use = index;
+    if(t == EXPRESSION_FUNCALL && changed){
+        use = create_funcall_expr(expression_pool.nodes[index].name, num_children);
+        reserve_bindings(expression_pool.num);
+    }
+    else if(t == EXPRESSION_FUNCALL)
+        expression_pool.pending.num -= num_children;
+    else if(changed || (resolver.bound[index] && !same_binding(resolver.bindings[index], b)))
+        use = copy_expression(index, children);
+
+    resolver.bindings[use] = b;
+    resolver.bound[use] = 1;
+    resolver.generations[use] = resolver.generation;
+    resolver.uses[use] = use;
+    resolver.generations[index] = resolver.generation;
+    resolver.uses[index] = use;
+    return use;
+}
+
+/* Resolve a statement at a depth, in a scope whose count of slots is slots */
+void resolve_statement(unsigned int index, unsigned int depth, unsigned int* slots){
+    if(index == 0)
+        return;
+    statement* st = statement_at(index);
+    int t = st->statement_type;
+
+    /* A variable is in scope in its own initializer, as in C */
+    if(t == STATEMENT_ASSIGN){
+        bind_declaration(index, depth, slots);
+        st->expr = resolve_expression(st->expr);
+    }
+    else if(t == STATEMENT_EXPRESSION || t == STATEMENT_RETURN)
+        st->expr = resolve_expression(st->expr);
+    else if(t == STATEMENT_IF){
+        st->expr = resolve_expression(st->expr);
+        for(int i = 0; i < 2; i++){
+            if(st->children[i] != 0 && statement_at(st->children[i])->statement_type == STATEMENT_BLOCK){
+                resolve_statement(st->children[i], depth, slots);
+                continue;
+            }
+            unsigned int mark = resolver.num_hidden;
+            unsigned int branch_slots = 0;
+            resolve_statement(st->children[i], depth + 1, &branch_slots);
+            close_binding_scope(mark);
+        }
+    }
+    else if(t == STATEMENT_BLOCK){
+        unsigned int mark = resolver.num_hidden;
+        unsigned int block_slots = 0;
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            resolve_statement(statement_pool.blocks.vals[st->code_block.first + i], depth + 1, &block_slots);
+        close_binding_scope(mark);
+    }
+}
+
+/* Bind every name used in a program to its declaration, rewriting the uses
+ * of shared expressions whose bindings differ from use to use */
+void resolve_program(program* prog){
+    del_resolver();
+    reserve_bindings(expression_pool.num);
+    resolver.declarations = calloc(statement_pool.num, sizeof(binding));
+    resolver.visible = calloc(symbol_table.num + 1, sizeof(binding));
+    resolver.generation = 1;
+
+    for(int i = 0; i < prog->num; i++)
+        resolve_statement(prog->statements[i], 0, &resolver.num_globals);
+}
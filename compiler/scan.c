@@ -0,0 +1,292 @@
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* This file describes the scanning kernels used by the tokenizer. Most of
+ * the bytes in a source file are whitespace, comments, identifiers, or the
+ * insides of string literals, and the tokenizer hands those long runs to
+ * these kernels instead of walking them one byte at a time.
+ *
+ * The source manager also uses the newline kernel to find line starts.
+ *
+ * Each kernel has a scalar version, an SSE2 version, and an AVX2 version,
+ * which all return the same index. init_scanner() picks the best version
+ * the CPU supports, and the tokenizer calls through the scan_* pointers.
+ * --scalar-scan, in the compiler and the benchmarks, picks the scalar
+ * versions instead, and the benchmarks' --check-scan checks that both give
+ * the same tokens.
+ *
+ * Every kernel takes the text, the index to start at, and the length of the
+ * text, and returns the index of the first byte that ends the run (or len).
+ * The vector versions only ever load whole aligned blocks, so they may read
+ * a few bytes before index or after len, but never outside the memory page
+ * holding the text; bytes outside [index, len) are masked off.
+ */
+
+/* Scalar kernels */
+
+/* Skip whitespace: space, \t, \n, \v, \f, \r and the zero bytes between files */
+int scan_whitespace_scalar(char* text, int index, int len){
+    while(index < len){
+        unsigned char c = text[index];
+        if(c != ' ' && c != '\0' && (c < '\t' || c > '\r'))
+            break;
+        index++;
+    }
+    return index;
+}
+
+/* Find the end of a run of identifier characters a-zA-Z0-9_ */
+int scan_ident_scalar(char* text, int index, int len){
+    while(index < len){
+        unsigned char c = text[index];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+            break;
+        index++;
+    }
+    return index;
+}
+
+/* Find the next quote or backslash inside a string literal */
+int scan_string_scalar(char* text, int index, int len){
+    while(index < len && text[index] != '"' && text[index] != '\\')
+        index++;
+    return index;
+}
+
+/* Find the next newline */
+int scan_newline_scalar(char* text, int index, int len){
+    while(index < len && text[index] != '\n')
+        index++;
+    return index;
+}
+
+/* Find the end of a comment, returning the index just past the closing * / */
+int scan_comment_end_scalar(char* text, int index, int len){
+    while(index + 1 < len && !(text[index] == '*' && text[index + 1] == '/'))
+        index++;
+    return index + 1 < len ? index + 2 : len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Kinds of runs for the generic vector search loops */
+int SCAN_WHITESPACE = 0;
+int SCAN_IDENT = 1;
+int SCAN_STRING = 2;
+int SCAN_NEWLINE = 3;
+
+/* SSE2 kernels */
+
+/* Return a mask of the bytes of x which lie in [lo, hi] */
+static inline __m128i sse2_in_range(__m128i x, char lo, char hi){
+    __m128i clamped = _mm_min_epu8(_mm_max_epu8(x, _mm_set1_epi8(lo)), _mm_set1_epi8(hi));
+    return _mm_cmpeq_epi8(clamped, x);
+}
+
+/* Return a bit mask of the bytes in a block which end a run of the given kind */
+static inline unsigned int sse2_run_end_mask(int kind, __m128i x){
+    __m128i in_run;
+    if(kind == SCAN_WHITESPACE)
+        in_run = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_setzero_si128())),
+                sse2_in_range(x, '\t', '\r'));
+    else if(kind == SCAN_IDENT)
+        in_run = _mm_or_si128(_mm_or_si128(sse2_in_range(x, 'a', 'z'), sse2_in_range(x, 'A', 'Z')),
+                _mm_or_si128(sse2_in_range(x, '0', '9'), _mm_cmpeq_epi8(x, _mm_set1_epi8('_'))));
+    else if(kind == SCAN_STRING)
+        return (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                    _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+    else
+        return (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+    return ~(unsigned int) _mm_movemask_epi8(in_run) & 0xFFFF;
+}
+
+/* Find the end of a run 16 bytes at a time */
+int sse2_find_run_end(int kind, char* text, int index, int len){
+    if(index >= len)
+        return len;
+
+    char* block = (char*) ((uintptr_t) (text + index) & ~(uintptr_t) 15);
+    unsigned int bits = sse2_run_end_mask(kind, _mm_load_si128((__m128i*) block)) & (~0u << (text + index - block));
+    while(bits == 0){
+        block += 16;
+        if(block - text >= len)
+            return len;
+        bits = sse2_run_end_mask(kind, _mm_load_si128((__m128i*) block));
+    }
+
+    int found = (int) (block - text) + __builtin_ctz(bits);
+    return found < len ? found : len;
+}
+
+int scan_whitespace_sse2(char* text, int index, int len){
+    return sse2_find_run_end(SCAN_WHITESPACE, text, index, len);
+}
+
+int scan_ident_sse2(char* text, int index, int len){
+    return sse2_find_run_end(SCAN_IDENT, text, index, len);
+}
+
+int scan_string_sse2(char* text, int index, int len){
+    return sse2_find_run_end(SCAN_STRING, text, index, len);
+}
+
+int scan_newline_sse2(char* text, int index, int len){
+    return sse2_find_run_end(SCAN_NEWLINE, text, index, len);
+}
+
+/* Find the end of a comment by looking for a / whose previous byte is a *.
+ * The top star bit of each block is carried into the next one. */
+int scan_comment_end_sse2(char* text, int index, int len){
+    if(index >= len)
+        return len;
+
+    char* block = (char*) ((uintptr_t) (text + index) & ~(uintptr_t) 15);
+    unsigned int valid = ~0u << (text + index - block);
+    unsigned int carry = 0;
+    while(1){
+        __m128i x = _mm_load_si128((__m128i*) block);
+        unsigned int stars = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('*'))) & valid;
+        unsigned int slashes = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('/'))) & valid;
+        unsigned int ends = slashes & ((stars << 1) | carry);
+        if(ends != 0){
+            int found = (int) (block - text) + __builtin_ctz(ends) + 1;
+            return found <= len ? found : len;
+        }
+
+        carry = (stars >> 15) & 1;
+        valid = ~0u;
+        block += 16;
+        if(block - text >= len)
+            return len;
+    }
+}
+
+/* AVX2 kernels, identical to the SSE2 ones but 32 bytes at a time */
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_in_range(__m256i x, char lo, char hi){
+    __m256i clamped = _mm256_min_epu8(_mm256_max_epu8(x, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi));
+    return _mm256_cmpeq_epi8(clamped, x);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int avx2_run_end_mask(int kind, __m256i x){
+    __m256i in_run;
+    if(kind == SCAN_WHITESPACE)
+        in_run = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(x, _mm256_setzero_si256())),
+                avx2_in_range(x, '\t', '\r'));
+    else if(kind == SCAN_IDENT)
+        in_run = _mm256_or_si256(_mm256_or_si256(avx2_in_range(x, 'a', 'z'), avx2_in_range(x, 'A', 'Z')),
+                _mm256_or_si256(avx2_in_range(x, '0', '9'), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'))));
+    else if(kind == SCAN_STRING)
+        return (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))));
+    else
+        return (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+    return ~(unsigned int) _mm256_movemask_epi8(in_run);
+}
+
+__attribute__((target("avx2")))
+int avx2_find_run_end(int kind, char* text, int index, int len){
+    if(index >= len)
+        return len;
+
+    char* block = (char*) ((uintptr_t) (text + index) & ~(uintptr_t) 31);
+    unsigned int bits = avx2_run_end_mask(kind, _mm256_load_si256((__m256i*) block)) & (~0u << (text + index - block));
+    while(bits == 0){
+        block += 32;
+        if(block - text >= len)
+            return len;
+        bits = avx2_run_end_mask(kind, _mm256_load_si256((__m256i*) block));
+    }
+
+    int found = (int) (block - text) + __builtin_ctz(bits);
+    return found < len ? found : len;
+}
+
+__attribute__((target("avx2")))
+int scan_whitespace_avx2(char* text, int index, int len){
+    return avx2_find_run_end(SCAN_WHITESPACE, text, index, len);
+}
+
+__attribute__((target("avx2")))
+int scan_ident_avx2(char* text, int index, int len){
+    return avx2_find_run_end(SCAN_IDENT, text, index, len);
+}
+
+__attribute__((target("avx2")))
+int scan_string_avx2(char* text, int index, int len){
+    return avx2_find_run_end(SCAN_STRING, text, index, len);
+}
+
+__attribute__((target("avx2")))
+int scan_newline_avx2(char* text, int index, int len){
+    return avx2_find_run_end(SCAN_NEWLINE, text, index, len);
+}
+
+__attribute__((target("avx2")))
+int scan_comment_end_avx2(char* text, int index, int len){
+    if(index >= len)
+        return len;
+
+    char* block = (char*) ((uintptr_t) (text + index) & ~(uintptr_t) 31);
+    unsigned int valid = ~0u << (text + index - block);
+    unsigned int carry = 0;
+    while(1){
+        __m256i x = _mm256_load_si256((__m256i*) block);
+        unsigned int stars = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('*'))) & valid;
+        unsigned int slashes = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/'))) & valid;
+        unsigned int ends = slashes & ((stars << 1) | carry);
+        if(ends != 0){
+            int found = (int) (block - text) + __builtin_ctz(ends) + 1;
+            return found <= len ? found : len;
+        }
+
+        carry = stars >> 31;
+        valid = ~0u;
+        block += 32;
+        if(block - text >= len)
+            return len;
+    }
+}
+
+#endif
+
+/* The kernels used by the tokenizer, chosen by init_scanner() */
+int (*scan_whitespace)(char*, int, int) = scan_whitespace_scalar;
+int (*scan_ident)(char*, int, int) = scan_ident_scalar;
+int (*scan_string)(char*, int, int) = scan_string_scalar;
+int (*scan_comment_end)(char*, int, int) = scan_comment_end_scalar;
+int (*scan_newline)(char*, int, int) = scan_newline_scalar;
+
+/* Pick the fastest kernels this CPU supports. If use_vector is 0, always
+ * use the scalar kernels. */
+void init_scanner(int use_vector){
+    scan_whitespace = scan_whitespace_scalar;
+    scan_ident = scan_ident_scalar;
+    scan_string = scan_string_scalar;
+    scan_comment_end = scan_comment_end_scalar;
+    scan_newline = scan_newline_scalar;
+    if(!use_vector)
+        return;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        scan_whitespace = scan_whitespace_avx2;
+        scan_ident = scan_ident_avx2;
+        scan_string = scan_string_avx2;
+        scan_comment_end = scan_comment_end_avx2;
+        scan_newline = scan_newline_avx2;
+    }
+    else if(__builtin_cpu_supports("sse2")){
+        scan_whitespace = scan_whitespace_sse2;
+        scan_ident = scan_ident_sse2;
+        scan_string = scan_string_sse2;
+        scan_comment_end = scan_comment_end_sse2;
+        scan_newline = scan_newline_sse2;
+    }
+#endif
+}
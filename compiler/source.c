@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* This file describes the source manager. The source manager maps every
+ * input file read-only into one reserved range of address space, so that
+ * all the source text lives in a single buffer without ever being copied.
+ *
+ * Each file gets its own page-aligned slot in the range, and every slot
+ * ends with at least one zero byte, so the text of a file is always
+ * followed by a terminator. A byte's position in the buffer is its global
+ * offset, and the table of file boundaries lets us map any global offset
+ * back to the file (and local offset) it came from, for diagnostics.
+ *
+ * The gaps between files are zero bytes. Anything scanning the whole
+ * buffer should treat them like whitespace.
+ *
+ * Tokens only remember their offset. Line and column numbers are worked out
+ * only when a diagnostic needs them: the first time a position in a file is
+ * asked for, the file is scanned for newlines once to build a table of line
+ * starts, and every lookup after that is a binary search in the table.
+ */
+
+/* Amount of address space reserved for source text. Offsets are 32-bit, so
+ * this is also the largest amount of source we can handle. Reserving costs
+ * nothing until pages are actually mapped. */
+#define SOURCE_RESERVE 0xFFFFF000UL
+
+/* Size of the slots that text made up by the compiler is packed into */
+#define GENERATED_SLOT 65536
+
+/* A single file mapped into the source buffer. The capacity is the size of
+ * its slot, which bounds how far the file can grow when edited in place. The
+ * line table is built lazily; line_starts is NULL until then. */
+typedef struct _source_file {
+    char* name;
+    unsigned int offset;
+    unsigned int length;
+    unsigned int capacity;
+
+    int num_lines;
+    unsigned int* line_starts;
+} source_file;
+
+/* Global source table, stores the source buffer and the list of mapped files */
+struct {
+    char* base;
+    unsigned int used;
+    unsigned int page_size;
+
+    int num;
+    int allocated;
+    source_file* files;
+
+    /* Entry that generated text is being added to, or -1 */
+    int generated;
+} source_table;
+
+/* Reserve address space for the source buffer */
+void init_source_manager(){
+    source_table.page_size = (unsigned int) sysconf(_SC_PAGESIZE);
+    source_table.base = mmap(NULL, SOURCE_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(source_table.base == MAP_FAILED)
+        error("Could not reserve space for source text");
+
+    source_table.used = 0;
+    source_table.num = 0;
+    source_table.allocated = 16;
+    source_table.files = calloc(source_table.allocated, sizeof(source_file));
+    source_table.generated = -1;
+}
+
+/* Unmap all source files and release the source table */
+void del_source_manager(){
+    munmap(source_table.base, SOURCE_RESERVE);
+    for(int i = 0; i < source_table.num; i++){
+        free(source_table.files[i].name);
+        free(source_table.files[i].line_starts);
+    }
+    free(source_table.files);
+}
+
+/* Reserve a slot for length bytes of text plus a terminator, and map it as
+ * zero pages. Returns the global offset of the slot. */
+unsigned int alloc_source_slot(unsigned int length){
+    unsigned int page = source_table.page_size;
+    unsigned long start = source_table.used;
+    unsigned long end = (start + length + 1 + page - 1) / page * page;
+    if(end > SOURCE_RESERVE)
+        error("Too much source text");
+
+    /* Zero pages back the whole slot, including the terminator */
+    if(mmap(source_table.base + start, end - start, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        error("Could not map source slot");
+
+    source_table.used = (unsigned int) end;
+    return (unsigned int) start;
+}
+
+/* Add an entry to the table of file boundaries, returning its index. The
+ * entry must be for the slot which was allocated last. */
+int add_source_entry(char* name, unsigned int offset, unsigned int length){
+    if(source_table.num == source_table.allocated){
+        source_table.allocated *= 2;
+        source_table.files = realloc(source_table.files, source_table.allocated * sizeof(source_file));
+    }
+
+    source_file* file = &source_table.files[source_table.num];
+    file->name = strdup(name);
+    file->offset = offset;
+    file->length = length;
+    file->capacity = source_table.used - offset;
+    file->num_lines = 0;
+    file->line_starts = NULL;
+    return source_table.num++;
+}
+
+/* Map a file into the source buffer, returning its index in the source table */
+int add_source_file(char* fname){
+    /* Open the file and find its length */
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "%s: ", fname);
+        error("Could not open file");
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) < 0 || info.st_size >= SOURCE_RESERVE){
+        fprintf(stderr, "%s: ", fname);
+        error("Could not read file");
+    }
+    unsigned int length = (unsigned int) info.st_size;
+
+    /* Map the file over the start of its slot. The kernel zero fills the rest
+     * of the last page, and the zero pages of the slot cover the remainder. */
+    unsigned int offset = alloc_source_slot(length);
+    if(length > 0 && mmap(source_table.base + offset, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+        fprintf(stderr, "%s: ", fname);
+        error("Could not map file");
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+    return add_source_entry(fname, offset, length);
+}
+
+/* Copy len bytes of in-memory text into the source buffer as if it were a
+ * file with the given name, returning its index in the source table */
+int add_source_buffer(char* name, char* text, unsigned int length){
+    unsigned int offset = alloc_source_slot(length);
+    unsigned int slot_length = source_table.used - offset;
+
+    /* Make the slot writable just long enough to copy the text in */
+    mprotect(source_table.base + offset, slot_length, PROT_READ | PROT_WRITE);
+    memcpy(source_table.base + offset, text, length);
+    mprotect(source_table.base + offset, slot_length, PROT_READ);
+    return add_source_entry(name, offset, length);
+}
+
+/* Copy length bytes of text made up by the compiler, such as tokens the
+ * preprocessor pastes together, into the source buffer so tokens can refer
+ * to it like any other text. Returns its global offset. Generated text is
+ * packed into shared slots named "<generated>", which are left writable,
+ * and each piece is followed by a newline. */
+unsigned int add_generated_text(char* text, unsigned int length){
+    source_file* f = source_table.generated >= 0 ? &source_table.files[source_table.generated] : NULL;
+
+    /* Start a new slot if this doesn't fit, keeping room for the terminator */
+    if(f == NULL || f->length + length + 2 > f->capacity){
+        unsigned int size = length + 2 > GENERATED_SLOT ? length + 2 : GENERATED_SLOT;
+        unsigned int offset = alloc_source_slot(size);
+        mprotect(source_table.base + offset, source_table.used - offset, PROT_READ | PROT_WRITE);
+        source_table.generated = add_source_entry("<generated>", offset, 0);
+        f = &source_table.files[source_table.generated];
+    }
+
+    unsigned int offset = f->offset + f->length;
+    memcpy(source_table.base + offset, text, length);
+    source_table.base[offset + length] = '\n';
+    f->length += length + 1;
+
+    free(f->line_starts);
+    f->line_starts = NULL;
+    f->num_lines = 0;
+    return offset;
+}
+
+/* Replace old_length bytes at local offset start in a file with new_length
+ * bytes of text. If the edited file still fits in its slot (with its
+ * terminator), it is edited in place. Otherwise it is copied into a new slot,
+ * with room to grow, at the end of the buffer, and gets a new entry in the
+ * source table; the old entry is left behind so offsets stay sorted. Returns
+ * the index of the file's entry. */
+int edit_source_file(int file, unsigned int start, unsigned int old_length, char* text, unsigned int new_length){
+    source_file* f = &source_table.files[file];
+    unsigned int tail = f->length - start - old_length;
+    unsigned int length = f->length - old_length + new_length;
+
+    /* Line starts will be found again the next time they are needed */
+    free(f->line_starts);
+    f->line_starts = NULL;
+    f->num_lines = 0;
+
+    if(length < f->capacity){
+        char* slot = source_table.base + f->offset;
+
+        /* Only the pages from the start of the edit to the end of the text that
+         * moves are made writable */
+        unsigned int first_page = start / source_table.page_size * source_table.page_size;
+        unsigned int end = old_length == new_length ? start + new_length : (length > f->length ? length : f->length);
+        mprotect(slot + first_page, end - first_page, PROT_READ | PROT_WRITE);
+        if(old_length != new_length)
+            memmove(slot + start + new_length, slot + start + old_length, tail);
+        memcpy(slot + start, text, new_length);
+
+        /* Zero out what's left of the old text after a file shrinks */
+        if(length < f->length)
+            memset(slot + length, 0, f->length - length);
+        mprotect(slot + first_page, end - first_page, PROT_READ);
+        f->length = length;
+        return file;
+    }
+
+    unsigned int offset = alloc_source_slot(length * 2);
+    char* old_slot = source_table.base + f->offset;
+    char* slot = source_table.base + offset;
+    mprotect(slot, source_table.used - offset, PROT_READ | PROT_WRITE);
+    memcpy(slot, old_slot, start);
+    memcpy(slot + start, text, new_length);
+    memcpy(slot + start + new_length, old_slot + start + old_length, tail);
+    mprotect(slot, source_table.used - offset, PROT_READ);
+
+    /* add_source_entry may move the table, so copy the name first */
+    char* name = strdup(f->name);
+    int moved = add_source_entry(name, offset, length);
+    free(name);
+    return moved;
+}
+
+/* Get a zero-copy view of a file's text, storing its length in length */
+char* source_view(int file, int* length){
+    *length = source_table.files[file].length;
+    return source_table.base + source_table.files[file].offset;
+}
+
+/* Find the index of the file containing a global offset */
+int source_file_at(unsigned int offset){
+    /* Binary search for the last file starting at or before the offset */
+    int low = 0;
+    int high = source_table.num - 1;
+    while(low < high){
+        int mid = (low + high + 1) / 2;
+        if(source_table.files[mid].offset <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+/* Map a global offset to its file name, storing the offset within the file in local_offset */
+char* source_locate(unsigned int offset, unsigned int* local_offset){
+    source_file* file = &source_table.files[source_file_at(offset)];
+    *local_offset = offset - file->offset;
+    return file->name;
+}
+
+/* Build the table of line starts (as offsets within the file) for a file */
+void build_line_table(source_file* file){
+    char* text = source_table.base + file->offset;
+    int len = file->length;
+
+    int allocated = 64;
+    file->line_starts = malloc(allocated * sizeof(unsigned int));
+    file->line_starts[0] = 0;
+    file->num_lines = 1;
+
+    /* Jump from newline to newline */
+    int index = 0;
+    while((index = scan_newline(text, index, len)) < len){
+        index++;
+        if(file->num_lines == allocated){
+            allocated *= 2;
+            file->line_starts = realloc(file->line_starts, allocated * sizeof(unsigned int));
+        }
+        file->line_starts[file->num_lines++] = index;
+    }
+}
+
+/* Map a global offset to its file name, storing the 1-based line and column in line and column */
+char* source_position(unsigned int offset, int* line, int* column){
+    source_file* file = &source_table.files[source_file_at(offset)];
+    if(file->line_starts == NULL)
+        build_line_table(file);
+
+    /* Binary search for the last line starting at or before the offset */
+    unsigned int local_offset = offset - file->offset;
+    int low = 0;
+    int high = file->num_lines - 1;
+    while(low < high){
+        int mid = (low + high + 1) / 2;
+        if(file->line_starts[mid] <= local_offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    *line = low + 1;
+    *column = local_offset - file->line_starts[low] + 1;
+    return file->name;
+}
+
+/* Exit with an error at a position in the source */
+void error_at(unsigned int offset, char* message){
+    int line, column;
+    char* name = source_position(offset, &line, &column);
+    fprintf(stderr, "%s:%d:%d: ", name, line, column);
+    error(message);
+}
+
+/* Print a warning about the text at an offset in the source buffer, and carry on */
+void warning_at(unsigned int offset, char* message){
+    int line, column;
+    char* name = source_position(offset, &line, &column);
+    fprintf(stderr, "%s:%d:%d: warning: %s\n", name, line, column, message);
+}
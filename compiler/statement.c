@@ -2,24 +2,34 @@
  * function should return an array of statements. At the top-level, any
  * non-expression statement is valid. Inside blocks, any non-function
  * statement is valid. The type of the statement is stored in statement_type,
- * while other possibly needed data is stored in the other fields.
+ * while other possibly needed data is stored in the other fields. Only one
+ * of the fields in the union is used, depending on the type: declarations
+ * and typedefs have the name they declare, if statements have their
+ * branches as children, and blocks have a run of the block pool.
+ *
+ * Statements refer to each other by their index in the statement pool, and
+ * to expressions by their index in the expression pool. The type that a
+ * declaration or typedef declares is a pointer, which would make every
+ * node 24 bytes for the sake of two kinds of statement, so it is kept
+ * alongside the nodes in the pool instead, and every statement is 16 bytes.
  */
 typedef struct _function {
 } function;
 
+/* The statements of a block: the run [first, first + num_statements) of the block pool */
 typedef struct _block {
-    struct _statement** statements;
-    int num_statements;
+    unsigned int first;
+    unsigned int num_statements;
 } block;
 
 typedef struct _statement {
-    int statement_type;
-    type* var_type;
-    char* ident;
-    expression* expr;
-    function* func;
-    block* code_block;
-    struct _statement** children;
+    unsigned char statement_type;
+    unsigned int expr;
+    union {
+        unsigned int ident;
+        unsigned int children[2];
+        block code_block;
+    };
 } statement;
 
 /*** Statement types ***/
@@ -43,21 +53,124 @@ int STATEMENT_IF = 5;
 int STATEMENT_BLOCK = 6;
 
 
-/* Create a blank statement with a certain statement type */
-statement* create_statement(int t){
-    statement* st = calloc(1, sizeof(statement));
+/*
+ * Global statement pool. Like expressions, every statement lives in one
+ * array in the order they were built, children before their parents, and
+ * statement 0 is never used, so 0 can mean no statement. Pointers into the
+ * pool are only valid until the next statement is created. Each thread has
+ * its own statement pool, like its own expression pool.
+ */
+__thread struct {
+    statement* nodes;
+    unsigned int num;
+    unsigned int allocated;
+
+    /* The type each declaration or typedef declares, kept alongside the
+     * nodes, NULL for other statements */
+    type** types;
+
+    /* Where each statement starts, kept alongside the nodes: its first
+     * token, counted from the first token of the top-level statement it is
+     * in, so that it stays right when an edit moves the tokens. Errors
+     * found after parsing are reported there. */
+    unsigned int* starts;
+
+    /* While parsing: how many statements are being parsed inside each
+     * other, and the first token of the outermost one */
+    int depth;
+    int top_first_token;
+
+    /* The block pool: each block's statements are a run of it */
+    index_vector blocks;
+
+    /* Statements of the blocks still being parsed, as a stack */
+    index_vector pending;
+} statement_pool;
+
+/* Throw away every statement in the pool, keeping its memory */
+void reset_statement_pool(){
+    statement_pool.num = 1;
+    statement_pool.depth = 0;
+    statement_pool.blocks.num = 0;
+    statement_pool.pending.num = 0;
+}
+
+/* Set up an empty statement pool */
+void init_statement_pool(){
+    statement_pool.allocated = 256;
+    statement_pool.nodes = malloc(statement_pool.allocated * sizeof(statement));
+    statement_pool.types = malloc(statement_pool.allocated * sizeof(type*));
+    statement_pool.starts = malloc(statement_pool.allocated * sizeof(unsigned int));
+    statement_pool.types[0] = NULL;
+    statement_pool.starts[0] = 0;
+    init_index_vector(&statement_pool.blocks, 256);
+    init_index_vector(&statement_pool.pending, 64);
+    reset_statement_pool();
+}
+
+/* Release the statement pool */
+void del_statement_pool(){
+    free(statement_pool.nodes);
+    free(statement_pool.types);
+    free(statement_pool.starts);
+    free_index_vector(&statement_pool.blocks);
+    free_index_vector(&statement_pool.pending);
+}
+
+/* Make room for num statements and num_blocks block entries in the pool in all */
+void reserve_statement_pool(unsigned int num, unsigned int num_blocks){
+    if(num > statement_pool.allocated){
+        statement_pool.allocated = grow_capacity(statement_pool.allocated, num);
+        statement_pool.nodes = realloc(statement_pool.nodes, statement_pool.allocated * sizeof(statement));
+        statement_pool.types = realloc(statement_pool.types, statement_pool.allocated * sizeof(type*));
+        statement_pool.starts = realloc(statement_pool.starts, statement_pool.allocated * sizeof(unsigned int));
+    }
+    reserve_index_vector(&statement_pool.blocks, num_blocks);
+}
+
+/* Get a statement from its index. The pointer is valid until the next statement is created. */
+statement* statement_at(unsigned int index){
+    return &statement_pool.nodes[index];
+}
+
+/* Create a blank statement with a certain statement type, returning its index in the statement pool */
+unsigned int create_statement(int t){
+    if(statement_pool.num == statement_pool.allocated)
+        reserve_statement_pool(statement_pool.num + 1, 0);
+
+    unsigned int index = statement_pool.num++;
+    statement* st = &statement_pool.nodes[index];
+    memset(st, 0, sizeof(statement));
     st->statement_type = t;
-    return st;
+    statement_pool.types[index] = NULL;
+    statement_pool.starts[index] = 0;
+    return index;
+}
+
+/* Get the type a declaration or typedef statement declares */
+type* declared_statement_type(unsigned int index){
+    return statement_pool.types[index];
 }
 
-statement* parse_statement(token**, int*, int);
+/* Get the offset in the source of where a statement starts, given the
+ * first token of the top-level statement it is in */
+unsigned int statement_offset(token_stream* tokens, int top_first_token, unsigned int index){
+    return tokens->offsets[top_first_token + statement_pool.starts[index]];
+}
+
+unsigned int parse_statement(token_stream*, int*, int);
 
 /* Print a statement in some useful debugging form to stdout */
-void print_statement(statement* st){
+void print_statement(unsigned int index){
+    if(index == 0){
+        printf("\n");
+        return;
+    }
+    statement* st = statement_at(index);
     if(st->statement_type == STATEMENT_ASSIGN){
         printf("ASSIGN ");
-        print_type(st->var_type);
-        printf(" %s = ", st->ident);
+        print_type(declared_statement_type(index));
+        printf(" %s = ", symbol_name(st->ident));
         print_expression(st->expr);
     }
     else if(st->statement_type == STATEMENT_EXPRESSION){
@@ -66,175 +179,211 @@ void print_statement(statement* st){
     }
     if(st->statement_type == STATEMENT_TYPEDEF){
         printf("TYPEDEF ");
-        print_type(st->var_type);
-        printf(" TO %s", st->ident);
+        print_type(declared_statement_type(index));
+        printf(" TO %s", symbol_name(st->ident));
     }
     if(st->statement_type == STATEMENT_RETURN){
-        printf("RETURN ");
-        print_expression(st->expr);
+        printf("RETURN");
+        if(st->expr != 0){
+            printf(" ");
+            print_expression(st->expr);
+        }
     }
     if(st->statement_type == STATEMENT_IF){
         printf("IF ");
         print_expression(st->expr);
         printf(" THEN ");
         print_statement(st->children[0]);
-        if(st->children[1] != NULL){
+        if(st->children[1] != 0){
             printf("ELSE ");
             print_statement(st->children[1]);
         }
 
     }
+    if(st->statement_type == STATEMENT_BLOCK){
+        printf("BLOCK {\n");
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            print_statement(statement_pool.blocks.vals[st->code_block.first + i]);
+        printf("}");
+    }
     printf("\n");
 }
 
-/* Release memory used by a statement */
-void free_statement(statement* st){
-    if(st->var_type != NULL)
-        free_type(st->var_type);
-    if(st->expr != NULL)
-        free_expression(st->expr);
-    if(st->ident != NULL)
-        free(st->ident);
-    if(st->children != NULL){
-        int num_children = 0;
-        if(st->statement_type == STATEMENT_IF)
-            num_children = 2;
-
-        for(int i = 0; i < num_children; i++)
-            if(st->children[i] != NULL)
-                free_statement(st->children[i]);
-        free(st->children);
-    }
+unsigned int create_declaration_statement(type* type, unsigned int ident){
+    unsigned int st = create_statement(STATEMENT_ASSIGN);
+    statement_pool.types[st] = type;
+    statement_pool.nodes[st].ident = ident;
+    statement_pool.nodes[st].expr = zero_expression();
+    return st;
+}
+
+unsigned int create_return_statement(unsigned int val){
+    unsigned int st = create_statement(STATEMENT_RETURN);
+    statement_pool.nodes[st].expr = val;
+    return st;
+}
 
-    free(st);
+unsigned int create_if_statement(unsigned int cond, unsigned int then, unsigned int alternative){
+    unsigned int if_st = create_statement(STATEMENT_IF);
+    statement_pool.nodes[if_st].expr = cond;
+    statement_pool.nodes[if_st].children[0] = then;
+    statement_pool.nodes[if_st].children[1] = alternative;
+    return if_st;
 }
 
-statement* create_declaration_statement(type* type, char* ident){
-    statement* st = create_statement(STATEMENT_ASSIGN);
-    st->var_type = type;
-    st->ident = ident;
-    st->expr = zero_expression();
+unsigned int create_assign_statement(type* type, unsigned int ident, unsigned int expr){
+    unsigned int st = create_statement(STATEMENT_ASSIGN);
+    statement_pool.types[st] = type;
+    statement_pool.nodes[st].ident = ident;
+    statement_pool.nodes[st].expr = expr;
     return st;
 }
 
-statement* create_return_statement(expression* val){
-    statement* st = create_statement(STATEMENT_RETURN);
-    st->expr = val;
+unsigned int create_typedef_statement(type* type, unsigned int name){
+    unsigned int st = create_statement(STATEMENT_TYPEDEF);
+    statement_pool.types[st] = type;
+    statement_pool.nodes[st].ident = name;
     return st;
 }
 
-statement* create_if_statement(expression* cond, statement* then, statement* alternative){
-    statement* if_st = create_statement(STATEMENT_IF);
-    if_st->expr = cond;
-    if_st->children = calloc(2, sizeof(statement*));
-    if_st->children[0] = then;
-    if_st->children[1] = alternative;
-    return if_st;
+unsigned int create_function_statement(type* return_type, unsigned int ident, function* func){
+    return 0;
 }
 
-statement* create_assign_statement(type* type, char* ident, expression* expr){
-    statement* st = create_statement(STATEMENT_ASSIGN);
-    st->var_type = type;
-    st->ident = ident;
-    st->expr = expr;
-    return st;
+/* Push a statement of a block being parsed */
+void push_pending_statement(unsigned int st){
+    index_vector_push(&statement_pool.pending, st);
 }
 
-statement* create_typedef_statement(type* type, char* name){
-    statement* st = create_statement(STATEMENT_TYPEDEF);
-    st->var_type = type;
-    st->ident = name;
+/* Create a block statement, whose statements are the last count pending
+ * statements. They are moved into the block pool. */
+unsigned int create_block_statement(int count){
+    unsigned int first = index_vector_move_top(&statement_pool.blocks, &statement_pool.pending, count);
+
+    unsigned int st = create_statement(STATEMENT_BLOCK);
+    statement_pool.nodes[st].code_block.first = first;
+    statement_pool.nodes[st].code_block.num_statements = count;
     return st;
 }
 
-statement* create_function_statement(type* return_type, char* ident, function* func){
-    return NULL;
+/* Parse an expression which can't be empty, unlike the one of a return
+ * or of a statement which is only a semicolon */
+unsigned int parse_required_expression(token_stream* tokens, int* index, int len, int end_token){
+    unsigned int expr = parse_expression(tokens, index, len, end_token);
+    if(expr == 0)
+        error_at(tokens->offsets[*index], "Expected expression");
+    return expr;
 }
 
-statement* parse_block(token** tokens, int* index, int len){
-    inc_ptr(index, len);
-    queue* statement_list = make_queue();
+/* 
+ * Consume the semicolon at the end of a statement. Every statement parser
+ * leaves the index just past the end of its statement, so that statements
+ * can be parsed one after another.
+ */
+void end_statement(token_stream* tokens, int* index, int len, char* message){
+    if(*index >= len)
+        error_at_end(tokens, len, message);
+    if(tokens->types[*index] != TOKEN_SEMICOLON)
+        error_at(tokens->offsets[*index], message);
+    (*index)++;
+}
 
-    int count = 0;
-    while(tokens[*index]->type != TOKEN_CBRACE){
-        statement* next = parse_statement(tokens, index, len);
-        enqueue(statement_list, next);
-        count++;
-    }
+unsigned int parse_block(token_stream* tokens, int* index, int len){
+    inc_ptr(tokens, index, len);
+
+    /* Types declared in the block are only in scope until its end */
+    unsigned int scope = open_type_scope();
 
-    statement** statements = calloc(count, sizeof(statement*));
-    for(int i = 0; i < count; i++)
-        statements[i] = dequeue(statement_list);
+    /* Statements wait on the pending stack until the block is built, since
+     * blocks inside this one push their own above them */
+    int count = 0;
+    while(tokens->types[*index] != TOKEN_CBRACE){
+        /* Statements which parse to nothing, such as struct declarations, are left out */
+        unsigned int st = parse_statement(tokens, index, len);
+        if(st != 0){
+            push_pending_statement(st);
+            count++;
+        }
 
-    free_queue(statement_list);
+        if(*index >= len)
+            error_at_end(tokens, len, "Expected closing brace at end of block");
+    }
 
-    block* b = calloc(1, sizeof(block));
-    b->statements = statements;
-    b->num_statements = count;
+    /* Skip the closing brace */
+    (*index)++;
+    close_type_scope(scope);
 
-    statement* st = create_statement(STATEMENT_BLOCK);
-    st->code_block = b;
-    return st;
+    return create_block_statement(count);
 }
 
-function* parse_function(token** tokens, int* index, int len){
+/* Parse the rest of a function declaration, after its opening parenthesis.
+ * Only prototypes are accepted, and nothing uses what they declare yet, so
+ * the parameters are skipped up to the closing parenthesis. */
+function* parse_function(token_stream* tokens, int* index, int len){
+    int depth = 1;
+    while(depth > 0){
+        if(tokens->types[*index] == TOKEN_OPAREN)
+            depth++;
+        else if(tokens->types[*index] == TOKEN_CPAREN)
+            depth--;
+        inc_ptr(tokens, index, len);
+    }
+    end_statement(tokens, index, len, "Expected semicolon after function prototype");
     return NULL;
 }
 
 
-statement* parse_typedef(token** tokens, int* index, int len){
+unsigned int parse_typedef(token_stream* tokens, int* index, int len){
     /* Skip typedef token */
-    inc_ptr(index, len);
+    inc_ptr(tokens, index, len);
 
     type* aliased_type = parse_type(tokens, index, len);
 
-    int first_token_type = tokens[*index]->type;
+    int first_token_type = tokens->types[*index];
     if(first_token_type != TOKEN_IDENT)
-        error("Expected identifier for typedef");
+        error_at(tokens->offsets[*index], "Expected identifier for typedef");
     
-    char* alias = strdup(tokens[*index]->data);
-    type* named_type = create_type(aliased_type->size);
-    named_type->name = alias;
-    named_type->alias = aliased_type;
-    add_to_type_table(named_type);
+    unsigned int alias = token_symbol(tokens, *index);
+    inc_ptr(tokens, index, len);
+    end_statement(tokens, index, len, "Expected semicolon after typedef");
+
+    add_to_type_table(create_type_alias(alias, aliased_type));
 
     return create_typedef_statement(aliased_type, alias);
 }
 
-/* Parse any statement */
-statement* parse_statement(token** tokens, int* index, int len){
-    if(*index >= len) error("Unexpected end of token stream");
+/* Parse a statement of whichever kind it is, through parse_statement() */
+unsigned int parse_statement_kind(token_stream* tokens, int* index, int len){
+    if(*index >= len)
+        error_at_end(tokens, len, "Unexpected end of token stream");
 
-    int first_token_type = tokens[*index]->type;
+    int first_token_type = tokens->types[*index];
     /* Typedef */
     if(first_token_type == TOKEN_TYPEDEF)
         return parse_typedef(tokens, index, len);
     if(first_token_type == TOKEN_RETURN){
-        inc_ptr(index, len);
-        expression* val = parse_expression(tokens, index, len, TOKEN_SEMICOLON);
-
-        if(tokens[*index]->type != TOKEN_SEMICOLON)
-            error("Expected semicolon after return statement");
+        inc_ptr(tokens, index, len);
+        unsigned int val = parse_expression(tokens, index, len, TOKEN_SEMICOLON);
+        end_statement(tokens, index, len, "Expected semicolon after return statement");
         return create_return_statement(val);
     }
     if(first_token_type == TOKEN_IF){
-        inc_ptr(index, len);
-        if(tokens[*index]->type != TOKEN_OPAREN)
-            error("Expected opening parenthesis after if statement");
-        inc_ptr(index, len);
+        inc_ptr(tokens, index, len);
+        if(tokens->types[*index] != TOKEN_OPAREN)
+            error_at(tokens->offsets[*index], "Expected opening parenthesis after if statement");
+        inc_ptr(tokens, index, len);
 
-        expression* cond = parse_expression(tokens, index, len, TOKEN_CPAREN);
+        unsigned int cond = parse_required_expression(tokens, index, len, TOKEN_CPAREN);
 
-        if(tokens[*index]->type != TOKEN_CPAREN)
-            error("Expected closing parenthesis after if statement condition");
-        inc_ptr(index, len);
+        if(tokens->types[*index] != TOKEN_CPAREN)
+            error_at(tokens->offsets[*index], "Expected closing parenthesis after if statement condition");
+        inc_ptr(tokens, index, len);
 
-        statement* block = parse_statement(tokens, index, len);
-        statement* alternative = NULL;
-        inc_ptr(index, len);
+        unsigned int block = parse_statement(tokens, index, len);
+        unsigned int alternative = 0;
 
-        if(tokens[*index]->type == TOKEN_ELSE){
-            inc_ptr(index, len);
+        if(*index < len && tokens->types[*index] == TOKEN_ELSE){
+            inc_ptr(tokens, index, len);
 
             alternative = parse_statement(tokens, index, len);
         }
@@ -242,37 +391,63 @@ statement* parse_statement(token** tokens, int* index, int len){
         return create_if_statement(cond, block, alternative);
     }
     if(first_token_type == TOKEN_OBRACE){
-        statement* block = parse_block(tokens, index, len);
-        return block;
+        return parse_block(tokens, index, len);
     }
 
     /* Get type of declaration */
     type* type = parse_type(tokens, index, len);
     if(type == NULL){
-        statement* st = create_statement(STATEMENT_EXPRESSION);
-        st->expr = parse_expression(tokens, index, len, TOKEN_SEMICOLON);
+        unsigned int expr = parse_expression(tokens, index, len, TOKEN_SEMICOLON);
+        end_statement(tokens, index, len, "Expected semicolon after expression");
+        unsigned int st = create_statement(STATEMENT_EXPRESSION);
+        statement_pool.nodes[st].expr = expr;
         return st;
     }
 
+    /* A struct declared on its own only adds to the type table, so it parses to nothing */
+    if(type->struct_type && tokens->types[*index] == TOKEN_SEMICOLON){
+        end_statement(tokens, index, len, "Expected semicolon after struct declaration");
+        return 0;
+    }
+
     /* Get identifier for declaration */
-    int next_token_type = tokens[*index]->type;
+    int next_token_type = tokens->types[*index];
     if(next_token_type != TOKEN_IDENT)
-        error("Expected identifier");
-    char* ident = strdup(tokens[*index]->data);
+        error_at(tokens->offsets[*index], "Expected identifier");
+    unsigned int ident = token_symbol(tokens, *index);
 
-    inc_ptr(index, len);
+    inc_ptr(tokens, index, len);
 
-    next_token_type = tokens[*index]->type;
+    next_token_type = tokens->types[*index];
     if(next_token_type == TOKEN_SEMICOLON){
-        inc_ptr(index, len);
+        end_statement(tokens, index, len, "Expected semicolon after declaration");
         return create_declaration_statement(type, ident);
     }
     if(next_token_type == TOKEN_ASSIGN){
-        inc_ptr(index, len);
-        return create_assign_statement(type, ident, parse_expression(tokens, index, len, TOKEN_SEMICOLON));
+        inc_ptr(tokens, index, len);
+        unsigned int value = parse_required_expression(tokens, index, len, TOKEN_SEMICOLON);
+        end_statement(tokens, index, len, "Expected semicolon after declaration");
+        return create_assign_statement(type, ident, value);
     }
     if(next_token_type == TOKEN_OPAREN){
-        inc_ptr(index, len);
+        inc_ptr(tokens, index, len);
         return create_function_statement(type, ident, parse_function(tokens, index, len));
     }
+    error_at(tokens->offsets[*index], "Expected ; or = after declaration");
+    return 0;
+}
+
+/* Parse any statement, returning its index in the statement pool, and
+ * note where it starts */
+unsigned int parse_statement(token_stream* tokens, int* index, int len){
+    int first_token = *index;
+    if(statement_pool.depth++ == 0)
+        statement_pool.top_first_token = first_token;
+
+    unsigned int st = parse_statement_kind(tokens, index, len);
+
+    statement_pool.depth--;
+    if(st != 0)
+        statement_pool.starts[st] = first_token - statement_pool.top_first_token;
+    return st;
 }
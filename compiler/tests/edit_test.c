@@ -0,0 +1,390 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file is a test of incremental re-lexing and re-parsing. It is built
+ * by make test in place of compiler.c. It makes two files of random
+ * statements, then applies random edits to them: replacing, deleting and
+ * inserting statements, and changing digits and spaces inside one. After
+ * every edit, the text, the token stream and the program apply_edit() left
+ * are checked against tokenizing and parsing the edited files from scratch.
+ * Some names are used by more than one statement, as types by some and as
+ * variables by others, so that what a statement means can depend on a
+ * typedef before or after it. Before the random edits, one edit is made on
+ * purpose to use a name which a later statement declares as a type.
+ *
+ * Usage: edit_test [seed] [edits] [preprocess]. It prints one line and
+ * exits with 0 if every edit gave the same result as starting from scratch,
+ * and prints the first difference and exits with 1 otherwise. If preprocess
+ * is 1, the files start with a #define instead of a typedef and are
+ * preprocessed, which apply_edit() has to see and preprocess them again.
+ */
+
+/* Most statements a test file can have */
+int EDIT_TEST_MAX_STATEMENTS = 4000;
+
+/* Every file starts with one of these, so statements can use the type */
+char* EDIT_TEST_PRELUDE = "typedef int tyA;\n";
+char* EDIT_TEST_DIRECTIVE_PRELUDE = "#define tyA int\n";
+
+char* test_prelude;
+int test_preprocess = 0;
+
+/* The statements of a test file, one per line, and whether each has digits which can be edited */
+typedef struct _test_file {
+    char** lines;
+    int* has_digits;
+    int num;
+    int file;
+} test_file;
+
+test_file test_files[2];
+int test_names = 0;
+
+/* Make a random statement, with names no other statement has, except for
+ * the few names r0 to r3 which are declared as types and used as variables */
+char* random_statement(int* has_digits){
+    char text[256];
+    int n = ++test_names;
+    int kind = rand() % 13;
+    *has_digits = 1;
+    if(kind == 0)
+        sprintf(text, "int a%d = %d + %d * %d;", n, rand() % 90 + 1, rand() % 9 + 1, rand() % 99 + 1);
+    else if(kind == 1)
+        sprintf(text, "x%d + %d;", n, rand() % 999 + 1);
+    else if(kind == 2)
+        sprintf(text, "puts(\"s%d \\\" q\");", n);
+    else if(kind == 3)
+        sprintf(text, "/* note %d */", n);
+    else if(kind == 4)
+        sprintf(text, "if(%d) y%d; else z%d;", rand() % 9 + 1, n, n);
+    else if(kind == 5)
+        sprintf(text, "typedef int u%d;", n);
+    else if(kind == 6)
+        sprintf(text, "tyA v%d = %d;", n, rand() % 50 + 1);
+    else if(kind == 7)
+        sprintf(text, "return %d;", rand() % 77 + 1);
+    else if(kind == 8)
+        sprintf(text, "*p%d * %d - x;", n, rand() % 5 + 1);
+    else if(kind == 10)
+        sprintf(text, "typedef int r%d;", rand() % 4);
+    else if(kind == 11)
+        sprintf(text, "r%d * x%d;", rand() % 4, n);
+    else if(kind == 9){
+        /* Changing the digits of a struct's name could clash with another's */
+        sprintf(text, "struct s%d { int f; char* g; } w%d;", n, n);
+        *has_digits = 0;
+    }
+    else
+        sprintf(text, "char c%d = 'q';", n);
+    return strdup(text);
+}
+
+/* Get the offset in its file of the start of a line of a test file */
+unsigned int line_offset(test_file* f, int line){
+    unsigned int offset = strlen(test_prelude);
+    for(int i = 0; i < line; i++)
+        offset += strlen(f->lines[i]) + 1;
+    return offset;
+}
+
+/* Get the text of a test file, and its length */
+char* file_text(test_file* f, unsigned int* length){
+    *length = line_offset(f, f->num);
+    char* text = malloc(*length + 1);
+    strcpy(text, test_prelude);
+    char* end = text + strlen(test_prelude);
+    for(int i = 0; i < f->num; i++)
+        end += sprintf(end, "%s\n", f->lines[i]);
+    return text;
+}
+
+/* Put a line into a test file */
+void insert_line(test_file* f, int line, char* text, int has_digits){
+    memmove(f->lines + line + 1, f->lines + line, (f->num - line) * sizeof(char*));
+    memmove(f->has_digits + line + 1, f->has_digits + line, (f->num - line) * sizeof(int));
+    f->lines[line] = text;
+    f->has_digits[line] = has_digits;
+    f->num++;
+}
+
+/* Take a line out of a test file */
+void remove_line(test_file* f, int line){
+    free(f->lines[line]);
+    memmove(f->lines + line, f->lines + line + 1, (f->num - line - 1) * sizeof(char*));
+    memmove(f->has_digits + line, f->has_digits + line + 1, (f->num - line - 1) * sizeof(int));
+    f->num--;
+}
+
+/* Pick a random digit of a line, returning its position, or -1 if it has none */
+int random_digit(char* line){
+    int digits[64];
+    int num_digits = 0;
+    for(int i = 0; line[i] != '\0' && num_digits < 64; i++)
+        if(line[i] >= '0' && line[i] <= '9')
+            digits[num_digits++] = i;
+    return num_digits > 0 ? digits[rand() % num_digits] : -1;
+}
+
+/* Make a random edit to a test file, and describe it as the range of
+ * bytes it replaced and the text it replaced them with. Returns 0 if the
+ * edit picked can't be made to this file. */
+int random_edit(test_file* f, unsigned int* start, unsigned int* old_length, char* text){
+    int kind = rand() % 6;
+    int line = f->num > 0 ? rand() % f->num : 0;
+    text[0] = '\0';
+
+    /* Replace a statement */
+    if(kind == 0 && f->num > 0){
+        int has_digits;
+        char* statement = random_statement(&has_digits);
+        *start = line_offset(f, line);
+        *old_length = strlen(f->lines[line]);
+        strcpy(text, statement);
+        free(f->lines[line]);
+        f->lines[line] = statement;
+        f->has_digits[line] = has_digits;
+        return 1;
+    }
+
+    /* Delete a statement */
+    if(kind == 1 && f->num > 1){
+        *start = line_offset(f, line);
+        *old_length = strlen(f->lines[line]) + 1;
+        remove_line(f, line);
+        return 1;
+    }
+
+    /* Insert one statement, or sometimes several */
+    if(kind == 2 && f->num < EDIT_TEST_MAX_STATEMENTS - 20){
+        line = rand() % (f->num + 1);
+        *start = line_offset(f, line);
+        *old_length = 0;
+        int count = rand() % 3 == 0 ? 20 : 1;
+        for(int i = 0; i < count && strlen(text) < 200; i++){
+            int has_digits;
+            char* statement = random_statement(&has_digits);
+            strcat(text, statement);
+            strcat(text, "\n");
+            insert_line(f, line++, statement, has_digits);
+        }
+        return 1;
+    }
+
+    /* Change a digit, or put another after it */
+    if((kind == 3 || kind == 4) && f->num > 0 && f->has_digits[line] && strlen(f->lines[line]) < 200){
+        char* old = f->lines[line];
+        int digit = random_digit(old);
+        if(digit < 0)
+            return 0;
+        text[0] = '1' + rand() % 9;
+        text[1] = '\0';
+        int at = kind == 3 ? digit : digit + 1;
+        *start = line_offset(f, line) + at;
+        *old_length = kind == 3 ? 1 : 0;
+
+        char* new = malloc(strlen(old) + 2);
+        memcpy(new, old, at);
+        new[at] = text[0];
+        strcpy(new + at + 1, old + at + *old_length);
+        free(old);
+        f->lines[line] = new;
+        return 1;
+    }
+
+    /* Add a space or a comment to the end of a statement */
+    if(kind == 5 && f->num > 0 && strlen(f->lines[line]) < 200){
+        char* old = f->lines[line];
+        strcpy(text, rand() % 2 ? " /*c*/" : " ");
+        *start = line_offset(f, line) + strlen(old);
+        *old_length = 0;
+        char* new = malloc(strlen(old) + strlen(text) + 1);
+        strcpy(new, old);
+        strcat(new, text);
+        free(old);
+        f->lines[line] = new;
+        return 1;
+    }
+    return 0;
+}
+
+/* Print where a statement and every statement in it start */
+void print_statement_starts(token_stream* tokens, int first_token, unsigned int index){
+    if(index == 0)
+        return;
+    printf("%u ", statement_offset(tokens, first_token, index));
+    statement* st = statement_at(index);
+    if(st->statement_type == STATEMENT_IF){
+        print_statement_starts(tokens, first_token, st->children[0]);
+        print_statement_starts(tokens, first_token, st->children[1]);
+    }
+    else if(st->statement_type == STATEMENT_BLOCK){
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            print_statement_starts(tokens, first_token, statement_pool.blocks.vals[st->code_block.first + i]);
+    }
+}
+
+/* Print a program, and where each of its statements starts in a token
+ * stream, into a string */
+char* program_text(program* prog, token_stream* tokens){
+    char* text;
+    size_t size;
+    FILE* out = stdout;
+    stdout = open_memstream(&text, &size);
+    print_program(prog);
+    for(int i = 0; i < prog->num; i++)
+        print_statement_starts(tokens, prog->first_tokens[i], prog->statements[i]);
+    fclose(stdout);
+    stdout = out;
+    return text;
+}
+
+/* Tokenize, and preprocess if the test does, both test files from scratch */
+token_stream* tokenize_test_files(){
+    token_stream* tokens = make_token_stream(source_table.base);
+    if(test_preprocess)
+        restart_preprocessor();
+    for(int i = 0; i < 2; i++){
+        source_file* file = &source_table.files[test_files[i].file];
+        if(test_preprocess)
+            preprocess_file(tokens, test_files[i].file);
+        else
+            tokenize(tokens, file->offset, file->length);
+    }
+    return tokens;
+}
+
+/* Check that an edited token stream has the same tokens as one made from scratch */
+int same_tokens(token_stream* edited, token_stream* fresh){
+    if(edited->num != fresh->num){
+        printf("%d tokens after the edit, but %d from scratch\n", edited->num, fresh->num);
+        return 0;
+    }
+    for(int i = 0; i < fresh->num; i++){
+        int t = fresh->types[i];
+        int same = base_token_type(edited->types[i]) == t && edited->offsets[i] == fresh->offsets[i]
+            && edited->lengths[i] == fresh->lengths[i];
+        if(t == TOKEN_IDENT)
+            same = same && edited->data[i] == fresh->data[i];
+        if(t == TOKEN_NUMBER || t == TOKEN_CHARACTER)
+            same = same && token_value(edited, i) == token_value(fresh, i);
+        if(!same){
+            printf("token %d differs from scratch\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Check that an edited program prints the same as parsing the tokens from
+ * scratch, which is done with a type table of its own, and that its
+ * statements start in the same places */
+int same_program(program* edited, token_stream* fresh){
+    char* edited_text = program_text(edited, fresh);
+    __typeof__(type_table) saved = type_table;
+    init_type_table();
+    program* prog = parse_program(fresh);
+    char* fresh_text = program_text(prog, fresh);
+    free_program(prog);
+    del_type_table();
+    type_table = saved;
+
+    int same = strcmp(edited_text, fresh_text) == 0;
+    if(!same)
+        printf("program differs from scratch\nafter the edit:\n%s\nfrom scratch:\n%s\n", edited_text, fresh_text);
+    free(edited_text);
+    free(fresh_text);
+    return same;
+}
+
+/* Make an edit to a file of its own, after which a statement uses a name as
+ * a type that a later statement declares as a type. Statements before the
+ * typedef have to see the name as a variable, as they would from scratch. */
+int later_typedef_test(){
+    char* text = "int c = 1;\nc + 1;\ntypedef int b;\n";
+    int file = add_source_buffer("<later>", text, strlen(text));
+    token_stream* tokens = make_token_stream(source_table.base);
+    tokenize(tokens, source_table.files[file].offset, source_table.files[file].length);
+    program* prog = parse_program(tokens);
+
+    char* edit = "b * c";
+    apply_edit(tokens, prog, file, strlen("int c = 1;\n"), strlen("c + 1"), edit, strlen(edit));
+    int same = same_program(prog, tokens);
+    if(!same)
+        printf("a later typedef changed an edited statement\n");
+    free_program(prog);
+    free_token_stream(tokens);
+    return same;
+}
+
+int main(int argc, char** argv){
+    int seed = argc > 1 ? atoi(argv[1]) : 1;
+    int edits = argc > 2 ? atoi(argv[2]) : 400;
+    test_preprocess = argc > 3 && atoi(argv[3]) != 0;
+    test_prelude = test_preprocess ? EDIT_TEST_DIRECTIVE_PRELUDE : EDIT_TEST_PRELUDE;
+    srand(seed);
+    init_source_manager();
+    init_symbol_table();
+    init_tokenizer();
+    init_preprocessor();
+    init_parser();
+
+    if(!later_typedef_test())
+        return 1;
+    reset_parser();
+
+    /* Two files of 30 statements each */
+    for(int i = 0; i < 2; i++){
+        test_file* f = &test_files[i];
+        f->lines = malloc(EDIT_TEST_MAX_STATEMENTS * sizeof(char*));
+        f->has_digits = malloc(EDIT_TEST_MAX_STATEMENTS * sizeof(int));
+        for(int j = 0; j < 30; j++){
+            int has_digits;
+            char* statement = random_statement(&has_digits);
+            insert_line(f, j, statement, has_digits);
+        }
+        unsigned int length;
+        char* text = file_text(f, &length);
+        f->file = add_source_buffer(i == 0 ? "<a>" : "<b>", text, length);
+        free(text);
+    }
+    token_stream* tokens = tokenize_test_files();
+    program* prog = parse_program(tokens);
+
+    char text[512];
+    for(int edit = 0; edit < edits; edit++){
+        test_file* f = &test_files[rand() % 2];
+        unsigned int start, old_length;
+        while(!random_edit(f, &start, &old_length, text));
+        f->file = apply_edit(tokens, prog, f->file, start, old_length, text, strlen(text));
+
+        unsigned int length;
+        char* expected = file_text(f, &length);
+        source_file* file = &source_table.files[f->file];
+        if(file->length != length || memcmp(source_table.base + file->offset, expected, length) != 0){
+            printf("seed %d, edit %d: text differs from the edit made\n", seed, edit);
+            return 1;
+        }
+        free(expected);
+
+        token_stream* fresh = tokenize_test_files();
+        if(!same_tokens(tokens, fresh) || !same_program(prog, fresh)){
+            printf("seed %d, edit %d: differs from scratch\n", seed, edit);
+            return 1;
+        }
+        free_token_stream(fresh);
+    }
+
+    printf("seed %d: %d edits, %d tokens, %d statements, same as from scratch\n", seed, edits, tokens->num, prog->num);
+    free_program(prog);
+    free_token_stream(tokens);
+    del_preprocessor();
+    for(int i = 0; i < 2; i++){
+        for(int j = 0; j < test_files[i].num; j++)
+            free(test_files[i].lines[j]);
+        free(test_files[i].lines);
+        free(test_files[i].has_digits);
+    }
+    return 0;
+}
@@ -0,0 +1,2 @@
+/* <name> only looks in the include paths, not next to the file */
+#include <angle_include.h>
@@ -0,0 +1,2 @@
+/* Next to angle_include.c, where <angle_include.h> doesn't look */
+int found = 1;
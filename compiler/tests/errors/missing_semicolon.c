@@ -0,0 +1,2 @@
+int y = 2;
+int x = 1
\ No newline at end of file
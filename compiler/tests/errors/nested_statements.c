@@ -0,0 +1,8 @@
+struct s { int x; } s;
+int q = 1;
+if(q){
+    int a = 1;
+    a = *q;
+    if(a)
+        a = s.y;
+}
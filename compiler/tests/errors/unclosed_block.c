@@ -0,0 +1,3 @@
+int y = 2;
+if(y){
+    y = 3;
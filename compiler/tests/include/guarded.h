@@ -0,0 +1,6 @@
+/* All of it is wrapped in an include guard */
+#ifndef GUARDED_H
+#define GUARDED_H
+includes = includes + 1;
+#include "sub/next.h"
+#endif
@@ -0,0 +1,3 @@
+/* Included only once, by #pragma once */
+#pragma once
+includes = includes + 10;
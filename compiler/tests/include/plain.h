@@ -0,0 +1,2 @@
+/* Included every time, since nothing stops it */
+includes = includes + 100;
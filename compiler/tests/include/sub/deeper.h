@@ -0,0 +1,2 @@
+/* Only found next to the header which includes it, not in the include path */
+#define NEXT 7
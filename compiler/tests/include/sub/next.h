@@ -0,0 +1,2 @@
+/* Found next to the header which includes it */
+#include "deeper.h"
@@ -0,0 +1,6 @@
+/* An include guard with something after it, which isn't one */
+#ifndef UNGUARDED_H
+#define UNGUARDED_H
+includes = includes + 1000;
+#endif
+includes = includes + 10000;
@@ -0,0 +1,116 @@
+#!/bin/sh
+# Runs the tests with the programs make test builds, in the build directory
+# given, build by default. Prints each test which fails, and exits with the
+# number of them.
+#
+#  - tests/run/*.c are run by the IR interpreter, unoptimized and optimized,
+#    with and without --share-expressions, and every run has to print what
+#    the .expected file next to it says. Where there is a .ir file, the
+#    optimized IR has to be exactly that, which shows the passes did their
+#    work. Where there is a .report file, the optimizer has to report exactly
+#    those numbers of nodes removed and rewritten, and where there is a
+#    .layout or .layout.json file, the layout report has to be exactly that
+#    as text or as JSON. The headers they include are in tests/include.
+#  - tests/errors/*.c each have mistakes, and running one has to report
+#    the lines, columns and messages the .expected file next to it says,
+#    warnings first and then the error which stops it, if any.
+#  - A program of more than 16384 tokens, enough for the parallel parser,
+#    has to give the same output parsed on 4 threads as on one.
+#  - The incremental re-lexer and re-parser have to give the same tokens and
+#    program as starting from scratch after each of many random edits.
+#    Edits to files which were preprocessed, and had directives, have to
+#    be seen and preprocessed again.
+#  - The scalar scanning kernels have to give the same tokens as the vector
+#    ones for every benchmark corpus, and the same output for the programs
+#    above.
+
+build=${1:-build}
+tests=$(dirname "$0")
+compiler="$build/compiler -I $tests/include"
+tmp=$build/tests
+mkdir -p "$tmp"
+failures=0
+
+fail(){
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# Programs run by the interpreter
+for program in "$tests"/run/*.c; do
+    name=${program%.c}
+    for flags in "-O0" "" "--share-expressions" "-O0 --share-expressions"; do
+        $compiler $flags --run "$program" > "$tmp/out" 2>&1
+        cmp -s "$tmp/out" "$name.expected" || fail "$program with $flags --run"
+    done
+    if [ -f "$name.ir" ]; then
+        $compiler --emit-ir "$program" > "$tmp/out" 2>&1
+        cmp -s "$tmp/out" "$name.ir" || fail "$program --emit-ir"
+    fi
+    if [ -f "$name.report" ]; then
+        $compiler --opt-report "$program" 2> "$tmp/out" > /dev/null
+        cmp -s "$tmp/out" "$name.report" || fail "$program --opt-report"
+    fi
+    if [ -f "$name.layout" ]; then
+        $compiler --layout-report "$program" > "$tmp/out" 2>&1
+        cmp -s "$tmp/out" "$name.layout" || fail "$program --layout-report"
+    fi
+    if [ -f "$name.layout.json" ]; then
+        $compiler --layout-report=json "$program" > "$tmp/out" 2>&1
+        cmp -s "$tmp/out" "$name.layout.json" || fail "$program --layout-report=json"
+    fi
+done
+
+# Programs with mistakes. The compiler stops by crashing, so it runs in a
+# subshell, which reports that where it is ignored, after the messages.
+for program in "$tests"/errors/*.c; do
+    ($compiler --run "$program"; true) > "$tmp/out" 2>&1
+    expected=${program%.c}.expected
+    head -n "$(wc -l < "$expected")" "$tmp/out" | sed "s|^$program:||" | cmp -s - "$expected" || fail "$program error"
+done
+
+# A large program, with every token written as a word, so that they can be counted
+awk 'BEGIN {
+    srand(1);
+    print "int v0 = 1 ;";
+    for(i = 1; i < 3000; i++){
+        j = int(rand() * i);
+        kind = int(rand() * 6);
+        if(kind == 0)
+            printf "typedef int t%d ; t%d v%d = v%d + %d ;\n", i, i, i, j, i;
+        else if(kind == 1)
+            printf "struct s%d { int a ; char b ; } w%d ; w%d . a = v%d ; int v%d = w%d . a + w%d . b ;\n", i, i, i, j, i, i, i;
+        else if(kind == 2)
+            printf "int v%d = v%d ; if ( v%d > %d ) { int k = v%d * 2 ; v%d = k - 1 ; } else v%d = v%d + 1 ;\n", i, j, j, i, j, i, i, j;
+        else if(kind == 3)
+            printf "int v%d = ( v%d + 3 ) * ( v%d - %d ) ;\n", i, j, j, i;
+        else if(kind == 4)
+            printf "int v%d = v%d && v%d || %d ; { int v%d = 2 ; v%d ++ ; }\n", i, j, i - 1, i % 2, j, j;
+        else
+            printf "int v%d = f ( v%d , %d ) ;\n", i, j, i;
+    }
+    print "return v1 ;";
+}' > "$tmp/parallel.c"
+[ "$(wc -w < "$tmp/parallel.c")" -gt 16384 ] || fail "the parallel parser test program is too small"
+for flags in "" "--share-expressions" "--run" "--share-expressions --run"; do
+    $compiler $flags "$tmp/parallel.c" > "$tmp/sequential" 2>&1
+    $compiler $flags -j 4 "$tmp/parallel.c" > "$tmp/out" 2>&1
+    cmp -s "$tmp/out" "$tmp/sequential" || fail "-j 4 $flags differs from parsing on one thread"
+done
+
+# Random edits
+for seed in 1 2 3 4; do
+    "$build/edit_test" $seed 400 > "$tmp/out" 2>&1 || { cat "$tmp/out"; fail "edit_test $seed"; }
+done
+"$build/edit_test" 5 100 1 > "$tmp/out" 2>&1 || { cat "$tmp/out"; fail "edit_test 5 preprocessed"; }
+
+# Scanning kernels
+"$build/bench" --check-scan --size 262144 > "$tmp/out" 2>&1 || { grep false "$tmp/out"; fail "bench --check-scan"; }
+for program in "$tests"/run/*.c "$tmp/parallel.c"; do
+    $compiler "$program" > "$tmp/vector" 2>&1
+    $compiler --scalar-scan "$program" > "$tmp/out" 2>&1
+    cmp -s "$tmp/out" "$tmp/vector" || fail "$program with --scalar-scan"
+done
+
+[ $failures -eq 0 ] && echo "All tests passed"
+exit $failures
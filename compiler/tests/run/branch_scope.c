@@ -0,0 +1,9 @@
+/* An if whose condition is constant is replaced by the branch taken, and a
+ * declaration in a branch which isn't a block still only lasts as long as
+ * the branch */
+int x = 1;
+if(1) int x = 5;
+if(0) x = 7; else int x = 9;
+if(1) { int y = 2; x = x + y; }
+if(0) print(x); else if(1) int x = 4; else print(0);
+return x;
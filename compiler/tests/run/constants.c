@@ -0,0 +1,11 @@
+/* Constants propagated through variables, phis and decided branches */
+int a = 5;
+int b = 0;
+if(a > 3) b = a * 2; else b = f(a);
+int c = b + 1;
+if(c == 11) { int t = c; c = t + b; } else c = 0;
+char ch = 0;
+if(g()) ch = 200; else ch = 100;
+if(c - 21) dead(c);
+print(c, ch + c);
+return c;
@@ -0,0 +1,6 @@
+int a = 3;
+int b = (a * 4) * 1;
+int c = (1 + 2) * (a * 1) * 8;
+if(1) { int d = a * 2 + 0; print(d); } else print(a * 16);
+if(0) print(b); else print(c * 4);
+return b + c;
@@ -0,0 +1,15 @@
+/* Structs declared on their own and function prototypes, as headers have
+ * them, which declare no variables */
+struct point { char tag; int x; int y; };
+int abs(int value);
+char* name(struct point* p, int (*compare)(int a, int b));
+struct point p;
+p.x = 3;
+if(p.x > 2){
+    struct box { struct point low; struct point high; };
+    int print(int value);
+    struct box b;
+    b.high.y = p.x * 7;
+    print(b.high.y);
+}
+return p.x;
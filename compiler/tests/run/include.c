@@ -0,0 +1,18 @@
+/* Headers, found in the include path, included more than once */
+int includes = 0;
+#include "guarded.h"
+#include "guarded.h"
+#include <guarded.h>
+#include <once.h>
+#include "once.h"
+#include "plain.h"
+#include "plain.h"
+#include "unguarded.h"
+#include "unguarded.h"
+print(includes, NEXT);
+
+/* Once its guard is undefined, a header is included again */
+#undef GUARDED_H
+#include "guarded.h"
+print(includes);
+return includes;
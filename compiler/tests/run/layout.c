@@ -0,0 +1,13 @@
+/* Structs the layout report has something to say about: holes which a
+ * better order of the fields would close, and a field which straddles a
+ * cache line */
+struct mixed { char a; int b; char c; int d; char e; };
+struct line {
+    int w0; int w1; int w2; int w3; int w4; int w5; int w6; int w7;
+    int w8; int w9; int w10; int w11; int w12; int w13; int w14;
+    struct mixed m;
+};
+struct line l;
+l.m.d = 5;
+l.w14 = 2;
+return l.m.d + l.w14;
@@ -0,0 +1,14 @@
+/* && and || only evaluate their second operand when the first doesn't decide them */
+int a = 0;
+int b = 7;
+int c = a && f(1);
+int d = b && f(2);
+int e = b || f(3);
+int h = a || f(4);
+char w = 0 || b;
+if(a || b && !a) print(1); else print(0);
+int k = b++;
+++k;
+int j = --b;
+print(c, d, e, h, w, k, j, b);
+return !(a || h);
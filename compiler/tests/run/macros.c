@@ -0,0 +1,51 @@
+/* Macros, expanded on the token stream */
+#define LIMIT 10
+#define TWICE(x) ((x) + (x))
+#define STR(x) #x
+#define CAT(a, b) a ## b
+#define CALL(f, ...) f(__VA_ARGS__)
+int CAT(val, ue) = TWICE(LIMIT);
+char* s = STR(ab  c);
+print(s[0], s[1], s[2], s[3], s[4], value, CAT(1, 2));
+CALL(print, TWICE(TWICE(1)), LIMIT);
+
+/* A macro isn't expanded again inside its own expansion */
+int self = 3;
+#define self (self + 1)
+#define ONE TWO
+#define TWO ONE
+int ONE = 4;
+print(self, ONE);
+
+/* An object-like macro's expansion changes when what it uses does */
+#define USES_LIMIT LIMIT
+print(USES_LIMIT);
+#undef LIMIT
+#define LIMIT 20
+print(USES_LIMIT);
+
+/* Conditionals inside each other, where skipped groups can hold anything */
+#if LIMIT > 15
+#  ifdef TWICE
+#    if LIMIT == 10
+print(1);
+#    elif defined(STR) && !defined(NOTHING)
+print(2);
+#    else
+print(3);
+#    endif
+#  else
+print(4);
+#  endif
+#elif 1
+print(5 @ );
+#  if 1
+print(6);
+#  endif
+#endif
+#ifndef LIMIT
+print(7);
+#else
+print(8);
+#endif
+return TWICE(LIMIT);
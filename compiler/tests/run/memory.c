@@ -0,0 +1,16 @@
+/* Variables in memory: taken addresses, structs, chars and strings */
+int x = 3;
+int y = x * 4 + 2;
+char c = 300;
+int* p = &x;
+*p = *p + 1;
+struct point { int a; char b; int c; } pt;
+struct point* pp = &pt;
+pt.a = 7;
+pp->c = pt.a + x;
+pp->b = 200;
+char* s = "hey";
+int* q = p + 2;
+int d = q - p;
+print(x, y, c, pt.a, pt.b, pp->c, d, s[1], *(s + 2));
+return x + y + pt.c;
@@ -0,0 +1,9 @@
+/* The same expressions under different declarations of their names, which
+ * --share-expressions shares until name resolution tells them apart */
+int x = 1;
+int y = x + 1;
+{ int x = 10; int z = x + 1; y = y + z; { char x = 300; y = y + (x + 1); } x + 1; }
+y = y + (x + 1);
+if(x) { int x = 100; y = y + (x + 1); } else { int x = 200; y = y + (x + 1); }
+print(x + 1, y);
+return y;
@@ -0,0 +1,11 @@
+/* Typedefs of typedefs of a struct without a tag, which is one type under every name */
+typedef struct { int a; char b; } pair;
+typedef pair couple;
+typedef couple duo;
+duo d;
+couple* p = &d;
+d.a = 5;
+p->b = 2;
+pair* q = p;
+print(d.a, d.b, q->a);
+return q->a * 10 + q->b;
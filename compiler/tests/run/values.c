@@ -0,0 +1,10 @@
+/* Values computed more than once, which value numbering merges */
+int q = g(1) + 1;
+int r = g(2) + 1;
+int m = q + 1;
+int n = 1 + q;
+int k = m * n;
+if(q) { int u = q + 1; print(u, m, k); } else { print(n); }
+int z = q + 1;
+print(z == m, r * 2, k - m * n);
+return m + n + r;
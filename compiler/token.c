@@ -1,11 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 /* This file describes the tokenizer. The tokenizer takes a string
- * of source text and divides it into tokens, and returns an array
- * of token objects. Each token object has a type and associated
- * data, which is NULL if no associated data is necessary. 
+ * of source text and divides it into tokens, which it appends to a
+ * token stream. The token stream is stored as parallel arrays: a byte
+ * for the type of each token, and the offset and length of the text
+ * the token came from. The text itself is never copied; anything that
+ * needs the contents of a token reads them from the source buffer.
  *
  * Each token represents a single piece of information from the 
  * C source file, whether it's a punctuation/syntax mark, a keyword,
@@ -87,375 +90,568 @@ int TOKEN_NUMBER = 40;
 int TOKEN_INCR = 41;
 int TOKEN_DECR = 42;
 
-/* Used in the parser */
+/* Preprocessor: a # at the start of a line begins a directive, anywhere else it's the # or ## operator */
+int TOKEN_DIRECTIVE = 43;
+int TOKEN_HASH = 44;
+int TOKEN_HASHHASH = 45;
+
+/* Used in macro bodies: a use of one of the macro's parameters, data is the parameter's index */
+int TOKEN_MACRO_PARAM = 46;
+
+/* Used in the parser. Token types are stored in a byte, so these must stay below 256. */
 int TOKEN_UNARY_DEREF = 100;
-int TOKEN_UNARY_MINUS = 200;
-int TOKEN_POSTINCR = 300;
-int TOKEN_POSTDECR = 400;
-int TOKEN_PREINCR = 500;
-int TOKEN_PREDECR = 600;
-
-/* The token type, containing an int type and the associated data */
-typedef struct _token {
-    int type;
-    char* data;
-} token;
-
-/* If the current index is on a single character token, create the token, else return NULL */
-token* get_single_char_token(int index, char* text){
+int TOKEN_UNARY_MINUS = 101;
+int TOKEN_POSTINCR = 102;
+int TOKEN_POSTDECR = 103;
+int TOKEN_PREINCR = 104;
+int TOKEN_PREDECR = 105;
+
+/* The token stream. Token i has type types[i], and its text is the lengths[i]
+ * bytes starting at text + offsets[i]. For strings and characters, the text
+ * is what's between the quotes, with escape sequences left in. For
+ * identifiers, data[i] is the interned symbol of the identifier. Numbers
+ * and characters are decoded by the tokenizer, and data[i] is the index of
+ * their value in the literals array. */
+typedef struct _token_stream {
+    int num;
+    int allocated;
+    unsigned char* types;
+    unsigned int* offsets;
+    unsigned int* lengths;
+    unsigned int* data;
+    char* text;
+
+    int num_literals;
+    int allocated_literals;
+    unsigned long long* literals;
+
+    /* The files preprocess_file() added to the stream, in order, and how
+     * many directives the preprocessor met in them. A stream of tokens
+     * straight from the tokenizer has neither. */
+    int num_files;
+    int* files;
+    int directives;
+} token_stream;
+
+/* 
+ * The lexer is driven by tables indexed by byte value, which are filled in
+ * once by init_tokenizer(). The first byte of every token selects what kind
+ * of token to read (lex_class), and the character class tables decide where
+ * identifiers and numbers end. Every byte of the input is looked at once.
+ */
+
+/* Lexer actions, selected by the first byte of a token */
+int LEX_SKIP = 0;
+int LEX_IDENT = 1;
+int LEX_NUMBER = 2;
+int LEX_STRING = 3;
+int LEX_CHARACTER = 4;
+int LEX_DIRECTIVE = 5;
+int LEX_PUNCT = 6;
+
+/* Number of slots in the keyword hash table, a power of two */
+#define KEYWORD_SLOTS 64
+
+struct {
+    /* First-byte dispatch and character classes */
+    unsigned char lex_class[256];
+    unsigned char digit_value[256];
+
+    /* Punctuation: the single character token, and up to two two-character
+     * tokens which start with the same character */
+    int single_token[256];
+    unsigned char pair_char[256][2];
+    int pair_token[256][2];
+
+    /* Keywords, looked up only after a whole identifier is read */
+    char* keywords[KEYWORD_SLOTS];
+    int keyword_lengths[KEYWORD_SLOTS];
+    int keyword_types[KEYWORD_SLOTS];
+} lex_tables;
+
+/* Hash an identifier for the keyword table */
+int keyword_hash(char* text, int len){
+    return (len * 7 + (unsigned char) text[0] * 3 + (unsigned char) text[len - 1]) & (KEYWORD_SLOTS - 1);
+}
+
+/* Add a keyword to the keyword hash table */
+void add_keyword(char* keyword, int tok_type){
+    int len = strlen(keyword);
+    int slot = keyword_hash(keyword, len);
+    while(lex_tables.keywords[slot] != NULL)
+        slot = (slot + 1) & (KEYWORD_SLOTS - 1);
+
+    lex_tables.keywords[slot] = keyword;
+    lex_tables.keyword_lengths[slot] = len;
+    lex_tables.keyword_types[slot] = tok_type;
+}
+
+/* Add a two-character punctuation token */
+void add_pair_token(char first, char second, int tok_type){
+    unsigned char c = first;
+    int i = lex_tables.pair_char[c][0] == 0 ? 0 : 1;
+    lex_tables.pair_char[c][i] = second;
+    lex_tables.pair_token[c][i] = tok_type;
+    lex_tables.lex_class[c] = LEX_PUNCT;
+}
+
+/* Fill in the lexer tables */
+void init_tokenizer(){
+    memset(&lex_tables, 0, sizeof(lex_tables));
+    init_scanner(1);
+
+    /* Identifiers start with a-zA-Z_ and contain those and numbers */
+    for(int c = 0; c < 256; c++){
+        int alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        int digit = c >= '0' && c <= '9';
+        lex_tables.digit_value[c] = 0xFF;
+        if(digit)
+            lex_tables.digit_value[c] = c - '0';
+        if(c >= 'a' && c <= 'f')
+            lex_tables.digit_value[c] = c - 'a' + 10;
+        if(c >= 'A' && c <= 'F')
+            lex_tables.digit_value[c] = c - 'A' + 10;
+        if(alpha)
+            lex_tables.lex_class[c] = LEX_IDENT;
+        if(digit)
+            lex_tables.lex_class[c] = LEX_NUMBER;
+    }
+    lex_tables.lex_class['"'] = LEX_STRING;
+    lex_tables.lex_class['\''] = LEX_CHARACTER;
+    lex_tables.lex_class['#'] = LEX_DIRECTIVE;
+
     /* All the types of single-character tokens and their corresponding characters */
     char single[18] = {'(', ')', '{', '}', '[', ']', '+', '-', '*', '/', ';', ',', '>', '<', '=', '.', '&', '!'};
     int single_token_types[18] = {TOKEN_OPAREN, TOKEN_CPAREN, TOKEN_OBRACE, TOKEN_CBRACE, TOKEN_OBRACKET, TOKEN_CBRACKET,
         TOKEN_PLUS, TOKEN_MINUS, TOKEN_TIMES, TOKEN_DIV, TOKEN_SEMICOLON, TOKEN_COMMA, TOKEN_GREATER, TOKEN_LESS, 
         TOKEN_ASSIGN, TOKEN_DOT, TOKEN_ADDR, TOKEN_NOT};
-    int singles = 18;
-
-    /* Test each type of token */
-    for(int i = 0; i < singles; i++){
-        /* If the token matches, create and return the token */
-        if(text[index] == single[i]){
-            token* t = calloc(1, sizeof(token));
-            t->type = single_token_types[i];
-            return t;
-        }
+    for(int i = 0; i < 18; i++){
+        unsigned char c = single[i];
+        lex_tables.single_token[c] = single_token_types[i];
+        lex_tables.lex_class[c] = LEX_PUNCT;
     }
 
-    /* If no token matches, return NULL for failure */
-    return NULL;
+    /* Two-character operators */
+    add_pair_token('|', '|', TOKEN_OR);
+    add_pair_token('&', '&', TOKEN_AND);
+    add_pair_token('>', '=', TOKEN_GREATEREQ);
+    add_pair_token('<', '=', TOKEN_LESSEQ);
+    add_pair_token('=', '=', TOKEN_EQUALS);
+    add_pair_token('-', '>', TOKEN_REF);
+    add_pair_token('-', '-', TOKEN_DECR);
+    add_pair_token('+', '+', TOKEN_INCR);
+
+    /* Keywords */
+    char* keywords[14] = {"typedef", "int", "char", "FILE", "long", "struct", "return",
+             "equals", "void", "sizeof", "for", "while", "if", "else"};
+    int keyword_token_types[14] = {TOKEN_TYPEDEF, TOKEN_INT, TOKEN_CHAR, TOKEN_FILE, TOKEN_LONG, TOKEN_STRUCT, TOKEN_RETURN,
+        TOKEN_EQUALS, TOKEN_VOID, TOKEN_SIZEOF, TOKEN_FOR, TOKEN_WHILE, TOKEN_IF, TOKEN_ELSE};
+    for(int i = 0; i < 14; i++)
+        add_keyword(keywords[i], keyword_token_types[i]);
 }
 
-/* If the current index is on a keyword, create a keyword token and return the length of it, else return NULL */
-token* get_keyword_token(int index, char* text, int* len){
-    /* All possible keywords */
-    char* keywords[21] = {"typedef", "int", "char", "FILE", "long", "struct", "return",
-             "equals", "||", "&&", ">=", "<=", "void", "sizeof", "for", "while", "if", "->", "++", "--", "else"};
-    int keyword_token_types[21] = {TOKEN_TYPEDEF, TOKEN_INT, TOKEN_CHAR, TOKEN_FILE, TOKEN_LONG, TOKEN_STRUCT, TOKEN_RETURN,
-        TOKEN_EQUALS, TOKEN_OR, TOKEN_AND, TOKEN_GREATEREQ, TOKEN_LESSEQ, TOKEN_VOID, TOKEN_SIZEOF, 
-        TOKEN_FOR, TOKEN_WHILE, TOKEN_IF, TOKEN_REF, TOKEN_INCR, TOKEN_DECR, TOKEN_ELSE};
-    int num_keywords = 21;
-
-    /* Get length of text, so we don't overflow */
-    int text_len = strlen(text);
-
-    /* Check every keyword */
-    for(int i = 0; i < num_keywords; i++){
-        char* keyword = keywords[i];
-
-        /* Test if this keyword matches */
-        int found = 1;
-        for(int j = 0; j < strlen(keyword); j++){
-            if(index+j >= text_len || keyword[j] != text[index+j])
-                found = 0;
-        }
-
-        /* If it matches, create and return the token */
-        if(found){
-            token* t = calloc(1, sizeof(token));
-            t->type = keyword_token_types[i];
-            *len = strlen(keyword);
-            return t;
-        }
+/* Return the keyword token type for an identifier, or TOKEN_IDENT if it's not a keyword */
+int get_keyword_type(char* text, int len){
+    int slot = keyword_hash(text, len);
+    while(lex_tables.keywords[slot] != NULL){
+        if(lex_tables.keyword_lengths[slot] == len && memcmp(lex_tables.keywords[slot], text, len) == 0)
+            return lex_tables.keyword_types[slot];
+        slot = (slot + 1) & (KEYWORD_SLOTS - 1);
     }
+    return TOKEN_IDENT;
+}
+
 
-    /* If none of the keywords match, return NULL */
-    return NULL;
+/* Create an empty token stream whose offsets are relative to text */
+token_stream* make_token_stream(char* text){
+    token_stream* tokens = calloc(1, sizeof(token_stream));
+    tokens->text = text;
+    tokens->allocated = 1024;
+    tokens->types = malloc(tokens->allocated * sizeof(unsigned char));
+    tokens->offsets = malloc(tokens->allocated * sizeof(unsigned int));
+    tokens->lengths = malloc(tokens->allocated * sizeof(unsigned int));
+    tokens->data = malloc(tokens->allocated * sizeof(unsigned int));
+    tokens->allocated_literals = 256;
+    tokens->literals = malloc(tokens->allocated_literals * sizeof(unsigned long long));
+    return tokens;
 }
 
-/* Read a string token, starting with the character after the first quote */
-token* get_string_token(int index, char* text, int* str_length){
-    /* Store the start and end index */
-    int start_index = index;
-    int end_index = index;
-
-    /* Store length of input text and length of string, so we don't overflow */
-    int len = strlen(text);
-    *str_length = 0;
-    int num_chars = 0;
-
-    /* Keep reading until the end */
-    while(end_index < len && text[end_index] != '"'){
-        /* If we see a backslash, ignore the next character */
-        if(text[end_index] == '\\'){
-            end_index+= 2;
-            (*str_length)++;
-        }
-        else
-            end_index++;
+/* Release the memory used by a token stream (the text belongs to the source manager) */
+void free_token_stream(token_stream* tokens){
+    free(tokens->types);
+    free(tokens->offsets);
+    free(tokens->lengths);
+    free(tokens->data);
+    free(tokens->literals);
+    free(tokens->files);
+    free(tokens);
+}
+
+/* Make sure the stream has space for at least num tokens */
+void reserve_tokens(token_stream* tokens, int num){
+    if(num <= tokens->allocated)
+        return;
+
+    tokens->allocated = grow_capacity(tokens->allocated, num);
+    tokens->types = realloc(tokens->types, tokens->allocated * sizeof(unsigned char));
+    tokens->offsets = realloc(tokens->offsets, tokens->allocated * sizeof(unsigned int));
+    tokens->lengths = realloc(tokens->lengths, tokens->allocated * sizeof(unsigned int));
+    tokens->data = realloc(tokens->data, tokens->allocated * sizeof(unsigned int));
+}
 
-        /* Update the length of the string */
-        (*str_length)++;
-        num_chars ++;
+/* Add a token to the stream, allocating more space if necessary */
+void add_token(token_stream* tokens, int type, unsigned int offset, unsigned int length, unsigned int data){
+    /* If we don't have enough memory, allocate more */
+    if(tokens->num == tokens->allocated)
+        reserve_tokens(tokens, tokens->num + 1);
+
+    /* Store the token, increment number of tokens we have */
+    tokens->types[tokens->num] = type;
+    tokens->offsets[tokens->num] = offset;
+    tokens->lengths[tokens->num] = length;
+    tokens->data[tokens->num] = data;
+    tokens->num++;
+}
+
+/* Add a literal value to the stream, returning its index in the literals array */
+unsigned int add_literal(token_stream* tokens, unsigned long long value){
+    if(tokens->num_literals == tokens->allocated_literals){
+        tokens->allocated_literals *= 2;
+        tokens->literals = realloc(tokens->literals, tokens->allocated_literals * sizeof(unsigned long long));
     }
 
-    /* Allocate space for the string, make it end with a \0 */
-    char* data = calloc(1, num_chars + 1);
-    data[*str_length] = '\0';
+    tokens->literals[tokens->num_literals] = value;
+    return tokens->num_literals++;
+}
+
+/* Copy the tokens [first, last) of another stream over the same text onto the end of a stream */
+void append_tokens(token_stream* tokens, token_stream* from, int first, int last){
+    int count = last - first;
+    reserve_tokens(tokens, tokens->num + count);
+    memcpy(tokens->types + tokens->num, from->types + first, count * sizeof(unsigned char));
+    memcpy(tokens->offsets + tokens->num, from->offsets + first, count * sizeof(unsigned int));
+    memcpy(tokens->lengths + tokens->num, from->lengths + first, count * sizeof(unsigned int));
+    memcpy(tokens->data + tokens->num, from->data + first, count * sizeof(unsigned int));
+
+    /* Literal values live in each stream's own array */
+    for(int i = tokens->num; i < tokens->num + count; i++)
+        if(tokens->types[i] == TOKEN_NUMBER || tokens->types[i] == TOKEN_CHARACTER)
+            tokens->data[i] = add_literal(tokens, from->literals[tokens->data[i]]);
+    tokens->num += count;
+}
+
+/* Get the decoded value of a number or character token */
+unsigned long long token_value(token_stream* tokens, int index){
+    return tokens->literals[tokens->data[index]];
+}
+
+/* Get a pointer to the text of a token. It is not null-terminated. */
+char* token_text(token_stream* tokens, int index){
+    return tokens->text + tokens->offsets[index];
+}
+
+/* Get the interned symbol of an identifier token */
+unsigned int token_symbol(token_stream* tokens, int index){
+    return tokens->data[index];
+}
+
+/* Get the offset of the first byte of source a token was read from, including any opening quote */
+unsigned int token_start(token_stream* tokens, int index){
+    int quoted = tokens->types[index] == TOKEN_STRING || tokens->types[index] == TOKEN_CHARACTER;
+    return tokens->offsets[index] - quoted;
+}
+
+/* Get the offset just past the last byte of source a token was read from, including any closing quote */
+unsigned int token_end(token_stream* tokens, int index){
+    int quoted = tokens->types[index] == TOKEN_STRING || tokens->types[index] == TOKEN_CHARACTER;
+    return tokens->offsets[index] + tokens->lengths[index] + quoted;
+}
+
+/* Exit with an error just past the last of the first len tokens, for input
+ * which ends before what is being parsed does */
+void error_at_end(token_stream* tokens, int len, char* message){
+    if(len == 0)
+        error(message);
+    error_at(token_end(tokens, len - 1), message);
+}
+
+/* Increment the token pointer and make sure we're not out of bounds on the token stream */
+void inc_ptr(token_stream* tokens, int* index, int len){
+    (*index)++;
+
+    /* Make sure we're not out of bounds */
+    if(*index >= len)
+        error_at_end(tokens, len, "Unexpected end of token stream");
+}
+
+/* Find the end of the directive whose # is token index, returning the offset
+ * of the newline which ends it. Lines ending in a backslash are joined. */
+unsigned int directive_end(token_stream* tokens, int index){
+    char* text = tokens->text;
+    unsigned int offset = tokens->offsets[index];
+    while(text[offset] != '\0' && (text[offset] != '\n' || text[offset - 1] == '\\'))
+        offset++;
+    return offset;
+}
+
+/* The parser changes the types of some operator tokens in place once it knows
+ * what they mean (a * may become a dereference, a ++ a pre-increment). Get
+ * the type a token had before that, so the token can be parsed again. */
+int base_token_type(int tok_type){
+    if(tok_type < TOKEN_UNARY_DEREF)
+        return tok_type;
+    if(tok_type == TOKEN_UNARY_DEREF)
+        return TOKEN_TIMES;
+    if(tok_type == TOKEN_UNARY_MINUS)
+        return TOKEN_MINUS;
+    if(tok_type == TOKEN_POSTINCR || tok_type == TOKEN_PREINCR)
+        return TOKEN_INCR;
+    if(tok_type == TOKEN_POSTDECR || tok_type == TOKEN_PREDECR)
+        return TOKEN_DECR;
+    return tok_type;
+}
+
+/* Decode the escape sequences in a string or character token into data,
+ * which must have room for the token's length plus a terminator. Returns data. */
+char* decode_token_string(token_stream* tokens, int index, char* data){
+    char* text = token_text(tokens, index);
+    int len = tokens->lengths[index];
 
     /* Copy over the data into the string */
-    for(int i = start_index; i < end_index; i++){
+    int out = 0;
+    for(int i = 0; i < len; i++){
         char next_char = text[i];
 
         /* Ignore backslashes (treat the next character literally) */
-        if(next_char == '\\'){
+        if(next_char == '\\' && i + 1 < len){
             next_char = text[++i];
 
             /* If it's an escape sequence, treat it as such */
             if(next_char == 'n')
                 next_char = '\n';
-            if(next_char == 't')
+            else if(next_char == 't')
                 next_char = '\t';
+            else if(next_char == '0')
+                next_char = '\0';
         }
-        data[i - start_index] = next_char;
+        data[out++] = next_char;
     }
-
-    /* Create and return the token */
-    token* tok = calloc(1, sizeof(token));
-    tok->type = TOKEN_STRING;
-    tok->data = data;
-    return tok;
+    data[out] = '\0';
+    return data;
 }
 
-/* Read an identifier token, starting with the first character */
-token* get_ident_token(int index, char* text, int* ident_length){
-    /* Keep track of start and end index */
-    int start_index = index;
-    int end_index = index;
-    
-    /* Use length of input text to make sure we don't read too far */
-    int len = strlen(text);
-
-    /* Keep incrementing end index and length of identifier until we encounter End-of-File or a non-ident character */
-    *ident_length = 0;
-    while(end_index < len && 
-            (text[end_index] == '_' || (text[end_index] >=  '0' && text[end_index] <=  '9') ||
-             (text[end_index] >=  'a' && text[end_index] <=  'z') || (text[end_index] >=  'A' && text[end_index] <=  'Z'))){
-        (*ident_length)++;
-        end_index++;
-    }
+/* Print a token for debugging, along with where it is in the source */
+void print_token(token_stream* tokens, int index){
+    int line, column;
+    char* name = source_position(tokens->offsets[index], &line, &column);
+    printf("%s:%d:%d: %d: %.*s\n", name, line, column, tokens->types[index], (int) tokens->lengths[index], token_text(tokens, index));
+}
 
-    /* Allocate space for the identifier, make the last character a terminator */
-    char* data = calloc(1, *ident_length + 1);
-    data[*ident_length] = '\0';
+/* 
+ * SWAR ("SIMD within a register") digit parsing: eight ASCII digits are
+ * loaded into one 64-bit word, checked, and converted with three multiplies
+ * instead of eight. The first digit is in the lowest byte of the word, so
+ * this only works on little-endian machines.
+ */
 
-    /* Copy over data from input text to identifier string */
-    for(int i = start_index; i < end_index; i++){
-        char next_char = text[i];
-        data[i - start_index] = next_char;
-    }
+/* Return 1 if all eight bytes of a word are the digits 0-9 */
+int swar_all_digits(unsigned long long word){
+    /* Digits have a high nibble of 3, and still do after adding 6 */
+    return ((word & 0xF0F0F0F0F0F0F0F0ULL) | 
+            (((word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
 
-    /* Create and return token */
-    token* tok = calloc(1, sizeof(token));
-    tok->type = TOKEN_IDENT;
-    tok->data = data;
-    return tok;
+/* Convert eight digits in a word into their value */
+unsigned long long swar_parse_eight(unsigned long long word){
+    /* Combine pairs of digits, then pairs of pairs, then the two halves */
+    word = (word & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+    word = (word & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+    return (word & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
 }
 
-/* Read a number token, starting with the first character */
-token* get_num_token(int index, char* text, int* num_length){
-    /* Keep track of start and end index */
-    int start_index = index;
-    int end_index = index;
-    
-    /* Use length of input text to make sure we don't read too far */
-    int len = strlen(text);
-
-    /* Keep incrementing end index and length of identifier until we encounter End-of-File or a non-ident character */
-    *num_length = 0;
-    while(end_index < len && (text[end_index] >=  '0' && text[end_index] <=  '9')){
-        (*num_length)++;
-        end_index++;
+/* Read a decimal, hex (0x...), or octal (0...) number starting at index into value,
+ * returning the index after it. Returns -1 if the value doesn't fit in 64 bits. */
+int get_number(char* text, int index, int len, unsigned long long* value){
+    unsigned long long v = 0;
+    int overflow = 0;
+    int base = 10;
+    if(text[index] == '0' && index + 1 < len && (text[index + 1] == 'x' || text[index + 1] == 'X')){
+        base = 16;
+        index += 2;
     }
-
-    /* Allocate space for the identifier, make the last character a terminator */
-    char* data = calloc(1, *num_length + 1);
-    data[*num_length] = '\0';
-
-    /* Copy over data from input text to identifier string */
-    for(int i = start_index; i < end_index; i++){
-        char next_char = text[i];
-        data[i - start_index] = next_char;
+    else if(text[index] == '0')
+        base = 8;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Decimal digits, eight at a time */
+    while(base == 10 && index + 8 <= len){
+        unsigned long long word;
+        memcpy(&word, text + index, 8);
+        if(!swar_all_digits(word))
+            break;
+
+        unsigned long long eight = swar_parse_eight(word);
+        if(v > (ULLONG_MAX - eight) / 100000000ULL)
+            overflow = 1;
+        v = v * 100000000ULL + eight;
+        index += 8;
     }
-
-    /* Create and return token */
-    token* tok = calloc(1, sizeof(token));
-    tok->type = TOKEN_NUMBER;
-    tok->data = data;
-    return tok;
-}
-
-/* Add the token to the list, allocating more space if necessary */
-void add_token(token* tok, token*** tokens, int* allocated, int* num){
-    /* If we don't have enough memory, allocate more */
-    if(num > allocated){
-        *allocated += 1000;
-        *tokens = realloc(*tokens, *allocated);
+#endif
+
+    /* Remaining digits, one at a time */
+    int digit;
+    while(index < len && (digit = lex_tables.digit_value[(unsigned char) text[index]]) < base){
+        if(v > (ULLONG_MAX - digit) / base)
+            overflow = 1;
+        v = v * base + digit;
+        index++;
     }
 
-    /* Store the token, increment number of tokens we have */
-    (*tokens)[*num] = tok;
-    (*num)++;
-}
+    /* Skip integer suffixes */
+    while(index < len && (text[index] == 'u' || text[index] == 'U' || text[index] == 'l' || text[index] == 'L'))
+        index++;
 
-/* Print a token for debugging */
-void print_token(token* token){
-    if(token->data == NULL)
-        printf("%d\n", token->type);
-    else
-        printf("%d: %s\n", token->type, token->data);
+    *value = v;
+    return overflow ? -1 : index;
 }
 
-/* Free a token and associated data */
-void free_token(token* token){
-    if(token->data != NULL)
-        free(token->data);
-    free(token);
+/* Decode the character literal (possibly an escape sequence) starting at index */
+unsigned long long get_character_value(char* text, int index, int len){
+    if(text[index] != '\\' || index + 1 >= len)
+        return (unsigned char) text[index];
+
+    char escaped = text[index + 1];
+    if(escaped == '0')
+        return '\0';
+    if(escaped == 'n')
+        return '\n';
+    if(escaped == 't')
+        return '\t';
+    return (unsigned char) escaped;
 }
 
-/* Tokenize */
-token** tokenize(char* text, int* num_tokens){
-    /* Store length of text, number of allocated tokens, and number of actual tokens */
-    int len = strlen(text);
-    int allocated = 1000;
-    int num = 0;
-
-    /* Store where we are in the input text */
-    int index = 0;
-
-    /* Allocate space for the tokens */
-    token** tokens = calloc(allocated, sizeof(token*));
-
-    /* Until we reach EOF, keep adding tokens */
-    while(index < len){
-        token* tok = NULL;
-
-        /* Comments: ignore everything until the ending * / */
-        if(index + 1 < len && text[index] == '/' && text[index+1] == '*'){
-            /* Account for starting / * */
-            index += 2;
-
-            /* Loop until end of comment */
-            while(!(text[index] == '*' && text[index+1] == '/')){
-                index++;
-            }
-
-            /* Account for ending * / */
-            index += 2;
-            continue;
-        }
-
-        /* Preprocessor macros: ignore everything after the # */
-        if(text[index] == '#'){
-            /* Account for # */
-            index++;
+/* Read the body of a string starting after the opening quote, returning the index of the closing quote */
+int get_string_end(char* text, int index, int len){
+    /* Find the closing quote, jumping from backslash to backslash */
+    while((index = scan_string(text, index, len)) < len && text[index] == '\\')
+        index += 2;
+    return index < len ? index : len;
+}
 
-            /* Forward until end of line */
-            while(index < len && text[index] != '\n')
-                index++;
+/* Run one step of the lexer on the len characters of the stream's text starting
+ * at offset start: either skip some whitespace or a comment, or add one token
+ * to the stream. Returns the index just past what was consumed. */
+int lex_step(token_stream* tokens, unsigned int start, int index, int len){
+    char* text = tokens->text + start;
+    unsigned char c = text[index];
+    int action = lex_tables.lex_class[c];
+
+    /* Whitespace and unknown characters: ignore them */
+    if(action == LEX_SKIP){
+        int skipped = scan_whitespace(text, index, len);
+        return skipped > index ? skipped : index + 1;
+    }
 
-            /* Account for newline */
-            index++;
-            continue;
-        }
+    /* Ident: read the whole identifier, then check whether it's a keyword */
+    if(action == LEX_IDENT){
+        int start_index = index;
+        index = scan_ident(text, index, len);
 
-        /* Keyword tokens */
-        int keyword_length = 0;
-        if((tok = get_keyword_token(index, text, &keyword_length)) != NULL){
-            add_token(tok, &tokens, &allocated, &num);
+        int ident_length = index - start_index;
+        int tok_type = get_keyword_type(text + start_index, ident_length);
+        unsigned int sym = tok_type == TOKEN_IDENT ? intern(text + start_index, ident_length) : 0;
+        add_token(tokens, tok_type, start + start_index, ident_length, sym);
+        return index;
+    }
 
-            /* Account for entire length of keyword */
-            index += keyword_length;
-            continue;
-        }
+    /* Number, decoded into its value */
+    if(action == LEX_NUMBER){
+        int start_index = index;
+        unsigned long long value;
+        index = get_number(text, index, len, &value);
+        if(index < 0)
+            error_at(start + start_index, "Integer literal is too large");
 
-        /* Single char tokens */
-        if((tok = get_single_char_token(index, text)) != NULL){
-            add_token(tok, &tokens, &allocated, &num);
+        add_token(tokens, TOKEN_NUMBER, start + start_index, index - start_index, add_literal(tokens, value));
+        return index;
+    }
 
-            /* Only one character is used up */
-            index++;
-            continue;
-        }
+    /* Punctuation and operators */
+    if(action == LEX_PUNCT){
+        unsigned char next = index + 1 < len ? text[index + 1] : 0;
 
-        /* String */
-        if(text[index] == '"'){
-            /* Account for the quote */
-            index++;
-            int str_length = 0;
-            tok = get_string_token(index, text, &str_length);
-
-            /* Account for length of string and ending quote */
-            index += str_length + 1;
-            add_token(tok, &tokens, &allocated, &num);
-            continue;
+        /* Comments: ignore everything until the ending * / */
+        if(c == '/' && next == '*'){
+            /* Skip the starting / * and everything through the ending * / */
+            return scan_comment_end(text, index + 2, len);
         }
 
-        /* Character surrounded by single quotes */
-        if(text[index] == '\''){
-            /* Account for quote */
-            index++;
-
-            /* Data string is just the character and terminating \0 */
-            char* c = calloc(1, 2);
-            c[1] = '\0';
-
-            /* Escape sequences */
-            if(text[index] == '\\' && text[index + 1] == '\'')
-                c[0] = '\'';
-            if(text[index] == '\\' && text[index + 1] == '\\')
-                c[0] = '\\';
-            if(text[index] == '\\' && text[index + 1] == '0')
-                c[0] = '\0';
-            if(text[index] == '\\' && text[index + 1] == 'n')
-                c[0] = '\n';
-            if(text[index] == '\\' && text[index + 1] == 't')
-                c[0] = '\t';
-
-            /* If it's not an escape sequence, just copy the character */
-            else if(text[index] != '\\')
-                c[0] = text[index];
-
-            /* Account for possible backslash, the character itself, and ending quote */
-            if(text[index] == '\\')
-                index += 3;
-            else
-                index += 2;
-
-            /* Allocate token and store it */
-            tok = calloc(1, sizeof(token));
-            tok->type = TOKEN_CHARACTER;
-            tok->data = c;
-            add_token(tok, &tokens, &allocated, &num);
-            continue;
+        /* Two-character operators */
+        int tok_type = 0;
+        int tok_length = 2;
+        if(next != 0 && lex_tables.pair_char[c][0] == next)
+            tok_type = lex_tables.pair_token[c][0];
+        else if(next != 0 && lex_tables.pair_char[c][1] == next)
+            tok_type = lex_tables.pair_token[c][1];
+        else {
+            tok_type = lex_tables.single_token[c];
+            tok_length = 1;
         }
 
-        /* Ident: start with a-zA-Z_ and contains those and numbers */
-        if(text[index] == '_' || (text[index] >=  'a' && text[index] <=  'z') || (text[index] >=  'A' && text[index] <=  'Z')){
-            int ident_length = 0;
-            tok = get_ident_token(index, text, &ident_length);
-            add_token(tok, &tokens, &allocated, &num);
+        /* A lone | is not a token */
+        if(tok_type != 0)
+            add_token(tokens, tok_type, start + index, tok_length, 0);
+        return index + tok_length;
+    }
 
-            /* Account for full length of token */
-            index += ident_length;
-            continue;
-        }
+    /* String: the token covers everything between the quotes */
+    if(action == LEX_STRING){
+        int start_index = index + 1;
+        index = get_string_end(text, start_index, len);
+        add_token(tokens, TOKEN_STRING, start + start_index, index - start_index, 0);
 
-        /* Number */
-        if(text[index] >= '0' && text[index] <= '9'){
-            int num_length = 0;
-            tok = get_num_token(index, text, &num_length);
-            add_token(tok, &tokens, &allocated, &num);
+        /* Account for ending quote */
+        return index + 1;
+    }
 
-            /* Account for all digits */
-            index += num_length;
-            continue;
-        }
+    /* Character surrounded by single quotes */
+    if(action == LEX_CHARACTER){
+        /* Account for quote, then the possible backslash and the character itself */
+        int start_index = index + 1;
+        int chr_length = start_index < len && text[start_index] == '\\' ? 2 : 1;
+        if(start_index + chr_length > len)
+            chr_length = len - start_index;
+        unsigned long long value = chr_length > 0 ? get_character_value(text, start_index, len) : 0;
+        add_token(tokens, TOKEN_CHARACTER, start + start_index, chr_length, add_literal(tokens, value));
+
+        /* Account for ending quote */
+        return start_index + chr_length + 1;
+    }
 
-        /* If we don't match any of the above conditions, it's probably whitespace, so ignore it */
-        index++;
+    /* Preprocessor: a # with only spaces before it on its line starts a
+     * directive. The rest of the directive is lexed as usual, and the
+     * preprocessor finds where it ends. */
+    int line_start = index - 1;
+    while(line_start >= 0 && (text[line_start] == ' ' || text[line_start] == '\t'))
+        line_start--;
+    if(line_start < 0 || text[line_start] == '\n'){
+        add_token(tokens, TOKEN_DIRECTIVE, start + index, 1, 0);
+        return index + 1;
     }
 
-    /* Store number of tokens found in num_tokens */
-    *num_tokens = num;
-    return tokens;
+    /* Otherwise it's the stringizing or token pasting operator */
+    if(index + 1 < len && text[index + 1] == '#'){
+        add_token(tokens, TOKEN_HASHHASH, start + index, 2, 0);
+        return index + 2;
+    }
+    add_token(tokens, TOKEN_HASH, start + index, 1, 0);
+    return index + 1;
 }
 
+/* Tokenize len characters of the stream's text starting at offset start, adding the tokens to the stream */
+void tokenize(token_stream* tokens, unsigned int start, int len){
+    /* Until we reach EOF, keep adding tokens */
+    int index = 0;
+    while(index < len)
+        index = lex_step(tokens, start, index, len);
+}
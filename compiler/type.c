@@ -1,222 +1,376 @@
 /* A type type, which defines a primitive or user-specified type. It can be
  * a pointer to another type, or a base type. Base types have a name ("int", 
- * "char", "void", etc) and a size (respectively, 4, 1, 0, etc).
+ * "char", "void", etc) and a size (respectively, 4, 1, 0, etc). Names are
+ * interned symbols, and 0 means the type has no name.
+ *
+ * Types are canonical: every distinct type is built once, and everything
+ * that uses it points at the same object. Each type caches the pointer type
+ * to it, and a typedef is one object shared by every use of its name. Two
+ * types are the same type if their canonical types are the same object,
+ * where a typedef's canonical type is that of the type it names.
  */
 typedef struct _type {
     struct _type* ptr_to;
     struct _type* alias;
+    struct _type* pointer;
+    struct _type* canonical;
     int size;
-    char* name;
+    unsigned int name;
 
     int struct_type;
     int num_fields;
     struct _type** field_types;
-    char** field_names;
+    unsigned int* field_names;
+
+    /* Offsets, alignment and field lookup table of a struct, once it is laid out */
+    struct _struct_layout* layout;
 } type;
 
+void lay_out_struct(type* t);
+
+/* A slot of a type index: an interned name, 0 for an empty slot, and one
+ * more than the index in the type table of the innermost type in scope
+ * with that name, or 0 if none is in scope */
+typedef struct _type_slot {
+    unsigned int name;
+    unsigned int newest;
+} type_slot;
+
+/* Open addressing hash table from names to types, at most half full */
+typedef struct _type_index {
+    type_slot* slots;
+    unsigned int capacity;
+    unsigned int num;
+} type_index;
+
 /* Global type table, stores array of known types */
 struct {
     int num;
+    int allocated;
     type** types;
+
+    /* For each type, one more than the index of the type with the same name
+     * that it shadows, or 0 if it shadows none */
+    unsigned int* shadows;
+
+    /* Typedef names and struct tags are looked up separately, as in C */
+    type_index typedefs;
+    type_index tags;
+
+    /* The named types in the scopes which are open, innermost last */
+    index_vector scoped;
 } type_table;
 
+/* Number of types at the start of the type table that parse_type can see
+ * on this thread, or -1 to see them all. A parallel parse limits each
+ * thread to the types defined before the statement it is parsing, while
+ * other threads may be adding later ones. */
+__thread int type_table_limit = -1;
+
 /* All the primitive built-in types and their indices in the type table */
 int TYPE_VOID = 0;
 int TYPE_CHAR = 1;
 int TYPE_INT = 2;
 
-/* Add a type to the global type table */
+/* Find the slot for a name in a type index, or the empty slot where it would go.
+ * Slots are filled in while other threads of a parallel parse may be reading them,
+ * so their names are read and written atomically. */
+type_slot* find_type_slot(type_index* index, unsigned int name){
+    unsigned int mask = index->capacity - 1;
+    unsigned int i = (name * 2654435761u) >> 8 & mask;
+    while(1){
+        unsigned int slot_name = __atomic_load_n(&index->slots[i].name, __ATOMIC_ACQUIRE);
+        if(slot_name == name || slot_name == 0)
+            return &index->slots[i];
+        i = (i + 1) & mask;
+    }
+}
+
+/* Make room for count more names in a type index, dropping the names which
+ * have no type in scope if it has to grow */
+void reserve_type_index(type_index* index, unsigned int count){
+    if(2 * (index->num + count) <= index->capacity)
+        return;
+
+    type_slot* old = index->slots;
+    unsigned int old_capacity = index->capacity;
+    index->capacity = grow_capacity(index->capacity, 2 * (index->num + count));
+    index->slots = calloc(index->capacity, sizeof(type_slot));
+    index->num = 0;
+    for(unsigned int i = 0; i < old_capacity; i++){
+        if(old[i].name == 0 || old[i].newest == 0)
+            continue;
+        *find_type_slot(index, old[i].name) = old[i];
+        index->num++;
+    }
+    free(old);
+}
+
+/* Make room for count more types in the type table, so that adding them
+ * won't move the table or its indices while other threads are reading them */
+void reserve_type_table(int count){
+    reserve_type_index(&type_table.typedefs, count);
+    reserve_type_index(&type_table.tags, count);
+    if(type_table.num + count <= type_table.allocated)
+        return;
+    type_table.allocated = grow_capacity(type_table.allocated, type_table.num + count);
+    type_table.types = realloc(type_table.types, type_table.allocated * sizeof(type*));
+    type_table.shadows = realloc(type_table.shadows, type_table.allocated * sizeof(unsigned int));
+}
+
+/* Get the index a type is looked up in: the tags for structs, the typedef names for the rest */
+type_index* type_index_of(type* t){
+    return t->struct_type ? &type_table.tags : &type_table.typedefs;
+}
+
+/* Add a type to the global type table. If it has a name, it is in scope
+ * until the innermost open scope is closed, shadowing any type with the
+ * same name. */
 void add_to_type_table(type* t){
-    type_table.num++;
-    type_table.types = realloc(type_table.types, type_table.num * sizeof(type*));
-    type_table.types[type_table.num - 1] = t;
+    reserve_type_table(1);
+    int i = type_table.num++;
+    type_table.types[i] = t;
+    type_table.shadows[i] = 0;
+    if(t->name == 0)
+        return;
+
+    /* Readers find the type once the slot points at it, so it has to be
+     * in the table before then */
+    type_index* index = type_index_of(t);
+    type_slot* slot = find_type_slot(index, t->name);
+    type_table.shadows[i] = slot->newest;
+    __atomic_store_n(&slot->newest, i + 1, __ATOMIC_RELEASE);
+    if(slot->name == 0){
+        index->num++;
+        __atomic_store_n(&slot->name, t->name, __ATOMIC_RELEASE);
+    }
+    index_vector_push(&type_table.scoped, i);
+}
+
+/* Find the innermost type in scope with a name in one of the type table's
+ * indices, or NULL if there is none */
+type* lookup_type(type_index* index, unsigned int name){
+    type_slot* slot = find_type_slot(index, name);
+    if(__atomic_load_n(&slot->name, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+
+    /* Skip the types this thread isn't allowed to see yet */
+    unsigned int entry = __atomic_load_n(&slot->newest, __ATOMIC_ACQUIRE);
+    if(type_table_limit >= 0){
+        while(entry > (unsigned int)type_table_limit)
+            entry = type_table.shadows[entry - 1];
+    }
+    return entry == 0 ? NULL : type_table.types[entry - 1];
+}
+
+/* Get the number of types at the start of the type table this thread can see */
+int visible_type_count(){
+    return type_table_limit >= 0 ? type_table_limit : type_table.num;
+}
+
+/* Open a scope for the types that are added next, returning a mark to close it with.
+ * A thread which only sees part of the type table is parsing statements that
+ * don't declare types, and leaves the scopes to the thread which does. */
+unsigned int open_type_scope(){
+    if(type_table_limit >= 0)
+        return 0;
+    return type_table.scoped.num;
 }
 
-/* Create a blank type given size in bytes */
+/* Close the scope opened with a mark, so that the types added in it are
+ * out of scope. They stay in the type table, since statements point at them. */
+void close_type_scope(unsigned int mark){
+    if(type_table_limit >= 0)
+        return;
+    while(type_table.scoped.num > mark){
+        unsigned int i = index_vector_pop(&type_table.scoped);
+        type* t = type_table.types[i];
+        type_slot* slot = find_type_slot(type_index_of(t), t->name);
+        __atomic_store_n(&slot->newest, type_table.shadows[i], __ATOMIC_RELEASE);
+    }
+}
+
+/* Create a blank type given size in bytes, in the parser's arena. It is a
+ * new distinct type, so it is its own canonical type. */
 type* create_type(int size){
-    type* t = calloc(1, sizeof(type));
+    type* t = arena_alloc(ast_arena, sizeof(type));
     t->size = size;
+    t->canonical = t;
     return t;
 }
 
+/* Check whether two types are the same type, looking through typedefs */
+int same_type(type* a, type* b){
+    return a->canonical == b->canonical;
+}
+
 /* Print the type in some useful debugging format to stdout */
 void print_type(type* type){
     if(type->ptr_to == NULL) {
         if(!type->struct_type)
-            printf("%s", type->name);
+            printf("%s", symbol_name(type->name));
         else {
-            printf("struct %s { ", type->name == NULL ? "" : type->name);
+            printf("struct %s { ", symbol_name(type->name));
             for(int i = 0; i < type->num_fields; i++){
                 print_type(type->field_types[i]);
                 printf(" ");
-                printf("%s", type->field_names[i]);
+                printf("%s", symbol_name(type->field_names[i]));
                 printf("; ");
             }
             printf(" }");
         }
     } else {
         if(type->ptr_to->struct_type){
-            printf("struct %s", type->ptr_to->name == NULL ? "" : type->ptr_to->name);
+            printf("struct %s", symbol_name(type->ptr_to->name));
         } else
             print_type(type->ptr_to);
         printf("*");
     }
 }
 
-/* Free memory used by a type */
-void free_type(type* type){
-    if(type->struct_type)
-        return;
-
-    if(type->ptr_to != NULL)
-        free_type(type->ptr_to);
-    if(type->name != NULL)
-        free(type->name);
-    free(type);
-}
-
-void free_struct_type(type* type){
-    type->struct_type = 0;
-    free_type(type);
-}
-
-/* Copy a type */
-type* copy_type(type* t){
-    type* cpy = create_type(t->size);
-    if(t->ptr_to != NULL)
-        cpy->ptr_to = copy_type(t->ptr_to);
-    else
-        cpy->name = strdup(t->name);
-
-    return cpy;
-}
-
-/* Create a type which is a pointer to another type */
+/* Get the type which is a pointer to another type, creating it the first
+ * time it is asked for */
 type* create_type_ptr(type* point_to){
+    type* cached = __atomic_load_n(&point_to->pointer, __ATOMIC_ACQUIRE);
+    if(cached != NULL)
+        return cached;
+
     /* All pointers are 4 bytes (on 32-bit systems, which we're targeting) */
     type* type = create_type(4);
     type->ptr_to = point_to;
+    if(point_to->canonical != point_to)
+        type->canonical = create_type_ptr(point_to->canonical);
+
+    /* Threads of a parallel parse may race to create the same pointer type,
+     * in which case the first one wins and the others' copies go unused */
+    if(!__atomic_compare_exchange_n(&point_to->pointer, &cached, type, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return cached;
     return type;
 }
 
+/* Create a type which is another name for a type */
+type* create_type_alias(unsigned int name, type* aliased){
+    type* alias = create_type(aliased->size);
+    alias->name = name;
+    alias->alias = aliased;
+    alias->canonical = aliased->canonical;
+    return alias;
+}
+
 /* Initialize the type table by adding primitive types */
 void init_type_table(){
     /* Initialize known primitive types */
     type_table.num = 3;
-    type_table.types = calloc(type_table.num, sizeof(type*));
+    type_table.allocated = 16;
+    type_table.types = calloc(type_table.allocated, sizeof(type*));
+    type_table.shadows = calloc(type_table.allocated, sizeof(unsigned int));
+    type_table.typedefs.capacity = type_table.tags.capacity = 64;
+    type_table.typedefs.slots = calloc(type_table.typedefs.capacity, sizeof(type_slot));
+    type_table.tags.slots = calloc(type_table.tags.capacity, sizeof(type_slot));
+    type_table.typedefs.num = type_table.tags.num = 0;
+    init_index_vector(&type_table.scoped, 64);
 
     type* type_void = create_type(0);
     type* type_int = create_type(4);
     type* type_char = create_type(1);
 
-    type_void->name = "void";
-    type_int->name = "int";
-    type_char->name = "char";
+    type_void->name = intern_string("void");
+    type_int->name = intern_string("int");
+    type_char->name = intern_string("char");
 
     type_table.types[TYPE_VOID] = type_void;
     type_table.types[TYPE_INT] = type_int;
     type_table.types[TYPE_CHAR] = type_char;
 }
 
-/* Delete the type table and any memory it uses */
+/* Delete the type table. The types themselves belong to the parser's arena. */
 void del_type_table(){
-    for(int i = 0; i < type_table.num; i++){
-        if(type_table.types[i]->struct_type)
-            free_struct_type(type_table.types[i]);
-        else
-            free_type(type_table.types[i]);
-    }
     free(type_table.types);
+    free(type_table.shadows);
+    free(type_table.typedefs.slots);
+    free(type_table.tags.slots);
+    free_index_vector(&type_table.scoped);
 }
 
 /* Parse type information */
-type* parse_type(token** tokens, int* index, int len){
-    int first_type = tokens[*index]->type;
-    char* token_str = tokens[*index]->data;
-    inc_ptr(index, len);
+type* parse_type(token_stream* tokens, int* index, int len){
+    int first_type = tokens->types[*index];
+    unsigned int name = token_symbol(tokens, *index);
+    inc_ptr(tokens, index, len);
 
     type* base = NULL;
 
-    /* If this is a primitive type, return a copy of it from the type table */
+    /* If this is a primitive type, get it from the type table */
     if(first_type == TOKEN_INT)
-        base = copy_type(type_table.types[TYPE_INT]);
+        base = type_table.types[TYPE_INT];
     else if(first_type == TOKEN_CHAR)
-        base = copy_type(type_table.types[TYPE_CHAR]);
+        base = type_table.types[TYPE_CHAR];
     else if(first_type == TOKEN_VOID)
-        base = copy_type(type_table.types[TYPE_VOID]);
-
-    /* If this is a known user-defined type, loop through the type table and find it */
-    else if(first_type == TOKEN_IDENT){
-        for(int i = 0; i < type_table.num; i++){
-            if(type_table.types[i]->name != NULL && strcmp(type_table.types[i]->name, token_str) == 0){
-                base = copy_type(type_table.types[i]);
-                break;
-            }
-        }
-    }
+        base = type_table.types[TYPE_VOID];
+
+    /* If this is a known typedef name, look it up */
+    else if(first_type == TOKEN_IDENT)
+        base = lookup_type(&type_table.typedefs, name);
 
     /* If this is a struct, parse it */
     else if(first_type == TOKEN_STRUCT){
-        type* struct_type;
+        type* struct_type = NULL;
 
         /* If it's a named struct, we have to add it to our known list */
-        if(tokens[*index]->type == TOKEN_IDENT){
-            for(int i = 0; i < type_table.num; i++){
-                if(type_table.types[i]->struct_type && strcmp(type_table.types[i]->name, tokens[*index]->data) == 0)
-                    base = type_table.types[i];
-            }
+        if(tokens->types[*index] == TOKEN_IDENT){
+            base = lookup_type(&type_table.tags, token_symbol(tokens, *index));
 
             if(base == NULL){
                 struct_type = create_type(0);
                 struct_type->struct_type = 1;
-                struct_type->name = strdup(tokens[*index]->data);
+                struct_type->name = token_symbol(tokens, *index);
                 add_to_type_table(struct_type);
             }
-            inc_ptr(index, len);
+            inc_ptr(tokens, index, len);
         }
 
         if(base == NULL) {
-            if(tokens[*index]->type != TOKEN_OBRACE)
-                error("Expected opening brace");
+            /* Anonymous structs don't go in the type table */
+            if(struct_type == NULL){
+                struct_type = create_type(0);
+                struct_type->struct_type = 1;
+            }
+
+            if(tokens->types[*index] != TOKEN_OBRACE)
+                error_at(tokens->offsets[*index], "Expected opening brace");
             else
-                inc_ptr(index, len);
+                inc_ptr(tokens, index, len);
 
-            while(tokens[*index]->type != TOKEN_CBRACE){
+            while(tokens->types[*index] != TOKEN_CBRACE){
                 type* field_type = parse_type(tokens, index, len);
-                if(tokens[*index]->type != TOKEN_IDENT)
-                    error("Expected field name identifier");
-                char* ident = strdup(tokens[*index]->data);
-                inc_ptr(index, len);
+                if(tokens->types[*index] != TOKEN_IDENT)
+                    error_at(tokens->offsets[*index], "Expected field name identifier");
+                unsigned int ident = token_symbol(tokens, *index);
+                inc_ptr(tokens, index, len);
 
-                if(tokens[*index]->type != TOKEN_SEMICOLON)
-                    error("Expected semicolon after field declaration");
-                inc_ptr(index, len);
+                if(tokens->types[*index] != TOKEN_SEMICOLON)
+                    error_at(tokens->offsets[*index], "Expected semicolon after field declaration");
+                inc_ptr(tokens, index, len);
 
+                /* The field arrays double in size whenever they fill up, at each power of two */
                 int field_ind = struct_type->num_fields;
-                struct_type->size += field_type->size;
+                if(field_ind >= 4 && (field_ind & (field_ind - 1)) == 0){
+                    struct_type->field_types = arena_grow(ast_arena, struct_type->field_types, field_ind * sizeof(type*), 2 * field_ind * sizeof(type*));
+                    struct_type->field_names = arena_grow(ast_arena, struct_type->field_names, field_ind * sizeof(unsigned int), 2 * field_ind * sizeof(unsigned int));
+                }
+                else if(field_ind == 0){
+                    struct_type->field_types = arena_alloc(ast_arena, 4 * sizeof(type*));
+                    struct_type->field_names = arena_alloc(ast_arena, 4 * sizeof(unsigned int));
+                }
                 struct_type->num_fields++;
-                struct_type->field_types = realloc(struct_type->field_types, struct_type->num_fields * sizeof(type*));
-                struct_type->field_names = realloc(struct_type->field_names, struct_type->num_fields * sizeof(char*));
                 struct_type->field_types[field_ind] = field_type;
                 struct_type->field_names[field_ind] = ident;
             }
-            inc_ptr(index, len);
-
-            /* Replace copied instances of this type with new copied instances (updated) */
-            for(int i = 0; i < struct_type->num_fields; i++){
-                type* ftype = struct_type->field_types[i];
-                if(ftype->ptr_to != NULL)
-                    ftype = ftype->ptr_to;
-                else
-                    continue;
-
-                if(ftype->struct_type && struct_type->name != NULL && ftype->name != NULL 
-                        && strcmp(ftype->name, struct_type->name) == 0){
-                    free_type(struct_type->field_types[i]);
-                    struct_type->field_types[i] = create_type_ptr(struct_type);
-                }
-            }
+            inc_ptr(tokens, index, len);
+            lay_out_struct(struct_type);
 
+            /* A named struct is in the type table before its fields are
+             * parsed, so fields pointing to the struct already point at it */
             base = struct_type;
         }
     }
@@ -227,9 +381,9 @@ type* parse_type(token** tokens, int* index, int len){
     }
 
     /* For every asterisk after the base type, wrap the type in a pointer type */
-    while(tokens[*index]->type == TOKEN_TIMES){
+    while(base_token_type(tokens->types[*index]) == TOKEN_TIMES){
         base = create_type_ptr(base);
-        inc_ptr(index, len);
+        inc_ptr(tokens, index, len);
     }
 
     return base;
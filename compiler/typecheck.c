@@ -0,0 +1,256 @@
+/* Include C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This file describes the type checker, which works out the type of every
+ * expression of a parsed program and keeps it in a table indexed by
+ * expression, so that anything after it can look a type up in constant
+ * time instead of working it out again.
+ *
+ * It runs after name resolution, which binds every variable to its
+ * declaration and gives every use of a shared expression that differs in
+ * what its names refer to a copy of its own, so every expression has one
+ * type however many times it is used. Statements are checked in order,
+ * and each expression after its children, the first time it is reached;
+ * a mistake in a shared expression is reported at its first use.
+ *
+ * Types follow C on the 32-bit target: constants are ints, strings are
+ * char pointers, comparisons and logical operators give ints, and adding an
+ * int to a pointer or subtracting one from it gives the pointer, where the
+ * int is scaled by the size of what the pointer points to. Functions aren't
+ * declared yet, so calls, and names which were never declared, have no
+ * known type, which is NULL in the table; so does anything worked out from
+ * them, and nothing is reported about it. Mistakes that are certain, such
+ * as dereferencing an int or asking a struct for a field it doesn't have,
+ * are reported as warnings at the start of the statement they are in,
+ * however deep inside blocks and ifs it is.
+ */
+
+/* Global type checker state */
+struct {
+    /* Type of each expression, NULL if it isn't known, and whether it has been worked out */
+    type** types;
+    unsigned char* typed;
+
+    /* The tokens of the program, the first token of the top-level
+     * statement being checked, the offset of the statement inside it being
+     * checked, and the number of warnings */
+    token_stream* tokens;
+    int first_token;
+    unsigned int offset;
+    int warnings;
+} type_checker;
+
+/* Release everything the type checker keeps, including the types it worked out */
+void del_type_checker(){
+    free(type_checker.types);
+    free(type_checker.typed);
+    memset(&type_checker, 0, sizeof(type_checker));
+}
+
+/* Get the type of an expression, once the program has been checked, or NULL if it isn't known */
+type* type_of_expression(unsigned int index){
+    return type_checker.types[index];
+}
+
+/* Check whether a type is known and a pointer */
+int is_pointer_type(type* t){
+    return t != NULL && t->canonical->ptr_to != NULL;
+}
+
+/* Get what the int operand of pointer arithmetic in an expression is scaled
+ * by: the size of what the pointer points to when an int is added to or
+ * subtracted from a pointer, a pointer is indexed or incremented, and 1
+ * otherwise. The difference of two pointers is divided by it. */
+int pointer_scale(unsigned int index){
+    expression* expr = expression_at(index);
+    int t = expr->expression_type;
+    type* pointer = NULL;
+    if(t == EXPRESSION_ARRAY_ACCESS){
+        type* element = type_checker.types[index];
+        return element != NULL && element->size > 0 ? element->size : 1;
+    }
+    if(t == EXPRESSION_ARITH_ADD || t == EXPRESSION_ARITH_SUB){
+        pointer = type_checker.types[expr->children[0]];
+        if(t == EXPRESSION_ARITH_ADD && !is_pointer_type(pointer))
+            pointer = type_checker.types[expr->children[1]];
+    }
+    else if(t == EXPRESSION_PREINCR || t == EXPRESSION_PREDECR || t == EXPRESSION_POSTINCR || t == EXPRESSION_POSTDECR)
+        pointer = type_checker.types[expr->children[0]];
+
+    if(!is_pointer_type(pointer))
+        return 1;
+    int size = pointer->canonical->ptr_to->size;
+    return size > 0 ? size : 1;
+}
+
+/* Report a mistake in the statement being checked */
+void type_warning(char* message){
+    warning_at(type_checker.offset, message);
+    type_checker.warnings++;
+}
+
+/* Get the declared type of the variable a name in an expression refers to, or NULL if it isn't declared */
+type* declared_type(unsigned int index){
+    binding b = binding_of(index);
+    return b.declaration != 0 ? declared_statement_type(b.declaration) : NULL;
+}
+
+/* Get the type of a field of a struct, or of the struct a pointer points to for -> */
+type* member_type(type* object, unsigned int field, int through_pointer){
+    if(object == NULL)
+        return NULL;
+    object = object->canonical;
+    if(through_pointer){
+        if(object->ptr_to == NULL){
+            type_warning("Member access with -> on something which isn't a pointer");
+            return NULL;
+        }
+        object = object->ptr_to->canonical;
+    }
+    if(!object->struct_type){
+        type_warning("Member access on something which isn't a struct");
+        return NULL;
+    }
+
+    int i = find_field(object, field);
+    if(i < 0){
+        char message[256];
+        snprintf(message, sizeof(message), "Struct has no field named %s", symbol_name(field));
+        type_warning(message);
+        return NULL;
+    }
+    return object->field_types[i];
+}
+
+/* Work out the type of an expression whose children have been checked */
+type* infer_type(unsigned int index){
+    expression* expr = expression_at(index);
+    int t = expr->expression_type;
+    type* int_type = type_table.types[TYPE_INT];
+
+    if(t == EXPRESSION_NUM_CONST || t == EXPRESSION_CHR_CONST)
+        return int_type;
+    if(t == EXPRESSION_STR_CONST)
+        return create_type_ptr(type_table.types[TYPE_CHAR]);
+    if(t == EXPRESSION_IDENT)
+        return declared_type(index);
+    if(t == EXPRESSION_FUNCALL)
+        return NULL;
+    if(t == EXPRESSION_ARRAY_ACCESS){
+        type* array = declared_type(index);
+        if(array == NULL)
+            return NULL;
+        if(!is_pointer_type(array)){
+            type_warning("Indexing something which isn't a pointer");
+            return NULL;
+        }
+        return array->canonical->ptr_to;
+    }
+
+    /* Comparisons and logical operators are ints whatever they compare */
+    if(t == EXPRESSION_AND || t == EXPRESSION_OR || t == EXPRESSION_EQUALS || t == EXPRESSION_GREATER
+        || t == EXPRESSION_LESS || t == EXPRESSION_GREATEREQ || t == EXPRESSION_LESSEQ || t == EXPRESSION_NOT)
+        return int_type;
+
+    type* a = type_checker.types[expr->children[0]];
+    type* b = expr->num_children > 1 ? type_checker.types[expr->children[1]] : NULL;
+
+    if(t == EXPRESSION_ASSIGN || t == EXPRESSION_PREINCR || t == EXPRESSION_PREDECR
+        || t == EXPRESSION_POSTINCR || t == EXPRESSION_POSTDECR)
+        return a;
+    if(t == EXPRESSION_MEMBER || t == EXPRESSION_MEMBER_REF)
+        return member_type(a, expr->name, t == EXPRESSION_MEMBER_REF);
+    if(a == NULL)
+        return NULL;
+
+    if(t == EXPRESSION_DEREF){
+        if(!is_pointer_type(a)){
+            type_warning("Dereferencing something which isn't a pointer");
+            return NULL;
+        }
+        return a->canonical->ptr_to;
+    }
+    if(t == EXPRESSION_ADDR)
+        return create_type_ptr(a);
+
+    /* The rest are arithmetic, with two operands */
+    if(b == NULL)
+        return NULL;
+    int pa = is_pointer_type(a);
+    int pb = is_pointer_type(b);
+    if(a->canonical->struct_type || b->canonical->struct_type){
+        type_warning("Arithmetic on a struct");
+        return NULL;
+    }
+    if(t == EXPRESSION_ARITH_ADD && pa && pb){
+        type_warning("Adding two pointers");
+        return NULL;
+    }
+    if(t == EXPRESSION_ARITH_ADD && (pa || pb))
+        return pa ? a : b;
+    if(t == EXPRESSION_ARITH_SUB && pa && pb){
+        if(!same_type(a->canonical->ptr_to, b->canonical->ptr_to))
+            type_warning("Subtracting pointers to different types");
+        return int_type;
+    }
+    if(t == EXPRESSION_ARITH_SUB && pb){
+        type_warning("Subtracting a pointer from an int");
+        return NULL;
+    }
+    if(t == EXPRESSION_ARITH_SUB && pa)
+        return a;
+    if(pa || pb){
+        type_warning("Multiplying, dividing or shifting a pointer");
+        return NULL;
+    }
+    return int_type;
+}
+
+/* Work out the types of an expression and everything in it, unless it has been checked already */
+void check_expression(unsigned int index){
+    if(index == 0 || type_checker.typed[index])
+        return;
+    int num_children = expression_num_children(index);
+    for(int i = 0; i < num_children; i++)
+        check_expression(expression_child(index, i));
+
+    type_checker.types[index] = infer_type(index);
+    type_checker.typed[index] = 1;
+}
+
+/* Check a statement and everything in it */
+void check_statement(unsigned int index){
+    if(index == 0)
+        return;
+    statement* st = statement_at(index);
+    int t = st->statement_type;
+    type_checker.offset = statement_offset(type_checker.tokens, type_checker.first_token, index);
+    if(t == STATEMENT_ASSIGN || t == STATEMENT_EXPRESSION || t == STATEMENT_RETURN)
+        check_expression(st->expr);
+    else if(t == STATEMENT_IF){
+        check_expression(st->expr);
+        check_statement(st->children[0]);
+        check_statement(st->children[1]);
+    }
+    else if(t == STATEMENT_BLOCK){
+        for(int i = 0; i < st->code_block.num_statements; i++)
+            check_statement(statement_pool.blocks.vals[st->code_block.first + i]);
+    }
+}
+
+/* Work out the type of every expression of a resolved program, reporting
+ * mistakes to the standard error. Returns the number of mistakes found. */
+int typecheck_program(program* prog, token_stream* tokens){
+    del_type_checker();
+    type_checker.types = malloc(expression_pool.num * sizeof(type*));
+    type_checker.typed = calloc(expression_pool.num, 1);
+    type_checker.tokens = tokens;
+
+    for(int i = 0; i < prog->num; i++){
+        type_checker.first_token = prog->first_tokens[i];
+        check_statement(prog->statements[i]);
+    }
+    return type_checker.warnings;
+}
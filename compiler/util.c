@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* Exit with an error */
 void error(char* error){
@@ -10,144 +11,78 @@ void error(char* error){
     exit(1);
 }
 
-/* Increment the token pointer and make sure we're not out of bounds on the token stream */
-void inc_ptr(int* index, int len){
-    (*index)++;
-
-    /* Make sure we're not out of bounds */
-    if(*index >= len)
-        error("Unexpected end of token stream.");
+/* Get the current time in nanoseconds */
+long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 /* Duplicate a string */
-char *strdup (char *s) {
+char *strdup (const char *s) {
     char *d = (char *)(malloc (strlen (s) + 1)); // Allocate memory
     if (d != NULL)
         strcpy (d,s);                            // Copy string if okay
     return d;                                    // Return new memory
 }
 
-/* Get the length of the file (number of characters) */
-int file_get_length(char* fname){
-    /* Open the file */
-    FILE* file = fopen(fname, "r");
-
-    /* Seek to the end */
-    fseek(file, 0, SEEK_END);
-    
-    /* Get current position (since we're at the end, this is the file size) */
-    long len = ftell(file);
-
-    /* Close the file, return the length */
-    fclose(file);
-    return (int) len;
+/* Capacity to grow an array to so that it holds at least needed elements.
+ * Capacities double, so that appending n elements one by one costs O(n) in all. */
+unsigned int grow_capacity(unsigned int allocated, unsigned int needed){
+    if(allocated == 0)
+        allocated = 16;
+    while(allocated < needed)
+        allocated *= 2;
+    return allocated;
 }
 
-/* Read contents of text file */
-char* read_file(char* fname){
-    /* Get file length */
-    long len = file_get_length(fname);
-
-    /* Open file for reading */
-    FILE* file = fopen(fname, "r");
-
-    /* Allocate buffer for file data */
-    char* buffer = (char*) calloc (1, sizeof(char)*len+1);
-
-    /* Read data into buffer */
-    int result = fread(buffer,1,len,file);
-
-    /* Close file and return buffer */
-    fclose (file);
-    return buffer;
+/* Growable array of 32-bit values, such as indices of pooled nodes. It can
+ * be used as a stack by pushing and popping at the end. */
+typedef struct _index_vector {
+    unsigned int* vals;
+    unsigned int num;
+    unsigned int allocated;
+} index_vector;
+
+void init_index_vector(index_vector* vec, unsigned int allocated){
+    vec->num = 0;
+    vec->allocated = allocated;
+    vec->vals = malloc(allocated * sizeof(unsigned int));
 }
 
-/* Stack */
-typedef struct _stack {
-    int size;
-    int num;
-    void** vals;
-} stack;
-
-typedef struct _queue {
-    int size;
-    int num;
-    void** vals;
-} queue;
-
-stack* make_stack(){
-    stack* stk = calloc(1, sizeof(stack));
-    stk->size = 10;
-    stk->vals = calloc(stk->size, sizeof(void*));
-    return stk;
+void free_index_vector(index_vector* vec){
+    free(vec->vals);
+    vec->vals = NULL;
+    vec->num = vec->allocated = 0;
 }
 
-void stack_push(stack* stk, void* ptr){
-    if(stk->num == stk->size){
-        stk->size += 20;
-        stk->vals = realloc(stk->vals, stk->size * sizeof(void*));
-    }
-
-    stk->vals[stk->num] = ptr;
-    stk->num++; 
+/* Make room for num values in all */
+void reserve_index_vector(index_vector* vec, unsigned int num){
+    if(num <= vec->allocated)
+        return;
+    vec->allocated = grow_capacity(vec->allocated, num);
+    vec->vals = realloc(vec->vals, vec->allocated * sizeof(unsigned int));
 }
 
-void* stack_pop(stack* stk){
-    if(stk->num == 0)
-        return NULL;
-
-    stk->num--;
-    void* ptr = stk->vals[stk->num];
-    return ptr;
+void index_vector_push(index_vector* vec, unsigned int val){
+    if(vec->num == vec->allocated)
+        reserve_index_vector(vec, vec->num + 1);
+    vec->vals[vec->num++] = val;
 }
 
-void* stack_peek(stack* stk){
-    if(stk->num == 0)
-        return NULL;
-
-    void* ptr = stk->vals[stk->num-1];
-    return ptr;
+unsigned int index_vector_pop(index_vector* vec){
+    if(vec->num == 0)
+        error("Popping empty vector");
+    return vec->vals[--vec->num];
 }
 
-void free_stack(stack* stk){
-    free(stk->vals);
-    free(stk);
+/* Move the top count values of the stack src onto the end of dst, keeping
+ * their order. Returns the index of the first of them in dst. */
+unsigned int index_vector_move_top(index_vector* dst, index_vector* src, unsigned int count){
+    unsigned int first = dst->num;
+    reserve_index_vector(dst, dst->num + count);
+    src->num -= count;
+    memcpy(dst->vals + first, src->vals + src->num, count * sizeof(unsigned int));
+    dst->num += count;
+    return first;
 }
-
-queue* make_queue(){
-    queue* q = calloc(1, sizeof(queue));
-    q->size = 10;
-    q->vals = calloc(q->size, sizeof(void*));
-    return q;
-}
-
-void enqueue(queue* q, void* ptr){
-    if(ptr == NULL)
-        error("Queueing null");
-
-    if(q->num == q->size){
-        q->size += 20;
-        q->vals = realloc(q->vals, q->size * sizeof(void*));
-    }
-
-    q->vals[q->num] = ptr;
-    q->num++; 
-}
-
-void* dequeue(queue* q){
-    if(q->num == 0)
-        return NULL;
-
-    q->num--;
-    void* ptr = q->vals[0];
-    for(int i = 0; i < q->num; i++)
-        q->vals[i] = q->vals[i+1];
-    return ptr;
-}
-
-void free_queue(queue* q){
-    free(q->vals);
-    free(q);
-}
-
-